@@ -0,0 +1,109 @@
+#!/usr/bin/env bash
+
+# Push bulk traffic through a local chutney network, and report throughput
+# and how much CPU each tor process used to relay it.
+#
+# Usage:
+#   CHUTNEY_PATH=/path/to/chutney \
+#   scripts/test/chutney-load-bench.sh [flavour [bytes [connections [rounds]]]]
+#
+# Runs from a tor build directory (or set TOR_DIR to one). Defaults to the
+# "basic-min" flavour, 10 MB per connection, 8 connections and 3 rounds.
+# Each round times chutney's verify step only, after the network has
+# bootstrapped, so the numbers are about relaying cells rather than about
+# building descriptors and consensuses. CPU times come from /proc, so they
+# are only reported on Linux.
+#
+# Compare two builds by running this in each of them with the same
+# arguments. Set RELAY_SHARDS to a number of threads to run every node with
+# that RelayShards setting, and compare against a run without it.
+
+FLAVOUR="${1:-basic-min}"
+BYTES="${2:-10485760}"
+CONNECTIONS="${3:-8}"
+ROUNDS="${4:-3}"
+
+if [ -z "$TOR_DIR" ]; then
+    TOR_DIR="$PWD"
+fi
+if [ ! -x "$TOR_DIR/src/app/tor" ] || [ ! -x "$TOR_DIR/src/tools/tor-gencert" ]; then
+    echo "Can't find tor binaries in $TOR_DIR: run make, or set TOR_DIR." >&2
+    exit 1
+fi
+if [ ! -x "$CHUTNEY_PATH/chutney" ]; then
+    echo "Set CHUTNEY_PATH to a chutney checkout." >&2
+    echo "Get chutney: git clone https://git.torproject.org/chutney.git" >&2
+    exit 1
+fi
+
+export CHUTNEY_TOR="$TOR_DIR/src/app/tor"
+export CHUTNEY_TOR_GENCERT="$TOR_DIR/src/tools/tor-gencert"
+export CHUTNEY_DATA_BYTES="$BYTES"
+export CHUTNEY_CONNECTIONS="$CONNECTIONS"
+
+NETWORK="networks/$FLAVOUR"
+CLK_TCK=$(getconf CLK_TCK 2>/dev/null || echo 100)
+
+cd "$CHUTNEY_PATH" || exit 1
+
+# Print "<node> <cpu ticks>" for every running node of the network.
+node_cpu_ticks() {
+    for pidfile in net/nodes/*/pid; do
+        [ -f "$pidfile" ] || continue
+        node=$(basename "$(dirname "$pidfile")")
+        pid=$(cat "$pidfile")
+        if [ -r "/proc/$pid/stat" ]; then
+            # Fields 14 and 15 are utime and stime. The command name in
+            # field 2 has no spaces for tor, so plain splitting works.
+            awk -v node="$node" '{ print node, $14 + $15 }' "/proc/$pid/stat"
+        fi
+    done
+}
+
+stop_network() {
+    ./chutney stop "$NETWORK" > /dev/null
+}
+trap stop_network EXIT
+
+./chutney configure "$NETWORK" > /dev/null || exit 1
+if [ -n "$RELAY_SHARDS" ]; then
+    # Clients ignore RelayShards, so it's safe to give it to every node.
+    for torrc in net/nodes/*/torrc; do
+        echo "RelayShards $RELAY_SHARDS" >> "$torrc"
+    done
+fi
+./chutney start "$NETWORK" > /dev/null || exit 1
+if ! ./chutney wait_for_bootstrap "$NETWORK" > /dev/null; then
+    echo "Network $FLAVOUR failed to bootstrap." >&2
+    exit 1
+fi
+
+total_bytes=$((BYTES * CONNECTIONS))
+i=1
+while [ "$i" -le "$ROUNDS" ]; do
+    before=$(node_cpu_ticks)
+    start=$(date +%s.%N)
+    if ! ./chutney verify "$NETWORK" > /dev/null; then
+        echo "Round $i/$ROUNDS: verify failed." >&2
+        exit 1
+    fi
+    end=$(date +%s.%N)
+    after=$(node_cpu_ticks)
+
+    awk -v start="$start" -v end="$end" -v bytes="$total_bytes" -v i="$i" \
+        -v rounds="$ROUNDS" 'BEGIN {
+        secs = end - start
+        printf "Round %d/%d: %d bytes in %.2f s (%.2f MB/s)\n",
+               i, rounds, bytes, secs, bytes / secs / 1048576
+    }'
+    # Join the before and after samples on node name.
+    printf '%s\n--\n%s\n' "$before" "$after" | \
+        awk -v tck="$CLK_TCK" '
+        NF == 0 { next }
+        $0 == "--" { after = 1; next }
+        !after { before[$1] = $2; next }
+        ($1 in before) {
+            printf "  %-16s %6.2f s CPU\n", $1, ($2 - before[$1]) / tck
+        }'
+    i=$((i+1))
+done
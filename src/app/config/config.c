@@ -80,6 +80,7 @@
 #include "core/or/dos.h"
 #include "core/or/policies.h"
 #include "core/or/relay.h"
+#include "core/or/relay_shard.h"
 #include "core/or/scheduler.h"
 #include "feature/client/addressmap.h"
 #include "feature/client/bridges.h"
@@ -115,6 +116,7 @@
 #include "lib/encoding/confline.h"
 #include "lib/net/resolve.h"
 #include "lib/sandbox/sandbox.h"
+#include "lib/tls/buffers_tls.h"
 #include "lib/version/torversion.h"
 
 #ifdef ENABLE_NSS
@@ -322,6 +324,8 @@ static config_var_t option_vars_[] = {
   V(AutomapHostsSuffixes,        CSV,      ".onion,.exit"),
   V(AvoidDiskWrites,             BOOL,     "0"),
   V(BandwidthBurst,              MEMUNIT,  "1 GB"),
+  V(BandwidthClassBurst,         LINELIST, NULL),
+  V(BandwidthClassRate,          LINELIST, NULL),
   V(BandwidthRate,               MEMUNIT,  "1 GB"),
   V(BridgeAuthoritativeDir,      BOOL,     "0"),
   VAR("Bridge",                  LINELIST, Bridges,    NULL),
@@ -331,6 +335,7 @@ static config_var_t option_vars_[] = {
   V(BridgeDistribution,          STRING,   NULL),
   VAR("CacheDirectory",          FILENAME, CacheDirectory_option, NULL),
   V(CacheDirectoryGroupReadable, AUTOBOOL,     "auto"),
+  V(CellPoolMaxIdle,             MEMUNIT,  "8 MB"),
   V(CellStatistics,              BOOL,     "0"),
   V(PaddingStatistics,           BOOL,     "1"),
   V(LearnCircuitBuildTimeout,    BOOL,     "1"),
@@ -338,6 +343,7 @@ static config_var_t option_vars_[] = {
   OBSOLETE("CircuitIdleTimeout"),
   V(CircuitsAvailableTimeout,    INTERVAL, "0"),
   V(CircuitStreamTimeout,        INTERVAL, "0"),
+  V(CircuitPriorityCalendar,     AUTOBOOL, "auto"),
   V(CircuitPriorityHalflife,     DOUBLE,  "-1.0"), /*negative:'Use default'*/
   V(ClientDNSRejectInternalAddresses, BOOL,"1"),
   V(ClientOnly,                  BOOL,     "0"),
@@ -409,6 +415,9 @@ static config_var_t option_vars_[] = {
   V(DoSConnectionDefenseType,    INT,      "0"),
   /* DoS single hop client options. */
   V(DoSRefuseSingleHopClientRendezvous,    AUTOBOOL, "auto"),
+  /* DoS client counting sketch options. */
+  V(DoSUseSketch,                AUTOBOOL, "auto"),
+  V(DoSSketchWidth,              UINT,     "0"),
   V(DownloadExtraInfo,           BOOL,     "0"),
   V(TestingEnableConnBwEvent,    BOOL,     "0"),
   V(TestingEnableCellStatsEvent, BOOL,     "0"),
@@ -538,6 +547,7 @@ static config_var_t option_vars_[] = {
   V(NumCPUs,                     UINT,     "0"),
   V(NumDirectoryGuards,          UINT,     "0"),
   V(NumEntryGuards,              UINT,     "0"),
+  V(NumORPortListeners,          UINT,     "1"),
   V(NumPrimaryGuards,            UINT,     "0"),
   V(OfflineMasterKey,            BOOL,     "0"),
   OBSOLETE("ORListenAddress"),
@@ -596,6 +606,7 @@ static config_var_t option_vars_[] = {
   V(RejectPlaintextPorts,        CSV,      ""),
   V(RelayBandwidthBurst,         MEMUNIT,  "0"),
   V(RelayBandwidthRate,          MEMUNIT,  "0"),
+  V(RelayShards,                 UINT,     "0"),
   V(RendPostPeriod,              INTERVAL, "1 hour"),
   V(RephistTrackTime,            INTERVAL, "24 hours"),
   V(RunAsDaemon,                 BOOL,     "0"),
@@ -617,6 +628,7 @@ static config_var_t option_vars_[] = {
   OBSOLETE("SchedulerMaxFlushCells__"),
   V(KISTSchedRunInterval,        MSEC_INTERVAL, "0 msec"),
   V(KISTSockBufSizeFactor,       DOUBLE,   "1.0"),
+  V(KISTSockInfoMaxAge,          MSEC_INTERVAL, "0 msec"),
   V(Schedulers,                  CSV,      "KIST,KISTLite,Vanilla"),
   V(ShutdownWaitLength,          INTERVAL, "30 seconds"),
   OBSOLETE("SocksListenAddress"),
@@ -633,6 +645,7 @@ static config_var_t option_vars_[] = {
   OBSOLETE("Tor2webMode"),
   OBSOLETE("Tor2webRendezvousPoints"),
   OBSOLETE("TLSECGroup"),
+  V(TLSRecordBatching,           BOOL,     "1"),
   V(TrackHostExits,              CSV,      NULL),
   V(TrackHostExitsExpire,        INTERVAL, "30 minutes"),
   OBSOLETE("TransListenAddress"),
@@ -2064,6 +2077,9 @@ options_act(const or_options_t *old_options)
    * might be a change of scheduler or parameter. */
   scheduler_conf_changed();
 
+  /* Tell the cell pools how much memory they may keep in empty slabs. */
+  cell_queues_set_pool_max_idle(options->CellPoolMaxIdle);
+
   /* Set up accounting */
   if (accounting_parse_options(options, 0)<0) {
     // LCOV_EXCL_START
@@ -2074,6 +2090,9 @@ options_act(const or_options_t *old_options)
   if (accounting_is_enabled(options))
     configure_accounting(time(NULL));
 
+  /* Tell the TLS buffer code whether to batch records. */
+  buf_tls_set_record_batching(options->TLSRecordBatching);
+
   /* Change the cell EWMA settings */
   cmux_ewma_set_options(options, networkstatus_get_latest_consensus());
 
@@ -2219,6 +2238,9 @@ options_act(const or_options_t *old_options)
       if (server_mode_turned_on || dir_server_mode_turned_on) {
         cpu_init();
       }
+      if (server_mode_turned_on) {
+        relay_shard_init();
+      }
 
       if (server_mode_turned_on) {
         ip_address_changed(0);
@@ -2240,7 +2262,11 @@ options_act(const or_options_t *old_options)
     if (options->BandwidthRate != old_options->BandwidthRate ||
         options->BandwidthBurst != old_options->BandwidthBurst ||
         options->RelayBandwidthRate != old_options->RelayBandwidthRate ||
-        options->RelayBandwidthBurst != old_options->RelayBandwidthBurst)
+        options->RelayBandwidthBurst != old_options->RelayBandwidthBurst ||
+        !config_lines_eq(options->BandwidthClassRate,
+                         old_options->BandwidthClassRate) ||
+        !config_lines_eq(options->BandwidthClassBurst,
+                         old_options->BandwidthClassBurst))
       connection_bucket_adjust(options);
 
     if (options->MainloopStats != old_options->MainloopStats) {
@@ -3255,6 +3281,12 @@ options_validate_scheduler(or_options_t *options, char **msg)
     return -1;
   }
 
+  if (options->KISTSockInfoMaxAge > KIST_SOCK_INFO_MAX_AGE_MAX) {
+    tor_asprintf(msg, "KISTSockInfoMaxAge must not be more than %d (ms)",
+                 KIST_SOCK_INFO_MAX_AGE_MAX);
+    return -1;
+  }
+
   return 0;
 }
 
@@ -3586,6 +3618,32 @@ options_validate(or_options_t *old_options, or_options_t *options,
     }
   }
 
+  if (options->NumORPortListeners > MAX_NUM_OR_PORT_LISTENERS) {
+    tor_asprintf(msg,
+                 "NumORPortListeners must not be more than %d, but "
+                 "was set to %d", MAX_NUM_OR_PORT_LISTENERS,
+                 options->NumORPortListeners);
+    return -1;
+  }
+
+  if (options->RelayShards > MAX_RELAY_SHARDS) {
+    tor_asprintf(msg,
+                 "RelayShards must not be more than %d, but "
+                 "was set to %d", MAX_RELAY_SHARDS,
+                 options->RelayShards);
+    return -1;
+  }
+
+  if (options->DoSSketchWidth &&
+      (options->DoSSketchWidth < DOS_SKETCH_WIDTH_MIN ||
+       options->DoSSketchWidth > DOS_SKETCH_WIDTH_MAX)) {
+    tor_asprintf(msg,
+                 "DoSSketchWidth must be 0 or between %d and %d, but "
+                 "was set to %d", DOS_SKETCH_WIDTH_MIN, DOS_SKETCH_WIDTH_MAX,
+                 options->DoSSketchWidth);
+    return -1;
+  }
+
   if (options->MaxClientCircuitsPending <= 0 ||
       options->MaxClientCircuitsPending > MAX_MAX_CLIENT_CIRCUITS_PENDING) {
     tor_asprintf(msg,
@@ -3949,6 +4007,9 @@ options_validate(or_options_t *old_options, or_options_t *options,
   if (options->RelayBandwidthBurst && !options->RelayBandwidthRate)
     options->RelayBandwidthRate = options->RelayBandwidthBurst;
 
+  if (connection_bucket_parse_class_limits(options, NULL, NULL, msg) < 0)
+    return -1;
+
   if (server_mode(options)) {
     const unsigned required_min_bw =
       public_server_mode(options) ?
@@ -4704,6 +4765,8 @@ options_transition_allowed(const or_options_t *old,
   NO_CHANGE_BOOL(TestingTorNetwork);
   NO_CHANGE_BOOL(DisableAllSwap);
   NO_CHANGE_INT(TokenBucketRefillInterval);
+  NO_CHANGE_INT(NumORPortListeners);
+  NO_CHANGE_INT(RelayShards);
   NO_CHANGE_BOOL(HiddenServiceSingleHopMode);
   NO_CHANGE_BOOL(HiddenServiceNonAnonymousMode);
   NO_CHANGE_BOOL(DisableDebuggerAttachment);
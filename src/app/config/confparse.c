@@ -28,7 +28,6 @@
 #include "lib/container/bitarray.h"
 #include "lib/encoding/confline.h"
 
-static uint64_t config_parse_memunit(const char *s, int *ok);
 static int config_parse_msec_interval(const char *s, int *ok);
 static int config_parse_interval(const char *s, int *ok);
 static void config_reset(const config_format_t *fmt, void *options,
@@ -1164,7 +1163,7 @@ config_parse_units(const char *val, struct unit_table_t *u, int *ok)
  * information (byte, KB, M, etc).  On success, set *<b>ok</b> to true
  * and return the number of bytes specified.  Otherwise, set
  * *<b>ok</b> to false and return 0. */
-static uint64_t
+uint64_t
 config_parse_memunit(const char *s, int *ok)
 {
   uint64_t u = config_parse_units(s, memory_units, ok);
@@ -211,6 +211,7 @@ char *config_dump(const config_format_t *fmt, const void *default_options,
 int config_assign(const config_format_t *fmt, void *options,
                   struct config_line_t *list,
                   unsigned flags, char **msg);
+uint64_t config_parse_memunit(const char *s, int *ok);
 config_var_t *config_find_option_mutable(config_format_t *fmt,
                                          const char *key);
 const char *config_find_deprecation(const config_format_t *fmt,
@@ -129,6 +129,13 @@ struct or_options_t {
   char *User; /**< Name of user to run Tor as. */
    /** Ports to listen on for OR connections. */
   struct config_line_t *ORPort_lines;
+#define MAX_NUM_OR_PORT_LISTENERS 64
+  /** How many listener sockets to open for each ORPort, if the platform
+   * supports SO_REUSEPORT. */
+  int NumORPortListeners;
+  /** How many threads should decrypt forward relay cells?  0 means to do
+   * it on the main thread. */
+  int RelayShards;
   /** Ports to listen on for extended OR connections. */
   struct config_line_t *ExtORPort_lines;
   /** Ports to listen on for SOCKS connections. */
@@ -167,6 +174,9 @@ struct or_options_t {
                             * for queues and buffers, run the OOM handler */
   /** Above this value, consider ourselves low on RAM. */
   uint64_t MaxMemInQueues_low_threshold;
+  /** Largest amount of memory that we keep in empty slabs of the cell
+   * pools, for reuse by later cells. */
+  uint64_t CellPoolMaxIdle;
 
   /** @name port booleans
    *
@@ -377,6 +387,12 @@ struct or_options_t {
                                  * use in a second for all relayed conns? */
   uint64_t PerConnBWRate; /**< Long-term bw on a single TLS conn, if set. */
   uint64_t PerConnBWBurst; /**< Allowed burst on a single TLS conn, if set. */
+  /** Lines of "class amount" giving the average bandwidth we are willing to
+   * use for each kind of traffic that has a limit of its own. */
+  struct config_line_t *BandwidthClassRate;
+  /** Lines of "class amount" giving the burst for each kind of traffic that
+   * has a limit of its own. */
+  struct config_line_t *BandwidthClassBurst;
   int NumCPUs; /**< How many CPUs should we try to use? */
   struct config_line_t *RendConfigLines; /**< List of configuration lines
                                           * for rendezvous services. */
@@ -533,6 +549,8 @@ struct or_options_t {
                       * acceleration where available? */
   /** Token Bucket Refill resolution in milliseconds. */
   int TokenBucketRefillInterval;
+  /** Boolean: Should we gather our TLS writes into full-sized records? */
+  int TLSRecordBatching;
   char *AccelName; /**< Optional hardware acceleration engine name. */
   char *AccelDir; /**< Optional hardware acceleration engine search dir. */
 
@@ -858,6 +876,11 @@ struct or_options_t {
    */
   double CircuitPriorityHalflife;
 
+  /** If 1, new channels keep their active circuits in a calendar queue
+   * rather than a heap; if 0, they use a heap; if -1, we take this from
+   * the consensus. */
+  int CircuitPriorityCalendar;
+
   /** Set to true if the TestingTorNetwork configuration option is set.
    * This is used so that options_validate() has a chance to realize that
    * the defaults have changed. */
@@ -1036,6 +1059,11 @@ struct or_options_t {
   /** A multiplier for the KIST per-socket limit calculation. */
   double KISTSockBufSizeFactor;
 
+  /** How many milliseconds may KIST keep using a socket's kernel TCP
+   * information before asking the kernel again?  If zero, ask on every
+   * scheduler run. */
+  int KISTSockInfoMaxAge;
+
   /** The list of scheduler type string ordered by priority that is first one
    * has to be tried first. Default: KIST,KISTLite,Vanilla */
   struct smartlist_t *Schedulers;
@@ -1079,6 +1107,12 @@ struct or_options_t {
   /** Autobool: Do we refuse single hop client rendezvous? */
   int DoSRefuseSingleHopClientRendezvous;
 
+  /** Autobool: Do we count clients in a fixed size sketch instead of keeping
+   * an entry for every address? */
+  int DoSUseSketch;
+  /** Number of counters in each row of the client counting sketch. */
+  int DoSSketchWidth;
+
   /** Interval: how long without activity does it take for a client
    * to become dormant?
    **/
@@ -33,6 +33,7 @@
 #include "core/or/policies.h"
 #include "core/or/protover.h"
 #include "core/or/relay.h"
+#include "core/or/relay_shard.h"
 #include "core/or/scheduler.h"
 #include "core/or/status.h"
 #include "core/or/versions.h"
@@ -54,6 +55,7 @@
 #include "feature/nodelist/authcert.h"
 #include "feature/nodelist/microdesc.h"
 #include "feature/nodelist/networkstatus.h"
+#include "feature/nodelist/node_select.h"
 #include "feature/nodelist/nodelist.h"
 #include "feature/nodelist/routerlist.h"
 #include "feature/relay/dns.h"
@@ -334,6 +336,7 @@ dumpmemusage(int severity)
       (rephist_total_alloc), rephist_total_num);
   dump_routerlist_mem_usage(severity);
   dump_cell_pool_usage(severity);
+  buf_dump_freelist_sizes(severity);
   dump_dns_mem_usage(severity);
   tor_log_mallinfo(severity);
 }
@@ -373,6 +376,13 @@ dumpstats(int severity)
           (int)connection_get_outbuf_len(conn),
           (int)buf_allocation(conn->outbuf),
           (int)(now - conn->timestamp_last_write_allowed));
+      if (conn->linked) {
+        tor_log(severity, LD_GENERAL,
+            "Conn %d: received %"PRIu64" bytes over its link by moving "
+            "chunks, %"PRIu64" by copying.", i,
+            (conn->n_linked_bytes_moved),
+            (conn->n_linked_bytes_copied));
+      }
       if (conn->type == CONN_TYPE_OR) {
         or_connection_t *or_conn = TO_OR_CONN(conn);
         if (or_conn->tls) {
@@ -383,6 +393,15 @@ dumpstats(int severity)
                 "%d/%d bytes used on write buffer.",
                 i, (int)rbuf_len, (int)rbuf_cap, (int)wbuf_len, (int)wbuf_cap);
           }
+          if (or_conn->tls_flush_stats.n_records) {
+            const tls_flush_stats_t *st = &or_conn->tls_flush_stats;
+            tor_log(severity, LD_GENERAL,
+                "Conn %d: %"PRIu64" TLS records in %"PRIu64" flushes "
+                "(%.2f records per flush, %.0f bytes per record).",
+                i, (st->n_records), (st->n_flushes),
+                ((double)st->n_records) / st->n_flushes,
+                ((double)st->n_bytes) / st->n_records);
+          }
         }
       }
     }
@@ -393,6 +412,14 @@ dumpstats(int severity)
   channel_dumpstats(severity);
   channel_listener_dumpstats(severity);
 
+  {
+    uint64_t n_moved = 0, n_copied = 0;
+    connection_get_linked_bytes_stats(&n_moved, &n_copied);
+    tor_log(severity, LD_NET,
+        "Linked connections have passed %"PRIu64" bytes to one another by "
+        "moving chunks, and %"PRIu64" by copying.", n_moved, n_copied);
+  }
+
   tor_log(severity, LD_NET,
       "Cells processed: %"PRIu64" padding\n"
       "                 %"PRIu64" create\n"
@@ -782,6 +809,7 @@ tor_free_all(int postfork)
   connection_edge_free_all();
   scheduler_free_all();
   nodelist_free_all();
+  node_select_free_all();
   microdesc_free_all();
   routerparse_free_all();
   ext_orport_free_all();
@@ -794,6 +822,8 @@ tor_free_all(int postfork)
   circuitmux_ewma_free_all();
   accounting_free_all();
   protover_summary_cache_free_all();
+  cell_queues_free_all();
+  buf_shrink_freelists(1);
 
   if (!postfork) {
     config_free_all();
@@ -1344,6 +1374,9 @@ run_tor_main_loop(void)
     /* launch cpuworkers. Need to do this *after* we've read the onion key. */
     cpu_init();
   }
+  if (server_mode(get_options())) {
+    relay_shard_init();
+  }
   consdiffmgr_enable_background_compression();
 
   /* Setup shared random protocol subsystem. */
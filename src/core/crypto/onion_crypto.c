@@ -56,8 +56,30 @@ server_onion_keys_new(void)
   keys->curve25519_key_map = construct_ntor_key_map();
   keys->junk_keypair = tor_malloc_zero(sizeof(curve25519_keypair_t));
   curve25519_keypair_generate(keys->junk_keypair, 0);
+  keys->ntor_ephemeral_keys = tor_calloc(SERVER_NTOR_EPHEMERAL_KEYS,
+                                         sizeof(curve25519_keypair_t));
   return keys;
 }
+
+/** Generate up to <b>max</b> more ephemeral ntor keypairs in <b>keys</b>,
+ * so that onion_skin_server_handshake() doesn't need to generate them while
+ * a client is waiting.  Return the number of keypairs generated: this is
+ * zero once <b>keys</b> holds as many as it can. */
+int
+server_onion_keys_precompute(server_onion_keys_t *keys, int max)
+{
+  int n = 0;
+  while (n < max &&
+         keys->n_ntor_ephemeral_keys < SERVER_NTOR_EPHEMERAL_KEYS) {
+    curve25519_keypair_generate(
+                     &keys->ntor_ephemeral_keys[keys->n_ntor_ephemeral_keys],
+                     0);
+    ++keys->n_ntor_ephemeral_keys;
+    ++n;
+  }
+  return n;
+}
+
 /** Release all storage held in <b>keys</b>. */
 void
 server_onion_keys_free_(server_onion_keys_t *keys)
@@ -69,6 +91,11 @@ server_onion_keys_free_(server_onion_keys_t *keys)
   crypto_pk_free(keys->last_onion_key);
   ntor_key_map_free(keys->curve25519_key_map);
   tor_free(keys->junk_keypair);
+  if (keys->ntor_ephemeral_keys) {
+    memwipe(keys->ntor_ephemeral_keys, 0,
+            SERVER_NTOR_EPHEMERAL_KEYS * sizeof(curve25519_keypair_t));
+    tor_free(keys->ntor_ephemeral_keys);
+  }
   memwipe(keys, 0, sizeof(server_onion_keys_t));
   tor_free(keys);
 }
@@ -165,7 +192,8 @@ onion_skin_create(int type,
 
 /** Perform the second (server-side) step of a circuit-creation handshake of
  * type <b>type</b>, responding to the client request in <b>onion_skin</b>
- * using the keys in <b>keys</b>.  On success, write our response into
+ * using the keys in <b>keys</b>, and consuming one of its precomputed
+ * ephemeral keys if it has any.  On success, write our response into
  * <b>reply_out</b>, generate <b>keys_out_len</b> bytes worth of key material
  * in <b>keys_out_len</b>, a hidden service nonce to <b>rend_nonce_out</b>,
  * and return the length of the reply. On failure, return -1.
@@ -173,7 +201,7 @@ onion_skin_create(int type,
 int
 onion_skin_server_handshake(int type,
                       const uint8_t *onion_skin, size_t onionskin_len,
-                      const server_onion_keys_t *keys,
+                      server_onion_keys_t *keys,
                       uint8_t *reply_out,
                       uint8_t *keys_out, size_t keys_out_len,
                       uint8_t *rend_nonce_out)
@@ -207,12 +235,20 @@ onion_skin_server_handshake(int type,
       size_t keys_tmp_len = keys_out_len + DIGEST_LEN;
       tor_assert(keys_tmp_len <= MAX_KEYS_TMP_LEN);
       uint8_t keys_tmp[MAX_KEYS_TMP_LEN];
+      curve25519_keypair_t *ephemeral = NULL;
+      int ok;
+
+      if (keys->n_ntor_ephemeral_keys)
+        ephemeral = &keys->ntor_ephemeral_keys[--keys->n_ntor_ephemeral_keys];
 
-      if (onion_skin_ntor_server_handshake(
+      ok = onion_skin_ntor_server_handshake(
                                    onion_skin, keys->curve25519_key_map,
-                                   keys->junk_keypair,
+                                   keys->junk_keypair, ephemeral,
                                    keys->my_identity,
-                                   reply_out, keys_tmp, keys_tmp_len)<0) {
+                                   reply_out, keys_tmp, keys_tmp_len) == 0;
+      if (ephemeral)
+        memwipe(ephemeral, 0, sizeof(*ephemeral));
+      if (!ok) {
         /* no need to memwipe here, since the output will never be used */
         return -1;
       }
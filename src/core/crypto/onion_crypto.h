@@ -12,12 +12,22 @@
 #ifndef TOR_ONION_CRYPTO_H
 #define TOR_ONION_CRYPTO_H
 
+/** How many ntor ephemeral keypairs should each server_onion_keys_t hold
+ * ready for use? */
+#define SERVER_NTOR_EPHEMERAL_KEYS 32
+
 typedef struct server_onion_keys_t {
   uint8_t my_identity[DIGEST_LEN];
   crypto_pk_t *onion_key;
   crypto_pk_t *last_onion_key;
   struct di_digest256_map_t *curve25519_key_map;
   struct curve25519_keypair_t *junk_keypair;
+  /** Array of SERVER_NTOR_EPHEMERAL_KEYS ephemeral keypairs for the ntor
+   * handshake, generated ahead of time by server_onion_keys_precompute().
+   * The first n_ntor_ephemeral_keys of them are ready to use; each one is
+   * used at most once. */
+  struct curve25519_keypair_t *ntor_ephemeral_keys;
+  int n_ntor_ephemeral_keys;
 } server_onion_keys_t;
 
 void onion_handshake_state_release(onion_handshake_state_t *state);
@@ -28,7 +38,7 @@ int onion_skin_create(int type,
                       uint8_t *onion_skin_out);
 int onion_skin_server_handshake(int type,
                       const uint8_t *onion_skin, size_t onionskin_len,
-                      const server_onion_keys_t *keys,
+                      server_onion_keys_t *keys,
                       uint8_t *reply_out,
                       uint8_t *keys_out, size_t key_out_len,
                       uint8_t *rend_nonce_out);
@@ -40,6 +50,7 @@ int onion_skin_client_handshake(int type,
                       const char **msg_out);
 
 server_onion_keys_t *server_onion_keys_new(void);
+int server_onion_keys_precompute(server_onion_keys_t *keys, int max);
 void server_onion_keys_free_(server_onion_keys_t *keys);
 #define server_onion_keys_free(keys) \
   FREE_AND_NULL(server_onion_keys_t, server_onion_keys_free_, (keys))
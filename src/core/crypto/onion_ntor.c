@@ -140,7 +140,9 @@ onion_skin_ntor_create(const uint8_t *router_id,
  * fingerprint as <b>my_node_id</b>, and an associative array mapping public
  * onion keys to curve25519_keypair_t in <b>private_keys</b>, attempt to
  * perform the handshake.  Use <b>junk_keys</b> if present if the handshake
- * indicates an unrecognized public key.  Write an NTOR_REPLY_LEN-byte
+ * indicates an unrecognized public key.  If <b>ephemeral_keys</b> is
+ * present, use it as our ephemeral keypair rather than generating a new one;
+ * the caller must never use it again.  Write an NTOR_REPLY_LEN-byte
  * message to send back to the client into <b>handshake_reply_out</b>, and
  * generate <b>key_out_len</b> bytes of key material in <b>key_out</b>. Return
  * 0 on success, -1 on failure.
@@ -149,6 +151,7 @@ int
 onion_skin_ntor_server_handshake(const uint8_t *onion_skin,
                                  const di_digest256_map_t *private_keys,
                                  const curve25519_keypair_t *junk_keys,
+                                 const curve25519_keypair_t *ephemeral_keys,
                                  const uint8_t *my_node_id,
                                  uint8_t *handshake_reply_out,
                                  uint8_t *key_out,
@@ -185,8 +188,13 @@ onion_skin_ntor_server_handshake(const uint8_t *onion_skin,
          CURVE25519_PUBKEY_LEN);
 
   /* Make y, Y */
-  curve25519_secret_key_generate(&s.seckey_y, 0);
-  curve25519_public_key_generate(&s.pubkey_Y, &s.seckey_y);
+  if (ephemeral_keys) {
+    memcpy(&s.seckey_y, &ephemeral_keys->seckey, sizeof(s.seckey_y));
+    memcpy(&s.pubkey_Y, &ephemeral_keys->pubkey, sizeof(s.pubkey_Y));
+  } else {
+    curve25519_secret_key_generate(&s.seckey_y, 0);
+    curve25519_public_key_generate(&s.pubkey_Y, &s.seckey_y);
+  }
 
   /* NOTE: If we ever use a group other than curve25519, or a different
    * representation for its points, we may need to perform different or
@@ -90,6 +90,22 @@ relay_crypt_one_payload(crypto_cipher_t *cipher, uint8_t *in)
   crypto_cipher_crypt_inplace(cipher, (char*) in, CELL_PAYLOAD_SIZE);
 }
 
+/** Apply <b>cipher</b> to the payloads of the <b>n_cells</b> cells in
+ * <b>cells</b> (in place), in order, by calling relay_crypt_one_payload()
+ * on each of them in turn.
+ *
+ * We don't gather the payloads into one contiguous buffer to generate the
+ * keystream in larger blocks: with AES-NI, the copies cost more than the
+ * extra cipher calls save.
+ */
+static void
+relay_crypt_payloads(crypto_cipher_t *cipher, cell_t **cells, int n_cells)
+{
+  int i;
+  for (i = 0; i < n_cells; ++i)
+    relay_crypt_one_payload(cipher, cells[i]->payload);
+}
+
 /** Do the appropriate en/decryptions for <b>cell</b> arriving on
  * <b>circ</b> in direction <b>cell_direction</b>.
  *
@@ -174,6 +190,88 @@ relay_decrypt_cell(circuit_t *circ, cell_t *cell,
   return 0;
 }
 
+/** Do the appropriate en/decryptions for the <b>n_cells</b> cells in
+ * <b>cells</b>, all arriving in order on <b>circ</b> in direction
+ * <b>cell_direction</b>.
+ *
+ * This has the same effect as calling relay_decrypt_cell() on each cell in
+ * turn, and reports its results in <b>layer_hints</b> and
+ * <b>recognized</b>, which must each hold <b>n_cells</b> entries.  The
+ * cipher still runs over one cell at a time; what we save is the per-cell
+ * dispatch on the circuit type and direction.
+ *
+ * Return -1 to indicate that we should mark the circuit for close,
+ * else return 0.
+ */
+int
+relay_decrypt_cells(circuit_t *circ, cell_t **cells, int n_cells,
+                    cell_direction_t cell_direction,
+                    crypt_path_t **layer_hints, char *recognized)
+{
+  int i;
+
+  tor_assert(circ);
+  tor_assert(cells);
+  tor_assert(n_cells > 0);
+  tor_assert(layer_hints);
+  tor_assert(recognized);
+  tor_assert(cell_direction == CELL_DIRECTION_IN ||
+             cell_direction == CELL_DIRECTION_OUT);
+
+  memset(layer_hints, 0, sizeof(crypt_path_t *) * n_cells);
+  memset(recognized, 0, n_cells);
+
+  if (CIRCUIT_IS_ORIGIN(circ)) {
+    /* Layered decryption stops at the hop that recognizes each cell, so
+     * we can't know in advance how much keystream each layer will use. */
+    for (i = 0; i < n_cells; ++i) {
+      if (relay_decrypt_cell(circ, cells[i], cell_direction,
+                             &layer_hints[i], &recognized[i]) < 0)
+        return -1;
+    }
+    return 0;
+  }
+
+  relay_crypto_t *crypto = &TO_OR_CIRCUIT(circ)->crypto;
+  if (cell_direction == CELL_DIRECTION_IN) {
+    /* We're in the middle. Encrypt one layer. */
+    relay_crypt_payloads(crypto->b_crypto, cells, n_cells);
+  } else /* cell_direction == CELL_DIRECTION_OUT */ {
+    /* We're in the middle. Decrypt one layer. */
+    relay_decrypt_cells_forward(crypto, cells, n_cells, recognized);
+  }
+  return 0;
+}
+
+/** Decrypt one layer from the <b>n_cells</b> cells in <b>cells</b>, all
+ * arriving in order, heading away from the origin, on the or_circuit_t whose
+ * crypto state is <b>crypto</b>.  Set <b>recognized</b>[i] to 1 if cell i
+ * is for us, and to 0 otherwise.
+ *
+ * This only touches the f_crypto and f_digest fields of <b>crypto</b>,
+ * which nothing else on an or_circuit_t uses, so it is safe to call from a
+ * relay shard thread.
+ */
+void
+relay_decrypt_cells_forward(relay_crypto_t *crypto, cell_t **cells,
+                            int n_cells, char *recognized)
+{
+  relay_header_t rh;
+  int i;
+
+  relay_crypt_payloads(crypto->f_crypto, cells, n_cells);
+
+  for (i = 0; i < n_cells; ++i) {
+    recognized[i] = 0;
+    relay_header_unpack(&rh, cells[i]->payload);
+    if (rh.recognized == 0) {
+      /* it's possibly recognized. have to check digest to be sure. */
+      if (relay_digest_matches(crypto->f_digest, cells[i]))
+        recognized[i] = 1;
+    }
+  }
+}
+
 /**
  * Encrypt a cell <b>cell</b> that we are creating, and sending outbound on
  * <b>circ</b> until the hop corresponding to <b>layer_hint</b>.
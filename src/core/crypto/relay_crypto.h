@@ -23,6 +23,12 @@ void relay_encrypt_cell_outbound(cell_t *cell, origin_circuit_t *or_circ,
                             crypt_path_t *layer_hint);
 void relay_encrypt_cell_inbound(cell_t *cell, or_circuit_t *or_circ);
 
+int relay_decrypt_cells(circuit_t *circ, cell_t **cells, int n_cells,
+                        cell_direction_t cell_direction,
+                        crypt_path_t **layer_hints, char *recognized);
+void relay_decrypt_cells_forward(relay_crypto_t *crypto, cell_t **cells,
+                                 int n_cells, char *recognized);
+
 void relay_crypto_clear(relay_crypto_t *crypto);
 
 void relay_crypto_assert_ok(const relay_crypto_t *crypto);
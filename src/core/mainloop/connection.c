@@ -68,6 +68,7 @@
 #define TOR_CHANNEL_INTERNAL_
 #define CONNECTION_PRIVATE
 #include "app/config/config.h"
+#include "app/config/confparse.h"
 #include "core/mainloop/connection.h"
 #include "core/mainloop/mainloop.h"
 #include "core/mainloop/netstatus.h"
@@ -103,6 +104,7 @@
 #include "feature/rend/rendcommon.h"
 #include "feature/stats/rephist.h"
 #include "lib/crypt_ops/crypto_util.h"
+#include "lib/encoding/confline.h"
 #include "lib/geoip/geoip.h"
 
 #include "lib/sandbox/sandbox.h"
@@ -166,7 +168,6 @@ static connection_t *connection_listener_new_for_port(
                                int *defer, int *addr_in_use);
 static void connection_init(time_t now, connection_t *conn, int type,
                             int socket_family);
-static int connection_handle_listener_read(connection_t *conn, int new_type);
 static int connection_finished_flushing(connection_t *conn);
 static int connection_flushed_some(connection_t *conn);
 static int connection_finished_connecting(connection_t *conn);
@@ -545,6 +546,47 @@ connection_link_connections(connection_t *conn_a, connection_t *conn_b)
   conn_b->linked_conn = conn_a;
 }
 
+/** Total number of bytes that linked connections have passed to one
+ * another by relinking buffer chunks. */
+static uint64_t stats_n_linked_bytes_moved = 0;
+/** Total number of bytes that linked connections have had to copy when
+ * passing data to one another. */
+static uint64_t stats_n_linked_bytes_copied = 0;
+
+/** Move as much of the flushable part of <b>from</b>'s outbuf as we can,
+ * up to <b>max</b> bytes, onto the inbuf of its linked connection, and
+ * update the per-link and global counts of bytes that were moved versus
+ * copied.  Return the number of bytes transferred, or -1 on error. */
+static int
+connection_move_from_linked_outbuf(connection_t *from, size_t max)
+{
+  connection_t *to = from->linked_conn;
+  size_t len = MIN(from->outbuf_flushlen, max);
+  size_t n_copied = 0;
+  int r;
+
+  tor_assert(to);
+  r = buf_move_to_buf_counted(to->inbuf, from->outbuf, &len, &n_copied);
+  if (r > 0) {
+    from->outbuf_flushlen -= r;
+    to->n_linked_bytes_moved += (size_t)r - n_copied;
+    to->n_linked_bytes_copied += n_copied;
+    stats_n_linked_bytes_moved += (size_t)r - n_copied;
+    stats_n_linked_bytes_copied += n_copied;
+  }
+  return r;
+}
+
+/** Set *<b>moved_out</b> and *<b>copied_out</b> to the total number of
+ * bytes that linked connections have passed to one another without and
+ * with copying, respectively. */
+void
+connection_get_linked_bytes_stats(uint64_t *moved_out, uint64_t *copied_out)
+{
+  *moved_out = stats_n_linked_bytes_moved;
+  *copied_out = stats_n_linked_bytes_copied;
+}
+
 /** Return true iff the provided connection listener type supports AF_UNIX
  * sockets. */
 int
@@ -614,11 +656,14 @@ connection_free_minimal(connection_t *conn)
 
   if (conn->linked) {
     log_info(LD_GENERAL, "Freeing linked %s connection [%s] with %d "
-             "bytes on inbuf, %d on outbuf.",
+             "bytes on inbuf, %d on outbuf. It received %"PRIu64" bytes "
+             "over its link by moving chunks, and %"PRIu64" by copying.",
              conn_type_to_string(conn->type),
              conn_state_to_string(conn->type, conn->state),
              (int)connection_get_inbuf_len(conn),
-             (int)connection_get_outbuf_len(conn));
+             (int)connection_get_outbuf_len(conn),
+             (conn->n_linked_bytes_moved),
+             (conn->n_linked_bytes_copied));
   }
 
   if (!connection_is_listener(conn)) {
@@ -1196,6 +1241,24 @@ make_win32_socket_exclusive(tor_socket_t sock)
 }
 #endif /* defined(_WIN32) */
 
+/** Return the number of listener sockets that we should open for each
+ * ORPort with a fixed port number. */
+static int
+get_n_or_port_listeners(const or_options_t *options)
+{
+#ifdef SO_REUSEPORT
+  return MAX(1, options->NumORPortListeners);
+#else
+  static int warned = 0;
+  if (options->NumORPortListeners > 1 && !warned) {
+    log_warn(LD_CONFIG, "NumORPortListeners needs SO_REUSEPORT, which this "
+             "platform doesn't support. Opening one listener per ORPort.");
+    warned = 1;
+  }
+  return 1;
+#endif /* defined(SO_REUSEPORT) */
+}
+
 /** Max backlog to pass to listen.  We start at */
 static int listen_limit = INT_MAX;
 
@@ -1285,6 +1348,21 @@ connection_listener_new(const struct sockaddr *listensockaddr,
                tor_socket_strerror(errno));
     }
 
+#ifdef SO_REUSEPORT
+    /* Let our other listeners for this ORPort bind to the same address, so
+     * that the kernel can spread new connections across them. */
+    if (type == CONN_TYPE_OR_LISTENER &&
+        get_n_or_port_listeners(options) > 1) {
+      int one = 1;
+      if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT, (void*) &one,
+                     (socklen_t)sizeof(one)) < 0) {
+        log_warn(LD_NET, "Error setting SO_REUSEPORT flag on %s: %s",
+                 conn_type_to_string(type),
+                 tor_socket_strerror(tor_socket_errno(s)));
+      }
+    }
+#endif /* defined(SO_REUSEPORT) */
+
 #ifdef _WIN32
     if (make_win32_socket_exclusive(s) < 0) {
       log_warn(LD_NET, "Error setting SO_EXCLUSIVEADDRUSE flag on %s: %s",
@@ -1686,11 +1764,57 @@ check_sockaddr_family_match(sa_family_t got, connection_t *listener)
   return 0;
 }
 
-/** The listener connection <b>conn</b> told poll() it wanted to read.
- * Call accept() on conn-\>s, and add the new connection if necessary.
+/** Number of times that a listener has told us it was readable. */
+static uint64_t stats_n_listener_wakeups = 0;
+/** Number of sockets that listeners have accepted. */
+static uint64_t stats_n_listener_accepts = 0;
+/** Largest number of sockets that a listener has accepted in one wakeup. */
+static int stats_max_accepts_per_wakeup = 0;
+/** Number of wakeups in which a listener used up its whole accept budget. */
+static uint64_t stats_n_listener_budget_exhausted = 0;
+
+/** Set *<b>n_wakeups_out</b>, *<b>n_accepts_out</b>, and
+ * *<b>max_per_wakeup_out</b> to the number of times that listeners have
+ * become readable, the number of sockets they have accepted, and the most
+ * sockets that a listener has accepted in a single wakeup. */
+void
+connection_get_accept_stats(uint64_t *n_wakeups_out,
+                            uint64_t *n_accepts_out,
+                            int *max_per_wakeup_out)
+{
+  *n_wakeups_out = stats_n_listener_wakeups;
+  *n_accepts_out = stats_n_listener_accepts;
+  *max_per_wakeup_out = stats_max_accepts_per_wakeup;
+}
+
+/** Log a heartbeat message about how many connections our listeners have
+ * accepted each time they became readable. */
+void
+connection_log_accept_heartbeat(void)
+{
+  if (!stats_n_listener_wakeups)
+    return;
+
+  log_notice(LD_HEARTBEAT,
+             "Since startup our listeners have accepted %" PRIu64
+             " connections in %" PRIu64 " wakeups: %.2f per wakeup on "
+             "average, and at most %d. %" PRIu64 " wakeups used up the "
+             "whole budget of %d accepts.",
+             stats_n_listener_accepts, stats_n_listener_wakeups,
+             ((double)stats_n_listener_accepts) / stats_n_listener_wakeups,
+             stats_max_accepts_per_wakeup, stats_n_listener_budget_exhausted,
+             LISTENER_ACCEPT_BUDGET);
+}
+
+/** Call accept() once on the listener connection <b>conn</b>, and add the
+ * new connection if necessary.
+ *
+ * Return 1 if we took a socket off the listen queue (even if we then closed
+ * it), 0 if there was nothing to accept or we should stop accepting for
+ * now, and -1 if we closed the listener.
  */
 static int
-connection_handle_listener_read(connection_t *conn, int new_type)
+connection_accept_one(connection_t *conn, int new_type)
 {
   tor_socket_t news; /* the new socket */
   connection_t *newconn = 0;
@@ -1746,7 +1870,7 @@ connection_handle_listener_read(connection_t *conn, int new_type)
                tor_socket_strerror(errno));
     }
     tor_close_socket(news);
-    return 0;
+    return 1;
   }
 
   if (options->ConstrainedSockets)
@@ -1754,7 +1878,7 @@ connection_handle_listener_read(connection_t *conn, int new_type)
 
   if (check_sockaddr_family_match(remote->sa_family, conn) < 0) {
     tor_close_socket(news);
-    return 0;
+    return 1;
   }
 
   if (conn->socket_family == AF_INET || conn->socket_family == AF_INET6 ||
@@ -1778,7 +1902,7 @@ connection_handle_listener_read(connection_t *conn, int new_type)
                    "Denying socks connection from untrusted address %s.",
                    fmt_and_decorate_addr(&addr));
         tor_close_socket(news);
-        return 0;
+        return 1;
       }
     }
     if (new_type == CONN_TYPE_DIR) {
@@ -1787,7 +1911,7 @@ connection_handle_listener_read(connection_t *conn, int new_type)
         log_notice(LD_DIRSERV,"Denying dir connection from address %s.",
                    fmt_and_decorate_addr(&addr));
         tor_close_socket(news);
-        return 0;
+        return 1;
       }
     }
     if (new_type == CONN_TYPE_OR) {
@@ -1795,7 +1919,7 @@ connection_handle_listener_read(connection_t *conn, int new_type)
        * can open a new connection. */
       if (dos_conn_addr_get_defense_type(&addr) == DOS_CONN_DEFENSE_CLOSE) {
         tor_close_socket(news);
-        return 0;
+        return 1;
       }
     }
 
@@ -1842,15 +1966,41 @@ connection_handle_listener_read(connection_t *conn, int new_type)
 
   if (connection_add(newconn) < 0) { /* no space, forget it */
     connection_free(newconn);
-    return 0; /* no need to tear down the parent */
+    return 0; /* no need to tear down the parent, but stop accepting */
   }
 
   if (connection_init_accepted_conn(newconn, TO_LISTENER_CONN(conn)) < 0) {
     if (! newconn->marked_for_close)
       connection_mark_for_close(newconn);
-    return 0;
   }
-  return 0;
+  return 1;
+}
+
+/** The listener connection <b>conn</b> told poll() it wanted to read.
+ * Accept new connections from it until its queue is empty, or until we have
+ * accepted LISTENER_ACCEPT_BUDGET of them, so that a busy listener doesn't
+ * need one trip through the event loop for every connection.
+ */
+STATIC int
+connection_handle_listener_read(connection_t *conn, int new_type)
+{
+  int n_accepted = 0, r = 0;
+
+  while (n_accepted < LISTENER_ACCEPT_BUDGET) {
+    r = connection_accept_one(conn, new_type);
+    if (r <= 0)
+      break;
+    ++n_accepted;
+  }
+
+  ++stats_n_listener_wakeups;
+  stats_n_listener_accepts += n_accepted;
+  if (n_accepted > stats_max_accepts_per_wakeup)
+    stats_max_accepts_per_wakeup = n_accepted;
+  if (n_accepted == LISTENER_ACCEPT_BUDGET)
+    ++stats_n_listener_budget_exhausted;
+
+  return r < 0 ? -1 : 0;
 }
 
 /** Initialize states for newly accepted connection <b>conn</b>.
@@ -2742,6 +2892,7 @@ connection_read_proxy_handshake(connection_t *conn)
 /** Given a list of listener connections in <b>old_conns</b>, and list of
  * port_cfg_t entries in <b>ports</b>, open a new listener for every port in
  * <b>ports</b> that does not already have a listener in <b>old_conns</b>.
+ * (An ORPort on a fixed port wants NumORPortListeners listeners.)
  *
  * Remove from <b>old_conns</b> every connection that has a corresponding
  * entry in <b>ports</b>.  Add to <b>new_conns</b> new every connection we
@@ -2767,6 +2918,7 @@ retry_listener_ports(smartlist_t *old_conns,
 #endif
 
   smartlist_t *launch = smartlist_new();
+  const int n_or_listeners = get_n_or_port_listeners(get_options());
   int r = 0;
 
   if (control_listeners_only) {
@@ -2775,7 +2927,16 @@ retry_listener_ports(smartlist_t *old_conns,
           smartlist_add(launch, p);
     });
   } else {
-    smartlist_add_all(launch, ports);
+    /* An ORPort on a fixed port may want several listeners: list it once
+     * for each of them.  (With 'auto', each one would get its own port.) */
+    SMARTLIST_FOREACH_BEGIN(ports, port_cfg_t *, p) {
+      int i, n = 1;
+      if (p->type == CONN_TYPE_OR_LISTENER && !p->is_unix_addr &&
+          p->port != CFG_AUTO_PORT)
+        n = n_or_listeners;
+      for (i = 0; i < n; ++i)
+        smartlist_add(launch, p);
+    } SMARTLIST_FOREACH_END(p);
   }
 
   /* Iterate through old_conns, comparing it to launch: remove from both lists
@@ -2852,7 +3013,7 @@ retry_listener_ports(smartlist_t *old_conns,
       /* This listener is already running; we don't need to launch it. */
       //log_debug(LD_NET, "Already have %s on %s:%d",
       //    conn_type_to_string(found_port->type), conn->address, conn->port);
-      smartlist_remove(launch, found_port);
+      smartlist_del_keeporder(launch, smartlist_pos(launch, found_port));
       /* And we can remove the connection from old_conns too. */
       SMARTLIST_DEL_CURRENT(old_conns, conn);
     }
@@ -3072,6 +3233,179 @@ connection_counts_as_relayed_traffic(connection_t *conn, time_t now)
   return 0;
 }
 
+/** Names of the bandwidth classes, as used in the BandwidthClassRate and
+ * BandwidthClassBurst options, indexed by bw_class_t. */
+static const char *bw_class_names[N_BW_CLASSES] = {
+  "ClientOR", "RelayOR", "Dir", "Exit", "OnionService",
+};
+
+/** Token buckets for each bandwidth class, indexed by bw_class_t.  Each
+ * class draws on its own bucket first, and then on the global buckets, and
+ * on the relayed buckets too if it is relayed traffic. */
+static token_bucket_rw_t bw_class_buckets[N_BW_CLASSES];
+/** True for each bw_class_t that has a configured limit of its own. */
+static int bw_class_is_limited[N_BW_CLASSES];
+
+/** Return the bw_class_t whose limit <b>conn</b> is subject to, or -1 if it
+ * isn't in any class. */
+STATIC int
+connection_get_bw_class(connection_t *conn, time_t now)
+{
+  switch (conn->type) {
+    case CONN_TYPE_OR:
+      return connection_counts_as_relayed_traffic(conn, now) ?
+        BW_CLASS_RELAY_OR : BW_CLASS_CLIENT_OR;
+    case CONN_TYPE_DIR:
+      return DIR_CONN_IS_SERVER(conn) ? BW_CLASS_DIR : -1;
+    case CONN_TYPE_EXIT: {
+      const edge_connection_t *edge_conn = TO_EDGE_CONN(conn);
+      /* A linked exit connection carries a tunneled directory request: it
+       * reads the answer from the directory connection on the other end. */
+      if (conn->linked)
+        return BW_CLASS_DIR;
+      return (edge_conn->hs_ident || edge_conn->rend_data) ?
+        BW_CLASS_ONION_SERVICE : BW_CLASS_EXIT;
+    }
+    default:
+      return -1;
+  }
+}
+
+/** Return the token bucket for the bandwidth class of <b>conn</b>, or NULL
+ * if its class has no limit of its own. */
+static token_bucket_rw_t *
+connection_get_bw_class_bucket(connection_t *conn, time_t now)
+{
+  const int cls = connection_get_bw_class(conn, now);
+  if (cls < 0 || !bw_class_is_limited[cls])
+    return NULL;
+  return &bw_class_buckets[cls];
+}
+
+/** Helper: parse every line in <b>lines</b>, from the option called
+ * <b>optname</b>, as a bandwidth class name followed by an amount of
+ * bytes, and store the amounts in <b>out</b>, indexed by class.  Return 0
+ * on success; on failure, set *<b>msg</b> and return -1. */
+static int
+parse_bw_class_lines(const config_line_t *lines, const char *optname,
+                     uint64_t *out, char **msg)
+{
+  const config_line_t *line;
+
+  for (line = lines; line; line = line->next) {
+    const char *end_of_name = find_whitespace(line->value);
+    const char *amount = eat_whitespace(end_of_name);
+    int cls, ok = 0;
+    uint64_t val;
+
+    for (cls = 0; cls < N_BW_CLASSES; ++cls) {
+      if (!strncasecmp(line->value, bw_class_names[cls],
+                       end_of_name - line->value) &&
+          strlen(bw_class_names[cls]) == (size_t)(end_of_name - line->value))
+        break;
+    }
+    if (cls == N_BW_CLASSES) {
+      tor_asprintf(msg, "%s line \"%s\" does not start with a bandwidth "
+                   "class. Known classes are ClientOR, RelayOR, Dir, Exit "
+                   "and OnionService.", optname, line->value);
+      return -1;
+    }
+    if (out[cls]) {
+      tor_asprintf(msg, "%s is set more than once for %s.", optname,
+                   bw_class_names[cls]);
+      return -1;
+    }
+    val = config_parse_memunit(amount, &ok);
+    if (!ok || val == 0 || val > TOKEN_BUCKET_MAX_BURST) {
+      tor_asprintf(msg, "%s for %s must be between 1 and %d bytes.",
+                   optname, bw_class_names[cls], TOKEN_BUCKET_MAX_BURST);
+      return -1;
+    }
+    out[cls] = val;
+  }
+  return 0;
+}
+
+/** Parse the BandwidthClassRate and BandwidthClassBurst lines of
+ * <b>options</b>.  If <b>rates_out</b> and <b>bursts_out</b> are provided,
+ * set them, indexed by bw_class_t, to the rate and burst for each class, or
+ * to 0 for a class without a limit of its own.  A class with a rate but no
+ * burst gets a burst equal to its rate.
+ *
+ * Return 0 on success; on failure, set *<b>msg</b> and return -1. */
+int
+connection_bucket_parse_class_limits(const or_options_t *options,
+                                     uint32_t *rates_out,
+                                     uint32_t *bursts_out,
+                                     char **msg)
+{
+  uint64_t rates[N_BW_CLASSES], bursts[N_BW_CLASSES];
+  int cls;
+
+  memset(rates, 0, sizeof(rates));
+  memset(bursts, 0, sizeof(bursts));
+  if (parse_bw_class_lines(options->BandwidthClassRate,
+                           "BandwidthClassRate", rates, msg) < 0 ||
+      parse_bw_class_lines(options->BandwidthClassBurst,
+                           "BandwidthClassBurst", bursts, msg) < 0)
+    return -1;
+
+  for (cls = 0; cls < N_BW_CLASSES; ++cls) {
+    if (bursts[cls] && !rates[cls]) {
+      tor_asprintf(msg, "BandwidthClassBurst is set for %s, but "
+                   "BandwidthClassRate is not.", bw_class_names[cls]);
+      return -1;
+    }
+    if (!bursts[cls])
+      bursts[cls] = rates[cls];
+    if (bursts[cls] < rates[cls]) {
+      tor_asprintf(msg, "BandwidthClassBurst for %s must be at least equal "
+                   "to its BandwidthClassRate.", bw_class_names[cls]);
+      return -1;
+    }
+    if (rates_out)
+      rates_out[cls] = (uint32_t)rates[cls];
+    if (bursts_out)
+      bursts_out[cls] = (uint32_t)bursts[cls];
+  }
+  return 0;
+}
+
+/** Set up or update the bandwidth class buckets from <b>options</b>.  If
+ * <b>reset</b> is true, or a class did not have a limit before, start its
+ * buckets out full as of <b>now_ts</b>. */
+static void
+connection_bucket_configure_classes(const or_options_t *options, int reset,
+                                    uint32_t now_ts)
+{
+  uint32_t rates[N_BW_CLASSES], bursts[N_BW_CLASSES];
+  char *msg = NULL;
+  int cls;
+
+  if (connection_bucket_parse_class_limits(options, rates, bursts,
+                                           &msg) < 0) {
+    /* options_validate() should have caught this. */
+    log_warn(LD_BUG, "Couldn't parse bandwidth class limits: %s", msg);
+    tor_free(msg);
+    memset(rates, 0, sizeof(rates));
+  }
+
+  for (cls = 0; cls < N_BW_CLASSES; ++cls) {
+    if (!rates[cls]) {
+      bw_class_is_limited[cls] = 0;
+      continue;
+    }
+    if (reset || !bw_class_is_limited[cls]) {
+      token_bucket_rw_init(&bw_class_buckets[cls], rates[cls], bursts[cls],
+                           now_ts);
+    } else {
+      token_bucket_rw_adjust(&bw_class_buckets[cls], rates[cls],
+                             bursts[cls]);
+    }
+    bw_class_is_limited[cls] = 1;
+  }
+}
+
 /** Helper function to decide how many bytes out of <b>global_bucket</b>
  * we're willing to use for this transaction. <b>base</b> is the size
  * of a cell on the network; <b>priority</b> says whether we should
@@ -3107,13 +3441,15 @@ connection_bucket_get_share(int base, int priority,
 }
 
 /** How many bytes at most can we read onto this connection? */
-static ssize_t
+STATIC ssize_t
 connection_bucket_read_limit(connection_t *conn, time_t now)
 {
   int base = RELAY_PAYLOAD_SIZE;
   int priority = conn->type != CONN_TYPE_DIR;
   ssize_t conn_bucket = -1;
   size_t global_bucket_val = token_bucket_rw_get_read(&global_bucket);
+  const token_bucket_rw_t *class_bucket =
+    connection_get_bw_class_bucket(conn, now);
 
   if (connection_speaks_cells(conn)) {
     or_connection_t *or_conn = TO_OR_CONN(conn);
@@ -3123,14 +3459,22 @@ connection_bucket_read_limit(connection_t *conn, time_t now)
   }
 
   if (!connection_is_rate_limited(conn)) {
-    /* be willing to read on local conns even if our buckets are empty */
-    return conn_bucket>=0 ? conn_bucket : 1<<14;
+    /* be willing to read on local conns even if our buckets are empty, as
+     * long as their bandwidth class lets us */
+    ssize_t limit = conn_bucket>=0 ? conn_bucket : 1<<14;
+    if (class_bucket)
+      limit = MIN(limit, (ssize_t)token_bucket_rw_get_read(class_bucket));
+    return limit;
   }
 
   if (connection_counts_as_relayed_traffic(conn, now)) {
     size_t relayed = token_bucket_rw_get_read(&global_relayed_bucket);
     global_bucket_val = MIN(global_bucket_val, relayed);
   }
+  if (class_bucket) {
+    global_bucket_val = MIN(global_bucket_val,
+                            token_bucket_rw_get_read(class_bucket));
+  }
 
   return connection_bucket_get_share(base, priority,
                                      global_bucket_val, conn_bucket);
@@ -3144,9 +3488,15 @@ connection_bucket_write_limit(connection_t *conn, time_t now)
   int priority = conn->type != CONN_TYPE_DIR;
   size_t conn_bucket = conn->outbuf_flushlen;
   size_t global_bucket_val = token_bucket_rw_get_write(&global_bucket);
+  const token_bucket_rw_t *class_bucket =
+    connection_get_bw_class_bucket(conn, now);
 
   if (!connection_is_rate_limited(conn)) {
-    /* be willing to write to local conns even if our buckets are empty */
+    /* be willing to write to local conns even if our buckets are empty, as
+     * long as their bandwidth class lets us */
+    if (class_bucket)
+      return MIN(conn->outbuf_flushlen,
+                 token_bucket_rw_get_write(class_bucket));
     return conn->outbuf_flushlen;
   }
 
@@ -3163,6 +3513,10 @@ connection_bucket_write_limit(connection_t *conn, time_t now)
     size_t relayed = token_bucket_rw_get_write(&global_relayed_bucket);
     global_bucket_val = MIN(global_bucket_val, relayed);
   }
+  if (class_bucket) {
+    global_bucket_val = MIN(global_bucket_val,
+                            token_bucket_rw_get_write(class_bucket));
+  }
 
   return connection_bucket_get_share(base, priority,
                                      global_bucket_val, conn_bucket);
@@ -3274,7 +3628,7 @@ record_num_bytes_transferred_impl(connection_t *conn,
 
 /** We just read <b>num_read</b> and wrote <b>num_written</b> bytes
  * onto <b>conn</b>. Decrement buckets appropriately. */
-static void
+STATIC void
 connection_buckets_decrement(connection_t *conn, time_t now,
                              size_t num_read, size_t num_written)
 {
@@ -3293,6 +3647,13 @@ connection_buckets_decrement(connection_t *conn, time_t now,
 
   record_num_bytes_transferred_impl(conn, now, num_read, num_written);
 
+  /* A bandwidth class limit covers local and linked connections too:
+   * onion service targets are usually local, and tunneled directory
+   * requests are linked. */
+  token_bucket_rw_t *class_bucket = connection_get_bw_class_bucket(conn, now);
+  if (class_bucket)
+    token_bucket_rw_dec(class_bucket, num_read, num_written);
+
   if (!connection_is_rate_limited(conn))
     return; /* local IPs are free */
 
@@ -3311,6 +3672,26 @@ connection_buckets_decrement(connection_t *conn, time_t now,
   }
 }
 
+/** Move whatever <b>conn</b> wants to flush onto the inbuf of its linked
+ * connection, counting the bytes as written by <b>conn</b> and as read by
+ * the linked connection.  Return the number of bytes moved, or -1 on
+ * error. */
+int
+connection_flush_to_linked_conn(connection_t *conn)
+{
+  connection_t *linked = conn->linked_conn;
+  int r;
+
+  tor_assert(linked);
+  r = connection_move_from_linked_outbuf(conn, SIZE_MAX);
+  if (r > 0) {
+    const time_t now = approx_time();
+    connection_buckets_decrement(conn, now, 0, r);
+    connection_buckets_decrement(linked, now, r, 0);
+  }
+  return r;
+}
+
 /**
  * Mark <b>conn</b> as needing to stop reading because bandwidth has been
  * exhausted.  If <b>is_global_bw</b>, it is closing because global bandwidth
@@ -3347,13 +3728,20 @@ void
 connection_consider_empty_read_buckets(connection_t *conn)
 {
   const char *reason;
+  const token_bucket_rw_t *class_bucket =
+    connection_get_bw_class_bucket(conn, approx_time());
+  const int is_rate_limited = connection_is_rate_limited(conn);
 
-  if (!connection_is_rate_limited(conn))
+  if (!is_rate_limited && !class_bucket)
     return; /* Always okay. */
 
   int is_global = 1;
 
-  if (token_bucket_rw_get_read(&global_bucket) <= 0) {
+  if (class_bucket && token_bucket_rw_get_read(class_bucket) <= 0) {
+    reason = "bandwidth class read bucket exhausted. Pausing.";
+  } else if (!is_rate_limited) {
+    return; /* Only the class limit applies. */
+  } else if (token_bucket_rw_get_read(&global_bucket) <= 0) {
     reason = "global read bucket exhausted. Pausing.";
   } else if (connection_counts_as_relayed_traffic(conn, approx_time()) &&
              token_bucket_rw_get_read(&global_relayed_bucket) <= 0) {
@@ -3376,12 +3764,19 @@ void
 connection_consider_empty_write_buckets(connection_t *conn)
 {
   const char *reason;
+  const token_bucket_rw_t *class_bucket =
+    connection_get_bw_class_bucket(conn, approx_time());
+  const int is_rate_limited = connection_is_rate_limited(conn);
 
-  if (!connection_is_rate_limited(conn))
+  if (!is_rate_limited && !class_bucket)
     return; /* Always okay. */
 
   bool is_global = true;
-  if (token_bucket_rw_get_write(&global_bucket) <= 0) {
+  if (class_bucket && token_bucket_rw_get_write(class_bucket) <= 0) {
+    reason = "bandwidth class write bucket exhausted. Pausing.";
+  } else if (!is_rate_limited) {
+    return; /* Only the class limit applies. */
+  } else if (token_bucket_rw_get_write(&global_bucket) <= 0) {
     reason = "global write bucket exhausted. Pausing.";
   } else if (connection_counts_as_relayed_traffic(conn, approx_time()) &&
              token_bucket_rw_get_write(&global_relayed_bucket) <= 0) {
@@ -3420,6 +3815,7 @@ connection_bucket_init(void)
                       (int32_t)options->BandwidthBurst,
                       now_ts);
   }
+  connection_bucket_configure_classes(options, 1, now_ts);
 
   reenable_blocked_connection_init(options);
 }
@@ -3440,6 +3836,8 @@ connection_bucket_adjust(const or_options_t *options)
                         (int32_t)options->BandwidthRate,
                         (int32_t)options->BandwidthBurst);
   }
+  connection_bucket_configure_classes(options, 0,
+                                      monotime_coarse_get_stamp());
 }
 
 /**
@@ -3449,18 +3847,23 @@ connection_bucket_adjust(const or_options_t *options)
 static uint32_t last_refilled_global_buckets_ts=0;
 /**
  * Refill the token buckets for a single connection <b>conn</b>, and the
- * global token buckets as appropriate.  Requires that <b>now_ts</b> is
- * the time in coarse timestamp units.
+ * global and bandwidth class token buckets as appropriate.  Requires that
+ * <b>now_ts</b> is the time in coarse timestamp units.
  */
-static void
+STATIC void
 connection_bucket_refill_single(connection_t *conn, uint32_t now_ts)
 {
   /* Note that we only check for equality here: the underlying
    * token bucket functions can handle moving backwards in time if they
    * need to. */
   if (now_ts != last_refilled_global_buckets_ts) {
+    int cls;
     token_bucket_rw_refill(&global_bucket, now_ts);
     token_bucket_rw_refill(&global_relayed_bucket, now_ts);
+    for (cls = 0; cls < N_BW_CLASSES; ++cls) {
+      if (bw_class_is_limited[cls])
+        token_bucket_rw_refill(&bw_class_buckets[cls], now_ts);
+    }
     last_refilled_global_buckets_ts = now_ts;
   }
 
@@ -3786,8 +4189,12 @@ connection_buf_read_from_socket(connection_t *conn, ssize_t *max_to_read,
               result, (long)n_read, (long)n_written);
   } else if (conn->linked) {
     if (conn->linked_conn) {
-      result = buf_move_to_buf(conn->inbuf, conn->linked_conn->outbuf,
-                               &conn->linked_conn->outbuf_flushlen);
+      /* Linked conns take everything they can, unless their bandwidth
+       * class has a limit. */
+      const size_t max =
+        connection_get_bw_class_bucket(conn, approx_time()) ?
+        (size_t)at_most : SIZE_MAX;
+      result = connection_move_from_linked_outbuf(conn->linked_conn, max);
     } else {
       result = 0;
     }
@@ -4064,7 +4471,8 @@ connection_handle_write_impl(connection_t *conn, int force)
     /* else open, or closing */
     initial_size = buf_datalen(conn->outbuf);
     result = buf_flush_to_tls(conn->outbuf, or_conn->tls,
-                           max_to_write, &conn->outbuf_flushlen);
+                              max_to_write, &conn->outbuf_flushlen,
+                              &or_conn->tls_flush_stats);
 
     if (result >= 0)
       update_send_buffer_size(conn->s);
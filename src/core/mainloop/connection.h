@@ -106,6 +106,12 @@ connection_t *connection_new(int type, int socket_family);
 int connection_init_accepted_conn(connection_t *conn,
                                   const listener_connection_t *listener);
 void connection_link_connections(connection_t *conn_a, connection_t *conn_b);
+void connection_get_linked_bytes_stats(uint64_t *moved_out,
+                                       uint64_t *copied_out);
+void connection_get_accept_stats(uint64_t *n_wakeups_out,
+                                 uint64_t *n_accepts_out,
+                                 int *max_per_wakeup_out);
+void connection_log_accept_heartbeat(void);
 MOCK_DECL(void,connection_free_,(connection_t *conn));
 #define connection_free(conn) \
   FREE_AND_NULL(connection_t, connection_free_, (conn))
@@ -195,10 +201,31 @@ int retry_all_listeners(smartlist_t *new_conns,
 void connection_mark_all_noncontrol_listeners(void);
 void connection_mark_all_noncontrol_connections(void);
 
+/** Kinds of traffic that can have a bandwidth limit of their own, under
+ * the global limits.  See connection_get_bw_class(). */
+typedef enum bw_class_t {
+  /** OR connections that we have used for our own circuits lately. */
+  BW_CLASS_CLIENT_OR = 0,
+  /** OR connections that only relay other people's circuits. */
+  BW_CLASS_RELAY_OR = 1,
+  /** Directory connections on which we are serving directory information. */
+  BW_CLASS_DIR = 2,
+  /** Exit connections for streams from the Tor network. */
+  BW_CLASS_EXIT = 3,
+  /** Exit connections from our onion services to their targets. */
+  BW_CLASS_ONION_SERVICE = 4,
+} bw_class_t;
+/** How many kinds of bw_class_t there are. */
+#define N_BW_CLASSES 5
+
 ssize_t connection_bucket_write_limit(connection_t *conn, time_t now);
 int global_write_bucket_low(connection_t *conn, size_t attempt, int priority);
 void connection_bucket_init(void);
 void connection_bucket_adjust(const or_options_t *options);
+int connection_bucket_parse_class_limits(const or_options_t *options,
+                                         uint32_t *rates_out,
+                                         uint32_t *bursts_out,
+                                         char **msg);
 void connection_bucket_refill_all(time_t now,
                                   uint32_t now_ts);
 void connection_read_bw_exhausted(connection_t *conn, bool is_global_bw);
@@ -234,6 +261,7 @@ connection_buf_add(const char *string, size_t len, connection_t *conn)
 void connection_buf_add_compress(const char *string, size_t len,
                                  dir_connection_t *conn, int done);
 void connection_buf_add_buf(connection_t *conn, struct buf_t *buf);
+int connection_flush_to_linked_conn(connection_t *conn);
 
 size_t connection_get_inbuf_len(connection_t *conn);
 size_t connection_get_outbuf_len(connection_t *conn);
@@ -336,7 +364,18 @@ void connection_check_oos(int n_socks, int failed);
   STMT_END
 
 #ifdef CONNECTION_PRIVATE
+/** Most connections that we accept from a listener each time it becomes
+ * readable, before we let other events run. */
+#define LISTENER_ACCEPT_BUDGET 64
+
 STATIC void connection_free_minimal(connection_t *conn);
+STATIC int connection_handle_listener_read(connection_t *conn, int new_type);
+STATIC int connection_get_bw_class(connection_t *conn, time_t now);
+STATIC ssize_t connection_bucket_read_limit(connection_t *conn, time_t now);
+STATIC void connection_buckets_decrement(connection_t *conn, time_t now,
+                                         size_t num_read, size_t num_written);
+STATIC void connection_bucket_refill_single(connection_t *conn,
+                                            uint32_t now_ts);
 
 /* Used only by connection.c and test*.c */
 MOCK_DECL(STATIC int,connection_connect_sockaddr,
@@ -14,7 +14,9 @@
  * Right now, we use this infrastructure
  *  <ul><li>for processing onionskins in onion.c
  *      <li>for compressing consensuses in consdiffmgr.c,
- *      <li>and for calculating diffs and compressing them in consdiffmgr.c.
+ *      <li>for calculating diffs and compressing them in consdiffmgr.c,
+ *      <li>and for parsing consensuses and checking their signatures in
+ *          ns_parse.c and networkstatus.c.
  *  </ul>
  **/
 #include "core/or/or.h"
@@ -31,6 +33,8 @@
 #include "feature/stats/rephist.h"
 #include "feature/relay/router.h"
 #include "lib/evloop/workqueue.h"
+#include "lib/lock/compat_mutex.h"
+#include "lib/thread/threads.h"
 #include "core/crypto/onion_crypto.h"
 
 #include "core/or/or_circuit_st.h"
@@ -71,8 +75,25 @@ worker_state_free_void(void *arg)
   worker_state_free_(arg);
 }
 
+/** How many ntor ephemeral keys should a worker generate at once when it
+ * has nothing better to do? */
+#define IDLE_NTOR_KEYS_PER_CALL 4
+
+/** Idle function for our worker threads: generate some ephemeral keys ahead
+ * of time, so that we don't need to make them while handling a CREATE
+ * cell. */
+static int
+worker_state_idle_fn(void *arg)
+{
+  worker_state_t *ws = arg;
+  return server_onion_keys_precompute(ws->onion_keys,
+                                      IDLE_NTOR_KEYS_PER_CALL) > 0;
+}
+
 static replyqueue_t *replyqueue = NULL;
 static threadpool_t *threadpool = NULL;
+/** How many threads does <b>threadpool</b> have? */
+static int threadpool_n_threads = 0;
 
 static tor_weak_rng_t request_sample_rng = TOR_WEAK_RNG_INIT;
 
@@ -96,6 +117,7 @@ cpu_init(void)
       least one thread of each kind.
     */
     const int n_threads = get_num_cpus(get_options()) + 1;
+    threadpool_n_threads = n_threads;
     threadpool = threadpool_new(n_threads,
                                 replyqueue,
                                 worker_state_new,
@@ -105,6 +127,8 @@ cpu_init(void)
     int r = threadpool_register_reply_event(threadpool, NULL);
 
     tor_assert(r == 0);
+
+    threadpool_set_idle_fn(threadpool, worker_state_idle_fn);
   }
 
   /* Total voodoo. Can we make this more sensible? */
@@ -289,8 +313,8 @@ get_overhead_for_onionskins(uint32_t *usec_out, double *frac_out,
   return 0;
 }
 
-/** If we've measured overhead for onionskins of type <b>onionskin_type</b>,
- * log it. */
+/** If we've measured the time and overhead for onionskins of type
+ * <b>onionskin_type</b>, log them. */
 void
 cpuworker_log_onionskin_overhead(int severity, int onionskin_type,
                                  const char *onionskin_type_name)
@@ -299,6 +323,17 @@ cpuworker_log_onionskin_overhead(int severity, int onionskin_type,
   double relative_overhead;
   int r;
 
+  if (onionskin_type <= MAX_ONION_HANDSHAKE_TYPE &&
+      onionskins_n_processed[onionskin_type]) {
+    log_fn(severity, LD_OR,
+           "%s onionskins have taken %u usec each on average in "
+           "cpuworkers, over %"PRIu64" measured handshakes.",
+           onionskin_type_name,
+           (unsigned)(onionskins_usec_internal[onionskin_type] /
+                      onionskins_n_processed[onionskin_type]),
+           onionskins_n_processed[onionskin_type]);
+  }
+
   r = get_overhead_for_onionskins(&overhead,  &relative_overhead,
                                   onionskin_type);
   if (!overhead || r<0)
@@ -310,6 +345,27 @@ cpuworker_log_onionskin_overhead(int severity, int onionskin_type,
          onionskin_type_name, (unsigned)overhead, relative_overhead*100);
 }
 
+/** Log how many times the main thread has been woken up to handle replies
+ * from the worker threads, and how many replies it handled each time. */
+void
+cpuworker_log_reply_stats(int severity)
+{
+  uint64_t n_wakeups, n_replies;
+  unsigned max_per_wakeup;
+
+  if (!replyqueue)
+    return;
+  replyqueue_get_stats(replyqueue, &n_wakeups, &n_replies, &max_per_wakeup);
+  if (!n_wakeups)
+    return;
+
+  log_fn(severity, LD_HEARTBEAT,
+         "CPU worker replies: %"PRIu64" replies in %"PRIu64" wakeups "
+         "(%.2f per wakeup on average, %u at most).",
+         n_replies, n_wakeups, ((double)n_replies) / n_wakeups,
+         max_per_wakeup);
+}
+
 /** Handle a reply from the worker threads. */
 static void
 cpuworker_onion_handshake_replyfn(void *work_)
@@ -507,6 +563,152 @@ cpuworker_queue_work,(workqueue_priority_t priority,
                                         arg);
 }
 
+/** Return the number of cpuworker threads we have, or 0 if we have not
+ * started any. */
+int
+cpuworker_get_n_threads(void)
+{
+  return threadpool ? threadpool_n_threads : 0;
+}
+
+/** State shared by all the jobs in one call to cpuworker_run_in_parallel().
+ *
+ * The caller and the workers that help it all take jobs from the same
+ * counter, so no job is ever run twice or cancelled.  A worker may not
+ * get to its work item until long after the caller has returned, so the
+ * batch is refcounted rather than living on the caller's stack. */
+typedef struct parallel_batch_t {
+  /** Protects every other field. */
+  tor_mutex_t lock;
+  /** Signalled whenever a worker finishes a job. */
+  tor_cond_t cond;
+  /** The function to run, and the argument for each of its jobs.
+   * <b>args</b> belongs to the caller, so we only look at it while
+   * <b>next_job</b> is less than <b>n_jobs</b>. */
+  void (*fn)(void *);
+  void **args;
+  int n_jobs;
+  /** Index of the first job that nobody has started. */
+  int next_job;
+  /** How many jobs have been started but not finished? */
+  int n_running;
+  /** One reference for the caller, and one for each work item that we
+   * queued.  Whoever drops the last one frees the batch. */
+  int refcnt;
+} parallel_batch_t;
+
+/** Run jobs from <b>batch</b> until every one of them has been started. */
+static void
+parallel_batch_run_jobs(parallel_batch_t *batch)
+{
+  tor_mutex_acquire(&batch->lock);
+  while (batch->next_job < batch->n_jobs) {
+    void *arg = batch->args[batch->next_job++];
+    ++batch->n_running;
+    tor_mutex_release(&batch->lock);
+
+    batch->fn(arg);
+
+    tor_mutex_acquire(&batch->lock);
+    --batch->n_running;
+    tor_cond_signal_one(&batch->cond);
+  }
+  tor_mutex_release(&batch->lock);
+}
+
+/** Drop one reference to <b>batch</b>, and free it if that was the last. */
+static void
+parallel_batch_decref(parallel_batch_t *batch)
+{
+  int last;
+  tor_mutex_acquire(&batch->lock);
+  last = (--batch->refcnt == 0);
+  tor_mutex_release(&batch->lock);
+  if (last) {
+    tor_cond_uninit(&batch->cond);
+    tor_mutex_uninit(&batch->lock);
+    tor_free(batch);
+  }
+}
+
+/** Worker-thread function: help with a parallel_batch_t's jobs. */
+static workqueue_reply_t
+parallel_batch_threadfn(void *state_, void *batch_)
+{
+  (void)state_;
+  parallel_batch_run_jobs(batch_);
+  parallel_batch_decref(batch_);
+  return WQ_RPL_REPLY;
+}
+
+/** Main-thread reply function for a parallel_batch_t work item.  The batch
+ * may be gone by now, so there is nothing to do. */
+static void
+parallel_batch_replyfn(void *batch_)
+{
+  (void)batch_;
+}
+
+/** Call <b>fn</b>(<b>args</b>[i]) for every i in [0, <b>n_jobs</b>), and
+ * return once every call has finished.
+ *
+ * If we have cpuworker threads, queue up to <b>n_jobs</b>-1 work items at
+ * <b>priority</b> that each take jobs until none are left, and take jobs
+ * here as well.  Since we run whatever the workers haven't got to, we never
+ * sit idle behind slower work on the queues.  Without cpuworkers, just run
+ * the jobs in order.
+ *
+ * This may be called from any thread, including a cpuworker.  <b>fn</b> may
+ * run on any thread, so it must not use anything that is only safe on the
+ * main thread. */
+void
+cpuworker_run_in_parallel(void (*fn)(void *), void **args, int n_jobs,
+                          workqueue_priority_t priority)
+{
+  parallel_batch_t *batch;
+  int i;
+
+  tor_assert(fn);
+  tor_assert(n_jobs >= 0);
+
+  if (!threadpool || n_jobs < 2) {
+    for (i = 0; i < n_jobs; ++i)
+      fn(args[i]);
+    return;
+  }
+
+  batch = tor_malloc_zero(sizeof(parallel_batch_t));
+  tor_mutex_init_for_cond(&batch->lock);
+  tor_cond_init(&batch->cond);
+  batch->fn = fn;
+  batch->args = args;
+  batch->n_jobs = n_jobs;
+  batch->refcnt = 1;
+
+  for (i = 1; i < n_jobs && i <= threadpool_n_threads; ++i) {
+    tor_mutex_acquire(&batch->lock);
+    ++batch->refcnt;
+    tor_mutex_release(&batch->lock);
+    if (!threadpool_queue_work_priority(threadpool, priority,
+                                        parallel_batch_threadfn,
+                                        parallel_batch_replyfn,
+                                        batch)) {
+      log_warn(LD_BUG, "Couldn't queue work on threadpool");
+      parallel_batch_decref(batch);
+      break;
+    }
+  }
+
+  parallel_batch_run_jobs(batch);
+
+  tor_mutex_acquire(&batch->lock);
+  while (batch->n_running > 0)
+    tor_cond_wait(&batch->cond, &batch->lock, NULL);
+  tor_mutex_release(&batch->lock);
+
+  parallel_batch_decref(batch);
+}
+
 /** Try to tell a cpuworker to perform the public key operations necessary to
  * respond to <b>onionskin</b> for the circuit <b>circ</b>.
  *
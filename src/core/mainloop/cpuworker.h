@@ -23,6 +23,10 @@ MOCK_DECL(struct workqueue_entry_s *, cpuworker_queue_work, (
                     void (*reply_fn)(void *),
                     void *arg));
 
+int cpuworker_get_n_threads(void);
+void cpuworker_run_in_parallel(void (*fn)(void *), void **args, int n_jobs,
+                               enum workqueue_priority_t priority);
+
 struct create_cell_t;
 int assign_onionskin_to_cpuworker(or_circuit_t *circ,
                                   struct create_cell_t *onionskin);
@@ -31,6 +35,7 @@ uint64_t estimated_usec_for_onionskins(uint32_t n_requests,
                                        uint16_t onionskin_type);
 void cpuworker_log_onionskin_overhead(int severity, int onionskin_type,
                                       const char *onionskin_type_name);
+void cpuworker_log_reply_stats(int severity);
 void cpuworker_cancel_circ_handshake(or_circuit_t *circ);
 
 #endif /* !defined(TOR_CPUWORKER_H) */
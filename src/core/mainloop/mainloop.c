@@ -980,8 +980,7 @@ conn_close_if_marked(int i)
                (int)conn->outbuf_flushlen,
                 conn->marked_for_close_file, conn->marked_for_close);
     if (conn->linked_conn) {
-      retval = buf_move_to_buf(conn->linked_conn->inbuf, conn->outbuf,
-                               &conn->outbuf_flushlen);
+      retval = connection_flush_to_linked_conn(conn);
       if (retval >= 0) {
         /* The linked conn will notice that it has data when it notices that
          * we're gone. */
@@ -995,7 +994,8 @@ conn_close_if_marked(int i)
     } else if (connection_speaks_cells(conn)) {
       if (conn->state == OR_CONN_STATE_OPEN) {
         retval = buf_flush_to_tls(conn->outbuf, TO_OR_CONN(conn)->tls, sz,
-                               &conn->outbuf_flushlen);
+                                  &conn->outbuf_flushlen,
+                                  &TO_OR_CONN(conn)->tls_flush_stats);
       } else
         retval = -1; /* never flush non-open broken tls connections */
     } else {
@@ -1379,6 +1379,7 @@ CALLBACK(write_bridge_ns);
 CALLBACK(write_stats_file);
 CALLBACK(control_per_second_events);
 CALLBACK(second_elapsed);
+CALLBACK(shrink_buffer_freelists);
 
 #undef CALLBACK
 
@@ -1410,6 +1411,7 @@ STATIC periodic_event_item_t periodic_events[] = {
   CALLBACK(launch_descriptor_fetches, NET_PARTICIPANT, FL(NEED_NET)),
   CALLBACK(rotate_x509_certificate, NET_PARTICIPANT, 0),
   CALLBACK(check_network_participation, NET_PARTICIPANT, 0),
+  CALLBACK(shrink_buffer_freelists, NET_PARTICIPANT, 0),
 
   /* We need to do these if we're participating in the Tor network, and
    * immediately before we stop. */
@@ -2277,6 +2279,20 @@ reset_padding_counts_callback(time_t now, const or_options_t *options)
   return REPHIST_CELL_PADDING_COUNTS_INTERVAL;
 }
 
+/**
+ * Periodic callback: give back to the system the buffer chunks that have
+ * sat unused on our freelists since the last time we ran.
+ */
+static int
+shrink_buffer_freelists_callback(time_t now, const or_options_t *options)
+{
+  (void)now;
+  (void)options;
+  buf_shrink_freelists(0);
+#define SHRINK_BUFFER_FREELISTS_INTERVAL 60
+  return SHRINK_BUFFER_FREELISTS_INTERVAL;
+}
+
 static int should_init_bridge_stats = 1;
 
 /**
@@ -0,0 +1,366 @@
+/* Copyright (c) 2019, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file cell_pool.c
+ * \brief Slab allocator for the fixed-size objects in our cell queues.
+ *
+ * A relay allocates and frees a packed_cell_t for every cell that it queues
+ * on a circuit, which can be hundreds of thousands of times per second.
+ * Instead of going to malloc each time, we carve these objects out of large
+ * slabs, and keep freed objects on a per-slab free list for reuse.
+ *
+ * Each cell_pool_t handles one size of object.  Its slabs are kept on three
+ * lists: full slabs, partly used slabs, and empty slabs.  We always allocate
+ * from a partly used slab if there is one, so that the objects in use stay
+ * packed into as few slabs as possible.  Slabs that become empty are kept for
+ * reuse, up to a configurable amount of idle memory (see
+ * cell_pool_set_max_idle()); past that, we give them back to the system.
+ *
+ * This is used from relay.c, for packed_cell_t and destroy_cell_t.
+ **/
+
+#define CELL_POOL_PRIVATE
+#include "core/or/or.h"
+#include "core/or/cell_pool.h"
+
+#include "ext/tor_queue.h"
+
+/** Header placed before every item in a slab.  It is a union so that the
+ * items that follow it will be aligned properly. */
+typedef union pool_item_hdr_t {
+  /** The slab that holds this item. */
+  struct pool_slab_t *slab;
+  uint64_t align_u64;
+  double align_double;
+} pool_item_hdr_t;
+
+/** A single slab of items, all of the same size. */
+typedef struct pool_slab_t {
+  /** Links for whichever list in the pool holds this slab. */
+  TOR_LIST_ENTRY(pool_slab_t) node;
+  /** The pool that this slab belongs to. */
+  cell_pool_t *pool;
+  /** First item in this slab that was released and not reused since;
+   * each free item holds a pointer to the next. */
+  void *first_free;
+  /** How many items in this slab are in use? */
+  int n_used;
+  /** Index of the first item that we have never handed out. */
+  int next_unused;
+  /* The items follow, at offset SLAB_HDR_LEN from the start of the slab. */
+} pool_slab_t;
+
+/** Offset of the first item in each slab. */
+#define SLAB_HDR_LEN \
+  ((sizeof(pool_slab_t) + sizeof(pool_item_hdr_t) - 1) / \
+   sizeof(pool_item_hdr_t) * sizeof(pool_item_hdr_t))
+
+TOR_LIST_HEAD(pool_slab_list_t, pool_slab_t);
+
+struct cell_pool_t {
+  /** Name of this pool, for logging. */
+  const char *name;
+  /** Size of each item, as requested by the user. */
+  size_t item_size;
+  /** Space used by each item in a slab, including its header. */
+  size_t stride;
+  /** Number of items in each slab. */
+  int items_per_slab;
+
+  /** Slabs with no free items. */
+  struct pool_slab_list_t full;
+  /** Slabs with some free and some used items. */
+  struct pool_slab_list_t partial;
+  /** Slabs with no used items. */
+  struct pool_slab_list_t empty;
+
+  /** Total number of slabs in this pool. */
+  size_t n_slabs;
+  /** Number of slabs in the empty list. */
+  size_t n_empty;
+  /** Number of items in use. */
+  size_t n_used;
+  /** Largest amount of memory that we keep in empty slabs. */
+  size_t max_idle_bytes;
+};
+
+/** Default value for max_idle_bytes in a new pool. */
+#define DEFAULT_MAX_IDLE_BYTES (4*CELL_POOL_SLAB_SIZE)
+
+/** Return a pointer to the header of item number <b>idx</b> in <b>slab</b>.
+ */
+static inline pool_item_hdr_t *
+slab_item_hdr(pool_slab_t *slab, int idx)
+{
+  return (pool_item_hdr_t *)
+    ((char *)slab + SLAB_HDR_LEN + (size_t)idx * slab->pool->stride);
+}
+
+/** Return a pointer to the header of the item at <b>item</b>. */
+static inline pool_item_hdr_t *
+item_get_hdr(void *item)
+{
+  return ((pool_item_hdr_t *)item) - 1;
+}
+
+/** Create and return a new pool for items of <b>item_size</b> bytes.
+ * <b>name</b> must be a string that will outlive the pool. */
+cell_pool_t *
+cell_pool_new(const char *name, size_t item_size)
+{
+  cell_pool_t *pool = tor_malloc_zero(sizeof(cell_pool_t));
+  const size_t hdr = sizeof(pool_item_hdr_t);
+
+  /* Free items have to hold a pointer to the next free item. */
+  if (item_size < sizeof(void *))
+    item_size = sizeof(void *);
+  pool->name = name;
+  pool->item_size = item_size;
+  pool->stride = (hdr + item_size + hdr - 1) / hdr * hdr;
+  pool->items_per_slab =
+    (int)((CELL_POOL_SLAB_SIZE - SLAB_HDR_LEN) / pool->stride);
+  tor_assert(pool->items_per_slab >= 1);
+  pool->max_idle_bytes = DEFAULT_MAX_IDLE_BYTES;
+  TOR_LIST_INIT(&pool->full);
+  TOR_LIST_INIT(&pool->partial);
+  TOR_LIST_INIT(&pool->empty);
+  return pool;
+}
+
+/** Release every slab on <b>list</b>. */
+static void
+slab_list_free(struct pool_slab_list_t *list)
+{
+  pool_slab_t *slab;
+  while ((slab = TOR_LIST_FIRST(list))) {
+    TOR_LIST_REMOVE(slab, node);
+    tor_free(slab);
+  }
+}
+
+/** Release all storage held by <b>pool</b>.  Any items still allocated
+ * from the pool become invalid. */
+void
+cell_pool_free_(cell_pool_t *pool)
+{
+  if (!pool)
+    return;
+  slab_list_free(&pool->full);
+  slab_list_free(&pool->partial);
+  slab_list_free(&pool->empty);
+  tor_free(pool);
+}
+
+/** Release the empty slab <b>slab</b> from <b>pool</b>. */
+static void
+pool_release_empty_slab(cell_pool_t *pool, pool_slab_t *slab)
+{
+  tor_assert(slab->n_used == 0);
+  TOR_LIST_REMOVE(slab, node);
+  --pool->n_empty;
+  --pool->n_slabs;
+  tor_free(slab);
+}
+
+/** Return an item from <b>pool</b>, filled with zeros. */
+void *
+cell_pool_get(cell_pool_t *pool)
+{
+  pool_slab_t *slab = TOR_LIST_FIRST(&pool->partial);
+  pool_item_hdr_t *hdr;
+  void *item;
+
+  if (PREDICT_UNLIKELY(!slab)) {
+    slab = TOR_LIST_FIRST(&pool->empty);
+    if (slab) {
+      TOR_LIST_REMOVE(slab, node);
+      --pool->n_empty;
+    } else {
+      slab = tor_malloc_zero(CELL_POOL_SLAB_SIZE);
+      slab->pool = pool;
+      ++pool->n_slabs;
+    }
+    TOR_LIST_INSERT_HEAD(&pool->partial, slab, node);
+  }
+
+  if (slab->first_free) {
+    item = slab->first_free;
+    memcpy(&slab->first_free, item, sizeof(void *));
+  } else {
+    tor_assert(slab->next_unused < pool->items_per_slab);
+    hdr = slab_item_hdr(slab, slab->next_unused++);
+    hdr->slab = slab;
+    item = hdr + 1;
+  }
+
+  ++pool->n_used;
+  if (++slab->n_used == pool->items_per_slab) {
+    TOR_LIST_REMOVE(slab, node);
+    TOR_LIST_INSERT_HEAD(&pool->full, slab, node);
+  }
+
+  memset(item, 0, pool->item_size);
+  return item;
+}
+
+/** Return <b>item</b>, which must have come from cell_pool_get() on
+ * <b>pool</b>, to the pool. */
+void
+cell_pool_release(cell_pool_t *pool, void *item)
+{
+  pool_slab_t *slab = item_get_hdr(item)->slab;
+  const int was_full = (slab->n_used == pool->items_per_slab);
+
+  tor_assert(slab->pool == pool);
+  tor_assert(slab->n_used > 0);
+
+  memcpy(item, &slab->first_free, sizeof(void *));
+  slab->first_free = item;
+  --pool->n_used;
+
+  if (--slab->n_used == 0) {
+    TOR_LIST_REMOVE(slab, node);
+    TOR_LIST_INSERT_HEAD(&pool->empty, slab, node);
+    ++pool->n_empty;
+    if (pool->n_empty * CELL_POOL_SLAB_SIZE > pool->max_idle_bytes)
+      pool_release_empty_slab(pool, slab);
+  } else if (was_full) {
+    TOR_LIST_REMOVE(slab, node);
+    TOR_LIST_INSERT_HEAD(&pool->partial, slab, node);
+  }
+}
+
+/** Keep no more than <b>max_idle_bytes</b> of memory in empty slabs in
+ * <b>pool</b> from now on, releasing any that we have beyond that. */
+void
+cell_pool_set_max_idle(cell_pool_t *pool, size_t max_idle_bytes)
+{
+  pool->max_idle_bytes = max_idle_bytes;
+  cell_pool_trim(pool, max_idle_bytes);
+}
+
+/** Release empty slabs from <b>pool</b> until it holds no more than
+ * <b>max_idle_bytes</b> of memory in them. */
+void
+cell_pool_trim(cell_pool_t *pool, size_t max_idle_bytes)
+{
+  pool_slab_t *slab;
+  while (pool->n_empty * CELL_POOL_SLAB_SIZE > max_idle_bytes &&
+         (slab = TOR_LIST_FIRST(&pool->empty))) {
+    pool_release_empty_slab(pool, slab);
+  }
+}
+
+/** Return the number of bytes that each item in <b>pool</b> takes up. */
+size_t
+cell_pool_item_cost(const cell_pool_t *pool)
+{
+  return pool->stride;
+}
+
+/** Return the number of bytes used by the items in <b>pool</b>, plus the
+ * bytes held in its empty slabs.
+ *
+ * We don't count the free space in partly used slabs: we reuse it before
+ * allocating any new slab, and freeing items can't give it back to the
+ * system, so counting it would only make the OOM handler close circuits in
+ * vain. */
+size_t
+cell_pool_get_allocation(const cell_pool_t *pool)
+{
+  return pool->n_used * pool->stride + pool->n_empty * CELL_POOL_SLAB_SIZE;
+}
+
+/** Return the number of items in use from <b>pool</b>. */
+size_t
+cell_pool_get_n_used(const cell_pool_t *pool)
+{
+  return pool->n_used;
+}
+
+/** Log how much memory <b>pool</b> holds, and how much of it is in use, at
+ * log level <b>severity</b>. */
+void
+cell_pool_log_usage(const cell_pool_t *pool, int severity)
+{
+  const size_t capacity = pool->n_slabs * pool->items_per_slab;
+  tor_log(severity, LD_MM,
+          "%s pool: %"TOR_PRIuSZ" of %"TOR_PRIuSZ" items in use "
+          "(%.1f%%), in %"TOR_PRIuSZ" slabs of %d items "
+          "(%"TOR_PRIuSZ" empty). %"TOR_PRIuSZ" bytes allocated.",
+          pool->name, pool->n_used, capacity,
+          capacity ? 100.0 * pool->n_used / capacity : 0.0,
+          pool->n_slabs, pool->items_per_slab, pool->n_empty,
+          pool->n_slabs * (size_t)CELL_POOL_SLAB_SIZE);
+}
+
+#ifdef TOR_UNIT_TESTS
+/** Return the number of slabs in <b>pool</b>. */
+STATIC size_t
+cell_pool_get_n_slabs(const cell_pool_t *pool)
+{
+  return pool->n_slabs;
+}
+
+/** Return the number of empty slabs in <b>pool</b>. */
+STATIC size_t
+cell_pool_get_n_empty_slabs(const cell_pool_t *pool)
+{
+  return pool->n_empty;
+}
+
+/** Return the number of free items on <b>slab</b>'s free list. */
+static int
+slab_count_free_list(const pool_slab_t *slab)
+{
+  int n = 0;
+  void *item = slab->first_free;
+  while (item) {
+    ++n;
+    memcpy(&item, item, sizeof(void *));
+  }
+  return n;
+}
+
+/** Check the internal consistency of <b>slab</b>, which should be on a list
+ * of slabs with between <b>min_used</b> and <b>max_used</b> items in use. */
+static void
+slab_assert_ok(const cell_pool_t *pool, const pool_slab_t *slab,
+               int min_used, int max_used)
+{
+  tor_assert(slab->pool == pool);
+  tor_assert(slab->n_used >= min_used);
+  tor_assert(slab->n_used <= max_used);
+  tor_assert(slab->next_unused <= pool->items_per_slab);
+  tor_assert(slab->n_used + slab_count_free_list(slab) == slab->next_unused);
+}
+
+/** Check the internal consistency of <b>pool</b>. */
+STATIC void
+cell_pool_assert_ok(const cell_pool_t *pool)
+{
+  const pool_slab_t *slab;
+  size_t n_slabs = 0, n_empty = 0, n_used = 0;
+  const int per_slab = pool->items_per_slab;
+
+  TOR_LIST_FOREACH(slab, &pool->full, node) {
+    slab_assert_ok(pool, slab, per_slab, per_slab);
+    n_used += slab->n_used;
+    ++n_slabs;
+  }
+  TOR_LIST_FOREACH(slab, &pool->partial, node) {
+    slab_assert_ok(pool, slab, 1, per_slab - 1);
+    n_used += slab->n_used;
+    ++n_slabs;
+  }
+  TOR_LIST_FOREACH(slab, &pool->empty, node) {
+    slab_assert_ok(pool, slab, 0, 0);
+    ++n_empty;
+    ++n_slabs;
+  }
+  tor_assert(n_slabs == pool->n_slabs);
+  tor_assert(n_empty == pool->n_empty);
+  tor_assert(n_used == pool->n_used);
+}
+#endif /* defined(TOR_UNIT_TESTS) */
@@ -0,0 +1,41 @@
+/* Copyright (c) 2019, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file cell_pool.h
+ * \brief Header file for cell_pool.c.
+ **/
+
+#ifndef TOR_CELL_POOL_H
+#define TOR_CELL_POOL_H
+
+/** A pool of fixed-size objects, allocated from slabs. */
+typedef struct cell_pool_t cell_pool_t;
+
+cell_pool_t *cell_pool_new(const char *name, size_t item_size);
+void cell_pool_free_(cell_pool_t *pool);
+#define cell_pool_free(pool) \
+  FREE_AND_NULL(cell_pool_t, cell_pool_free_, (pool))
+
+void *cell_pool_get(cell_pool_t *pool);
+void cell_pool_release(cell_pool_t *pool, void *item);
+
+void cell_pool_set_max_idle(cell_pool_t *pool, size_t max_idle_bytes);
+void cell_pool_trim(cell_pool_t *pool, size_t max_idle_bytes);
+
+size_t cell_pool_item_cost(const cell_pool_t *pool);
+size_t cell_pool_get_allocation(const cell_pool_t *pool);
+size_t cell_pool_get_n_used(const cell_pool_t *pool);
+void cell_pool_log_usage(const cell_pool_t *pool, int severity);
+
+#ifdef CELL_POOL_PRIVATE
+/** Size of each slab that we allocate, in bytes, including its header. */
+#define CELL_POOL_SLAB_SIZE (64*1024)
+#ifdef TOR_UNIT_TESTS
+STATIC size_t cell_pool_get_n_slabs(const cell_pool_t *pool);
+STATIC size_t cell_pool_get_n_empty_slabs(const cell_pool_t *pool);
+STATIC void cell_pool_assert_ok(const cell_pool_t *pool);
+#endif
+#endif /* defined(CELL_POOL_PRIVATE) */
+
+#endif /* !defined(TOR_CELL_POOL_H) */
@@ -916,6 +916,8 @@ channel_free_(channel_t *chan)
     chan->cmux = NULL;
   }
 
+  circid_map_clear(&chan->circid_map);
+
   tor_free(chan);
 }
 
@@ -987,6 +989,8 @@ channel_force_xfree(channel_t *chan)
     chan->cmux = NULL;
   }
 
+  circid_map_clear(&chan->circid_map);
+
   tor_free(chan);
 }
 
@@ -1110,6 +1114,27 @@ channel_set_cell_handlers(channel_t *chan,
   chan->var_cell_handler = var_cell_handler;
 }
 
+/**
+ * Set the batched relay cell handler for a channel.
+ *
+ * This handler, if set, receives runs of consecutive RELAY cells that the
+ * lower layer found buffered for a single circuit.
+ */
+void
+channel_set_relay_cells_handler(channel_t *chan,
+                                channel_relay_cells_handler_fn_ptr
+                                  relay_cells_handler)
+{
+  tor_assert(chan);
+  tor_assert(CHANNEL_CAN_HANDLE_CELLS(chan));
+
+  log_debug(LD_CHANNEL,
+           "Setting relay_cells_handler callback for channel %p to %p",
+           chan, relay_cells_handler);
+
+  chan->relay_cells_handler = relay_cells_handler;
+}
+
 /*
  * On closing channels
  *
@@ -1407,18 +1432,16 @@ channel_clear_remote_end(channel_t *chan)
 }
 
 /**
- * Write to a channel the given packed cell.
+ * Hand the given packed cell to a channel's lower layer, without updating
+ * the channel's transmit timestamp and counters.
  *
  * Two possible errors can happen. Either the channel is not opened or the
  * lower layer (specialized channel) failed to write it. In both cases, it is
  * the caller responsibility to free the cell.
  */
 static int
-write_packed_cell(channel_t *chan, packed_cell_t *cell)
+write_packed_cell_to_lower_layer(channel_t *chan, packed_cell_t *cell)
 {
-  int ret = -1;
-  size_t cell_bytes;
-
   tor_assert(chan);
   tor_assert(cell);
 
@@ -1432,28 +1455,47 @@ write_packed_cell(channel_t *chan, packed_cell_t *cell)
     }
   }
 
-  /* For statistical purposes, figure out how big this cell is */
-  cell_bytes = get_cell_network_size(chan->wide_circ_ids);
-
   /* Can we send it right out?  If so, try */
   if (!CHANNEL_IS_OPEN(chan)) {
-    goto done;
+    return -1;
   }
 
   /* Write the cell on the connection's outbuf. */
-  if (chan->write_packed_cell(chan, cell) < 0) {
-    goto done;
-  }
+  return chan->write_packed_cell(chan, cell) < 0 ? -1 : 0;
+}
+
+/**
+ * Update a channel's transmit timestamp and counters for <b>n_cells</b>
+ * cells that its lower layer has just accepted.
+ */
+static void
+channel_note_cells_xmitted(channel_t *chan, int n_cells)
+{
+  if (n_cells <= 0)
+    return;
+
   /* Timestamp for transmission */
   channel_timestamp_xmit(chan);
-  /* Update the counter */
-  ++(chan->n_cells_xmitted);
-  chan->n_bytes_xmitted += cell_bytes;
-  /* Successfully sent the cell. */
-  ret = 0;
+  /* Update the counters */
+  chan->n_cells_xmitted += n_cells;
+  chan->n_bytes_xmitted +=
+    n_cells * get_cell_network_size(chan->wide_circ_ids);
+}
 
- done:
-  return ret;
+/**
+ * Write to a channel the given packed cell.
+ *
+ * Return 0 on success else a negative value, as
+ * write_packed_cell_to_lower_layer().
+ */
+static int
+write_packed_cell(channel_t *chan, packed_cell_t *cell)
+{
+  if (write_packed_cell_to_lower_layer(chan, cell) < 0)
+    return -1;
+  /* Successfully sent the cell. */
+  channel_note_cells_xmitted(chan, 1);
+  return 0;
 }
 
 /**
@@ -1494,6 +1536,55 @@ channel_write_packed_cell(channel_t *chan, packed_cell_t *cell)
   return ret;
 }
 
+/**
+ * Write a run of packed cells to a channel.
+ *
+ * As channel_write_packed_cell() for every cell on <b>cells</b>, in order,
+ * except that the channel's timestamp and counters are updated once for
+ * the whole run.
+ *
+ * Return 0 on success else a negative value. In both cases, every cell on
+ * <b>cells</b> has been freed and the queue is left empty.
+ */
+int
+channel_write_packed_cells(channel_t *chan, cell_queue_t *cells)
+{
+  int ret = 0, n_written = 0;
+  packed_cell_t *cell;
+
+  tor_assert(chan);
+  tor_assert(cells);
+
+  if (cells->n == 0)
+    return 0;
+
+  if (CHANNEL_IS_CLOSING(chan)) {
+    log_debug(LD_CHANNEL, "Discarding %d cells on closing channel %p with "
+              "global ID %"PRIu64, cells->n, chan,
+              (chan->global_identifier));
+    ret = -1;
+    goto end;
+  }
+  log_debug(LD_CHANNEL,
+            "Writing %d cells to channel %p with global ID "
+            "%"PRIu64, cells->n, chan, (chan->global_identifier));
+
+  TOR_SIMPLEQ_FOREACH(cell, &cells->head, next) {
+    if (write_packed_cell_to_lower_layer(chan, cell) < 0) {
+      ret = -1;
+      break;
+    }
+    ++n_written;
+  }
+  channel_note_cells_xmitted(chan, n_written);
+
+ end:
+  /* Whatever happens, we free the cells, as channel_write_packed_cell()
+   * does. */
+  cell_queue_clear(cells);
+  return ret;
+}
+
 /**
  * Change channel state.
  *
@@ -1983,6 +2074,47 @@ channel_process_cell(channel_t *chan, cell_t *cell)
   chan->cell_handler(chan, cell);
 }
 
+/**
+ * Process a run of <b>n_cells</b> RELAY cells from the given channel, all
+ * with the same circuit ID, in order.
+ *
+ * If the upper layer registered a batched relay cell handler, the whole run
+ * goes to it at once; otherwise we fall back to channel_process_cell().
+ */
+void
+channel_process_relay_cells(channel_t *chan, cell_t **cells, int n_cells)
+{
+  int i;
+
+  tor_assert(chan);
+  tor_assert(CHANNEL_IS_CLOSING(chan) || CHANNEL_IS_MAINT(chan) ||
+             CHANNEL_IS_OPEN(chan));
+  tor_assert(cells);
+  tor_assert(n_cells > 0);
+
+  if (!chan->relay_cells_handler) {
+    for (i = 0; i < n_cells; ++i)
+      channel_process_cell(chan, cells[i]);
+    return;
+  }
+
+  /* Nothing we can do if we have no registered cell handlers */
+  if (!chan->cell_handler)
+    return;
+
+  /* Timestamp for receiving */
+  channel_timestamp_recv(chan);
+  /* Update received counter. */
+  chan->n_cells_recved += n_cells;
+  chan->n_bytes_recved += n_cells * get_cell_network_size(chan->wide_circ_ids);
+
+  log_debug(LD_CHANNEL,
+            "Processing %d incoming relay cells for channel %p (global ID "
+            "%"PRIu64 ")", n_cells, chan,
+            (chan->global_identifier));
+  chan->relay_cells_handler(chan, cells, n_cells);
+}
+
 /** If <b>packed_cell</b> on <b>chan</b> is a destroy cell, then set
  * *<b>circid_out</b> to its circuit ID, and return true.  Otherwise, return
  * false. */
@@ -10,6 +10,7 @@
 #define TOR_CHANNEL_H
 
 #include "core/or/or.h"
+#include "core/or/circid_map.h"
 #include "core/or/circuitmux.h"
 #include "lib/container/handles.h"
 #include "lib/crypt_ops/crypto_ed25519.h"
@@ -23,6 +24,8 @@ struct tor_timer_t;
 typedef void (*channel_listener_fn_ptr)(channel_listener_t *, channel_t *);
 typedef void (*channel_cell_handler_fn_ptr)(channel_t *, cell_t *);
 typedef void (*channel_var_cell_handler_fn_ptr)(channel_t *, var_cell_t *);
+typedef void (*channel_relay_cells_handler_fn_ptr)(channel_t *, cell_t **,
+                                                   int);
 
 /**
  * This enum is used by channelpadding to decide when to pad channels.
@@ -321,6 +324,9 @@ struct channel_s {
   /** Registered handlers for incoming cells */
   channel_cell_handler_fn_ptr cell_handler;
   channel_var_cell_handler_fn_ptr var_cell_handler;
+  /** Optional handler for a run of relay cells on one circuit; if this is
+   * not set, such runs are passed to cell_handler one cell at a time. */
+  channel_relay_cells_handler_fn_ptr relay_cells_handler;
 
   /* Methods implemented by the lower layer */
 
@@ -415,6 +421,10 @@ struct channel_s {
   /** For how many circuits are we n_chan?  What about p_chan? */
   unsigned int num_n_circuits, num_p_circuits;
 
+  /** Map from circuit ID to the circuit using that ID on this channel, as
+   * n_chan or p_chan.  Maintained by circuitlist.c. */
+  circid_map_t circid_map;
+
   /**
    * True iff this channel shouldn't get any new circs attached to it,
    * because the connection is too old, or because there's a better one.
@@ -529,6 +539,7 @@ channel_listener_state_to_string(channel_listener_state_t state);
 
 void channel_mark_for_close(channel_t *chan);
 int channel_write_packed_cell(channel_t *chan, packed_cell_t *cell);
+int channel_write_packed_cells(channel_t *chan, cell_queue_t *cells);
 
 void channel_listener_mark_for_close(channel_listener_t *chan_l);
 
@@ -548,6 +559,9 @@ void channel_set_cell_handlers(channel_t *chan,
                                channel_cell_handler_fn_ptr cell_handler,
                                channel_var_cell_handler_fn_ptr
                                  var_cell_handler);
+void channel_set_relay_cells_handler(channel_t *chan,
+                                     channel_relay_cells_handler_fn_ptr
+                                       relay_cells_handler);
 
 /* Clean up closed channels and channel listeners periodically; these are
  * called from run_scheduled_events() in main.c.
@@ -633,6 +647,8 @@ void channel_listener_queue_incoming(channel_listener_t *listener,
 
 /* Incoming cell handling */
 void channel_process_cell(channel_t *chan, cell_t *cell);
+void channel_process_relay_cells(channel_t *chan, cell_t **cells,
+                                 int n_cells);
 
 /* Request from lower layer for more cells if available */
 MOCK_DECL(ssize_t, channel_flush_some_cells,
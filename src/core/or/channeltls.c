@@ -174,8 +174,8 @@ channel_tls_common_init(channel_tls_t *tlschan)
   chan->write_var_cell = channel_tls_write_var_cell_method;
 
   chan->cmux = circuitmux_alloc();
-  /* We only have one policy for now so always set it to EWMA. */
-  circuitmux_set_policy(chan->cmux, &ewma_policy);
+  /* Use whichever EWMA policy new channels should use right now. */
+  circuitmux_set_policy(chan->cmux, cmux_ewma_get_policy());
 }
 
 /**
@@ -1140,6 +1140,56 @@ channel_tls_handle_cell(cell_t *cell, or_connection_t *conn)
   }
 }
 
+/**
+ * Handle a run of incoming RELAY cells on a channel_tls_t.
+ *
+ * This is called from connection_or.c when it finds <b>n_cells</b>
+ * consecutive RELAY cells for the same circuit waiting on an open
+ * <b>conn</b>.  It does the same bookkeeping as channel_tls_handle_cell()
+ * would for each of them, and then passes them up through the channel_t
+ * mechanism as a single batch.
+ */
+void
+channel_tls_handle_relay_cells(cell_t **cells, int n_cells,
+                               or_connection_t *conn)
+{
+  channel_tls_t *chan;
+  int i;
+
+  tor_assert(cells);
+  tor_assert(n_cells > 0);
+  tor_assert(conn);
+
+  chan = conn->chan;
+
+  if (!chan) {
+    log_warn(LD_CHANNEL,
+             "Got %d cell_ts on an OR connection with no channel", n_cells);
+    return;
+  }
+
+  if (conn->base_.marked_for_close)
+    return;
+
+  if (BUG(TO_CONN(conn)->state != OR_CONN_STATE_OPEN)) {
+    for (i = 0; i < n_cells; ++i)
+      channel_tls_handle_cell(cells[i], conn);
+    return;
+  }
+
+  /* We note that we're on the internet whenever we read a cell. This is
+   * a fast operation. */
+  entry_guards_note_internet_connectivity(get_guard_selection_info());
+  for (i = 0; i < n_cells; ++i) {
+    tor_assert(cells[i]->command == CELL_RELAY);
+    rep_hist_padding_count_read(PADDING_TYPE_TOTAL);
+    if (TLS_CHAN_TO_BASE(chan)->currently_padding)
+      rep_hist_padding_count_read(PADDING_TYPE_ENABLED_TOTAL);
+  }
+
+  channel_process_relay_cells(TLS_CHAN_TO_BASE(chan), cells, n_cells);
+}
+
 /**
  * Handle an incoming variable-length cell on a channel_tls_t.
  *
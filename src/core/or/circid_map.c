@@ -0,0 +1,208 @@
+/* Copyright (c) 2019, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file circid_map.c
+ * \brief Per-channel maps from circuit ID to circuit.
+ *
+ * Every cell that arrives on a channel needs its circuit looked up by
+ * circuit ID, so this lookup is in the critical path.  Each channel keeps
+ * its own circid_map_t: a flat array of slots, probed linearly, so that a
+ * lookup usually touches a single cache line and never chases a pointer
+ * until it reaches the circuit itself.  Because the maps are per channel,
+ * they stay small, and busy channels don't slow down lookups on quiet ones.
+ *
+ * Removal shifts later entries of the same probe run back into the freed
+ * slot, so we never need tombstones.  We grow the map once it is 60% full,
+ * and shrink it once it is less than 1/8 full.
+ *
+ * Peers choose the circuit IDs on their side of a channel, so each map
+ * hashes IDs with its own random key, to keep peers from picking IDs that
+ * force long probe runs.  We use a keyed multiplicative hash rather than
+ * siphash here: it is several times cheaper, and the damage a peer could
+ * do by learning a key would be limited to its own channel's map.
+ *
+ * This is used from circuitlist.c, which keeps one map on every channel.
+ **/
+
+#define CIRCID_MAP_PRIVATE
+#include "core/or/or.h"
+#include "core/or/circid_map.h"
+
+#include "lib/crypt_ops/crypto_rand.h"
+
+/** Return the slot where we would start looking for <b>circ_id</b> in
+ * <b>map</b>. */
+static inline unsigned
+circid_map_home(const circid_map_t *map, circid_t circ_id)
+{
+  uint64_t h = (circ_id ^ (uint32_t)map->hash_key) * map->hash_key;
+  return (unsigned)(h >> 32) & (map->n_slots - 1);
+}
+
+/** Return the index of the slot holding <b>circ_id</b> in <b>map</b>, or,
+ * if there is none, the index of the empty slot where it would go.  The
+ * map must have at least one empty slot. */
+static inline unsigned
+circid_map_probe(const circid_map_t *map, circid_t circ_id)
+{
+  const unsigned mask = map->n_slots - 1;
+  unsigned idx = circid_map_home(map, circ_id);
+
+  while (map->slots[idx].used && map->slots[idx].circ_id != circ_id)
+    idx = (idx + 1) & mask;
+  return idx;
+}
+
+/** Move every entry of <b>map</b> into a new array of <b>n_slots</b>
+ * slots, or free the array if <b>n_slots</b> is 0. */
+static void
+circid_map_resize(circid_map_t *map, unsigned n_slots)
+{
+  circid_map_ent_t *old_slots = map->slots;
+  unsigned old_n_slots = map->n_slots, i;
+
+  tor_assert(n_slots == 0 || n_slots > map->n_used);
+
+  if (!map->hash_key) {
+    crypto_rand((char *)&map->hash_key, sizeof(map->hash_key));
+    /* The key is our multiplier, so it must be odd. */
+    map->hash_key |= 1;
+  }
+  map->slots = n_slots ? tor_calloc(n_slots, sizeof(circid_map_ent_t)) : NULL;
+  map->n_slots = n_slots;
+  map->last_idx = 0;
+
+  for (i = 0; i < old_n_slots; ++i) {
+    if (old_slots[i].used) {
+      tor_assert(n_slots);
+      map->slots[circid_map_probe(map, old_slots[i].circ_id)] = old_slots[i];
+    }
+  }
+  tor_free(old_slots);
+}
+
+/** Return the entry for <b>circ_id</b> in <b>map</b>, or NULL if there is
+ * none.  The returned pointer is only good until the next time the map
+ * is modified. */
+circid_map_ent_t *
+circid_map_find(circid_map_t *map, circid_t circ_id)
+{
+  circid_map_ent_t *ent;
+  unsigned idx;
+
+  if (map->n_used == 0)
+    return NULL;
+
+  ent = &map->slots[map->last_idx];
+  if (ent->used && ent->circ_id == circ_id)
+    return ent;
+
+  idx = circid_map_probe(map, circ_id);
+  ent = &map->slots[idx];
+  if (!ent->used)
+    return NULL;
+  map->last_idx = idx;
+  return ent;
+}
+
+/** Return the entry for <b>circ_id</b> in <b>map</b>, adding a new entry
+ * with no circuit if there is none.  The returned pointer is only good
+ * until the next time the map is modified. */
+circid_map_ent_t *
+circid_map_find_or_insert(circid_map_t *map, circid_t circ_id)
+{
+  circid_map_ent_t *ent;
+  unsigned idx;
+
+  if ((ent = circid_map_find(map, circ_id)))
+    return ent;
+
+  /* Grow once we would be more than 60% full. */
+  if ((map->n_used + 1) * 5 > map->n_slots * 3) {
+    circid_map_resize(map,
+                      map->n_slots ? map->n_slots * 2 : CIRCID_MAP_MIN_SLOTS);
+  }
+
+  idx = circid_map_probe(map, circ_id);
+  ent = &map->slots[idx];
+  tor_assert(!ent->used);
+  ent->used = 1;
+  ent->circ_id = circ_id;
+  ++map->n_used;
+  map->last_idx = idx;
+  return ent;
+}
+
+/** Remove the entry for <b>circ_id</b> from <b>map</b>.  If there was one,
+ * copy it into *<b>ent_out</b> (if provided) and return 1.  Otherwise,
+ * return 0. */
+int
+circid_map_remove(circid_map_t *map, circid_t circ_id,
+                  circid_map_ent_t *ent_out)
+{
+  unsigned mask, hole, idx;
+  circid_map_ent_t *ent = circid_map_find(map, circ_id);
+
+  if (!ent)
+    return 0;
+  if (ent_out)
+    memcpy(ent_out, ent, sizeof(*ent));
+
+  /* Walk the rest of this probe run, moving back into the hole any entry
+   * that would no longer be reachable from its home slot. */
+  mask = map->n_slots - 1;
+  hole = idx = (unsigned)(ent - map->slots);
+  for (;;) {
+    unsigned home;
+    idx = (idx + 1) & mask;
+    if (!map->slots[idx].used)
+      break;
+    home = circid_map_home(map, map->slots[idx].circ_id);
+    /* Leave the entry alone if its home is cyclically in (hole, idx]. */
+    if (hole <= idx ? (hole < home && home <= idx)
+                    : (hole < home || home <= idx))
+      continue;
+    map->slots[hole] = map->slots[idx];
+    hole = idx;
+  }
+  memset(&map->slots[hole], 0, sizeof(circid_map_ent_t));
+  --map->n_used;
+
+  if (map->n_used == 0) {
+    circid_map_resize(map, 0);
+  } else if (map->n_slots > CIRCID_MAP_MIN_SLOTS &&
+             map->n_used * 8 < map->n_slots) {
+    circid_map_resize(map, map->n_slots / 2);
+  }
+  return 1;
+}
+
+/** Remove every entry from <b>map</b>, and release its storage. */
+void
+circid_map_clear(circid_map_t *map)
+{
+  tor_free(map->slots);
+  memset(map, 0, sizeof(*map));
+}
+
+#ifdef TOR_UNIT_TESTS
+/** Check the invariants of <b>map</b>: its entry count is right, every
+ * entry is reachable from its home slot, and no ID appears twice. */
+STATIC void
+circid_map_assert_ok(const circid_map_t *map)
+{
+  unsigned i, n = 0;
+
+  tor_assert(map->n_slots == 0 || (map->n_slots & (map->n_slots - 1)) == 0);
+  tor_assert(!map->slots == !map->n_slots);
+  for (i = 0; i < map->n_slots; ++i) {
+    if (!map->slots[i].used)
+      continue;
+    ++n;
+    tor_assert(circid_map_probe(map, map->slots[i].circ_id) == i);
+  }
+  tor_assert(n == map->n_used);
+  tor_assert(map->n_used * 5 <= map->n_slots * 3);
+}
+#endif /* defined(TOR_UNIT_TESTS) */
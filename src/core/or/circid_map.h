@@ -0,0 +1,68 @@
+/* Copyright (c) 2019, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file circid_map.h
+ * \brief Header file for circid_map.c.
+ **/
+
+#ifndef TOR_CIRCID_MAP_H
+#define TOR_CIRCID_MAP_H
+
+#include "lib/cc/torint.h"
+
+/** One slot in a circid_map_t. */
+typedef struct circid_map_ent_t {
+  /** The circuit using this circuit ID, or NULL if the ID is only reserved
+   * until we can send a destroy cell for it. */
+  struct circuit_t *circuit;
+  /** For debugging 12184: when was this placeholder item added? */
+  time_t made_placeholder_at;
+  /** The circuit ID that this slot is for. */
+  circid_t circ_id;
+  /** True iff this slot is in use. */
+  uint8_t used;
+} circid_map_ent_t;
+
+/** An open-addressing hash table from circuit ID to circuit, for the
+ * circuits on a single channel.
+ *
+ * A circid_map_t that is all zeros is a valid empty map. */
+typedef struct circid_map_t {
+  /** Array of <b>n_slots</b> slots, or NULL if we have none. */
+  circid_map_ent_t *slots;
+  /** Number of slots in <b>slots</b>: zero or a power of two. */
+  unsigned n_slots;
+  /** Number of slots in <b>slots</b> that are in use. */
+  unsigned n_used;
+  /** Index of the slot that our last successful lookup returned.  Cells
+   * tend to arrive in runs on the same circuit, so we check here first. */
+  unsigned last_idx;
+  /** Random key for hashing circuit IDs, chosen when we first allocate
+   * slots.  Always odd once chosen. */
+  uint64_t hash_key;
+} circid_map_t;
+
+circid_map_ent_t *circid_map_find(circid_map_t *map, circid_t circ_id);
+circid_map_ent_t *circid_map_find_or_insert(circid_map_t *map,
+                                            circid_t circ_id);
+int circid_map_remove(circid_map_t *map, circid_t circ_id,
+                      circid_map_ent_t *ent_out);
+void circid_map_clear(circid_map_t *map);
+
+/** Return the number of circuit IDs in <b>map</b>. */
+static inline unsigned
+circid_map_size(const circid_map_t *map)
+{
+  return map->n_used;
+}
+
+#ifdef CIRCID_MAP_PRIVATE
+/** Fewest slots that we allocate for a map that isn't empty. */
+#define CIRCID_MAP_MIN_SLOTS 16
+#ifdef TOR_UNIT_TESTS
+STATIC void circid_map_assert_ok(const circid_map_t *map);
+#endif
+#endif /* defined(CIRCID_MAP_PRIVATE) */
+
+#endif /* !defined(TOR_CIRCID_MAP_H) */
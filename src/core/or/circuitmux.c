@@ -1320,8 +1320,10 @@ circuitmux_count_queued_destroy_cells(const channel_t *chan,
  * sort order), > 0 if cmux_2 has higher priority, or 0 if they are
  * equally preferred.
  *
- * If the cmuxes have different cmux policies or the policy does not
- * support the cmp_cmux method, return 0.
+ * If the cmuxes have different cmux policies, we can still compare them if
+ * both policies share the same cmp_cmux method, which must then handle
+ * either policy's data.  Otherwise, or if the policy does not support the
+ * cmp_cmux method, return 0.
  */
 
 MOCK_IMPL(int,
@@ -1352,6 +1354,11 @@ circuitmux_compare_muxes, (circuitmux_t *cmux_1, circuitmux_t *cmux_2))
          */
         return 0;
       }
+    } else if (cmux_1->policy->cmp_cmux &&
+               cmux_1->policy->cmp_cmux == cmux_2->policy->cmp_cmux) {
+      /* Different policies, but they know how to compare with each other */
+      return cmux_1->policy->cmp_cmux(cmux_1, cmux_1->policy_data,
+                                      cmux_2, cmux_2->policy_data);
     } else {
       /* Equivalent because they have different policies */
       return 0;
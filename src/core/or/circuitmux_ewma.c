@@ -22,6 +22,21 @@
  * that has elapsed since the tick.  We do re-scale the circuits on the
  * circuitmux periodically, so that we don't overflow double.
  *
+ * There are two versions of this policy.  The original, ewma_policy, keeps
+ * the active circuits on each circuitmux in a heap ordered by cell count,
+ * and rescales all of them every tick.  The second, ewma_calendar_policy,
+ * keeps them in a "calendar queue": an array of FIFO buckets, four for each
+ * doubling of the cell count, along with a bitmap of the nonempty
+ * buckets.  Picking, activating, deactivating, and re-queueing a circuit
+ * after it sends are all constant-time.  Instead of rescaling every tick,
+ * it keeps cell counts scaled relative to an older "base" tick, and only
+ * rescales once they grow large.  The price is that circuits whose cell
+ * counts share a bucket are served round-robin rather than strictly in
+ * order.  Each doubling is split into buckets of equal width, so the
+ * counts in one bucket differ by up to 25% in the lowest bucket of a
+ * doubling and by up to about 14% in the highest; all counts below 1.0
+ * share a single bucket.  Which one new channels use is controlled by the
+ * CircuitPriorityCalendar option and consensus parameter.
  *
  * This module should be used through the interfaces in circuitmux.c, which it
  * implements.
@@ -38,9 +53,12 @@
 #include "core/or/circuitmux.h"
 #include "core/or/circuitmux_ewma.h"
 #include "lib/crypt_ops/crypto_rand.h"
+#include "lib/intmath/bits.h"
 #include "feature/nodelist/networkstatus.h"
 #include "app/config/or_options_st.h"
 
+#include "ext/tor_queue.h"
+
 /*** EWMA parameter #defines ***/
 
 /** How long does a tick last (seconds)? */
@@ -58,6 +76,24 @@
 /** The natural logarithm of 0.5. */
 #define LOG_ONEHALF -0.69314718055994529
 
+/*** Calendar queue #defines ***/
+
+/** How many calendar buckets do we use for each doubling of the cell
+ * count? */
+#define EWMA_CAL_BUCKETS_PER_OCTAVE 4
+/** How many doublings of the cell count, starting at 1.0, do we keep
+ * separate buckets for?  Larger counts all go in the last bucket. */
+#define EWMA_CAL_N_OCTAVES 40
+/** Total number of buckets in a calendar queue: one for counts below 1.0,
+ * then EWMA_CAL_BUCKETS_PER_OCTAVE for each octave. */
+#define EWMA_CAL_N_BUCKETS \
+  (1 + EWMA_CAL_N_OCTAVES * EWMA_CAL_BUCKETS_PER_OCTAVE)
+/** Number of 64-bit words in the bitmap of nonempty buckets. */
+#define EWMA_CAL_N_BITMAP_WORDS ((EWMA_CAL_N_BUCKETS + 63) / 64)
+/** Once a circuit's cell count, relative to its calendar queue's base tick,
+ * reaches this value, we rescale the whole queue to the current tick. */
+#define EWMA_CAL_REBASE_LIMIT 4294967296.0 /* 2^32 */
+
 /*** EWMA structures ***/
 
 typedef struct cell_ewma_s cell_ewma_t;
@@ -84,8 +120,11 @@ struct cell_ewma_s {
    * channel. */
   unsigned int is_for_p_chan : 1;
   /** The position of the circuit within the OR connection's priority
-   * queue. */
+   * queue, or, for the calendar policy, the index of the bucket that holds
+   * it.  -1 if the circuit is not queued. */
   int heap_index;
+  /** Links for the calendar bucket that holds this circuit, if any. */
+  TOR_TAILQ_ENTRY(cell_ewma_s) bucket_link;
 };
 
 struct ewma_policy_data_s {
@@ -107,6 +146,26 @@ struct ewma_policy_data_s {
   unsigned int active_circuit_pqueue_last_recalibrated;
 };
 
+/** Head of a FIFO list of cell_ewma_t, for one calendar bucket. */
+TOR_TAILQ_HEAD(cell_ewma_bucket_s, cell_ewma_s);
+
+/** Policy data for a circuitmux using ewma_calendar_policy. */
+typedef struct ewma_cal_policy_data_s {
+  circuitmux_policy_data_t base_;
+
+  /** The tick relative to which every queued circuit's cell_count is
+   * scaled.  Unlike ewma_policy_data_t, we only move this forward when
+   * some cell count reaches EWMA_CAL_REBASE_LIMIT. */
+  unsigned int base_tick;
+  /** Number of circuits in the buckets. */
+  int n_queued;
+  /** Bitmap of the buckets that are nonempty. */
+  uint64_t nonempty[EWMA_CAL_N_BITMAP_WORDS];
+  /** The buckets themselves: bucket i holds the circuits whose cell count
+   * falls in the range that ewma_cal_bucket() maps to i. */
+  struct cell_ewma_bucket_s buckets[EWMA_CAL_N_BUCKETS];
+} ewma_cal_policy_data_t;
+
 struct ewma_policy_circ_data_s {
   circuitmux_policy_circ_data_t base_;
 
@@ -127,6 +186,7 @@ struct ewma_policy_circ_data_s {
 };
 
 #define EWMA_POL_DATA_MAGIC 0x2fd8b16aU
+#define EWMA_CAL_POL_DATA_MAGIC 0x5c41e3d7U
 #define EWMA_POL_CIRC_DATA_MAGIC 0x761e7747U
 
 /*** Downcasts for the above types ***/
@@ -152,6 +212,21 @@ TO_EWMA_POL_DATA(circuitmux_policy_data_t *pol)
   }
 }
 
+/**
+ * Downcast a circuitmux_policy_data_t to an ewma_cal_policy_data_t and
+ * assert if the cast is impossible.
+ */
+
+static inline ewma_cal_policy_data_t *
+TO_EWMA_CAL_POL_DATA(circuitmux_policy_data_t *pol)
+{
+  if (!pol) return NULL;
+  else {
+    tor_assert(pol->magic == EWMA_CAL_POL_DATA_MAGIC);
+    return DOWNCAST(ewma_cal_policy_data_t, pol);
+  }
+}
+
 /**
  * Downcast a circuitmux_policy_circ_data_t to an ewma_policy_circ_data_t
  * and assert if the cast is impossible.
@@ -178,6 +253,7 @@ static void remove_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma);
 static void scale_single_cell_ewma(cell_ewma_t *ewma, unsigned cur_tick);
 static void scale_active_circuits(ewma_policy_data_t *pol,
                                   unsigned cur_tick);
+static cell_ewma_t *ewma_cal_first(ewma_cal_policy_data_t *pol);
 
 /*** Circuitmux policy methods ***/
 
@@ -216,6 +292,30 @@ static int
 ewma_cmp_cmux(circuitmux_t *cmux_1, circuitmux_policy_data_t *pol_data_1,
               circuitmux_t *cmux_2, circuitmux_policy_data_t *pol_data_2);
 
+static circuitmux_policy_data_t *
+ewma_cal_alloc_cmux_data(circuitmux_t *cmux);
+static void ewma_cal_free_cmux_data(circuitmux_t *cmux,
+                                    circuitmux_policy_data_t *pol_data);
+static void
+ewma_cal_notify_circ_active(circuitmux_t *cmux,
+                            circuitmux_policy_data_t *pol_data,
+                            circuit_t *circ,
+                            circuitmux_policy_circ_data_t *pol_circ_data);
+static void
+ewma_cal_notify_circ_inactive(circuitmux_t *cmux,
+                              circuitmux_policy_data_t *pol_data,
+                              circuit_t *circ,
+                              circuitmux_policy_circ_data_t *pol_circ_data);
+static void
+ewma_cal_notify_xmit_cells(circuitmux_t *cmux,
+                           circuitmux_policy_data_t *pol_data,
+                           circuit_t *circ,
+                           circuitmux_policy_circ_data_t *pol_circ_data,
+                           unsigned int n_cells);
+static circuit_t *
+ewma_cal_pick_active_circuit(circuitmux_t *cmux,
+                             circuitmux_policy_data_t *pol_data);
+
 /*** EWMA global variables ***/
 
 /** The per-tick scale factor to be used when computing cell-count EWMA
@@ -239,6 +339,25 @@ circuitmux_policy_t ewma_policy = {
   /*.cmp_cmux =*/ ewma_cmp_cmux
 };
 
+/*** EWMA calendar queue circuitmux_policy_t method table ***/
+
+circuitmux_policy_t ewma_calendar_policy = {
+  /*.alloc_cmux_data =*/ ewma_cal_alloc_cmux_data,
+  /*.free_cmux_data =*/ ewma_cal_free_cmux_data,
+  /*.alloc_circ_data =*/ ewma_alloc_circ_data,
+  /*.free_circ_data =*/ ewma_free_circ_data,
+  /*.notify_circ_active =*/ ewma_cal_notify_circ_active,
+  /*.notify_circ_inactive =*/ ewma_cal_notify_circ_inactive,
+  /*.notify_set_n_cells =*/ NULL,
+  /*.notify_xmit_cells =*/ ewma_cal_notify_xmit_cells,
+  /*.pick_active_circuit =*/ ewma_cal_pick_active_circuit,
+  /*.cmp_cmux =*/ ewma_cmp_cmux
+};
+
+/** True iff new channels should use ewma_calendar_policy rather than
+ * ewma_policy. */
+static int ewma_use_calendar = 0;
+
 /** Have we initialized the ewma tick-counting logic? */
 static int ewma_ticks_initialized = 0;
 /** At what monotime_coarse_t did the current tick begin? */
@@ -495,56 +614,75 @@ ewma_pick_active_circuit(circuitmux_t *cmux,
   return circ;
 }
 
+/**
+ * Return the cell_ewma_t of the preferred circuit on the cmux whose EWMA
+ * policy data is <b>pol_data</b>, or NULL if it has no active circuits.
+ * Set *<b>tick_out</b> to the tick relative to which its count is scaled.
+ * <b>pol_data</b> may belong to either ewma_policy or ewma_calendar_policy.
+ */
+static cell_ewma_t *
+ewma_cmux_first(circuitmux_policy_data_t *pol_data, unsigned *tick_out)
+{
+  if (pol_data->magic == EWMA_CAL_POL_DATA_MAGIC) {
+    ewma_cal_policy_data_t *pol = TO_EWMA_CAL_POL_DATA(pol_data);
+    *tick_out = pol->base_tick;
+    return ewma_cal_first(pol);
+  } else {
+    ewma_policy_data_t *pol = TO_EWMA_POL_DATA(pol_data);
+    *tick_out = pol->active_circuit_pqueue_last_recalibrated;
+    if (smartlist_len(pol->active_circuit_pqueue) == 0)
+      return NULL;
+    return smartlist_get(pol->active_circuit_pqueue, 0);
+  }
+}
+
 /**
  * Compare two EWMA cmuxes, and return -1, 0 or 1 to indicate which should
  * be more preferred - see circuitmux_compare_muxes() of circuitmux.c.
+ *
+ * Both ewma_policy and ewma_calendar_policy use this method, and either
+ * cmux may use either of them: this happens for a while after the
+ * CircuitPriorityCalendar parameter changes, since only new channels pick
+ * up the new policy.  We compare the cell counts of the two preferred
+ * circuits after scaling them to the same EWMA tick.
  */
-
 static int
 ewma_cmp_cmux(circuitmux_t *cmux_1, circuitmux_policy_data_t *pol_data_1,
               circuitmux_t *cmux_2, circuitmux_policy_data_t *pol_data_2)
 {
-  ewma_policy_data_t *p1 = NULL, *p2 = NULL;
   cell_ewma_t *ce1 = NULL, *ce2 = NULL;
+  unsigned tick1, tick2;
+  double count1;
 
   tor_assert(cmux_1);
   tor_assert(pol_data_1);
   tor_assert(cmux_2);
   tor_assert(pol_data_2);
 
-  p1 = TO_EWMA_POL_DATA(pol_data_1);
-  p2 = TO_EWMA_POL_DATA(pol_data_2);
-
-  if (p1 != p2) {
-    /* Get the head cell_ewma_t from each queue */
-    if (smartlist_len(p1->active_circuit_pqueue) > 0) {
-      ce1 = smartlist_get(p1->active_circuit_pqueue, 0);
-    }
-
-    if (smartlist_len(p2->active_circuit_pqueue) > 0) {
-      ce2 = smartlist_get(p2->active_circuit_pqueue, 0);
-    }
-
-    /* Got both of them? */
-    if (ce1 != NULL && ce2 != NULL) {
-      /* Pick whichever one has the better best circuit */
-      return compare_cell_ewma_counts(ce1, ce2);
-    } else {
-      if (ce1 != NULL ) {
-        /* We only have a circuit on cmux_1, so prefer it */
-        return -1;
-      } else if (ce2 != NULL) {
-        /* We only have a circuit on cmux_2, so prefer it */
-        return 1;
-      } else {
-        /* No circuits at all; no preference */
-        return 0;
-      }
-    }
-  } else {
+  if (pol_data_1 == pol_data_2) {
     /* We got identical params */
     return 0;
   }
+
+  /* Get the head cell_ewma_t from each queue */
+  ce1 = ewma_cmux_first(pol_data_1, &tick1);
+  ce2 = ewma_cmux_first(pol_data_2, &tick2);
+  if (ce1 == NULL || ce2 == NULL) {
+    /* Prefer whichever one has a circuit, if either does. */
+    return ce1 ? -1 : (ce2 ? 1 : 0);
+  }
+
+  /* The two queues may be scaled relative to different ticks: scale the
+   * first count to match the second before comparing. */
+  count1 = ce1->cell_count;
+  if (tick1 != tick2)
+    count1 *= get_scale_factor(tick1, tick2);
+  if (count1 < ce2->cell_count)
+    return -1;
+  else if (count1 > ce2->cell_count)
+    return 1;
+  else
+    return 0;
 }
 
 /** Helper for sorting cell_ewma_t values in their priority queue. */
@@ -699,13 +837,32 @@ get_circuit_priority_halflife(const or_options_t *options,
   return halflife;
 }
 
-/** Adjust the global cell scale factor based on <b>options</b> */
+/* Default value for the CircuitPriorityCalendar consensus parameter. */
+#define CMUX_PRIORITY_CALENDAR_DEFAULT 0
+
+/* Return true iff new channels should use the calendar queue version of
+ * the EWMA policy, according to the options if they say, or else according
+ * to the consensus. */
+static int
+get_circuit_priority_calendar(const or_options_t *options,
+                              const networkstatus_t *consensus)
+{
+  if (options && options->CircuitPriorityCalendar != -1)
+    return options->CircuitPriorityCalendar;
+
+  return networkstatus_get_param(consensus, "CircuitPriorityCalendar",
+                                 CMUX_PRIORITY_CALENDAR_DEFAULT, 0, 1);
+}
+
+/** Adjust the global cell scale factor, and our choice of EWMA policy for
+ * new channels, based on <b>options</b> and <b>consensus</b>. */
 void
 cmux_ewma_set_options(const or_options_t *options,
                       const networkstatus_t *consensus)
 {
   double halflife;
   const char *source;
+  int use_calendar;
 
   cell_ewma_initialize_ticks();
 
@@ -721,6 +878,13 @@ cmux_ewma_set_options(const or_options_t *options,
            "Enabled cell_ewma algorithm because of value in %s; "
            "scale factor is %f per %d seconds",
            source, ewma_scale_factor, EWMA_TICK_LEN);
+
+  use_calendar = get_circuit_priority_calendar(options, consensus);
+  if (use_calendar != ewma_use_calendar) {
+    log_info(LD_OR, "New channels will keep their active circuits in %s.",
+             use_calendar ? "a calendar queue" : "a heap");
+    ewma_use_calendar = use_calendar;
+  }
 }
 
 /** Return the multiplier necessary to convert the value of a cell sent in
@@ -819,6 +983,263 @@ pop_first_cell_ewma(ewma_policy_data_t *pol)
                               offsetof(cell_ewma_t, heap_index));
 }
 
+/* ==== Calendar queue version of the EWMA policy ==== */
+
+/** Return the index of the calendar bucket for a circuit whose cell count
+ * is <b>cell_count</b>. */
+static inline int
+ewma_cal_bucket(double cell_count)
+{
+  int exponent, bucket;
+  double mantissa;
+
+  if (!(cell_count >= 1.0))
+    return 0;
+  /* cell_count = mantissa * 2^exponent, with 0.5 <= mantissa < 1. */
+  mantissa = frexp(cell_count, &exponent);
+  bucket = 1 + (exponent - 1) * EWMA_CAL_BUCKETS_PER_OCTAVE +
+    (int)((mantissa - 0.5) * 2 * EWMA_CAL_BUCKETS_PER_OCTAVE);
+  return MIN(bucket, EWMA_CAL_N_BUCKETS - 1);
+}
+
+/** Append <b>ewma</b>, whose cell count must already be scaled relative to
+ * <b>pol</b>'s base tick, to the right bucket of <b>pol</b>. */
+static void
+ewma_cal_enqueue(ewma_cal_policy_data_t *pol, cell_ewma_t *ewma)
+{
+  int bucket = ewma_cal_bucket(ewma->cell_count);
+
+  tor_assert(ewma->heap_index == -1);
+  TOR_TAILQ_INSERT_TAIL(&pol->buckets[bucket], ewma, bucket_link);
+  pol->nonempty[bucket / 64] |= UINT64_C(1) << (bucket % 64);
+  ewma->heap_index = bucket;
+  ++pol->n_queued;
+}
+
+/** Remove <b>ewma</b> from whichever bucket of <b>pol</b> holds it. */
+static void
+ewma_cal_dequeue(ewma_cal_policy_data_t *pol, cell_ewma_t *ewma)
+{
+  int bucket = ewma->heap_index;
+
+  tor_assert(bucket >= 0 && bucket < EWMA_CAL_N_BUCKETS);
+  TOR_TAILQ_REMOVE(&pol->buckets[bucket], ewma, bucket_link);
+  if (TOR_TAILQ_EMPTY(&pol->buckets[bucket]))
+    pol->nonempty[bucket / 64] &= ~(UINT64_C(1) << (bucket % 64));
+  ewma->heap_index = -1;
+  --pol->n_queued;
+}
+
+/** Return the first circuit in the lowest nonempty bucket of <b>pol</b>,
+ * or NULL if there are no queued circuits. */
+static cell_ewma_t *
+ewma_cal_first(ewma_cal_policy_data_t *pol)
+{
+  int i;
+  for (i = 0; i < EWMA_CAL_N_BITMAP_WORDS; ++i) {
+    uint64_t word = pol->nonempty[i];
+    if (word) {
+      /* Isolate the lowest set bit, and find its position. */
+      int bucket = i * 64 + tor_log2(word & (~word + 1));
+      return TOR_TAILQ_FIRST(&pol->buckets[bucket]);
+    }
+  }
+  return NULL;
+}
+
+/** Rescale every queued circuit on <b>pol</b> relative to <b>cur_tick</b>,
+ * make that the new base tick, and sort the circuits into their new
+ * buckets. */
+static void
+ewma_cal_rebase(ewma_cal_policy_data_t *pol, unsigned cur_tick)
+{
+  struct cell_ewma_bucket_s all;
+  cell_ewma_t *e;
+  double factor = get_scale_factor(pol->base_tick, cur_tick);
+  int i;
+
+  /* Gather every circuit in order, so that circuits that end up sharing a
+   * bucket keep their relative order. */
+  TOR_TAILQ_INIT(&all);
+  for (i = 0; i < EWMA_CAL_N_BUCKETS; ++i) {
+    while ((e = TOR_TAILQ_FIRST(&pol->buckets[i]))) {
+      TOR_TAILQ_REMOVE(&pol->buckets[i], e, bucket_link);
+      TOR_TAILQ_INSERT_TAIL(&all, e, bucket_link);
+    }
+  }
+  memset(pol->nonempty, 0, sizeof(pol->nonempty));
+  pol->n_queued = 0;
+  pol->base_tick = cur_tick;
+
+  while ((e = TOR_TAILQ_FIRST(&all))) {
+    TOR_TAILQ_REMOVE(&all, e, bucket_link);
+    e->cell_count *= factor;
+    e->last_adjusted_tick = cur_tick;
+    e->heap_index = -1;
+    ewma_cal_enqueue(pol, e);
+  }
+}
+
+/**
+ * Allocate an ewma_cal_policy_data_t and upcast it to a
+ * circuitmux_policy_data_t; this is called when setting the policy on a
+ * circuitmux_t to ewma_calendar_policy.
+ */
+static circuitmux_policy_data_t *
+ewma_cal_alloc_cmux_data(circuitmux_t *cmux)
+{
+  ewma_cal_policy_data_t *pol = NULL;
+  int i;
+
+  tor_assert(cmux);
+
+  pol = tor_malloc_zero(sizeof(*pol));
+  pol->base_.magic = EWMA_CAL_POL_DATA_MAGIC;
+  pol->base_tick = cell_ewma_get_tick();
+  for (i = 0; i < EWMA_CAL_N_BUCKETS; ++i)
+    TOR_TAILQ_INIT(&pol->buckets[i]);
+
+  return TO_CMUX_POL_DATA(pol);
+}
+
+/**
+ * Free an ewma_cal_policy_data_t allocated with ewma_cal_alloc_cmux_data()
+ */
+static void
+ewma_cal_free_cmux_data(circuitmux_t *cmux,
+                        circuitmux_policy_data_t *pol_data)
+{
+  ewma_cal_policy_data_t *pol = NULL;
+
+  tor_assert(cmux);
+  if (!pol_data) return;
+
+  pol = TO_EWMA_CAL_POL_DATA(pol_data);
+  tor_free(pol);
+}
+
+/**
+ * Handle circuit activation; this scales the circuit's cell_ewma to the
+ * queue's base tick, and adds it to the right bucket.
+ */
+static void
+ewma_cal_notify_circ_active(circuitmux_t *cmux,
+                            circuitmux_policy_data_t *pol_data,
+                            circuit_t *circ,
+                            circuitmux_policy_circ_data_t *pol_circ_data)
+{
+  ewma_cal_policy_data_t *pol = NULL;
+  ewma_policy_circ_data_t *cdata = NULL;
+
+  tor_assert(cmux);
+  tor_assert(pol_data);
+  tor_assert(circ);
+  tor_assert(pol_circ_data);
+
+  pol = TO_EWMA_CAL_POL_DATA(pol_data);
+  cdata = TO_EWMA_POL_CIRC_DATA(pol_circ_data);
+
+  scale_single_cell_ewma(&cdata->cell_ewma, pol->base_tick);
+  ewma_cal_enqueue(pol, &cdata->cell_ewma);
+}
+
+/**
+ * Handle circuit deactivation; this removes the circuit's cell_ewma from
+ * its bucket.
+ */
+static void
+ewma_cal_notify_circ_inactive(circuitmux_t *cmux,
+                              circuitmux_policy_data_t *pol_data,
+                              circuit_t *circ,
+                              circuitmux_policy_circ_data_t *pol_circ_data)
+{
+  ewma_cal_policy_data_t *pol = NULL;
+  ewma_policy_circ_data_t *cdata = NULL;
+
+  tor_assert(cmux);
+  tor_assert(pol_data);
+  tor_assert(circ);
+  tor_assert(pol_circ_data);
+
+  pol = TO_EWMA_CAL_POL_DATA(pol_data);
+  cdata = TO_EWMA_POL_CIRC_DATA(pol_circ_data);
+
+  ewma_cal_dequeue(pol, &cdata->cell_ewma);
+}
+
+/**
+ * Update cell_ewma for this circuit after we've sent some cells, and move
+ * it to the back of its new bucket.  If the counts have grown too large,
+ * rescale the whole queue to the current tick first.
+ */
+static void
+ewma_cal_notify_xmit_cells(circuitmux_t *cmux,
+                           circuitmux_policy_data_t *pol_data,
+                           circuit_t *circ,
+                           circuitmux_policy_circ_data_t *pol_circ_data,
+                           unsigned int n_cells)
+{
+  ewma_cal_policy_data_t *pol = NULL;
+  ewma_policy_circ_data_t *cdata = NULL;
+  unsigned int tick;
+  double fractional_tick, weight;
+  cell_ewma_t *cell_ewma;
+
+  tor_assert(cmux);
+  tor_assert(pol_data);
+  tor_assert(circ);
+  tor_assert(pol_circ_data);
+  tor_assert(n_cells > 0);
+
+  pol = TO_EWMA_CAL_POL_DATA(pol_data);
+  cdata = TO_EWMA_POL_CIRC_DATA(pol_circ_data);
+  cell_ewma = &cdata->cell_ewma;
+
+  tick = cell_ewma_get_current_tick_and_fraction(&fractional_tick);
+
+  /* A cell sent now is worth this much, relative to the base tick.  If
+   * that, or this circuit's count, has grown too large, rebase first. */
+  weight = pow(ewma_scale_factor,
+               -((int)(tick - pol->base_tick) + fractional_tick));
+  if (tick != pol->base_tick &&
+      (weight >= EWMA_CAL_REBASE_LIMIT ||
+       cell_ewma->cell_count >= EWMA_CAL_REBASE_LIMIT)) {
+    ewma_cal_rebase(pol, tick);
+    weight = pow(ewma_scale_factor, -fractional_tick);
+  }
+
+  ewma_cal_dequeue(pol, cell_ewma);
+  cell_ewma->cell_count += ((double)(n_cells)) * weight;
+  ewma_cal_enqueue(pol, cell_ewma);
+}
+
+/**
+ * Pick the preferred circuit to send from: the first one in the lowest
+ * nonempty bucket.
+ */
+static circuit_t *
+ewma_cal_pick_active_circuit(circuitmux_t *cmux,
+                             circuitmux_policy_data_t *pol_data)
+{
+  ewma_cal_policy_data_t *pol = NULL;
+  cell_ewma_t *cell_ewma;
+
+  tor_assert(cmux);
+  tor_assert(pol_data);
+
+  pol = TO_EWMA_CAL_POL_DATA(pol_data);
+  cell_ewma = ewma_cal_first(pol);
+
+  return cell_ewma ? cell_ewma_to_circuit(cell_ewma) : NULL;
+}
+
+/** Return the circuitmux policy that new channels should use. */
+const circuitmux_policy_t *
+cmux_ewma_get_policy(void)
+{
+  return ewma_use_calendar ? &ewma_calendar_policy : &ewma_policy;
+}
+
 /**
  * Drop all resources held by circuitmux_ewma.c, and deinitialize the
  * module. */
@@ -826,4 +1247,5 @@ void
 circuitmux_ewma_free_all(void)
 {
   ewma_ticks_initialized = 0;
+  ewma_use_calendar = 0;
 }
@@ -14,10 +14,13 @@
 
 /* The public EWMA policy callbacks object. */
 extern circuitmux_policy_t ewma_policy;
+/* The calendar queue version of the EWMA policy. */
+extern circuitmux_policy_t ewma_calendar_policy;
 
 /* Externally visible EWMA functions */
 void cmux_ewma_set_options(const or_options_t *options,
                            const networkstatus_t *consensus);
+const circuitmux_policy_t *cmux_ewma_get_policy(void);
 
 void circuitmux_ewma_free_all(void);
 
@@ -472,35 +472,88 @@ command_process_created_cell(cell_t *cell, channel_t *chan)
   }
 }
 
-/** Process a 'relay' or 'relay_early' <b>cell</b> that just arrived from
- * <b>conn</b>. Make sure it came in with a recognized circ_id. Pass it on to
- * circuit_receive_relay_cell() for actual processing.
+/** Find the circuit that relay cells with circuit ID <b>circ_id</b>,
+ * arriving on <b>chan</b>, belong to, and set *<b>direction_out</b> to the
+ * direction they're heading on it.  Return NULL if there is no such
+ * circuit, or if it can't take relay cells yet (in which case we close
+ * it).
  */
-static void
-command_process_relay_cell(cell_t *cell, channel_t *chan)
+static circuit_t *
+command_get_relay_cell_circ(circid_t circ_id, channel_t *chan,
+                            int *direction_out)
 {
-  const or_options_t *options = get_options();
   circuit_t *circ;
-  int reason, direction;
-  uint32_t orig_delivered_bw = 0;
-  uint32_t orig_overhead_bw = 0;
 
-  circ = circuit_get_by_circid_channel(cell->circ_id, chan);
+  circ = circuit_get_by_circid_channel(circ_id, chan);
 
   if (!circ) {
     log_debug(LD_OR,
               "unknown circuit %u on connection from %s. Dropping.",
-              (unsigned)cell->circ_id,
+              (unsigned)circ_id,
               channel_get_canonical_remote_descr(chan));
-    return;
+    return NULL;
   }
 
   if (circ->state == CIRCUIT_STATE_ONIONSKIN_PENDING) {
     log_fn(LOG_PROTOCOL_WARN,LD_PROTOCOL,"circuit in create_wait. Closing.");
     circuit_mark_for_close(circ, END_CIRC_REASON_TORPROTOCOL);
-    return;
+    return NULL;
   }
 
+  if (!CIRCUIT_IS_ORIGIN(circ) &&
+      chan == TO_OR_CIRCUIT(circ)->p_chan &&
+      circ_id == TO_OR_CIRCUIT(circ)->p_circ_id)
+    *direction_out = CELL_DIRECTION_OUT;
+  else
+    *direction_out = CELL_DIRECTION_IN;
+
+  return circ;
+}
+
+/** Handling relay cells heading in <b>direction</b> on <b>circ</b> failed
+ * with -<b>reason</b>: close the circuit. */
+static void
+command_relay_cells_failed(circuit_t *circ, int direction, int reason)
+{
+  log_fn(LOG_PROTOCOL_WARN,LD_PROTOCOL,"circuit_receive_relay_cell "
+         "(%s) failed. Closing.",
+         direction==CELL_DIRECTION_OUT?"forward":"backward");
+  /* Always emit a bandwidth event for closed circs */
+  if (CIRCUIT_IS_ORIGIN(circ)) {
+    control_event_circ_bandwidth_used_for_circ(TO_ORIGIN_CIRCUIT(circ));
+  }
+  circuit_mark_for_close(circ, -reason);
+}
+
+/** We just handled <b>n_cells</b> relay cells on <b>circ</b>: if it's an
+ * RP circuit, count them as part of the hidden service stats. */
+static void
+command_note_rp_cells(const circuit_t *circ, int n_cells)
+{
+  if (get_options()->HiddenServiceStatistics &&
+      !CIRCUIT_IS_ORIGIN(circ) &&
+      CONST_TO_OR_CIRCUIT(circ)->circuit_carries_hs_traffic_stats) {
+    while (n_cells--)
+      rep_hist_seen_new_rp_cell();
+  }
+}
+
+/** Process a 'relay' or 'relay_early' <b>cell</b> that just arrived from
+ * <b>conn</b>. Make sure it came in with a recognized circ_id. Pass it on to
+ * circuit_receive_relay_cell() for actual processing.
+ */
+static void
+command_process_relay_cell(cell_t *cell, channel_t *chan)
+{
+  circuit_t *circ;
+  int reason, direction;
+  uint32_t orig_delivered_bw = 0;
+  uint32_t orig_overhead_bw = 0;
+
+  circ = command_get_relay_cell_circ(cell->circ_id, chan, &direction);
+  if (!circ)
+    return;
+
   if (CIRCUIT_IS_ORIGIN(circ)) {
     /* if we're a relay and treating connections with recent local
      * traffic better, then this is one of them. */
@@ -527,13 +580,6 @@ command_process_relay_cell(cell_t *cell, channel_t *chan)
     orig_overhead_bw = ocirc->n_overhead_read_circ_bw;
   }
 
-  if (!CIRCUIT_IS_ORIGIN(circ) &&
-      chan == TO_OR_CIRCUIT(circ)->p_chan &&
-      cell->circ_id == TO_OR_CIRCUIT(circ)->p_circ_id)
-    direction = CELL_DIRECTION_OUT;
-  else
-    direction = CELL_DIRECTION_IN;
-
   /* If we have a relay_early cell, make sure that it's outbound, and we've
    * gotten no more than MAX_RELAY_EARLY_CELLS_PER_CIRCUIT of them. */
   if (cell->command == CELL_RELAY_EARLY) {
@@ -571,16 +617,8 @@ command_process_relay_cell(cell_t *cell, channel_t *chan)
     }
   }
 
-  if ((reason = circuit_receive_relay_cell(cell, circ, direction)) < 0) {
-    log_fn(LOG_PROTOCOL_WARN,LD_PROTOCOL,"circuit_receive_relay_cell "
-           "(%s) failed. Closing.",
-           direction==CELL_DIRECTION_OUT?"forward":"backward");
-    /* Always emit a bandwidth event for closed circs */
-    if (CIRCUIT_IS_ORIGIN(circ)) {
-      control_event_circ_bandwidth_used_for_circ(TO_ORIGIN_CIRCUIT(circ));
-    }
-    circuit_mark_for_close(circ, -reason);
-  }
+  if ((reason = circuit_receive_relay_cell(cell, circ, direction)) < 0)
+    command_relay_cells_failed(circ, direction, reason);
 
   if (CIRCUIT_IS_ORIGIN(circ)) {
     origin_circuit_t *ocirc = TO_ORIGIN_CIRCUIT(circ);
@@ -602,13 +640,50 @@ command_process_relay_cell(cell_t *cell, channel_t *chan)
     }
   }
 
-  /* If this is a cell in an RP circuit, count it as part of the
-     hidden service stats */
-  if (options->HiddenServiceStatistics &&
-      !CIRCUIT_IS_ORIGIN(circ) &&
-      TO_OR_CIRCUIT(circ)->circuit_carries_hs_traffic_stats) {
-    rep_hist_seen_new_rp_cell();
+  command_note_rp_cells(circ, 1);
+}
+
+/** Process a run of <b>n_cells</b> 'relay' <b>cells</b> that just arrived,
+ * in order, from <b>chan</b>, all with the same circ_id.
+ *
+ * When they belong to a circuit that we're relaying for, hand them to
+ * circuit_receive_relay_cells() together so their crypto can be batched;
+ * otherwise, process them one at a time as command_process_relay_cell()
+ * would.
+ */
+void
+command_process_relay_cells(channel_t *chan, cell_t **cells, int n_cells)
+{
+  circuit_t *circ;
+  int i, reason, direction;
+
+  tor_assert(chan);
+  tor_assert(cells);
+  tor_assert(n_cells > 0);
+
+  stats_n_relay_cells_processed += n_cells;
+
+  circ = command_get_relay_cell_circ(cells[0]->circ_id, chan, &direction);
+  if (!circ)
+    return;
+
+  if (n_cells == 1 || CIRCUIT_IS_ORIGIN(circ)) {
+    for (i = 0; i < n_cells; ++i)
+      command_process_relay_cell(cells[i], chan);
+    return;
+  }
+
+  for (i = 0; i < n_cells; ++i) {
+    if (BUG(cells[i]->command != CELL_RELAY) ||
+        BUG(cells[i]->circ_id != cells[0]->circ_id))
+      return;
   }
+
+  if ((reason = circuit_receive_relay_cells(cells, n_cells, circ,
+                                            direction)) < 0)
+    command_relay_cells_failed(circ, direction, reason);
+
+  command_note_rp_cells(circ, n_cells);
 }
 
 /** Process a 'destroy' <b>cell</b> that just arrived from
@@ -687,6 +762,7 @@ command_setup_channel(channel_t *chan)
   channel_set_cell_handlers(chan,
                             command_process_cell,
                             command_process_var_cell);
+  channel_set_relay_cells_handler(chan, command_process_relay_cells);
 }
 
 /** Given a listener, install the right handler to process incoming
@@ -790,6 +790,17 @@ connection_or_about_to_close(or_connection_t *or_conn)
     or_conn->chan = NULL;
   }
 
+  if (or_conn->tls_flush_stats.n_records) {
+    const tls_flush_stats_t *st = &or_conn->tls_flush_stats;
+    log_info(LD_OR, "Closing OR connection to %s after writing %"PRIu64
+             " TLS records in %"PRIu64" flushes (%.2f records per flush, "
+             "%.0f bytes per record).",
+             safe_str_client(conn->address),
+             (st->n_records), (st->n_flushes),
+             ((double)st->n_records) / st->n_flushes,
+             ((double)st->n_bytes) / st->n_records);
+  }
+
   /* Remember why we're closing this connection. */
   if (conn->state != OR_CONN_STATE_OPEN) {
     /* now mark things down as needed */
@@ -2352,6 +2363,58 @@ connection_fetch_var_cell_from_buf(or_connection_t *or_conn, var_cell_t **out)
   return fetch_var_cell_from_buf(conn->inbuf, out, or_conn->link_proto);
 }
 
+/** Return true iff <b>conn</b> is open and its inbuf begins with a complete
+ * RELAY cell whose circuit ID matches that of the packed cell header in
+ * <b>first_hdr</b>.  Only the next cell's header is examined.
+ */
+static int
+connection_or_next_cell_continues_run(or_connection_t *conn,
+                                      const char *first_hdr)
+{
+  const size_t cell_network_size = get_cell_network_size(conn->wide_circ_ids);
+  const size_t circ_id_len = get_circ_id_size(conn->wide_circ_ids);
+  char hdr[4 + 1];
+
+  if (TO_CONN(conn)->state != OR_CONN_STATE_OPEN || !conn->chan)
+    return 0;
+  if (connection_get_inbuf_len(TO_CONN(conn)) < cell_network_size)
+    return 0;
+
+  buf_peek(TO_CONN(conn)->inbuf, hdr, circ_id_len + 1);
+  return get_uint8(hdr + circ_id_len) == CELL_RELAY &&
+    fast_memeq(hdr, first_hdr, circ_id_len);
+}
+
+/** We have just removed the RELAY cell <b>first</b>, packed as
+ * <b>first_hdr</b>, from <b>conn</b>'s inbuf, and at least one more RELAY
+ * cell for the same circuit follows it.  Remove the cells that follow it on
+ * that circuit, up to a batch of RELAY_CELL_BATCH_MAX and stopping at the
+ * first cell for another circuit, and hand the whole run to the channel
+ * together so that its crypto can be batched.
+ */
+static void
+connection_or_process_relay_cell_run(or_connection_t *conn, cell_t *first,
+                                     const char *first_hdr)
+{
+  const int wide_circ_ids = conn->wide_circ_ids;
+  const size_t cell_network_size = get_cell_network_size(wide_circ_ids);
+  char buf[CELL_MAX_NETWORK_SIZE];
+  cell_t run[RELAY_CELL_BATCH_MAX - 1];
+  cell_t *run_ptrs[RELAY_CELL_BATCH_MAX];
+  int n_run = 1;
+
+  run_ptrs[0] = first;
+  while (n_run < RELAY_CELL_BATCH_MAX &&
+         connection_or_next_cell_continues_run(conn, first_hdr)) {
+    connection_buf_get_bytes(buf, cell_network_size, TO_CONN(conn));
+    cell_unpack(&run[n_run - 1], buf, wide_circ_ids);
+    run_ptrs[n_run] = &run[n_run - 1];
+    ++n_run;
+  }
+
+  channel_tls_handle_relay_cells(run_ptrs, n_run, conn);
+}
+
 /** Process cells from <b>conn</b>'s inbuf.
  *
  * Loop: while inbuf contains a cell, pull it off the inbuf, unpack it,
@@ -2408,12 +2471,22 @@ connection_or_process_cells_from_inbuf(or_connection_t *conn)
         channel_timestamp_active(TLS_CHAN_TO_BASE(conn->chan));
 
       circuit_build_times_network_is_live(get_circuit_build_times_mutable());
+
       connection_buf_get_bytes(buf, cell_network_size, TO_CONN(conn));
 
       /* retrieve cell info from buf (create the host-order struct from the
        * network-order string) */
       cell_unpack(&cell, buf, wide_circ_ids);
 
+      /* If more relay cells for the same circuit are already buffered
+       * behind this one, pass them up together so that their crypto can be
+       * batched. */
+      if (cell.command == CELL_RELAY &&
+          connection_or_next_cell_continues_run(conn, buf)) {
+        connection_or_process_relay_cell_run(conn, &cell, buf);
+        continue;
+      }
+
       channel_tls_handle_cell(&cell, conn);
     }
   }
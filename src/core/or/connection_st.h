@@ -125,6 +125,12 @@ struct connection_t {
                   * strdup into this, because free_connection() frees it. */
   /** Another connection that's connected to this one in lieu of a socket. */
   struct connection_t *linked_conn;
+  /** For linked connections: how many bytes have we received from
+   * linked_conn by taking over whole buffer chunks? */
+  uint64_t n_linked_bytes_moved;
+  /** For linked connections: how many bytes have we received from
+   * linked_conn by copying them? */
+  uint64_t n_linked_bytes_copied;
 
   /** Unique identifier for this connection on this Tor instance. */
   uint64_t global_identifier;
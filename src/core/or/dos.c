@@ -20,6 +20,7 @@
 #include "feature/relay/routermode.h"
 #include "feature/stats/geoip_stats.h"
 #include "lib/crypt_ops/crypto_rand.h"
+#include "lib/intmath/bits.h"
 
 #include "core/or/dos.h"
 
@@ -64,6 +65,26 @@ static dos_conn_defense_type_t dos_conn_defense_type;
 /* Keep some stats for the heartbeat so we can report out. */
 static uint64_t conn_num_addr_rejected;
 
+/*
+ * Client counting sketch. When enabled, concurrent connection and circuit
+ * creation counts live in fixed size count-min sketches instead of the geoip
+ * clientmap, which then only holds the heavy hitters.
+ *
+ * Namespace used for this is "dos_sketch_".
+ */
+
+/* Is the sketch mode enabled? */
+static unsigned int dos_sketch_enabled = 0;
+
+/* Consensus parameters. They can be changed when a new consensus arrives. */
+static uint32_t dos_sketch_width;
+
+/* The sketch, or NULL if we aren't using one. */
+static dos_sketch_t *dos_sketch = NULL;
+
+/* Keep some stats for the heartbeat so we can report out. */
+static uint64_t sketch_num_promoted_addrs;
+
 /*
  * General interface of the denial of service mitigation subsystem.
  */
@@ -187,6 +208,36 @@ get_param_conn_defense_type(const networkstatus_t *ns)
                                  DOS_CONN_DEFENSE_NONE, DOS_CONN_DEFENSE_MAX);
 }
 
+/* Return true iff the client counting sketch is enabled. We look at the
+ * consensus for this else a default value is returned. */
+MOCK_IMPL(STATIC unsigned int,
+get_param_sketch_enabled, (const networkstatus_t *ns))
+{
+  if (get_options()->DoSUseSketch != -1) {
+    return get_options()->DoSUseSketch;
+  }
+  return !!networkstatus_get_param(ns, "DoSUseSketch",
+                                   DOS_SKETCH_ENABLED_DEFAULT, 0, 1);
+}
+
+/* Return the parameter for the number of counters in each row of the sketch,
+ * rounded down to a power of two. */
+STATIC uint32_t
+get_param_sketch_width(const networkstatus_t *ns)
+{
+  uint32_t width;
+  if (get_options()->DoSSketchWidth) {
+    width = get_options()->DoSSketchWidth;
+  } else {
+    width = networkstatus_get_param(ns, "DoSSketchWidth",
+                                    DOS_SKETCH_WIDTH_DEFAULT,
+                                    DOS_SKETCH_WIDTH_MIN,
+                                    DOS_SKETCH_WIDTH_MAX);
+  }
+  width = CLAMP(DOS_SKETCH_WIDTH_MIN, width, DOS_SKETCH_WIDTH_MAX);
+  return UINT32_C(1) << tor_log2(width);
+}
+
 /* Set circuit creation parameters located in the consensus or their default
  * if none are present. Called at initialization or when the consensus
  * changes. */
@@ -205,6 +256,10 @@ set_dos_parameters(const networkstatus_t *ns)
   dos_conn_enabled = get_param_conn_enabled(ns);
   dos_conn_max_concurrent_count = get_param_conn_max_concurrent_count(ns);
   dos_conn_defense_type = get_param_conn_defense_type(ns);
+
+  /* Client counting sketch. */
+  dos_sketch_enabled = get_param_sketch_enabled(ns);
+  dos_sketch_width = get_param_sketch_width(ns);
 }
 
 /* Free everything for the circuit creation DoS mitigation subsystem. */
@@ -339,14 +394,15 @@ cc_stats_refill_bucket(cc_client_stats_t *stats, const tor_addr_t *addr)
 }
 
 /* Return true iff the circuit bucket is down to 0 and the number of
- * concurrent connections is greater or equal the minimum threshold set the
- * consensus parameter. */
+ * concurrent connections, <b>concurrent_count</b>, is greater or equal the
+ * minimum threshold set the consensus parameter. */
 static int
-cc_has_exhausted_circuits(const dos_client_stats_t *stats)
+cc_has_exhausted_circuits(const cc_client_stats_t *stats,
+                          uint32_t concurrent_count)
 {
   tor_assert(stats);
-  return stats->cc_stats.circuit_bucket == 0 &&
-         stats->concurrent_count >= dos_cc_min_concurrent_conn;
+  return stats->circuit_bucket == 0 &&
+         concurrent_count >= dos_cc_min_concurrent_conn;
 }
 
 /* Mark client address by setting a timestamp in the stats object which tells
@@ -431,6 +487,241 @@ dos_is_enabled(void)
   return (dos_cc_enabled || dos_conn_enabled);
 }
 
+/* Client counting sketch private API. */
+
+/* Fill <b>idx_out</b> with the index of the counter for <b>addr</b> in each
+ * row of the sketch. We derive all the row hashes from one keyed hash of the
+ * address. */
+static void
+sketch_get_indices(const tor_addr_t *addr,
+                   uint32_t idx_out[DOS_SKETCH_DEPTH])
+{
+  uint64_t hash;
+  uint32_t h1, h2, mask;
+  unsigned i;
+
+  tor_assert(dos_sketch);
+
+  hash = tor_addr_keyed_hash(&dos_sketch->key, addr);
+  h1 = (uint32_t) hash;
+  /* Odd, so that the rows don't all land on the same column. */
+  h2 = (uint32_t) (hash >> 32) | 1;
+  mask = dos_sketch->width - 1;
+  for (i = 0; i < DOS_SKETCH_DEPTH; i++) {
+    idx_out[i] = i * dos_sketch->width + ((h1 + i * h2) & mask);
+  }
+}
+
+/* Return the smallest of the counters of <b>counts</b> at <b>idx</b>. */
+static uint32_t
+sketch_min_count(const uint32_t *counts,
+                 const uint32_t idx[DOS_SKETCH_DEPTH])
+{
+  uint32_t min = UINT32_MAX;
+  unsigned i;
+  for (i = 0; i < DOS_SKETCH_DEPTH; i++) {
+    min = MIN(min, counts[idx[i]]);
+  }
+  return min;
+}
+
+/* Add one connection to the count of <b>addr</b> in the connection sketch if
+ * <b>add</b> is true, else remove one. */
+static void
+sketch_update_conn_count(const tor_addr_t *addr, int add)
+{
+  uint32_t idx[DOS_SKETCH_DEPTH];
+  unsigned i;
+
+  sketch_get_indices(addr, idx);
+  for (i = 0; i < DOS_SKETCH_DEPTH; i++) {
+    uint32_t *count = &dos_sketch->conn_counts[idx[i]];
+    if (add) {
+      (*count)++;
+    } else if (!BUG(*count == 0)) {
+      /* Every counter of this address includes the connection we are
+       * removing, so it can't be zero. */
+      (*count)--;
+    }
+  }
+}
+
+/* Note a new circuit from <b>addr</b> in the circuit sketch and return the
+ * new estimate of its recent circuit count. We use a conservative update,
+ * only raising the counters that hold the current estimate, which keeps the
+ * overestimation from hash collisions smaller. */
+STATIC uint32_t
+dos_sketch_note_circuit(const tor_addr_t *addr)
+{
+  uint32_t idx[DOS_SKETCH_DEPTH];
+  uint32_t estimate;
+  unsigned i;
+
+  dos_sketch_decay(approx_time());
+
+  sketch_get_indices(addr, idx);
+  estimate = sketch_min_count(dos_sketch->circ_counts, idx);
+  if (estimate == UINT32_MAX) {
+    return estimate;
+  }
+  estimate++;
+  for (i = 0; i < DOS_SKETCH_DEPTH; i++) {
+    uint32_t *count = &dos_sketch->circ_counts[idx[i]];
+    *count = MAX(*count, estimate);
+  }
+  return estimate;
+}
+
+/* Return the circuit estimate at which an address becomes a heavy hitter and
+ * gets a geoip clientmap entry to keep its exact circuit bucket. A client
+ * that goes through its whole burst always reaches this. */
+static uint32_t
+sketch_get_promote_threshold(void)
+{
+  return MAX(1, dos_cc_circuit_burst / 2);
+}
+
+/* Free the sketch. Connections counted in it are forgotten: we won't try to
+ * remove them from a future sketch when they close. */
+static void
+sketch_free(void)
+{
+  if (dos_sketch == NULL) {
+    return;
+  }
+
+  SMARTLIST_FOREACH_BEGIN(get_connection_array(), connection_t *, conn) {
+    if (conn->type == CONN_TYPE_OR) {
+      TO_OR_CONN(conn)->tracked_in_dos_sketch = 0;
+    }
+  } SMARTLIST_FOREACH_END(conn);
+
+  tor_free(dos_sketch->conn_counts);
+  tor_free(dos_sketch->circ_counts);
+  tor_free(dos_sketch);
+}
+
+/* Allocate, resize or free the sketch according to the current parameters.
+ * A new sketch starts with the connections that the previous one, if any,
+ * was counting. The circuit counts start over. */
+static void
+sketch_configure(void)
+{
+  dos_sketch_t *sketch;
+
+  if (!dos_sketch_enabled || !dos_is_enabled()) {
+    sketch_free();
+    return;
+  }
+  if (dos_sketch && dos_sketch->width == dos_sketch_width) {
+    return;
+  }
+
+  sketch = tor_malloc_zero(sizeof(*sketch));
+  sketch->width = dos_sketch_width;
+  crypto_rand((char *) &sketch->key, sizeof(sketch->key));
+  sketch->conn_counts = tor_calloc((size_t) DOS_SKETCH_DEPTH * sketch->width,
+                                   sizeof(uint32_t));
+  sketch->circ_counts = tor_calloc((size_t) DOS_SKETCH_DEPTH * sketch->width,
+                                   sizeof(uint32_t));
+  sketch->last_decay_ts = approx_time();
+
+  if (dos_sketch) {
+    /* Resizing: move the connection counts over. */
+    tor_free(dos_sketch->conn_counts);
+    tor_free(dos_sketch->circ_counts);
+    tor_free(dos_sketch);
+    dos_sketch = sketch;
+    SMARTLIST_FOREACH_BEGIN(get_connection_array(), connection_t *, conn) {
+      if (conn->type == CONN_TYPE_OR &&
+          TO_OR_CONN(conn)->tracked_in_dos_sketch) {
+        sketch_update_conn_count(&TO_OR_CONN(conn)->real_addr, 1);
+      }
+    } SMARTLIST_FOREACH_END(conn);
+  } else {
+    dos_sketch = sketch;
+  }
+
+  log_info(LD_DOS, "Counting client addresses in a %" TOR_PRIuSZ
+           " byte sketch.", dos_sketch_get_allocation());
+}
+
+/* Return the concurrent connection estimate for <b>addr</b>. The sketch must
+ * be in use. */
+STATIC uint32_t
+dos_sketch_conn_estimate(const tor_addr_t *addr)
+{
+  uint32_t idx[DOS_SKETCH_DEPTH];
+  sketch_get_indices(addr, idx);
+  return sketch_min_count(dos_sketch->conn_counts, idx);
+}
+
+#ifdef TOR_UNIT_TESTS
+/* Return the recent circuit count estimate for <b>addr</b>. The sketch must
+ * be in use. */
+STATIC uint32_t
+dos_sketch_circ_estimate(const tor_addr_t *addr)
+{
+  uint32_t idx[DOS_SKETCH_DEPTH];
+  sketch_get_indices(addr, idx);
+  return sketch_min_count(dos_sketch->circ_counts, idx);
+}
+#endif /* defined(TOR_UNIT_TESTS) */
+
+/* Halve the circuit counts of the sketch once for every DOS_SKETCH_HALF_LIFE
+ * seconds that have gone by since we last did it. */
+STATIC void
+dos_sketch_decay(time_t now)
+{
+  int64_t periods;
+  size_t i, n_counts;
+  unsigned shift;
+
+  tor_assert(dos_sketch);
+
+  /* Our clock jumped backward, start counting from now. */
+  if (now < dos_sketch->last_decay_ts) {
+    dos_sketch->last_decay_ts = now;
+    return;
+  }
+  periods = ((int64_t) now - dos_sketch->last_decay_ts) /
+            DOS_SKETCH_HALF_LIFE;
+  if (periods == 0) {
+    return;
+  }
+
+  n_counts = (size_t) DOS_SKETCH_DEPTH * dos_sketch->width;
+  if (periods >= 32) {
+    memset(dos_sketch->circ_counts, 0, n_counts * sizeof(uint32_t));
+    dos_sketch->last_decay_ts = now;
+    return;
+  }
+  shift = (unsigned) periods;
+  for (i = 0; i < n_counts; i++) {
+    dos_sketch->circ_counts[i] >>= shift;
+  }
+  dos_sketch->last_decay_ts += periods * DOS_SKETCH_HALF_LIFE;
+}
+
+/* Return the number of bytes used by the sketch, or 0 if we have none. */
+STATIC size_t
+dos_sketch_get_allocation(void)
+{
+  if (dos_sketch == NULL) {
+    return 0;
+  }
+  return sizeof(*dos_sketch) +
+         2 * (size_t) DOS_SKETCH_DEPTH * dos_sketch->width * sizeof(uint32_t);
+}
+
+/* Return how many addresses the sketch has promoted to a geoip clientmap
+ * entry since startup. */
+STATIC uint64_t
+dos_sketch_get_n_promoted(void)
+{
+  return sketch_num_promoted_addrs;
+}
+
 /* Circuit creation public API. */
 
 /* Called when a CREATE cell is received from the given channel. */
@@ -439,6 +730,7 @@ dos_cc_new_create_cell(channel_t *chan)
 {
   tor_addr_t addr;
   clientmap_entry_t *entry;
+  uint32_t concurrent_count;
 
   tor_assert(chan);
 
@@ -456,13 +748,39 @@ dos_cc_new_create_cell(channel_t *chan)
     goto end;
   }
 
-  /* We are only interested in client connection from the geoip cache. */
-  entry = geoip_lookup_client(&addr, NULL, GEOIP_CLIENT_CONNECT);
-  if (entry == NULL) {
-    /* We can have a connection creating circuits but not tracked by the geoip
-     * cache. Once this DoS subsystem is enabled, we can end up here with no
-     * entry for the channel. */
-    goto end;
+  if (dos_sketch) {
+    /* Only heavy hitters get an entry in the geoip cache. Everyone else is
+     * well under the circuit rate, so there is nothing more to do. */
+    uint32_t sketch_count = dos_sketch_note_circuit(&addr);
+    if (sketch_count < sketch_get_promote_threshold()) {
+      goto end;
+    }
+    entry = geoip_lookup_client(&addr, NULL, GEOIP_CLIENT_CONNECT);
+    if (entry == NULL) {
+      entry = geoip_add_client(&addr, approx_time());
+      sketch_num_promoted_addrs++;
+      log_debug(LD_DOS, "Address %s is now a circuit creation heavy hitter.",
+                fmt_addr(&addr));
+    }
+    if (entry->dos_stats.cc_stats.last_circ_bucket_refill_ts == 0) {
+      /* The sketch already saw the circuits that made this address a heavy
+       * hitter: take them out of its first bucket, rather than giving it a
+       * whole new burst on top of them. This one is taken below. */
+      entry->dos_stats.cc_stats.circuit_bucket =
+        dos_cc_circuit_burst - MIN(sketch_count - 1, dos_cc_circuit_burst);
+      entry->dos_stats.cc_stats.last_circ_bucket_refill_ts = approx_time();
+    }
+    concurrent_count = dos_sketch_conn_estimate(&addr);
+  } else {
+    /* We are only interested in client connection from the geoip cache. */
+    entry = geoip_lookup_client(&addr, NULL, GEOIP_CLIENT_CONNECT);
+    if (entry == NULL) {
+      /* We can have a connection creating circuits but not tracked by the
+       * geoip cache. Once this DoS subsystem is enabled, we can end up here
+       * with no entry for the channel. */
+      goto end;
+    }
+    concurrent_count = entry->dos_stats.concurrent_count;
   }
 
   /* General comment. Even though the client can already be marked as
@@ -482,7 +800,8 @@ dos_cc_new_create_cell(channel_t *chan)
 
   /* This is the detection. Assess at every CREATE cell if the client should
    * get marked as malicious. This should be kept as fast as possible. */
-  if (cc_has_exhausted_circuits(&entry->dos_stats)) {
+  if (cc_has_exhausted_circuits(&entry->dos_stats.cc_stats,
+                                concurrent_count)) {
     /* If this is the first time we mark this entry, log it a info level.
      * Under heavy DDoS, logging each time we mark would results in lots and
      * lots of logs. */
@@ -532,6 +851,7 @@ dos_conn_defense_type_t
 dos_conn_addr_get_defense_type(const tor_addr_t *addr)
 {
   clientmap_entry_t *entry;
+  uint32_t concurrent_count;
 
   tor_assert(addr);
 
@@ -540,15 +860,20 @@ dos_conn_addr_get_defense_type(const tor_addr_t *addr)
     goto end;
   }
 
-  /* We are only interested in client connection from the geoip cache. */
-  entry = geoip_lookup_client(addr, NULL, GEOIP_CLIENT_CONNECT);
-  if (entry == NULL) {
-    goto end;
+  if (dos_sketch) {
+    concurrent_count = dos_sketch_conn_estimate(addr);
+  } else {
+    /* We are only interested in client connection from the geoip cache. */
+    entry = geoip_lookup_client(addr, NULL, GEOIP_CLIENT_CONNECT);
+    if (entry == NULL) {
+      goto end;
+    }
+    concurrent_count = entry->dos_stats.concurrent_count;
   }
 
   /* Need to be above the maximum concurrent connection count to trigger a
    * defense. */
-  if (entry->dos_stats.concurrent_count > dos_conn_max_concurrent_count) {
+  if (concurrent_count > dos_conn_max_concurrent_count) {
     conn_num_addr_rejected++;
     return dos_conn_defense_type;
   }
@@ -621,6 +946,14 @@ dos_should_refuse_single_hop_client(void)
                                        0 /* default */, 0, 1);
 }
 
+/* Return true iff the DoS mitigation subsystem needs a geoip cache entry for
+ * every client address. It doesn't when it counts clients in its sketch. */
+int
+dos_wants_client_entries(void)
+{
+  return dos_is_enabled() && dos_sketch == NULL;
+}
+
 /* Log a heartbeat message with some statistics. */
 void
 dos_log_heartbeat(void)
@@ -629,6 +962,7 @@ dos_log_heartbeat(void)
   char *cc_msg = NULL;
   char *single_hop_client_msg = NULL;
   char *circ_stats_msg = NULL;
+  char *memory_msg = NULL;
 
   /* Stats number coming from relay.c append_cell_to_circuit_queue(). */
   tor_asprintf(&circ_stats_msg,
@@ -654,17 +988,32 @@ dos_log_heartbeat(void)
                  num_single_hop_client_refused);
   }
 
+  if (dos_sketch) {
+    tor_asprintf(&memory_msg,
+                 " Client sketch uses %" TOR_PRIuSZ " kB, client cache %"
+                 TOR_PRIuSZ " kB, %" PRIu64 " heavy hitters promoted.",
+                 dos_sketch_get_allocation() / 1024,
+                 geoip_client_cache_total_allocation() / 1024,
+                 dos_sketch_get_n_promoted());
+  } else {
+    tor_asprintf(&memory_msg,
+                 " Client cache uses %" TOR_PRIuSZ " kB.",
+                 geoip_client_cache_total_allocation() / 1024);
+  }
+
   log_notice(LD_HEARTBEAT,
-             "DoS mitigation since startup:%s%s%s%s",
+             "DoS mitigation since startup:%s%s%s%s%s",
              circ_stats_msg,
              (cc_msg != NULL) ? cc_msg : " [cc not enabled]",
              (conn_msg != NULL) ? conn_msg : " [conn not enabled]",
-             (single_hop_client_msg != NULL) ? single_hop_client_msg : "");
+             (single_hop_client_msg != NULL) ? single_hop_client_msg : "",
+             memory_msg);
 
   tor_free(conn_msg);
   tor_free(cc_msg);
   tor_free(single_hop_client_msg);
   tor_free(circ_stats_msg);
+  tor_free(memory_msg);
   return;
 }
 
@@ -691,6 +1040,12 @@ dos_new_client_conn(or_connection_t *or_conn)
     goto end;
   }
 
+  if (dos_sketch) {
+    sketch_update_conn_count(&or_conn->real_addr, 1);
+    or_conn->tracked_in_dos_sketch = 1;
+    goto end;
+  }
+
   /* We are only interested in client connection from the geoip cache. */
   entry = geoip_lookup_client(&or_conn->real_addr, NULL,
                               GEOIP_CLIENT_CONNECT);
@@ -718,6 +1073,15 @@ dos_close_client_conn(const or_connection_t *or_conn)
 
   tor_assert(or_conn);
 
+  /* The flag is only set while the sketch that counted this connection is in
+   * use: freeing the sketch clears it. */
+  if (or_conn->tracked_in_dos_sketch) {
+    if (!BUG(dos_sketch == NULL)) {
+      sketch_update_conn_count(&or_conn->real_addr, 0);
+    }
+    goto end;
+  }
+
   /* We have to decrement the count on tracked connection only even if the
    * subsystem has been disabled at runtime because it might be re-enabled
    * after and we need to keep a synchronized counter at all time. */
@@ -770,6 +1134,7 @@ dos_consensus_has_changed(const networkstatus_t *ns)
   /* We were already enabled or we just became enabled but either way, set the
    * consensus parameters for all subsystems. */
   set_dos_parameters(ns);
+  sketch_configure();
 }
 
 /* Return true iff the DoS mitigation subsystem is enabled. */
@@ -790,12 +1155,18 @@ dos_free_all(void)
   /* Free the connection mitigation subsystem. It is safe to do this even if
    * it wasn't initialized. */
   conn_free_all();
+
+  /* Free the client counting sketch. */
+  sketch_free();
+  dos_sketch_enabled = 0;
 }
 
 /* Initialize the Denial of Service subsystem. */
 void
 dos_init(void)
 {
-  /* To initialize, we only need to get the parameters. */
+  /* To initialize, we only need to get the parameters and set up the sketch
+   * if they ask for one. */
   set_dos_parameters(NULL);
+  sketch_configure();
 }
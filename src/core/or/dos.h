@@ -9,6 +9,8 @@
 #ifndef TOR_DOS_H
 #define TOR_DOS_H
 
+#include "ext/siphash.h"
+
 /* Structure that keeps stats of client connection per-IP. */
 typedef struct cc_client_stats_t {
   /* Number of allocated circuits remaining for this address.  It is
@@ -59,6 +61,21 @@ void dos_close_client_conn(const or_connection_t *or_conn);
 int dos_should_refuse_single_hop_client(void);
 void dos_note_refuse_single_hop_client(void);
 
+int dos_wants_client_entries(void);
+
+/*
+ * Client counting sketch interface.
+ */
+
+/* DoSUseSketch default. Disabled by default. */
+#define DOS_SKETCH_ENABLED_DEFAULT 0
+/* DoSSketchWidth default. This is the number of counters in each row of the
+ * sketch, so with 4 rows and two sketches, 8192 uses 256 KB. */
+#define DOS_SKETCH_WIDTH_DEFAULT 8192
+/* Boundaries of DoSSketchWidth. */
+#define DOS_SKETCH_WIDTH_MIN 256
+#define DOS_SKETCH_WIDTH_MAX (1 << 20)
+
 /*
  * Circuit creation DoS mitigation subsystemn interface.
  */
@@ -119,6 +136,43 @@ dos_conn_defense_type_t dos_conn_addr_get_defense_type(const tor_addr_t *addr);
 
 #ifdef DOS_PRIVATE
 
+/* Number of rows in the count-min sketches, each using its own hash of the
+ * address. A row count of 4 bounds the chance that the estimate for an address
+ * is off by more than e/width of the total count to under 2%. */
+#define DOS_SKETCH_DEPTH 4
+/* Every this many seconds, we halve all counters of the circuit sketch so it
+ * reflects the recent circuit creation rate of an address. */
+#define DOS_SKETCH_HALF_LIFE 30
+
+/* Fixed size replacement for the per-address DoS statistics. An address only
+ * gets a geoip clientmap entry once its circuit estimate says that it is a
+ * heavy hitter. Everything runs on the main thread, so counters are updated
+ * in place without any locking. */
+typedef struct dos_sketch_t {
+  /* Number of counters in each row. Always a power of two. */
+  uint32_t width;
+  /* Random key for hashing addresses so that clients can't pick addresses
+   * which collide on purpose. */
+  struct sipkey key;
+  /* DOS_SKETCH_DEPTH rows of concurrent connection counts. Incremented when a
+   * client connection opens and decremented when it closes. */
+  uint32_t *conn_counts;
+  /* DOS_SKETCH_DEPTH rows of circuit creation counts, decayed over time. */
+  uint32_t *circ_counts;
+  /* When did we last halve the circuit counts? */
+  time_t last_decay_ts;
+} dos_sketch_t;
+
+STATIC uint32_t get_param_sketch_width(const networkstatus_t *ns);
+STATIC uint32_t dos_sketch_conn_estimate(const tor_addr_t *addr);
+STATIC uint32_t dos_sketch_note_circuit(const tor_addr_t *addr);
+STATIC void dos_sketch_decay(time_t now);
+STATIC size_t dos_sketch_get_allocation(void);
+STATIC uint64_t dos_sketch_get_n_promoted(void);
+#ifdef TOR_UNIT_TESTS
+STATIC uint32_t dos_sketch_circ_estimate(const tor_addr_t *addr);
+#endif
+
 STATIC uint32_t get_param_conn_max_concurrent_count(
                                               const networkstatus_t *ns);
 STATIC uint32_t get_param_cc_circuit_burst(const networkstatus_t *ns);
@@ -133,6 +187,8 @@ MOCK_DECL(STATIC unsigned int, get_param_cc_enabled,
           (const networkstatus_t *ns));
 MOCK_DECL(STATIC unsigned int, get_param_conn_enabled,
           (const networkstatus_t *ns));
+MOCK_DECL(STATIC unsigned int, get_param_sketch_enabled,
+          (const networkstatus_t *ns));
 
 #endif /* TOR_DOS_PRIVATE */
 
@@ -27,6 +27,16 @@ struct or_circuit_t {
    * safe to free a circuit or if it is still in use by a cpuworker. */
   struct workqueue_entry_s *workqueue_entry;
 
+  /** If we are decrypting forward relay cells on the relay shard threads,
+   * the batch of cells that a shard thread is working on now, if any.  Used
+   * only in relay_shard.c. */
+  struct relay_shard_job_t *shard_job;
+  /** Batches of forward relay cells waiting for <b>shard_job</b> to finish,
+   * oldest first.  Used only in relay_shard.c. */
+  smartlist_t *shard_pending;
+  /** How many cells are in <b>shard_job</b> and <b>shard_pending</b>? */
+  int shard_n_cells;
+
   /** The circuit_id used in the previous (backward) hop of this circuit. */
   circid_t p_circ_id;
   /** Queue of cells waiting to be transmitted on p_conn. */
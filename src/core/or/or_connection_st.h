@@ -9,6 +9,7 @@
 
 #include "core/or/connection_st.h"
 #include "lib/evloop/token_bucket.h"
+#include "lib/tls/buffers_tls.h"
 
 struct tor_tls_t;
 
@@ -67,6 +68,9 @@ struct or_connection_t {
    * geoip cache and handled by the DoS mitigation subsystem. We use this to
    * insure we have a coherent count of concurrent connection. */
   unsigned int tracked_for_dos_mitigation : 1;
+  /** True iff this is a client connection that the DoS mitigation subsystem
+   * has counted in its connection sketch instead of the geoip cache. */
+  unsigned int tracked_in_dos_sketch : 1;
 
   uint16_t link_proto; /**< What protocol version are we using? 0 for
                         * "none negotiated yet." */
@@ -87,6 +91,11 @@ struct or_connection_t {
    * bytes TLS actually sent - used for overhead estimation for scheduling.
    */
   uint64_t bytes_xmitted, bytes_xmitted_by_tls;
+
+  /** How many times have we flushed data onto this connection's TLS
+   * object, and how many TLS records, carrying how many bytes, did those
+   * flushes write? */
+  tls_flush_stats_t tls_flush_stats;
 };
 
 #endif
@@ -1547,6 +1547,691 @@ compare_tor_addr_to_addr_policy,(const tor_addr_t *addr, uint16_t port,
   }
 }
 
+/** The largest policy that compiled_policy_get() will compile.  Both the
+ * port table and the tries keep a bitmap of every entry for each port range
+ * or trie node, so a compiled policy with n entries can take about n*n/2
+ * bytes; at this size that's about 32 KB. */
+#define COMPILED_POLICY_MAX_ENTRIES 256
+
+/** How many 64-bit words a compiled policy with <b>n</b> entries needs for
+ * a bitmap with one bit per entry. */
+#define COMPILED_POLICY_N_WORDS(n) ((n) ? (((n) + 63) / 64) : 1)
+
+/** A value for bits_offset meaning "no bitmap". */
+#define POLICY_TRIE_NO_BITS UINT32_MAX
+
+/** An address, or an address prefix, as a 128-bit big-endian number.  IPv4
+ * addresses use the top 32 bits. */
+typedef struct policy_trie_key_t {
+  uint64_t hi, lo;
+} policy_trie_key_t;
+
+/** One node in a policy_trie_t.  The trie is path-compressed: we only keep
+ * the root, nodes where some entry's prefix ends, and nodes where the trie
+ * branches. */
+typedef struct policy_trie_node_t {
+  /** The address prefix of this node: its first <b>depth</b> bits. */
+  policy_trie_key_t prefix;
+  /** Indices of this node's children for a 0 bit and a 1 bit at position
+   * <b>depth</b>, or 0 if there is no such child.  (Node 0 is the root, so
+   * it is nobody's child.) */
+  uint32_t child[2];
+  /** Offset into the trie's <b>bits</b> of a bitmap of the policy entries
+   * whose address prefix is exactly this node's prefix, or
+   * POLICY_TRIE_NO_BITS. */
+  uint32_t bits_offset;
+  /** How many bits long is this node's prefix? */
+  uint32_t depth;
+} policy_trie_node_t;
+
+/** A trie of the address prefixes in a policy, for one address family.
+ * Walking down it along the bits of an address visits exactly the nodes
+ * whose prefixes match that address, and maybe one more that doesn't. */
+typedef struct policy_trie_t {
+  /** Array of <b>n_nodes</b> nodes in depth-first order, or NULL if the
+   * policy has no entries for this family. */
+  const policy_trie_node_t *nodes;
+  uint32_t n_nodes;
+  /** The bitmaps that the nodes point to. */
+  const uint64_t *bits;
+} policy_trie_t;
+
+/** One node of a policy_trie_builder_t. */
+typedef struct policy_trie_builder_node_t {
+  /** Children for a 0 bit and a 1 bit, or 0 for none. */
+  uint32_t child[2];
+  /** As for policy_trie_node_t.bits_offset. */
+  uint32_t bits_offset;
+} policy_trie_builder_node_t;
+
+/** An uncompressed binary trie that we build a policy_trie_t from. */
+typedef struct policy_trie_builder_t {
+  /** Array of <b>n_nodes</b> nodes, with room for
+   * <b>n_nodes_allocated</b>. */
+  policy_trie_builder_node_t *nodes;
+  uint32_t n_nodes, n_nodes_allocated;
+  /** Array of bitmaps, <b>n_bits_words</b> words long in total, with room
+   * for <b>n_bits_allocated</b>. */
+  uint64_t *bits;
+  uint32_t n_bits_words, n_bits_allocated;
+  /** Compressed nodes: <b>n_out</b> of them, with room for
+   * <b>n_out_allocated</b>. */
+  policy_trie_node_t *out;
+  uint32_t n_out, n_out_allocated;
+  /** The bitmaps for the compressed nodes, in the same order as the nodes,
+   * <b>n_out_bits_words</b> words long in total. */
+  uint64_t *out_bits;
+  uint32_t n_out_bits_words;
+} policy_trie_builder_t;
+
+/** The port half of a compiled policy.  We split the port space into
+ * ranges that no entry's port range starts or ends inside of, and keep a
+ * bitmap of the entries that cover each range.
+ *
+ * Port tables only depend on the ports and actions of a policy's entries,
+ * so we share them between compiled policies in port_table_map.  Most
+ * relays' exit policies differ only in which addresses they reject, so there
+ * are far fewer port tables than policies, and they stay in the cache. */
+typedef struct policy_port_table_t {
+  HT_ENTRY(policy_port_table_t) node;
+  /** How many compiled policies use this table? */
+  int refcnt;
+  /** How many 64-bit words are in each bitmap? */
+  unsigned n_words;
+  /** How many port ranges are there? */
+  unsigned n_port_ranges;
+  /** The first port in each port range, in ascending order.  The first
+   * range always starts at 0. */
+  const uint16_t *port_range_start;
+  /** A bitmap of the entries that accept. */
+  const uint64_t *accept_bits;
+  /** For each port range, a bitmap of the entries whose ports cover it. */
+  const uint64_t *port_bits;
+  /** How many words of <b>storage</b> are there? */
+  size_t n_storage_words;
+  /** Storage for all of the tables above. */
+  uint64_t storage[FLEXIBLE_ARRAY_MEMBER];
+} policy_port_table_t;
+
+/** Return a hashcode for <b>t</b>. */
+static unsigned int
+policy_port_table_hash(const policy_port_table_t *t)
+{
+  return (unsigned) siphash24g(t->storage,
+                               t->n_storage_words * sizeof(uint64_t));
+}
+
+/** Return true iff <b>a</b> and <b>b</b> hold the same tables. */
+static inline int
+policy_port_table_eq(const policy_port_table_t *a,
+                     const policy_port_table_t *b)
+{
+  return a->n_words == b->n_words &&
+    a->n_port_ranges == b->n_port_ranges &&
+    a->n_storage_words == b->n_storage_words &&
+    fast_memeq(a->storage, b->storage,
+               a->n_storage_words * sizeof(uint64_t));
+}
+
+/** Map holding every port table that some compiled policy uses. */
+static HT_HEAD(port_table_map, policy_port_table_t) port_table_root =
+  HT_INITIALIZER();
+
+HT_PROTOTYPE(port_table_map, policy_port_table_t, node,
+             policy_port_table_hash, policy_port_table_eq)
+HT_GENERATE2(port_table_map, policy_port_table_t, node,
+             policy_port_table_hash, policy_port_table_eq, 0.6,
+             tor_reallocarray_, tor_free_)
+
+/** An address policy, compiled into tables that let us find its first
+ * matching entry for a known address and port without walking the whole
+ * policy.
+ *
+ * Besides its port table, we keep a trie of the entries' address prefixes
+ * for each family, with a bitmap of the entries that end at each node.  The
+ * first matching entry is then the lowest bit set both in the bitmap for
+ * the port's range and in a bitmap on the address's path through the trie.
+ *
+ * Compiled policies are shared and reference-counted: since the entries of
+ * a policy are canonicalized through policy_map, two policies are equal iff
+ * they have the same list of canonical entries, and that list is our key in
+ * compiled_policy_map. */
+struct compiled_policy_t {
+  /** The port table for this policy. */
+  policy_port_table_t *ports;
+  /** Address prefix tries for IPv4 and IPv6 entries. */
+  policy_trie_t trie4, trie6;
+
+  HT_ENTRY(compiled_policy_t) node;
+  /** How many users does this compiled policy have? */
+  int refcnt;
+  /** The entries of this policy, in order.  We hold a reference to each of
+   * these canonical entries. */
+  smartlist_t *entries;
+
+  /** Storage for the tries.  We keep them together so that evaluating a
+   * policy touches as little memory as we can manage. */
+  uint64_t storage[FLEXIBLE_ARRAY_MEMBER];
+};
+
+/** Return a hashcode for the entries of <b>cp</b>. */
+static unsigned int
+compiled_policy_hash(const compiled_policy_t *cp)
+{
+  return (unsigned) siphash24g(cp->entries->list,
+                               smartlist_len(cp->entries) * sizeof(void*));
+}
+
+/** Return true iff <b>a</b> and <b>b</b> have the same canonical
+ * entries. */
+static inline int
+compiled_policy_eq(const compiled_policy_t *a, const compiled_policy_t *b)
+{
+  return smartlist_len(a->entries) == smartlist_len(b->entries) &&
+    fast_memeq(a->entries->list, b->entries->list,
+               smartlist_len(a->entries) * sizeof(void*));
+}
+
+/** Map from lists of canonical entries to the compiled policies for them. */
+static HT_HEAD(compiled_policy_map, compiled_policy_t) compiled_policy_root =
+  HT_INITIALIZER();
+
+HT_PROTOTYPE(compiled_policy_map, compiled_policy_t, node,
+             compiled_policy_hash, compiled_policy_eq)
+HT_GENERATE2(compiled_policy_map, compiled_policy_t, node,
+             compiled_policy_hash, compiled_policy_eq, 0.6,
+             tor_reallocarray_, tor_free_)
+
+/** Helper for qsort: compare two uint16_t values. */
+static int
+compare_uint16_(const void *a, const void *b)
+{
+  uint16_t x = *(const uint16_t *)a, y = *(const uint16_t *)b;
+  return (x > y) - (x < y);
+}
+
+/** Set <b>key_out</b> to the address in <b>addr</b>, and return the number
+ * of bits in it.  Return 0 if <b>addr</b> isn't IPv4 or IPv6. */
+static unsigned
+policy_trie_key_from_addr(policy_trie_key_t *key_out, const tor_addr_t *addr)
+{
+  switch (tor_addr_family(addr)) {
+    case AF_INET:
+      key_out->hi = ((uint64_t) tor_addr_to_ipv4h(addr)) << 32;
+      key_out->lo = 0;
+      return 32;
+    case AF_INET6: {
+      const uint8_t *bytes = tor_addr_to_in6_addr8(addr);
+      key_out->hi = tor_ntohll(get_uint64(bytes));
+      key_out->lo = tor_ntohll(get_uint64(bytes + 8));
+      return 128;
+    }
+    default:
+      return 0;
+  }
+}
+
+/** Return bit number <b>idx</b> of <b>key</b>, counting from the most
+ * significant. */
+static inline int
+policy_trie_key_bit(const policy_trie_key_t *key, unsigned idx)
+{
+  if (idx < 64)
+    return (key->hi >> (63 - idx)) & 1;
+  else
+    return (key->lo >> (127 - idx)) & 1;
+}
+
+/** Return true iff the first <b>depth</b> bits of <b>a</b> and <b>b</b> are
+ * the same. */
+static inline int
+policy_trie_key_prefix_eq(const policy_trie_key_t *a,
+                          const policy_trie_key_t *b, unsigned depth)
+{
+  if (depth == 0)
+    return 1;
+  else if (depth <= 64)
+    return ((a->hi ^ b->hi) >> (64 - depth)) == 0;
+  else
+    return a->hi == b->hi && ((a->lo ^ b->lo) >> (128 - depth)) == 0;
+}
+
+/** Add entry number <b>idx</b>, whose address prefix is the first
+ * <b>maskbits</b> bits of <b>key</b>, to <b>trie</b>.  Each bitmap in the
+ * trie is <b>n_words</b> words long. */
+static void
+policy_trie_builder_add(policy_trie_builder_t *trie,
+                        const policy_trie_key_t *key,
+                        unsigned maskbits, int idx, unsigned n_words)
+{
+  uint32_t node = 0;
+  unsigned depth;
+  policy_trie_builder_node_t *nd;
+
+  if (trie->n_nodes == 0) {
+    trie->n_nodes_allocated = 64;
+    trie->nodes = tor_calloc(trie->n_nodes_allocated, sizeof(*trie->nodes));
+    trie->nodes[0].bits_offset = POLICY_TRIE_NO_BITS;
+    trie->n_nodes = 1;
+  }
+
+  for (depth = 0; depth < maskbits; ++depth) {
+    int bit = policy_trie_key_bit(key, depth);
+    uint32_t next = trie->nodes[node].child[bit];
+    if (!next) {
+      if (trie->n_nodes == trie->n_nodes_allocated) {
+        trie->n_nodes_allocated *= 2;
+        trie->nodes = tor_reallocarray(trie->nodes, trie->n_nodes_allocated,
+                                       sizeof(*trie->nodes));
+      }
+      next = trie->n_nodes++;
+      memset(&trie->nodes[next], 0, sizeof(trie->nodes[next]));
+      trie->nodes[next].bits_offset = POLICY_TRIE_NO_BITS;
+      trie->nodes[node].child[bit] = next;
+    }
+    node = next;
+  }
+
+  nd = &trie->nodes[node];
+  if (nd->bits_offset == POLICY_TRIE_NO_BITS) {
+    if (trie->n_bits_words + n_words > trie->n_bits_allocated) {
+      trie->n_bits_allocated = MAX(trie->n_bits_allocated * 2,
+                                   trie->n_bits_words + n_words);
+      trie->bits = tor_reallocarray(trie->bits, trie->n_bits_allocated,
+                                    sizeof(uint64_t));
+    }
+    nd->bits_offset = trie->n_bits_words;
+    memset(&trie->bits[nd->bits_offset], 0, n_words * sizeof(uint64_t));
+    trie->n_bits_words += n_words;
+  }
+  trie->bits[nd->bits_offset + idx / 64] |= UINT64_C(1) << (idx % 64);
+}
+
+/** Append the compressed form of the subtrie at <b>node</b> in
+ * <b>trie</b>, whose prefix is the first <b>depth</b> bits of
+ * <b>prefix</b>, to trie->out, and its bitmaps to trie->out_bits.  Each
+ * bitmap is <b>n_words</b> words long.  Return the index of its top
+ * node. */
+static uint32_t
+policy_trie_builder_compress(policy_trie_builder_t *trie, uint32_t node,
+                             policy_trie_key_t prefix, unsigned depth,
+                             unsigned n_words)
+{
+  const policy_trie_builder_node_t *nd = &trie->nodes[node];
+  uint32_t out_idx;
+  int bit;
+
+  /* Skip over nodes that have one child and no entries. */
+  while (node != 0 && nd->bits_offset == POLICY_TRIE_NO_BITS &&
+         !(nd->child[0] && nd->child[1])) {
+    bit = nd->child[1] ? 1 : 0;
+    if (bit) {
+      if (depth < 64)
+        prefix.hi |= UINT64_C(1) << (63 - depth);
+      else
+        prefix.lo |= UINT64_C(1) << (127 - depth);
+    }
+    node = nd->child[bit];
+    nd = &trie->nodes[node];
+    ++depth;
+  }
+
+  if (trie->n_out == trie->n_out_allocated) {
+    trie->n_out_allocated = trie->n_out_allocated ?
+      trie->n_out_allocated * 2 : 16;
+    trie->out = tor_reallocarray(trie->out, trie->n_out_allocated,
+                                 sizeof(*trie->out));
+  }
+  out_idx = trie->n_out++;
+  memset(&trie->out[out_idx], 0, sizeof(trie->out[out_idx]));
+  trie->out[out_idx].prefix = prefix;
+  trie->out[out_idx].depth = depth;
+  trie->out[out_idx].bits_offset = POLICY_TRIE_NO_BITS;
+  if (nd->bits_offset != POLICY_TRIE_NO_BITS) {
+    if (!trie->out_bits)
+      trie->out_bits = tor_calloc(trie->n_bits_words, sizeof(uint64_t));
+    memcpy(trie->out_bits + trie->n_out_bits_words,
+           trie->bits + nd->bits_offset, n_words * sizeof(uint64_t));
+    trie->out[out_idx].bits_offset = trie->n_out_bits_words;
+    trie->n_out_bits_words += n_words;
+  }
+
+  for (bit = 0; bit < 2; ++bit) {
+    policy_trie_key_t child_prefix = prefix;
+    uint32_t child_idx;
+    if (!nd->child[bit])
+      continue;
+    if (bit) {
+      if (depth < 64)
+        child_prefix.hi |= UINT64_C(1) << (63 - depth);
+      else
+        child_prefix.lo |= UINT64_C(1) << (127 - depth);
+    }
+    child_idx = policy_trie_builder_compress(trie, nd->child[bit],
+                                             child_prefix, depth + 1,
+                                             n_words);
+    /* Don't use nd here: the recursive call may have moved it. */
+    trie->out[out_idx].child[bit] = child_idx;
+  }
+  return out_idx;
+}
+
+/** Release all storage held in <b>trie</b>. */
+static void
+policy_trie_builder_clear(policy_trie_builder_t *trie)
+{
+  tor_free(trie->nodes);
+  tor_free(trie->bits);
+  tor_free(trie->out);
+  tor_free(trie->out_bits);
+  memset(trie, 0, sizeof(*trie));
+}
+
+/** How many 64-bit words do we need to store the trie built by
+ * <b>trie</b>? */
+static size_t
+policy_trie_builder_n_words(const policy_trie_builder_t *trie)
+{
+  return trie->n_out_bits_words +
+    (trie->n_out * sizeof(policy_trie_node_t) + 7) / 8;
+}
+
+/** Copy the trie built by <b>src</b> into <b>dst</b>, putting its tables
+ * at *<b>storagep</b>, and advance *<b>storagep</b> past them. */
+static void
+policy_trie_builder_pack(policy_trie_t *dst,
+                         const policy_trie_builder_t *src,
+                         uint64_t **storagep)
+{
+  uint64_t *storage = *storagep;
+
+  /* The root's bitmap comes first, so it's likely to share a cache line
+   * with the root. */
+  if (src->n_out_bits_words)
+    memcpy(storage, src->out_bits, src->n_out_bits_words * sizeof(uint64_t));
+  dst->bits = storage;
+  storage += src->n_out_bits_words;
+  dst->n_nodes = src->n_out;
+  if (src->n_out) {
+    memcpy(storage, src->out, src->n_out * sizeof(policy_trie_node_t));
+    dst->nodes = (const policy_trie_node_t *) storage;
+  }
+  storage += (src->n_out * sizeof(policy_trie_node_t) + 7) / 8;
+  *storagep = storage;
+}
+
+/** Return a port table for <b>entries</b>, a list of policy entries,
+ * using one that we already have if we can.  Each bitmap in it is
+ * <b>n_words</b> long. */
+static policy_port_table_t *
+policy_port_table_get(const smartlist_t *entries, unsigned n_words)
+{
+  const int n = smartlist_len(entries);
+  policy_port_table_t *t, *found;
+  uint16_t *starts;
+  uint64_t *storage, *bits;
+  unsigned i, n_starts = 0, n_ranges;
+  size_t starts_words;
+
+  /* Every port range starts at 0, at some entry's prt_min, or just after
+   * some entry's prt_max. */
+  starts = tor_calloc(2 * n + 1, sizeof(uint16_t));
+  starts[n_starts++] = 0;
+  SMARTLIST_FOREACH_BEGIN(entries, const addr_policy_t *, e) {
+    starts[n_starts++] = e->prt_min;
+    if (e->prt_max < 65535)
+      starts[n_starts++] = e->prt_max + 1;
+  } SMARTLIST_FOREACH_END(e);
+  qsort(starts, n_starts, sizeof(uint16_t), compare_uint16_);
+  n_ranges = 1;
+  for (i = 1; i < n_starts; ++i) {
+    if (starts[i] != starts[n_ranges - 1])
+      starts[n_ranges++] = starts[i];
+  }
+
+  /* Lay the tables out in the order that lookups use them. */
+  starts_words = (n_ranges * sizeof(uint16_t) + 7) / 8;
+  t = tor_malloc_zero(offsetof(policy_port_table_t, storage) +
+                      (starts_words + (n_ranges + 1) * n_words) *
+                      sizeof(uint64_t));
+  t->n_words = n_words;
+  t->n_port_ranges = n_ranges;
+  t->n_storage_words = starts_words + (n_ranges + 1) * n_words;
+  storage = t->storage;
+
+  memcpy(storage, starts, n_ranges * sizeof(uint16_t));
+  t->port_range_start = (const uint16_t *) storage;
+  storage += starts_words;
+
+  t->accept_bits = bits = storage;
+  SMARTLIST_FOREACH_BEGIN(entries, const addr_policy_t *, e) {
+    if (e->policy_type == ADDR_POLICY_ACCEPT)
+      bits[e_sl_idx / 64] |= UINT64_C(1) << (e_sl_idx % 64);
+  } SMARTLIST_FOREACH_END(e);
+  storage += n_words;
+
+  t->port_bits = bits = storage;
+  for (i = 0; i < n_ranges; ++i, bits += n_words) {
+    SMARTLIST_FOREACH_BEGIN(entries, const addr_policy_t *, e) {
+      if (e->prt_min <= starts[i] && starts[i] <= e->prt_max)
+        bits[e_sl_idx / 64] |= UINT64_C(1) << (e_sl_idx % 64);
+    } SMARTLIST_FOREACH_END(e);
+  }
+  tor_free(starts);
+
+  found = HT_FIND(port_table_map, &port_table_root, t);
+  if (found) {
+    tor_free(t);
+    t = found;
+  } else {
+    HT_INSERT(port_table_map, &port_table_root, t);
+  }
+  ++t->refcnt;
+  return t;
+}
+
+/** Release a reference to <b>t</b>, and free it if that was the last
+ * one. */
+static void
+policy_port_table_free(policy_port_table_t *t)
+{
+  if (!t || --t->refcnt > 0)
+    return;
+  HT_REMOVE(port_table_map, &port_table_root, t);
+  tor_free(t);
+}
+
+/** Build and return a new compiled policy for <b>entries</b>, a list of
+ * canonical entries that we already hold references to.  The new compiled
+ * policy takes ownership of <b>entries</b>. */
+static compiled_policy_t *
+compiled_policy_build(smartlist_t *entries)
+{
+  const unsigned n_words = COMPILED_POLICY_N_WORDS(smartlist_len(entries));
+  compiled_policy_t *cp;
+  policy_trie_builder_t trie4, trie6;
+  policy_trie_key_t zero;
+  uint64_t *storage;
+  size_t n_storage_words;
+
+  memset(&trie4, 0, sizeof(trie4));
+  memset(&trie6, 0, sizeof(trie6));
+  memset(&zero, 0, sizeof(zero));
+
+  SMARTLIST_FOREACH_BEGIN(entries, const addr_policy_t *, e) {
+    policy_trie_key_t key;
+    unsigned addr_bits = policy_trie_key_from_addr(&key, &e->addr);
+    if (addr_bits == 0) {
+      /* This entry can't match any address we look up here. */
+      log_warn(LD_BUG, "Policy contains an address with family %d, which "
+               "only matches addresses of that family.",
+               (int)tor_addr_family(&e->addr));
+      continue;
+    }
+    policy_trie_builder_add(addr_bits == 32 ? &trie4 : &trie6, &key,
+                            MIN(e->maskbits, addr_bits), e_sl_idx, n_words);
+  } SMARTLIST_FOREACH_END(e);
+  if (trie4.n_nodes)
+    policy_trie_builder_compress(&trie4, 0, zero, 0, n_words);
+  if (trie6.n_nodes)
+    policy_trie_builder_compress(&trie6, 0, zero, 0, n_words);
+
+  n_storage_words = policy_trie_builder_n_words(&trie4) +
+    policy_trie_builder_n_words(&trie6);
+  cp = tor_malloc_zero(offsetof(compiled_policy_t, storage) +
+                       n_storage_words * sizeof(uint64_t));
+  cp->entries = entries;
+  cp->ports = policy_port_table_get(entries, n_words);
+  storage = cp->storage;
+  policy_trie_builder_pack(&cp->trie4, &trie4, &storage);
+  policy_trie_builder_pack(&cp->trie6, &trie6, &storage);
+  tor_assert(storage == cp->storage + n_storage_words);
+
+  policy_trie_builder_clear(&trie4);
+  policy_trie_builder_clear(&trie6);
+  return cp;
+}
+
+/** Return a compiled version of <b>policy</b>, or NULL if <b>policy</b> is
+ * NULL or has more than COMPILED_POLICY_MAX_ENTRIES entries.  If we already
+ * have a compiled version of an equal policy, return that one.  The caller
+ * must release the result with compiled_policy_free().
+ *
+ * Callers must fall back to compare_tor_addr_to_addr_policy() when this
+ * returns NULL for a non-NULL policy. */
+compiled_policy_t *
+compiled_policy_get(const smartlist_t *policy)
+{
+  compiled_policy_t search, *found;
+  smartlist_t *entries;
+
+  if (!policy)
+    return NULL;
+  /* The tables grow with the square of the number of entries, and we
+   * compile policies from descriptors that anybody can upload. */
+  if (smartlist_len(policy) > COMPILED_POLICY_MAX_ENTRIES)
+    return NULL;
+
+  entries = smartlist_new();
+  SMARTLIST_FOREACH_BEGIN(policy, addr_policy_t *, e) {
+    addr_policy_t *ce = addr_policy_get_canonical_entry(e);
+    if (ce == e)
+      ++ce->refcnt; /* The canonical entry didn't count this reference. */
+    smartlist_add(entries, ce);
+  } SMARTLIST_FOREACH_END(e);
+
+  search.entries = entries;
+  found = HT_FIND(compiled_policy_map, &compiled_policy_root, &search);
+  if (found) {
+    addr_policy_list_free(entries);
+  } else {
+    found = compiled_policy_build(entries);
+    HT_INSERT(compiled_policy_map, &compiled_policy_root, found);
+  }
+  ++found->refcnt;
+  return found;
+}
+
+/** Release a reference to <b>cp</b>, and free it if that was the last
+ * one. */
+void
+compiled_policy_free_(compiled_policy_t *cp)
+{
+  if (!cp)
+    return;
+  if (--cp->refcnt > 0)
+    return;
+
+  HT_REMOVE(compiled_policy_map, &compiled_policy_root, cp);
+  addr_policy_list_free(cp->entries);
+  policy_port_table_free(cp->ports);
+  tor_free(cp);
+}
+
+/** Helper for compare_tor_addr_to_compiled_policy.  Implements the case
+ * where addr and port are both known, and addr is IPv4 or IPv6. */
+static addr_policy_result_t
+compare_known_tor_addr_to_compiled_policy(const policy_trie_key_t *key,
+                                          unsigned addr_bits,
+                                          const policy_trie_t *trie,
+                                          uint16_t port,
+                                          const compiled_policy_t *cp)
+{
+  const policy_port_table_t *ports = cp->ports;
+  const unsigned n_words = ports->n_words;
+  const uint64_t *port_bits;
+  unsigned lo = 0, hi = ports->n_port_ranges;
+  uint32_t node = 0;
+  int best = -1;
+
+  /* Find the last range that starts at or before port. */
+  while (hi - lo > 1) {
+    unsigned mid = lo + (hi - lo) / 2;
+    if (ports->port_range_start[mid] <= port)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  port_bits = ports->port_bits + lo * n_words;
+
+  /* Walk down the trie along addr, looking for the lowest-numbered entry
+   * that matches both addr and port. */
+  while (trie->n_nodes) {
+    const policy_trie_node_t *nd = &trie->nodes[node];
+    if (!policy_trie_key_prefix_eq(key, &nd->prefix, nd->depth))
+      break;
+    if (nd->bits_offset != POLICY_TRIE_NO_BITS) {
+      const uint64_t *bits = trie->bits + nd->bits_offset;
+      unsigned w;
+      for (w = 0; w < n_words && (best < 0 || (int)(w * 64) < best); ++w) {
+        uint64_t m = bits[w] & port_bits[w];
+        if (m) {
+          int idx = (int)(w * 64) + tor_log2(m & (~m + 1));
+          if (best < 0 || idx < best)
+            best = idx;
+          break;
+        }
+      }
+    }
+    if (nd->depth == addr_bits)
+      break;
+    node = nd->child[policy_trie_key_bit(key, nd->depth)];
+    if (!node)
+      break;
+  }
+
+  if (best < 0) {
+    /* accept all by default. */
+    return ADDR_POLICY_ACCEPTED;
+  }
+  return (ports->accept_bits[best / 64] >> (best % 64)) & 1 ?
+    ADDR_POLICY_ACCEPTED : ADDR_POLICY_REJECTED;
+}
+
+/** As compare_tor_addr_to_addr_policy(), but use the compiled policy
+ * <b>cp</b>.  A NULL <b>cp</b> accepts everything, like a NULL policy. */
+addr_policy_result_t
+compare_tor_addr_to_compiled_policy(const tor_addr_t *addr, uint16_t port,
+                                    const compiled_policy_t *cp)
+{
+  policy_trie_key_t key;
+  unsigned addr_bits;
+
+  if (!cp)
+    return ADDR_POLICY_ACCEPTED;
+
+  if (addr && port && !tor_addr_is_null(addr) &&
+      (addr_bits = policy_trie_key_from_addr(&key, addr))) {
+    return compare_known_tor_addr_to_compiled_policy(&key, addr_bits,
+                         addr_bits == 32 ? &cp->trie4 : &cp->trie6,
+                         port, cp);
+  }
+
+  /* We only compile for the common case; the others are rare enough that a
+   * linear walk is fine. */
+  return compare_tor_addr_to_addr_policy(addr, port, cp->entries);
+}
+
 /** Return true iff the address policy <b>a</b> covers every case that
  * would be covered by <b>b</b>, so that a,b is redundant. */
 static int
@@ -2804,6 +3489,13 @@ parse_short_policy(const char *summary)
   result->is_accept = is_accept;
   result->n_entries = n_entries;
   memcpy(result->entries, entries, sizeof(short_policy_entry_t)*n_entries);
+  result->entries_are_sorted = 1;
+  for (int i = 1; i < n_entries; ++i) {
+    if (entries[i].min_port <= entries[i-1].max_port) {
+      result->entries_are_sorted = 0;
+      break;
+    }
+  }
   return result;
 
  bad_ent:
@@ -2866,11 +3558,25 @@ compare_tor_addr_to_short_policy(const tor_addr_t *addr, uint16_t port,
       (tor_addr_is_internal(addr, 0) || tor_addr_is_loopback(addr)))
     return ADDR_POLICY_REJECTED;
 
-  for (i=0; i < policy->n_entries; ++i) {
-    const short_policy_entry_t *e = &policy->entries[i];
-    if (e->min_port <= port && port <= e->max_port) {
-      found_match = 1;
-      break;
+  if (policy->entries_are_sorted) {
+    /* Find the first entry that doesn't end before port. */
+    int lo = 0, hi = policy->n_entries;
+    while (lo < hi) {
+      int mid = lo + (hi - lo) / 2;
+      if (policy->entries[mid].max_port < port)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    found_match = lo < (int)policy->n_entries &&
+      policy->entries[lo].min_port <= port;
+  } else {
+    for (i=0; i < policy->n_entries; ++i) {
+      const short_policy_entry_t *e = &policy->entries[i];
+      if (e->min_port <= port && port <= e->max_port) {
+        found_match = 1;
+        break;
+      }
     }
   }
 
@@ -2934,6 +3640,9 @@ compare_tor_addr_to_node_policy(const tor_addr_t *addr, uint16_t port,
   }
 
   if (node->ri) {
+    if (node->ri->compiled_exit_policy)
+      return compare_tor_addr_to_compiled_policy(addr, port,
+                                         node->ri->compiled_exit_policy);
     return compare_tor_addr_to_addr_policy(addr, port, node->ri->exit_policy);
   } else if (node->md) {
     if (node->md->exit_policy == NULL)
@@ -3142,6 +3851,13 @@ policies_free_all(void)
   addr_policy_list_free(authdir_badexit_policy);
   authdir_badexit_policy = NULL;
 
+  if (!HT_EMPTY(&compiled_policy_root)) {
+    log_warn(LD_MM, "Still had %d compiled policies cached at shutdown.",
+             (int)HT_SIZE(&compiled_policy_root));
+  }
+  HT_CLEAR(compiled_policy_map, &compiled_policy_root);
+  HT_CLEAR(port_table_map, &port_table_root);
+
   if (!HT_EMPTY(&policy_root)) {
     policy_map_ent_t **ent;
     int n = 0;
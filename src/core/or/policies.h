@@ -58,8 +58,11 @@ typedef struct short_policy_t {
   /** True if the members of 'entries' are port ranges to accept; false if
    * they are port ranges to reject */
   unsigned int is_accept : 1;
+  /** True if the members of 'entries' are in ascending order and don't
+   * overlap, so that we can binary-search them. */
+  unsigned int entries_are_sorted : 1;
   /** The actual number of values in 'entries'. */
-  unsigned int n_entries : 31;
+  unsigned int n_entries : 30;
   /** An array of 0 or more short_policy_entry_t values, each describing a
    * range of ports that this policy accepts or rejects (depending on the
    * value of is_accept).
@@ -117,6 +120,17 @@ MOCK_DECL(addr_policy_result_t, compare_tor_addr_to_addr_policy,
 addr_policy_result_t compare_tor_addr_to_node_policy(const tor_addr_t *addr,
                               uint16_t port, const node_t *node);
 
+/** An address policy, compiled into lookup tables so that we can evaluate
+ * it without walking all of its entries. */
+typedef struct compiled_policy_t compiled_policy_t;
+compiled_policy_t *compiled_policy_get(const smartlist_t *policy);
+void compiled_policy_free_(compiled_policy_t *cp);
+#define compiled_policy_free(cp) \
+  FREE_AND_NULL(compiled_policy_t, compiled_policy_free_, (cp))
+addr_policy_result_t compare_tor_addr_to_compiled_policy(
+                          const tor_addr_t *addr, uint16_t port,
+                          const compiled_policy_t *cp);
+
 int policies_parse_exit_policy_from_options(
                                           const or_options_t *or_options,
                                           uint32_t local_address,
@@ -76,11 +76,13 @@
 #include "core/or/reasons.h"
 #include "core/or/relay.h"
 #include "core/crypto/relay_crypto.h"
+#include "core/or/relay_shard.h"
 #include "feature/rend/rendcache.h"
 #include "feature/rend/rendcommon.h"
 #include "feature/nodelist/describe.h"
 #include "feature/nodelist/routerlist.h"
 #include "core/or/scheduler.h"
+#include "core/or/cell_pool.h"
 
 #include "core/or/cell_st.h"
 #include "core/or/cell_queue_st.h"
@@ -96,6 +98,11 @@
 
 #include "lib/intmath/weakrng.h"
 
+static int circuit_handle_decrypted_relay_cell(cell_t *cell,
+                                               circuit_t *circ,
+                                               cell_direction_t cell_direction,
+                                               crypt_path_t *layer_hint,
+                                               char recognized);
 static edge_connection_t *relay_lookup_conn(circuit_t *circ, cell_t *cell,
                                             cell_direction_t cell_direction,
                                             crypt_path_t *layer_hint);
@@ -229,10 +236,8 @@ int
 circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
                            cell_direction_t cell_direction)
 {
-  channel_t *chan = NULL;
   crypt_path_t *layer_hint=NULL;
   char recognized=0;
-  int reason;
 
   tor_assert(cell);
   tor_assert(circ);
@@ -241,6 +246,9 @@ circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
   if (circ->marked_for_close)
     return 0;
 
+  if (relay_shard_wants_cells(circ, cell_direction))
+    return relay_shard_queue_cells(TO_OR_CIRCUIT(circ), &cell, 1);
+
   if (relay_decrypt_cell(circ, cell, cell_direction, &layer_hint, &recognized)
       < 0) {
     log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
@@ -248,6 +256,98 @@ circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
     return -END_CIRC_REASON_INTERNAL;
   }
 
+  return circuit_handle_decrypted_relay_cell(cell, circ, cell_direction,
+                                             layer_hint, recognized);
+}
+
+/** Receive the <b>n_cells</b> relay cells in <b>cells</b>, all of which
+ * arrived in order on <b>circ</b> in direction <b>cell_direction</b>.
+ *
+ * This behaves like calling circuit_receive_relay_cell() on each cell in
+ * turn, except that relay_decrypt_cells() does the relay crypto for all of
+ * them before we handle any.  We stop at the first cell that fails, or as
+ * soon as <b>circ</b> gets marked for close.
+ *
+ * Return -<b>reason</b> on failure.
+ */
+int
+circuit_receive_relay_cells(cell_t **cells, int n_cells, circuit_t *circ,
+                            cell_direction_t cell_direction)
+{
+  crypt_path_t *layer_hints[RELAY_CELL_BATCH_MAX];
+  char recognized[RELAY_CELL_BATCH_MAX];
+
+  tor_assert(cells);
+  tor_assert(circ);
+  tor_assert(n_cells > 0 && n_cells <= RELAY_CELL_BATCH_MAX);
+  tor_assert(cell_direction == CELL_DIRECTION_OUT ||
+             cell_direction == CELL_DIRECTION_IN);
+  if (circ->marked_for_close)
+    return 0;
+
+  if (relay_shard_wants_cells(circ, cell_direction))
+    return relay_shard_queue_cells(TO_OR_CIRCUIT(circ), cells, n_cells);
+
+  if (relay_decrypt_cells(circ, cells, n_cells, cell_direction,
+                          layer_hints, recognized) < 0) {
+    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+           "relay crypt failed. Dropping connection.");
+    return -END_CIRC_REASON_INTERNAL;
+  }
+
+  return circuit_handle_decrypted_relay_cells(circ, cells, n_cells,
+                                              cell_direction, layer_hints,
+                                              recognized);
+}
+
+/** Handle the <b>n_cells</b> relay cells in <b>cells</b>, which arrived in
+ * order on <b>circ</b> in direction <b>cell_direction</b> and have already
+ * been crypted, given the <b>layer_hints</b> and <b>recognized</b> values
+ * that relay_decrypt_cells() returned for them.  If <b>layer_hints</b> is
+ * NULL, every layer hint is NULL.  We stop at the first cell that fails, or
+ * as soon as <b>circ</b> gets marked for close.
+ *
+ * Return -<b>reason</b> on failure.
+ */
+MOCK_IMPL(int,
+circuit_handle_decrypted_relay_cells,(circuit_t *circ, cell_t **cells,
+                                      int n_cells,
+                                      cell_direction_t cell_direction,
+                                      crypt_path_t **layer_hints,
+                                      const char *recognized))
+{
+  int i, reason;
+
+  for (i = 0; i < n_cells; ++i) {
+    if (circ->marked_for_close)
+      break;
+    reason = circuit_handle_decrypted_relay_cell(cells[i], circ,
+                                                 cell_direction,
+                                                 layer_hints ?
+                                                   layer_hints[i] : NULL,
+                                                 recognized[i]);
+    if (reason < 0)
+      return reason;
+  }
+  return 0;
+}
+
+/** Handle a relay <b>cell</b> on <b>circ</b> that relay_decrypt_cell() has
+ * already crypted, given the <b>layer_hint</b> and <b>recognized</b> values
+ * that it returned: deliver it to the right edge connection if it is
+ * recognized, or queue it to be relayed if it isn't.
+ *
+ * Return -<b>reason</b> on failure.
+ */
+static int
+circuit_handle_decrypted_relay_cell(cell_t *cell, circuit_t *circ,
+                                    cell_direction_t cell_direction,
+                                    crypt_path_t *layer_hint,
+                                    char recognized)
+{
+  channel_t *chan = NULL;
+  int reason;
+
   circuit_update_channel_usage(circ, cell);
 
   if (recognized) {
@@ -2406,23 +2506,58 @@ circuit_consider_sending_sendme(circuit_t *circ, crypt_path_t *layer_hint)
   }
 }
 
-/** The total number of cells we have allocated. */
-static size_t total_cells_allocated = 0;
+/** Pool from which we allocate every packed_cell_t. */
+static cell_pool_t *packed_cell_pool = NULL;
+/** Pool from which we allocate every destroy_cell_t. */
+static cell_pool_t *destroy_cell_pool = NULL;
+
+/** Largest amount of memory that each cell pool may keep in empty slabs,
+ * if cell_queues_set_pool_max_idle() has been called. */
+static size_t cell_pool_max_idle = 0;
+/** True iff cell_queues_set_pool_max_idle() has been called. */
+static int cell_pool_max_idle_set = 0;
+
+/** Create the cell pools if we have not done so already. */
+static void
+cell_pools_init(void)
+{
+  if (PREDICT_LIKELY(packed_cell_pool))
+    return;
+  packed_cell_pool = cell_pool_new("Packed cell", sizeof(packed_cell_t));
+  destroy_cell_pool = cell_pool_new("Destroy cell", sizeof(destroy_cell_t));
+  if (cell_pool_max_idle_set) {
+    cell_pool_set_max_idle(packed_cell_pool, cell_pool_max_idle);
+    cell_pool_set_max_idle(destroy_cell_pool, cell_pool_max_idle);
+  }
+}
+
+/** Keep no more than <b>max_idle</b> bytes of memory in the empty slabs of
+ * the cell pools, as configured by CellPoolMaxIdle. */
+void
+cell_queues_set_pool_max_idle(uint64_t max_idle)
+{
+  /* Each pool may keep up to half of max_idle in empty slabs. */
+  cell_pool_max_idle = (size_t) MIN(max_idle / 2, SIZE_MAX);
+  cell_pool_max_idle_set = 1;
+  if (packed_cell_pool) {
+    cell_pool_set_max_idle(packed_cell_pool, cell_pool_max_idle);
+    cell_pool_set_max_idle(destroy_cell_pool, cell_pool_max_idle);
+  }
+}
 
 /** Release storage held by <b>cell</b>. */
 static inline void
 packed_cell_free_unchecked(packed_cell_t *cell)
 {
-  --total_cells_allocated;
-  tor_free(cell);
+  cell_pool_release(packed_cell_pool, cell);
 }
 
 /** Allocate and return a new packed_cell_t. */
 STATIC packed_cell_t *
 packed_cell_new(void)
 {
-  ++total_cells_allocated;
-  return tor_malloc_zero(sizeof(packed_cell_t));
+  cell_pools_init();
+  return cell_pool_get(packed_cell_pool);
 }
 
 /** Return a packed cell used outside by channel_t lower layer */
@@ -2434,6 +2569,23 @@ packed_cell_free_(packed_cell_t *cell)
   packed_cell_free_unchecked(cell);
 }
 
+/** Release storage held by the destroy cell <b>cell</b>. */
+void
+destroy_cell_free_(destroy_cell_t *cell)
+{
+  if (!cell)
+    return;
+  cell_pool_release(destroy_cell_pool, cell);
+}
+
+/** Allocate and return a new destroy_cell_t. */
+static destroy_cell_t *
+destroy_cell_new(void)
+{
+  cell_pools_init();
+  return cell_pool_get(destroy_cell_pool);
+}
+
 /** Log current statistics for cell pool allocation at log level
  * <b>severity</b>. */
 void
@@ -2441,6 +2593,7 @@ dump_cell_pool_usage(int severity)
 {
   int n_circs = 0;
   int n_cells = 0;
+  size_t n_allocated = 0;
   SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *, c) {
     n_cells += c->n_chan_cells.n;
     if (!CIRCUIT_IS_ORIGIN(c))
@@ -2448,9 +2601,24 @@ dump_cell_pool_usage(int severity)
     ++n_circs;
   }
   SMARTLIST_FOREACH_END(c);
+  if (packed_cell_pool)
+    n_allocated = cell_pool_get_n_used(packed_cell_pool);
   tor_log(severity, LD_MM,
           "%d cells allocated on %d circuits. %d cells leaked.",
-          n_cells, n_circs, (int)total_cells_allocated - n_cells);
+          n_cells, n_circs, (int)n_allocated - n_cells);
+  if (packed_cell_pool) {
+    cell_pool_log_usage(packed_cell_pool, severity);
+    cell_pool_log_usage(destroy_cell_pool, severity);
+  }
+}
+
+/** Release all storage held by the cell pools.  Every packed_cell_t and
+ * destroy_cell_t must already have been freed. */
+void
+cell_queues_free_all(void)
+{
+  cell_pool_free(packed_cell_pool);
+  cell_pool_free(destroy_cell_pool);
 }
 
 /** Allocate a new copy of packed <b>cell</b>. */
@@ -2538,7 +2706,7 @@ destroy_cell_queue_clear(destroy_cell_queue_t *queue)
   destroy_cell_t *cell;
   while ((cell = TOR_SIMPLEQ_FIRST(&queue->head))) {
     TOR_SIMPLEQ_REMOVE_HEAD(&queue->head, next);
-    tor_free(cell);
+    destroy_cell_free(cell);
   }
   TOR_SIMPLEQ_INIT(&queue->head);
   queue->n = 0;
@@ -2563,7 +2731,7 @@ destroy_cell_queue_append(destroy_cell_queue_t *queue,
                           circid_t circid,
                           uint8_t reason)
 {
-  destroy_cell_t *cell = tor_malloc_zero(sizeof(destroy_cell_t));
+  destroy_cell_t *cell = destroy_cell_new();
   cell->circid = circid;
   cell->reason = reason;
   /* Not yet used, but will be required for OOM handling. */
@@ -2585,23 +2753,41 @@ destroy_cell_to_packed_cell(destroy_cell_t *inp, int wide_circ_ids)
   cell.payload[0] = inp->reason;
   cell_pack(packed, &cell, wide_circ_ids);
 
-  tor_free(inp);
+  destroy_cell_free(inp);
   return packed;
 }
 
-/** Return the total number of bytes used for each packed_cell in a queue.
- * Approximate. */
+/** Return the total number of bytes used for each packed_cell in a queue,
+ * including its share of the slab that holds it. */
 size_t
 packed_cell_mem_cost(void)
 {
-  return sizeof(packed_cell_t);
+  cell_pools_init();
+  return cell_pool_item_cost(packed_cell_pool);
 }
 
-/* DOCDOC */
+/** Return the number of bytes that the cell pools hold for cells that are
+ * in use, or in empty slabs that we are keeping for reuse. */
 size_t
 cell_queues_get_total_allocation(void)
 {
-  return total_cells_allocated * packed_cell_mem_cost();
+  if (!packed_cell_pool)
+    return 0;
+  return cell_pool_get_allocation(packed_cell_pool) +
+    cell_pool_get_allocation(destroy_cell_pool);
+}
+
+/** Release every empty slab from the cell pools, and return the number of
+ * bytes that we freed. */
+static size_t
+cell_queues_trim_pools(void)
+{
+  size_t before = cell_queues_get_total_allocation();
+  if (packed_cell_pool) {
+    cell_pool_trim(packed_cell_pool, 0);
+    cell_pool_trim(destroy_cell_pool, 0);
+  }
+  return before - cell_queues_get_total_allocation();
 }
 
 /** How long after we've been low on memory should we try to conserve it? */
@@ -2616,7 +2802,9 @@ STATIC int
 cell_queues_check_size(void)
 {
   time_t now = time(NULL);
-  size_t alloc = cell_queues_get_total_allocation();
+  size_t alloc;
+  alloc = cell_queues_get_total_allocation();
+  alloc += relay_shard_get_total_allocation();
   alloc += half_streams_get_total_allocation();
   alloc += buf_get_total_allocation();
   alloc += tor_compress_get_total_allocation();
@@ -2629,6 +2817,12 @@ cell_queues_check_size(void)
   alloc += dns_cache_total;
   if (alloc >= get_options()->MaxMemInQueues_low_threshold) {
     last_time_under_memory_pressure = approx_time();
+    if (alloc >= get_options()->MaxMemInQueues) {
+      /* Empty slabs and freelisted buffer chunks are the cheapest memory to
+       * give back. */
+      alloc -= cell_queues_trim_pools();
+      alloc -= buf_shrink_freelists(1);
+    }
     if (alloc >= get_options()->MaxMemInQueues) {
       /* If we're spending over 20% of the memory limit on hidden service
        * descriptors, free them until we're down to 10%. Do the same for geoip
@@ -2650,6 +2844,8 @@ cell_queues_check_size(void)
         alloc -= dns_cache_handle_oom(now, bytes_to_remove);
       }
       circuits_handle_oom(alloc);
+      /* Don't hold on to the chunks of the buffers we just freed. */
+      buf_shrink_freelists(1);
       return 1;
     }
   }
@@ -2801,6 +2997,20 @@ packed_cell_get_circid(const packed_cell_t *cell, int wide_circ_ids)
   }
 }
 
+/** Hand every cell on <b>batch</b> to <b>chan</b>, leaving <b>batch</b>
+ * empty.  It is very unlikely that this fails but just in case, get rid of
+ * the channel. */
+static void
+channel_write_cell_batch(channel_t *chan, cell_queue_t *batch)
+{
+  if (batch->n == 0)
+    return;
+  if (channel_write_packed_cells(chan, batch) < 0) {
+    /* The cells have been freed at this point. */
+    channel_mark_for_close(chan);
+  }
+}
+
 /** Pull as many cells as possible (but no more than <b>max</b>) from the
  * queue of the first active circuit on <b>chan</b>, and write them to
  * <b>chan</b>-&gt;outbuf.  Return the number of cells written.  Advance
@@ -2816,12 +3026,17 @@ channel_flush_from_first_active_circuit, (channel_t *chan, int max))
   or_circuit_t *or_circ;
   int streams_blocked;
   packed_cell_t *cell;
+  cell_queue_t batch;
 
   /* Get the cmux */
   tor_assert(chan);
   tor_assert(chan->cmux);
   cmux = chan->cmux;
 
+  /* We collect the cells we pick into <b>batch</b>, and hand them to the
+   * channel CELL_WRITE_BATCH_MAX at a time, and once more at the end. */
+  cell_queue_init(&batch);
+
   /* Main loop: pick a circuit, send a cell, update the cmux */
   while (n_flushed < max) {
     circ = circuitmux_get_first_active_circuit(cmux, &destroy_queue);
@@ -2836,13 +3051,10 @@ channel_flush_from_first_active_circuit, (channel_t *chan, int max))
       tor_assert(dcell);
       /* frees dcell */
       cell = destroy_cell_to_packed_cell(dcell, chan->wide_circ_ids);
-      /* Send the DESTROY cell. It is very unlikely that this fails but just
-       * in case, get rid of the channel. */
-      if (channel_write_packed_cell(chan, cell) < 0) {
-        /* The cell has been freed. */
-        channel_mark_for_close(chan);
-        continue;
-      }
+      /* Queue the DESTROY cell to be sent. */
+      cell_queue_append(&batch, cell);
+      if (batch.n >= CELL_WRITE_BATCH_MAX)
+        channel_write_cell_batch(chan, &batch);
       /* Update the cmux destroy counter */
       circuitmux_notify_xmit_destroy(cmux);
       cell = NULL;
@@ -2918,13 +3130,10 @@ channel_flush_from_first_active_circuit, (channel_t *chan, int max))
                                 DIRREQ_TUNNELED,
                                 DIRREQ_CIRC_QUEUE_FLUSHED);
 
-    /* Now send the cell. It is very unlikely that this fails but just in
-     * case, get rid of the channel. */
-    if (channel_write_packed_cell(chan, cell) < 0) {
-      /* The cell has been freed at this point. */
-      channel_mark_for_close(chan);
-      continue;
-    }
+    /* Now queue the cell to be sent. */
+    cell_queue_append(&batch, cell);
+    if (batch.n >= CELL_WRITE_BATCH_MAX)
+      channel_write_cell_batch(chan, &batch);
     cell = NULL;
 
     /*
@@ -2953,7 +3162,8 @@ channel_flush_from_first_active_circuit, (channel_t *chan, int max))
     /* If n_flushed < max still, loop around and pick another circuit */
   }
 
-  /* Okay, we're done sending now */
+  /* Okay, we're done picking cells: send whatever we haven't sent yet. */
+  channel_write_cell_batch(chan, &batch);
   return n_flushed;
 }
 
@@ -19,6 +19,21 @@ extern uint64_t stats_n_circ_max_cell_reached;
 void relay_consensus_has_changed(const networkstatus_t *ns);
 int circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
                                cell_direction_t cell_direction);
+/** Largest number of relay cells for a single circuit that we will pull off
+ * an OR connection's inbuf and hand to circuit_receive_relay_cells() at
+ * once. */
+#define RELAY_CELL_BATCH_MAX 16
+/** Largest number of packed cells that we collect in
+ * channel_flush_from_first_active_circuit() before handing them to the
+ * channel in a single call. */
+#define CELL_WRITE_BATCH_MAX 32
+int circuit_receive_relay_cells(cell_t **cells, int n_cells,
+                                circuit_t *circ,
+                                cell_direction_t cell_direction);
+MOCK_DECL(int, circuit_handle_decrypted_relay_cells,
+          (circuit_t *circ, cell_t **cells, int n_cells,
+           cell_direction_t cell_direction, crypt_path_t **layer_hints,
+           const char *recognized));
 size_t cell_queues_get_total_allocation(void);
 
 void relay_header_pack(uint8_t *dest, const relay_header_t *src);
@@ -49,6 +64,8 @@ extern uint64_t stats_n_data_cells_received;
 extern uint64_t stats_n_data_bytes_received;
 
 void dump_cell_pool_usage(int severity);
+void cell_queues_free_all(void);
+void cell_queues_set_pool_max_idle(uint64_t max_idle);
 size_t packed_cell_mem_cost(void);
 
 int have_been_under_memory_pressure(void);
@@ -57,6 +74,9 @@ int have_been_under_memory_pressure(void);
 void packed_cell_free_(packed_cell_t *cell);
 #define packed_cell_free(cell) \
   FREE_AND_NULL(packed_cell_t, packed_cell_free_, (cell))
+void destroy_cell_free_(destroy_cell_t *cell);
+#define destroy_cell_free(cell) \
+  FREE_AND_NULL(destroy_cell_t, destroy_cell_free_, (cell))
 
 void cell_queue_init(cell_queue_t *queue);
 void cell_queue_clear(cell_queue_t *queue);
@@ -0,0 +1,338 @@
+/* Copyright (c) 2019, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file relay_shard.c
+ * \brief Move the forward relay crypto for our circuits off the main thread.
+ *
+ * When RelayShards is nonzero, every relay cell that arrives on an
+ * or_circuit_t heading away from the origin is handed to this module
+ * instead of being decrypted in circuit_receive_relay_cells().  We keep a
+ * small threadpool (in workqueue.c) for it, separate from the cpuworkers so
+ * that onionskins and consensus diffs can't starve it.
+ *
+ * Each circuit has at most one job on the threadpool at a time; cells that
+ * arrive meanwhile wait on the circuit's shard_pending list.  That keeps
+ * each circuit's cells in order and its f_crypto and f_digest state owned
+ * by a single thread, while different circuits get decrypted in parallel.
+ * When a job is done, the main thread takes the decrypted cells back and
+ * hands them to circuit_handle_decrypted_relay_cells(), exactly as if they
+ * had been decrypted inline.
+ **/
+
+#define RELAY_SHARD_PRIVATE
+#include "core/or/or.h"
+#include "app/config/config.h"
+#include "core/or/circuitlist.h"
+#include "core/or/relay.h"
+#include "core/or/relay_shard.h"
+#include "core/crypto/relay_crypto.h"
+#include "lib/crypt_ops/crypto_cipher.h"
+#include "lib/crypt_ops/crypto_digest.h"
+#include "lib/crypt_ops/crypto_util.h"
+#include "lib/evloop/workqueue.h"
+
+#include "core/or/cell_st.h"
+#include "core/or/or_circuit_st.h"
+
+/** Magic number for a live relay_shard_job_t. */
+#define RELAY_SHARD_JOB_MAGIC 0x5a4d0b1eu
+
+/** A batch of cells from one circuit, along with what we need to decrypt
+ * them off the main thread. */
+typedef struct relay_shard_job_t {
+  uint32_t magic;
+  /** The circuit these cells arrived on, or NULL if it was freed while the
+   * job was on the threadpool.  Only touched from the main thread. */
+  or_circuit_t *circ;
+  /** The threadpool entry for this job, while it is queued or running. */
+  workqueue_entry_t *work;
+  /** A copy of the circuit's crypto state, taken when we queued the job.
+   * The worker thread uses only its f_crypto and f_digest fields. */
+  relay_crypto_t crypto;
+  /** How many entries of <b>cells</b> are in use? */
+  int n_cells;
+  /** The cells themselves, in the order they arrived. */
+  cell_t cells[RELAY_CELL_BATCH_MAX];
+  /** Set by the worker thread: recognized[i] is true if cells[i] is for
+   * us. */
+  char recognized[RELAY_CELL_BATCH_MAX];
+} relay_shard_job_t;
+
+static replyqueue_t *replyqueue = NULL;
+static threadpool_t *threadpool = NULL;
+
+/** How many cells are waiting on the threadpool or on some circuit's
+ * shard_pending list? */
+static size_t total_cells_queued = 0;
+
+/** Relay shard threads need no state of their own: everything they use
+ * comes with the job. */
+static void *
+relay_shard_state_new(void *arg)
+{
+  (void)arg;
+  return NULL;
+}
+
+static void
+relay_shard_state_free_void(void *arg)
+{
+  (void)arg;
+}
+
+/** Start <b>n_threads</b> relay shard threads, unless we already have
+ * some.  If <b>n_threads</b> is 0, don't start any: forward relay crypto
+ * stays on the main thread. */
+STATIC void
+relay_shard_init_with_n_threads(int n_threads)
+{
+  if (threadpool || n_threads <= 0)
+    return;
+
+  replyqueue = replyqueue_new(0);
+  threadpool = threadpool_new(n_threads,
+                              replyqueue,
+                              relay_shard_state_new,
+                              relay_shard_state_free_void,
+                              NULL);
+  int r = threadpool_register_reply_event(threadpool, NULL);
+  tor_assert(r == 0);
+
+  log_notice(LD_OR, "Decrypting forward relay cells on %d thread%s.",
+             n_threads, n_threads == 1 ? "" : "s");
+}
+
+/** Initialize the relay shard subsystem according to our RelayShards
+ * option. It is OK to call this more than once during Tor's lifetime. */
+void
+relay_shard_init(void)
+{
+  relay_shard_init_with_n_threads((int)get_options()->RelayShards);
+}
+
+#ifdef TOR_UNIT_TESTS
+/** Return the replyqueue that our threads answer on, or NULL if we have
+ * none. */
+STATIC replyqueue_t *
+relay_shard_get_replyqueue(void)
+{
+  return replyqueue;
+}
+#endif /* defined(TOR_UNIT_TESTS) */
+
+/** Return true iff cells arriving on <b>circ</b> in direction
+ * <b>cell_direction</b> should be handed to relay_shard_queue_cells()
+ * instead of being decrypted inline. */
+int
+relay_shard_wants_cells(const circuit_t *circ,
+                        cell_direction_t cell_direction)
+{
+  return threadpool != NULL &&
+    cell_direction == CELL_DIRECTION_OUT &&
+    ! CIRCUIT_IS_ORIGIN(circ);
+}
+
+/** Release all storage held by <b>job</b>, which must not be on the
+ * threadpool. */
+static void
+relay_shard_job_free_(relay_shard_job_t *job)
+{
+  if (!job)
+    return;
+  tor_assert(job->magic == RELAY_SHARD_JOB_MAGIC);
+  tor_assert(total_cells_queued >= (size_t)job->n_cells);
+  total_cells_queued -= job->n_cells;
+  if (job->circ) {
+    tor_assert(job->circ->shard_n_cells >= job->n_cells);
+    job->circ->shard_n_cells -= job->n_cells;
+  }
+  memwipe(job, 0xe0, sizeof(*job));
+  tor_free(job);
+}
+#define relay_shard_job_free(job) \
+  FREE_AND_NULL(relay_shard_job_t, relay_shard_job_free_, (job))
+
+/** Worker thread: strip our layer of encryption from every cell in the
+ * relay_shard_job_t in <b>job_</b>, and see which ones are for us. */
+static workqueue_reply_t
+relay_shard_threadfn(void *state_, void *job_)
+{
+  relay_shard_job_t *job = job_;
+  cell_t *cells[RELAY_CELL_BATCH_MAX];
+  int i;
+  (void)state_;
+
+  for (i = 0; i < job->n_cells; ++i)
+    cells[i] = &job->cells[i];
+  relay_decrypt_cells_forward(&job->crypto, cells, job->n_cells,
+                              job->recognized);
+  return WQ_RPL_REPLY;
+}
+
+static void relay_shard_replyfn(void *job_);
+
+/** If <b>circ</b> has no job on the threadpool, send it the oldest batch on
+ * its shard_pending list.  Return 0 on success, and -<b>reason</b> if we
+ * couldn't queue the work. */
+static int
+relay_shard_dispatch(or_circuit_t *circ)
+{
+  relay_shard_job_t *job;
+
+  if (circ->shard_job || !circ->shard_pending ||
+      smartlist_len(circ->shard_pending) == 0)
+    return 0;
+
+  job = smartlist_get(circ->shard_pending, 0);
+  smartlist_del_keeporder(circ->shard_pending, 0);
+  memcpy(&job->crypto, &circ->crypto, sizeof(job->crypto));
+
+  job->work = threadpool_queue_work(threadpool,
+                                    relay_shard_threadfn,
+                                    relay_shard_replyfn,
+                                    job);
+  if (!job->work) {
+    log_warn(LD_BUG, "Couldn't queue relay cells on threadpool");
+    relay_shard_job_free(job);
+    return -END_CIRC_REASON_INTERNAL;
+  }
+  circ->shard_job = job;
+  return 0;
+}
+
+/** Main thread: a relay shard thread has finished with <b>job_</b>.  Hand
+ * its cells back to their circuit, if it's still around, and start on the
+ * circuit's next batch. */
+static void
+relay_shard_replyfn(void *job_)
+{
+  relay_shard_job_t *job = job_;
+  or_circuit_t *circ = job->circ;
+  cell_t *cells[RELAY_CELL_BATCH_MAX];
+  int i, reason;
+
+  tor_assert(job->magic == RELAY_SHARD_JOB_MAGIC);
+
+  if (!circ) {
+    /* The circuit was freed while we were working on it, and left its
+     * forward crypto state for us to release. */
+    crypto_cipher_free(job->crypto.f_crypto);
+    crypto_digest_free(job->crypto.f_digest);
+    relay_shard_job_free(job);
+    return;
+  }
+
+  tor_assert(circ->shard_job == job);
+  circ->shard_job = NULL;
+
+  if (TO_CIRCUIT(circ)->marked_for_close) {
+    relay_shard_job_free(job);
+    return;
+  }
+
+  for (i = 0; i < job->n_cells; ++i)
+    cells[i] = &job->cells[i];
+  reason = circuit_handle_decrypted_relay_cells(TO_CIRCUIT(circ), cells,
+                                                job->n_cells,
+                                                CELL_DIRECTION_OUT, NULL,
+                                                job->recognized);
+  relay_shard_job_free(job);
+
+  if (reason >= 0 && !TO_CIRCUIT(circ)->marked_for_close)
+    reason = relay_shard_dispatch(circ);
+  if (reason < 0) {
+    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+           "Handling relay cells from shard thread failed. Closing.");
+    circuit_mark_for_close(TO_CIRCUIT(circ), -reason);
+  }
+}
+
+/** Queue copies of the <b>n_cells</b> relay cells in <b>cells</b>, which
+ * all arrived in order on <b>circ</b> heading away from the origin, to be
+ * decrypted on a relay shard thread and then handled.
+ *
+ * Return 0 on success, and -<b>reason</b> on failure.
+ */
+int
+relay_shard_queue_cells(or_circuit_t *circ, cell_t **cells, int n_cells)
+{
+  relay_shard_job_t *job = NULL;
+  int i;
+
+  tor_assert(threadpool);
+  tor_assert(circ);
+  tor_assert(cells);
+  tor_assert(n_cells > 0);
+
+  if (circ->shard_n_cells + n_cells > RELAY_SHARD_MAX_CELLS_PER_CIRC) {
+    log_fn(LOG_PROTOCOL_WARN, LD_CIRC,
+           "Too many relay cells waiting for a shard thread on this "
+           "circuit. Closing.");
+    return -END_CIRC_REASON_RESOURCELIMIT;
+  }
+
+  if (!circ->shard_pending)
+    circ->shard_pending = smartlist_new();
+
+  for (i = 0; i < n_cells; ++i) {
+    if (!job && smartlist_len(circ->shard_pending))
+      job = smartlist_get(circ->shard_pending,
+                          smartlist_len(circ->shard_pending) - 1);
+    if (!job || job->n_cells == RELAY_CELL_BATCH_MAX) {
+      job = tor_malloc_zero(sizeof(relay_shard_job_t));
+      job->magic = RELAY_SHARD_JOB_MAGIC;
+      job->circ = circ;
+      smartlist_add(circ->shard_pending, job);
+    }
+    memcpy(&job->cells[job->n_cells++], cells[i], sizeof(cell_t));
+  }
+
+  circ->shard_n_cells += n_cells;
+  total_cells_queued += n_cells;
+
+  return relay_shard_dispatch(circ);
+}
+
+/** <b>circ</b> is about to be freed: drop every batch of its cells that we
+ * still hold.  If a relay shard thread might be using its forward crypto
+ * state, take that state away from <b>circ</b> so that the job can release
+ * it when it finishes. */
+void
+relay_shard_circuit_free(or_circuit_t *circ)
+{
+  relay_shard_job_t *job;
+
+  if (circ->shard_pending) {
+    SMARTLIST_FOREACH(circ->shard_pending, relay_shard_job_t *, j,
+                      relay_shard_job_free(j));
+    smartlist_free(circ->shard_pending);
+  }
+
+  job = circ->shard_job;
+  circ->shard_job = NULL;
+  if (!job)
+    return;
+
+  if (workqueue_entry_cancel(job->work)) {
+    /* We cancelled it before any thread picked it up. */
+    relay_shard_job_free(job);
+    return;
+  }
+
+  /* The job is running, or finished and waiting for
+   * relay_shard_replyfn(). */
+  tor_assert(circ->shard_n_cells >= job->n_cells);
+  circ->shard_n_cells -= job->n_cells;
+  job->circ = NULL;
+  circ->crypto.f_crypto = NULL;
+  circ->crypto.f_digest = NULL;
+}
+
+/** Return the number of bytes of cells that we're holding for the relay
+ * shards. */
+size_t
+relay_shard_get_total_allocation(void)
+{
+  return total_cells_queued * sizeof(cell_t);
+}
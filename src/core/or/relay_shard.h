@@ -0,0 +1,34 @@
+/* Copyright (c) 2019, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file relay_shard.h
+ * \brief Header file for relay_shard.c.
+ **/
+
+#ifndef TOR_RELAY_SHARD_H
+#define TOR_RELAY_SHARD_H
+
+/** Largest number of relay shard threads we'll allow. */
+#define MAX_RELAY_SHARDS 64
+
+/** Largest number of cells that we'll hold for the relay shards on any
+ * single circuit before we give up on it. */
+#define RELAY_SHARD_MAX_CELLS_PER_CIRC 2048
+
+void relay_shard_init(void);
+int relay_shard_wants_cells(const circuit_t *circ,
+                            cell_direction_t cell_direction);
+int relay_shard_queue_cells(or_circuit_t *circ, cell_t **cells, int n_cells);
+void relay_shard_circuit_free(or_circuit_t *circ);
+size_t relay_shard_get_total_allocation(void);
+
+#ifdef RELAY_SHARD_PRIVATE
+struct replyqueue_s;
+STATIC void relay_shard_init_with_n_threads(int n_threads);
+#ifdef TOR_UNIT_TESTS
+STATIC struct replyqueue_s *relay_shard_get_replyqueue(void);
+#endif /* defined(TOR_UNIT_TESTS) */
+#endif /* defined(RELAY_SHARD_PRIVATE) */
+
+#endif /* !defined(TOR_RELAY_SHARD_H) */
@@ -107,6 +107,8 @@ typedef struct scheduler_s {
 #define KIST_SCHED_RUN_INTERVAL_MIN 0
 /* Maximum interval that KIST runs (in ms). */
 #define KIST_SCHED_RUN_INTERVAL_MAX 100
+/* Maximum time that KIST may cache a socket's kernel information (in ms). */
+#define KIST_SOCK_INFO_MAX_AGE_MAX 1000
 
 /*****************************************************************************
  * Globally visible scheduler functions
@@ -130,6 +132,8 @@ void scheduler_channel_wants_writes(channel_t *chan);
 MOCK_DECL(void, scheduler_channel_doesnt_want_writes, (channel_t *chan));
 MOCK_DECL(void, scheduler_channel_has_waiting_cells, (channel_t *chan));
 
+void scheduler_kist_log_heartbeat(void);
+
 /*****************************************************************************
  * Private scheduler functions
  *
@@ -176,15 +180,24 @@ void scheduler_touch_channel(channel_t *chan);
 typedef struct socket_table_ent_s {
   HT_ENTRY(socket_table_ent_s) node;
   const channel_t *chan;
-  /* Amount written this scheduling run */
+  /* Amount written since we last computed the limit */
   uint64_t written;
-  /* Amount that can be written this scheduling run */
+  /* Amount that can be written since we last computed the limit */
   uint64_t limit;
   /* TCP info from the kernel */
   uint32_t cwnd;
   uint32_t unacked;
   uint32_t mss;
   uint32_t notsent;
+  /* The socket's retransmission timeout from the kernel, in usec, or 0 if
+   * we don't know it. */
+  uint32_t rto;
+  /* True iff we have computed the limit at least once. */
+  unsigned int have_info : 1;
+  /* When we last computed the limit. */
+  monotime_t last_updated;
+  /* The channel's n_bytes_xmitted when we last computed the limit. */
+  uint64_t xmitted_at_update;
 } socket_table_ent_t;
 
 typedef HT_HEAD(outbuf_table_s, outbuf_table_ent_s) outbuf_table_t;
@@ -95,6 +95,19 @@ static monotime_t scheduler_last_run;
 static double sock_buf_size_factor = 1.0;
 /* How often the scheduler runs. */
 STATIC int sched_run_interval = KIST_SCHED_RUN_INTERVAL_DEFAULT;
+/* How long we may keep using a socket's kernel information before asking
+ * the kernel again, in msec. Zero means to ask on every run. */
+static int sock_info_max_age = 0;
+
+/* Statistics for the heartbeat, since startup: the number of scheduler runs,
+ * the number of system calls we made to get socket information, the most we
+ * made in a single run, and how many times we did and didn't need to ask the
+ * kernel about a socket. */
+static uint64_t kist_n_runs = 0;
+static uint64_t kist_n_syscalls = 0;
+static uint64_t kist_max_syscalls_per_run = 0;
+static uint64_t kist_n_sock_info_updates = 0;
+static uint64_t kist_n_sock_info_reused = 0;
 
 #ifdef HAVE_KIST_SUPPORT
 /* Indicate if KIST lite mode is on or off. We can disable it at runtime.
@@ -207,6 +220,7 @@ update_socket_info_impl, (socket_table_ent_t *ent))
   }
 
   /* Gather information */
+  ++kist_n_syscalls;
   if (getsockopt(sock, SOL_TCP, TCP_INFO, (void *)&(tcp), &tcp_info_len) < 0) {
     if (errno == EINVAL) {
       /* Oops, this option is not provided by the kernel, we'll have to
@@ -221,6 +235,7 @@ update_socket_info_impl, (socket_table_ent_t *ent))
     }
     goto fallback;
   }
+  ++kist_n_syscalls;
   if (ioctl(sock, SIOCOUTQNSD, &(ent->notsent)) < 0) {
     if (errno == EINVAL) {
       log_notice(LD_SCHED, "Looks like our kernel doesn't have the support "
@@ -235,6 +250,7 @@ update_socket_info_impl, (socket_table_ent_t *ent))
   ent->cwnd = tcp.tcpi_snd_cwnd;
   ent->unacked = tcp.tcpi_unacked;
   ent->mss = tcp.tcpi_snd_mss;
+  ent->rto = tcp.tcpi_rto;
 
   /* In order to reduce outbound kernel queuing delays and thus improve Tor's
    * ability to prioritize circuits, KIST wants to set a socket write limit
@@ -308,7 +324,7 @@ update_socket_info_impl, (socket_table_ent_t *ent))
    * also allow the socket to write as much as it can from the estimated
    * number of cells the lower layer can accept, effectively returning it to
    * Vanilla scheduler behavior. */
-  ent->cwnd = ent->unacked = ent->mss = ent->notsent = 0;
+  ent->cwnd = ent->unacked = ent->mss = ent->notsent = ent->rto = 0;
   /* This function calls the specialized channel object (currently channeltls)
    * and ask how many cells it can write on the outbuf which we then multiply
    * by the size of the cells for this channel. The cast is because this
@@ -318,9 +334,8 @@ update_socket_info_impl, (socket_table_ent_t *ent))
                 TLS_PER_CELL_OVERHEAD);
 }
 
-/* Given a socket that isn't in the table, add it.
- * Given a socket that is in the table, re-init values that need init-ing
- * every scheduling run
+/* Given a socket that isn't in the table, add it. Its written amount is
+ * reset whenever update_socket_info() recomputes its limit.
  */
 static void
 init_socket_info(socket_table_t *table, const channel_t *chan)
@@ -334,7 +349,6 @@ init_socket_info(socket_table_t *table, const channel_t *chan)
     ent->chan = chan;
     HT_INSERT(socket_table_s, table, ent);
   }
-  ent->written = 0;
 }
 
 /* Add chan to the outbuf table if it isn't already in it. If it is, then don't
@@ -399,16 +413,64 @@ socket_can_write(socket_table_t *table, const channel_t *chan)
   return kist_limit_space > 0;
 }
 
-/* Update the channel's socket kernel information. */
+/* Return true iff the limit we last computed for the socket in <b>ent</b>
+ * is still good enough to use at <b>now</b>, so that we don't need to ask
+ * the kernel again. */
+static int
+socket_info_is_current(const socket_table_ent_t *ent, const monotime_t *now)
+{
+  /* Without kernel information, the limit depends on the outbuf, which is
+   * cheap to look at and changes all the time. */
+  if (!ent->have_info || kist_lite_mode || ent->mss == 0) {
+    return 0;
+  }
+#ifdef HAVE_KIST_SUPPORT
+  if (kist_no_kernel_support) {
+    return 0;
+  }
+#endif
+
+  const int64_t age_msec = monotime_diff_msec(&ent->last_updated, now);
+
+  /* If the socket had nothing in flight and nothing waiting to be sent, no
+   * ACKs can have come in to change what the kernel told us. Unless we have
+   * written to it since, its limit is the same -- but only until it has been
+   * idle for longer than its RTO, when the kernel may shrink its congestion
+   * window back down (see tcp_slow_start_after_idle). */
+  if (ent->unacked == 0 && ent->notsent == 0 &&
+      ent->chan->n_bytes_xmitted == ent->xmitted_at_update) {
+    const int64_t idle_max_msec =
+      ent->rto ? ent->rto / 1000 : KIST_SOCK_INFO_MAX_AGE_MAX;
+    return age_msec < idle_max_msec;
+  }
+
+  /* Otherwise, the limit might have changed, but we may have been told that
+   * a slightly stale one is fine. What we have written since still counts
+   * against it. */
+  return sock_info_max_age > 0 && age_msec < sock_info_max_age;
+}
+
+/* Update the channel's socket kernel information, unless what we have is
+ * still current at <b>now</b>. */
 static void
-update_socket_info(socket_table_t *table, const channel_t *chan)
+update_socket_info(socket_table_t *table, const channel_t *chan,
+                   const monotime_t *now)
 {
   socket_table_ent_t *ent = NULL;
   ent = socket_table_search(table, chan);
   if (SCHED_BUG(!ent, chan)) {
     return; // Whelp. Entry didn't exist for some reason so nothing to do.
   }
+  if (socket_info_is_current(ent, now)) {
+    ++kist_n_sock_info_reused;
+    return;
+  }
+  ++kist_n_sock_info_updates;
   update_socket_info_impl(ent);
+  ent->written = 0;
+  ent->have_info = 1;
+  ent->xmitted_at_update = ent->chan->n_bytes_xmitted;
+  memcpy(&ent->last_updated, now, sizeof(*now));
   log_debug(LD_SCHED, "chan=%" PRIu64 " updated socket info, limit: %" PRIu64
                       ", cwnd: %" PRIu32 ", unacked: %" PRIu32
                       ", notsent: %" PRIu32 ", mss: %" PRIu32,
@@ -498,6 +560,7 @@ static void
 kist_scheduler_on_new_options(void)
 {
   sock_buf_size_factor = get_options()->KISTSockBufSizeFactor;
+  sock_info_max_age = get_options()->KISTSockInfoMaxAge;
 
   /* Calls kist_scheduler_run_interval which calls get_options(). */
   set_scheduler_run_interval();
@@ -576,14 +639,21 @@ kist_scheduler_run(void)
   /* Channels to be re-adding to pending at the end */
   smartlist_t *to_readd = NULL;
   smartlist_t *cp = get_channels_pending();
+  const uint64_t syscalls_before = kist_n_syscalls;
+  monotime_t now;
 
   outbuf_table_t outbuf_table = HT_INITIALIZER();
 
-  /* For each pending channel, collect new kernel information */
+  /* For each pending channel, collect new kernel information if we need
+   * it */
+  monotime_get(&now);
   SMARTLIST_FOREACH_BEGIN(cp, const channel_t *, pchan) {
       init_socket_info(&socket_table, pchan);
-      update_socket_info(&socket_table, pchan);
+      update_socket_info(&socket_table, pchan, &now);
   } SMARTLIST_FOREACH_END(pchan);
+  ++kist_n_runs;
+  kist_max_syscalls_per_run = MAX(kist_max_syscalls_per_run,
+                                  kist_n_syscalls - syscalls_before);
 
   log_debug(LD_SCHED, "Running the scheduler. %d channels pending",
             smartlist_len(cp));
@@ -793,6 +863,25 @@ kist_scheduler_run_interval(void)
                                  KIST_SCHED_RUN_INTERVAL_MAX);
 }
 
+/* Log how many system calls KIST has made to get socket information, if
+ * it has run at all. */
+void
+scheduler_kist_log_heartbeat(void)
+{
+  if (!kist_n_runs) {
+    return;
+  }
+
+  log_notice(LD_HEARTBEAT,
+             "KIST scheduler since startup: %" PRIu64 " runs, with an "
+             "average of %.2f and a maximum of %" PRIu64 " socket "
+             "information system calls per run. We reused the previous "
+             "information for %" PRIu64 " of %" PRIu64 " sockets.",
+             kist_n_runs, ((double)kist_n_syscalls) / kist_n_runs,
+             kist_max_syscalls_per_run, kist_n_sock_info_reused,
+             kist_n_sock_info_reused + kist_n_sock_info_updates);
+}
+
 /* Set KISTLite mode that is KIST without kernel support. */
 void
 scheduler_kist_set_lite_mode(void)
@@ -24,12 +24,17 @@
 #include "feature/relay/routermode.h"
 #include "core/or/circuitlist.h"
 #include "core/mainloop/mainloop.h"
+#include "core/mainloop/connection.h"
 #include "feature/stats/rephist.h"
 #include "feature/hibernate/hibernate.h"
 #include "app/config/statefile.h"
 #include "feature/hs/hs_stats.h"
 #include "feature/hs/hs_service.h"
 #include "core/or/dos.h"
+#include "core/mainloop/cpuworker.h"
+#include "feature/relay/onion_queue.h"
+#include "core/or/scheduler.h"
+#include "feature/dircache/consdiffmgr.h"
 #include "feature/stats/geoip_stats.h"
 
 #include "app/config/or_state_st.h"
@@ -173,8 +178,14 @@ log_heartbeat(time_t now)
     rep_hist_log_circuit_handshake_stats(now);
     rep_hist_log_link_protocol_counts();
     dos_log_heartbeat();
+    cpuworker_log_reply_stats(LOG_NOTICE);
+    onion_queue_log_heartbeat();
+    scheduler_kist_log_heartbeat();
+    connection_log_accept_heartbeat();
   }
 
+  consdiffmgr_log_heartbeat();
+
   circuit_log_ancient_one_hop_circuits(1800);
 
   if (options->BridgeRelay) {
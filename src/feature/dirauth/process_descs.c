@@ -507,6 +507,7 @@ dirserv_set_node_flags_from_authoritative_status(node_t *node,
 {
   node->is_valid = (authstatus & FP_INVALID) ? 0 : 1;
   node->is_bad_exit = (authstatus & FP_BADEXIT) ? 1 : 0;
+  nodelist_note_node_changed();
 }
 
 /** True iff <b>a</b> is more severe than <b>b</b>. */
@@ -837,6 +838,7 @@ directory_remove_invalid(void)
       log_info(LD_DIRSERV, "Router '%s' is now a %s exit", description,
                (r & FP_BADEXIT) ? "bad" : "good");
       node->is_bad_exit = (r&FP_BADEXIT) ? 1: 0;
+      nodelist_note_node_changed();
     }
   } SMARTLIST_FOREACH_END(node);
 
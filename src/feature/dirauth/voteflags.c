@@ -309,6 +309,9 @@ dirserv_compute_performance_thresholds(digestmap_t *omit_as_sybil)
     }
   } SMARTLIST_FOREACH_END(node);
 
+  /* We may have just changed some nodes' Exit flags. */
+  nodelist_note_node_changed();
+
   /* Now, compute thresholds. */
   if (n_active) {
     /* The median uptime is stable. */
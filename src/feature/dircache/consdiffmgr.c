@@ -112,6 +112,8 @@ static mainloop_event_t *consdiffmgr_rescan_ev = NULL;
 
 static void consdiffmgr_rescan_cb(mainloop_event_t *ev, void *arg);
 static void mark_cdm_cache_dirty(void);
+static void cdm_note_consensus_arrived(consensus_flavor_t flavor,
+                                       time_t valid_after);
 
 /** How many different methods will we try to use for diff compression? */
 STATIC unsigned
@@ -563,6 +565,7 @@ consdiffmgr_add_consensus(const char *consensus,
   }
 
   /* We don't have it. Add it to the cache. */
+  cdm_note_consensus_arrived(flavor, valid_after);
   return consensus_queue_compression_work(consensus, consensus_len, as_parsed);
 }
 
@@ -1250,6 +1253,202 @@ consdiffmgr_set_cache_flags(void)
   smartlist_free(objects);
 }
 
+/* =====
+   Statistics
+   =====*/
+
+/**
+ * How much compression we have done with one method, for the heartbeat.
+ */
+typedef struct cdm_compress_stats_t {
+  /** How many documents have we compressed? */
+  uint64_t n_compressed;
+  /** How many bytes went into the compressor, and how many came out? */
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  /** How many microseconds of CPU time did the compressor spend? */
+  uint64_t usec;
+} cdm_compress_stats_t;
+
+/** Compression statistics for each compression method.  Only used in the
+ * main thread. */
+static cdm_compress_stats_t compress_stats[UNKNOWN_METHOD];
+
+/**
+ * How soon we could serve the newest consensus of one flavor, and diffs to
+ * it, after it arrived.
+ */
+typedef struct cdm_latency_t {
+  /** The valid-after time of the newest consensus we have been given, or 0
+   * if we haven't been given any. */
+  time_t valid_after;
+  /** When we were given that consensus. */
+  monotime_t arrived;
+  /** True iff we have stored that consensus, compressed. */
+  int compressed;
+  /** How many msec after it arrived did we store it? */
+  int64_t compressed_msec;
+  /** How many diffs to that consensus have we stored, and how many msec
+   * after it arrived did we store the most recent one? */
+  int n_diffs;
+  int64_t last_diff_msec;
+
+  /** How many earlier consensuses did we store, and what was the total of
+   * their <b>compressed_msec</b>? */
+  uint64_t n_earlier;
+  uint64_t earlier_compressed_msec;
+  /** How many of those earlier consensuses got diffs, and what was the total
+   * of their <b>last_diff_msec</b>? */
+  uint64_t n_earlier_with_diffs;
+  uint64_t earlier_last_diff_msec;
+} cdm_latency_t;
+
+/** Latency statistics for each flavor.  Only used in the main thread. */
+static cdm_latency_t cdm_latency[N_CONSENSUS_FLAVORS];
+
+/**
+ * Note that we have been given a new consensus of flavor <b>flavor</b>
+ * with valid-after time <b>valid_after</b>, and are about to compress it.
+ */
+static void
+cdm_note_consensus_arrived(consensus_flavor_t flavor, time_t valid_after)
+{
+  tor_assert((int)flavor < N_CONSENSUS_FLAVORS);
+  cdm_latency_t *lat = &cdm_latency[flavor];
+
+  if (valid_after <= lat->valid_after)
+    return; /* An older one than we've seen; don't count it. */
+
+  if (lat->compressed) {
+    ++lat->n_earlier;
+    lat->earlier_compressed_msec += lat->compressed_msec;
+    if (lat->n_diffs) {
+      ++lat->n_earlier_with_diffs;
+      lat->earlier_last_diff_msec += lat->last_diff_msec;
+    }
+  }
+  lat->valid_after = valid_after;
+  monotime_get(&lat->arrived);
+  lat->compressed = 0;
+  lat->compressed_msec = 0;
+  lat->n_diffs = 0;
+  lat->last_diff_msec = 0;
+}
+
+/**
+ * Note that we have just stored the consensus of flavor <b>flavor</b> with
+ * valid-after time <b>valid_after</b> (if <b>is_diff</b> is false), or a
+ * diff to it (if <b>is_diff</b> is true).
+ */
+static void
+cdm_note_stored(consensus_flavor_t flavor, time_t valid_after, int is_diff)
+{
+  tor_assert((int)flavor < N_CONSENSUS_FLAVORS);
+  cdm_latency_t *lat = &cdm_latency[flavor];
+  monotime_t now;
+
+  if (valid_after != lat->valid_after)
+    return;
+
+  monotime_get(&now);
+  const int64_t msec = monotime_diff_msec(&lat->arrived, &now);
+  if (is_diff) {
+    ++lat->n_diffs;
+    lat->last_diff_msec = msec;
+  } else {
+    lat->compressed = 1;
+    lat->compressed_msec = msec;
+  }
+}
+
+/**
+ * Add the <b>n</b> compressed documents in <b>results</b>, compressed with
+ * the corresponding entries of <b>methods</b> from <b>len_in</b> bytes
+ * each, to our compression statistics.
+ */
+static void
+cdm_note_compressed(const compress_method_t *methods,
+                    const compressed_result_t *results, int n,
+                    size_t len_in)
+{
+  int i;
+  for (i = 0; i < n; ++i) {
+    if (!results[i].body || BUG(methods[i] >= UNKNOWN_METHOD))
+      continue;
+    cdm_compress_stats_t *st = &compress_stats[methods[i]];
+    ++st->n_compressed;
+    st->bytes_in += len_in;
+    st->bytes_out += results[i].bodylen;
+    st->usec += results[i].usec;
+  }
+}
+
+/**
+ * Log a heartbeat message about how long we have spent compressing
+ * consensuses and diffs with each method, and how soon after the latest
+ * consensus of each flavor arrived we could serve it and diffs to it.
+ */
+void
+consdiffmgr_log_heartbeat(void)
+{
+  smartlist_t *elems = smartlist_new();
+  int i;
+
+  for (i = 0; i < UNKNOWN_METHOD; ++i) {
+    const cdm_compress_stats_t *st = &compress_stats[i];
+    if (!st->n_compressed)
+      continue;
+    smartlist_add_asprintf(elems,
+                           "%"PRIu64" %s documents (%"PRIu64" kB to "
+                           "%"PRIu64" kB) in %"PRIu64" msec",
+                           st->n_compressed,
+                           compression_method_get_human_name(i),
+                           st->bytes_in / 1024,
+                           st->bytes_out / 1024, st->usec / 1000);
+  }
+  if (smartlist_len(elems)) {
+    char *joined = smartlist_join_strings(elems, "; ", 0, NULL);
+    log_notice(LD_HEARTBEAT, "Since startup, we have spent this long "
+               "compressing consensuses and consensus diffs: %s.", joined);
+    tor_free(joined);
+  }
+  SMARTLIST_FOREACH(elems, char *, cp, tor_free(cp));
+  smartlist_free(elems);
+
+  for (i = 0; i < N_CONSENSUS_FLAVORS; ++i) {
+    const cdm_latency_t *lat = &cdm_latency[i];
+    char *diffs = NULL, *earlier = NULL;
+    if (!lat->compressed)
+      continue;
+    if (lat->n_diffs) {
+      tor_asprintf(&diffs, "the last of %d diffs to it was ready after "
+                   "%"PRId64" msec", lat->n_diffs, lat->last_diff_msec);
+    } else {
+      diffs = tor_strdup("no diffs to it are ready yet");
+    }
+    if (lat->n_earlier) {
+      tor_asprintf(&earlier, " Earlier %s consensuses were ready after "
+                   "%"PRIu64" msec on average",
+                   networkstatus_get_flavor_name(i),
+                   lat->earlier_compressed_msec / lat->n_earlier);
+      if (lat->n_earlier_with_diffs) {
+        char *tmp = earlier;
+        tor_asprintf(&earlier, "%s, and their last diffs after %"PRIu64
+                     " msec", tmp,
+                     lat->earlier_last_diff_msec /
+                     lat->n_earlier_with_diffs);
+        tor_free(tmp);
+      }
+    }
+    log_notice(LD_HEARTBEAT, "Our latest %s consensus was ready to serve "
+               "%"PRId64" msec after it arrived, and %s.%s%s",
+               networkstatus_get_flavor_name(i), lat->compressed_msec,
+               diffs, earlier ? earlier : "", earlier ? "." : "");
+    tor_free(diffs);
+    tor_free(earlier);
+  }
+}
+
 /**
  * Called before shutdown: drop all storage held by the consdiffmgr.c module.
  */
@@ -1273,64 +1472,280 @@ consdiffmgr_free_all(void)
   consensus_cache_free(cons_diff_cache);
   cons_diff_cache = NULL;
   mainloop_event_free(consdiffmgr_rescan_ev);
+  memset(compress_stats, 0, sizeof(compress_stats));
+  memset(cdm_latency, 0, sizeof(cdm_latency));
 }
 
 /* =====
    Thread workers
    =====*/
 
-typedef struct compressed_result_t {
-  config_line_t *labels;
-  /**
-   * Output: Body of the diff, as compressed.
-   */
-  uint8_t *body;
-  /**
-   * Output: length of body_out
-   */
-  size_t bodylen;
-} compressed_result_t;
+/**
+ * How many bytes of input compress_multiple() gives each compressor at a
+ * time.  This is small enough that a chunk stays in cache while every
+ * compressor reads it, and no smaller than a zstd block, since our zstd
+ * backend flushes after every call.
+ */
+#define COMPRESS_CHUNK_LEN (128*1024)
+
+/**
+ * One compressor that compress_multiple() is running.
+ */
+typedef struct compress_stream_t {
+  /** The compressor's state, or NULL if it has failed. */
+  tor_compress_state_t *state;
+  /** The output so far, and how much room we have allocated for it. */
+  char *out;
+  size_t out_alloc;
+  /** Where the compressor will write next, and how much room is left. */
+  char *outptr;
+  size_t out_remaining;
+} compress_stream_t;
+
+/**
+ * Give the <b>in_len</b> bytes at <b>in</b> to the compressor in
+ * <b>stream</b>, growing its output buffer as needed.  If <b>finish</b> is
+ * true, this is the end of the input.  Return 0 on success, -1 on failure.
+ */
+static int
+compress_stream_feed(compress_stream_t *stream,
+                     const char *in, size_t in_len, int finish)
+{
+  while (1) {
+    switch (tor_compress_process(stream->state,
+                                 &stream->outptr, &stream->out_remaining,
+                                 &in, &in_len, finish)) {
+      case TOR_COMPRESS_DONE:
+        if (finish)
+          return 0;
+        break;
+      case TOR_COMPRESS_OK:
+        /* Every backend should say DONE once it has finished. */
+        if (finish)
+          return -1;
+        if (in_len == 0)
+          return 0;
+        break;
+      case TOR_COMPRESS_BUFFER_FULL: {
+        if (stream->out_alloc >= SIZE_T_CEILING / 2)
+          return -1;
+        const size_t offset = stream->outptr - stream->out;
+        stream->out_alloc *= 2;
+        stream->out = tor_realloc(stream->out, stream->out_alloc);
+        stream->outptr = stream->out + offset;
+        stream->out_remaining = stream->out_alloc - offset;
+        break;
+      }
+      case TOR_COMPRESS_ERROR:
+      default:
+        return -1;
+    }
+  }
+}
+
+/**
+ * A set of compressions that compress_multiple() does on one thread.
+ */
+typedef struct compress_group_t {
+  /** The input, shared with every other group. */
+  const uint8_t *input;
+  size_t len;
+  /** This group does methods[i] for every i < n_methods such that i is
+   * <b>first</b> more than a multiple of <b>step</b>. */
+  int first;
+  int step;
+  int n_methods;
+  const compress_method_t *methods;
+  /** Where to put the result for each of the <b>n_methods</b> methods. */
+  compressed_result_t *results_out;
+  /** True iff any of this group's compressions failed. */
+  int failed;
+} compress_group_t;
+
+/**
+ * Return a timestamp in microseconds for timing our compressors: the CPU
+ * time that the calling thread has used, if we can tell, or the monotonic
+ * time otherwise.  Only the difference between two of these means
+ * anything.
+ *
+ * We prefer CPU time because our compressors share cpuworkers with other
+ * jobs, and a thread that gets preempted in the middle of a chunk would
+ * otherwise charge its compressor for the wait.
+ */
+static uint64_t
+compress_timer_usec(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_THREAD_CPUTIME_ID)
+  struct timespec ts;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+    return ((uint64_t)ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+#endif
+  return monotime_absolute_usec();
+}
+
+/**
+ * Do all the compressions in the compress_group_t <b>arg</b>, in a single
+ * pass over the input.  We feed each chunk of the input to every compressor
+ * in turn, so we read it from memory once rather than once per method.  We
+ * time each compressor separately.
+ */
+static void
+compress_group_run(void *arg)
+{
+  compress_group_t *group = arg;
+  compress_stream_t streams[UNKNOWN_METHOD];
+  const int n = (group->n_methods - group->first + group->step - 1)
+    / group->step;
+  int i, j;
+  size_t pos = 0;
+
+  tor_assert(n <= (int)ARRAY_LENGTH(streams));
+  memset(streams, 0, sizeof(streams));
+
+  for (j = 0; j < n; ++j) {
+    i = group->first + j * group->step;
+    const uint64_t start = compress_timer_usec();
+    streams[j].state = tor_compress_new(1, group->methods[i],
+                                        BEST_COMPRESSION);
+    const uint64_t end = compress_timer_usec();
+    if (end > start)
+      group->results_out[i].usec += end - start;
+    if (!streams[j].state) {
+      log_warn(LD_DIRSERV, "Unable to start compressing with %s",
+               compression_method_get_name(group->methods[i]));
+    }
+    /* Guess a factor of 2, as tor_compress() does. */
+    streams[j].out_alloc = streams[j].out_remaining =
+      MAX(group->len / 2, 1024);
+    streams[j].out = streams[j].outptr = tor_malloc(streams[j].out_alloc);
+  }
+
+  do {
+    const size_t chunk_len = MIN(group->len - pos, COMPRESS_CHUNK_LEN);
+    const int finish = (pos + chunk_len == group->len);
+    for (j = 0; j < n; ++j) {
+      if (!streams[j].state)
+        continue;
+      i = group->first + j * group->step;
+      const uint64_t start = compress_timer_usec();
+      int r = compress_stream_feed(&streams[j],
+                                   (const char*)group->input + pos,
+                                   chunk_len, finish);
+      const uint64_t end = compress_timer_usec();
+      if (end > start)
+        group->results_out[i].usec += end - start;
+      if (r < 0) {
+        log_warn(LD_DIRSERV, "Error while compressing with %s",
+                 compression_method_get_name(group->methods[i]));
+        tor_compress_free(streams[j].state);
+      }
+    }
+    pos += chunk_len;
+  } while (pos < group->len);
+
+  for (j = 0; j < n; ++j) {
+    i = group->first + j * group->step;
+    if (!streams[j].state) {
+      tor_free(streams[j].out);
+      group->failed = 1;
+      continue;
+    }
+    tor_compress_free(streams[j].state);
+    const size_t out_len = streams[j].outptr - streams[j].out;
+    if (tor_compress_is_compression_bomb(out_len, group->len)) {
+      /* As in tor_compress(). */
+      log_warn(LD_BUG, "We compressed something with %s and got an insanely "
+               "high compression factor; other Tors would think this was a "
+               "compression bomb.",
+               compression_method_get_name(group->methods[i]));
+      tor_free(streams[j].out);
+      group->failed = 1;
+      continue;
+    }
+    group->results_out[i].body = (uint8_t *)streams[j].out;
+    group->results_out[i].bodylen = out_len;
+  }
+}
 
 /**
  * Compress the bytestring <b>input</b> of length <b>len</b> using the
  * <n>n_methods</b> compression methods listed in the array <b>methods</b>.
  *
+ * Share the methods out among <b>n_groups</b> groups, and run the groups in
+ * parallel on our cpuworkers if we have any.  Each group reads the input
+ * only once: see compress_group_run().  This may be called from a
+ * cpuworker.
+ *
  * For each successful compression, set the fields in the <b>results_out</b>
  * array in the position corresponding to the compression method. Use
  * <b>labels_in</b> as a basis for the labels of the result.
  *
  * Return 0 if all compression succeeded; -1 if any failed.
  */
-static int
-compress_multiple(compressed_result_t *results_out, int n_methods,
-                  const compress_method_t *methods,
-                  const uint8_t *input, size_t len,
-                  const config_line_t *labels_in)
+STATIC int
+compress_multiple_in_groups(compressed_result_t *results_out, int n_methods,
+                            const compress_method_t *methods,
+                            const uint8_t *input, size_t len,
+                            const config_line_t *labels_in,
+                            int n_groups)
 {
+  compress_group_t groups[UNKNOWN_METHOD];
+  void *args[UNKNOWN_METHOD];
   int rv = 0;
   int i;
-  for (i = 0; i < n_methods; ++i) {
-    compress_method_t method = methods[i];
-    const char *methodname = compression_method_get_name(method);
-    char *result;
-    size_t sz;
-    if (0 == tor_compress(&result, &sz, (const char*)input, len, method)) {
-      results_out[i].body = (uint8_t*)result;
-      results_out[i].bodylen = sz;
-      results_out[i].labels = config_lines_dup(labels_in);
-      cdm_labels_prepend_sha3(&results_out[i].labels, LABEL_SHA3_DIGEST,
-                              results_out[i].body,
-                              results_out[i].bodylen);
-      config_line_prepend(&results_out[i].labels,
-                          LABEL_COMPRESSION_TYPE,
-                          methodname);
-    } else {
+
+  tor_assert(n_methods <= (int)ARRAY_LENGTH(groups));
+  if (n_methods <= 0)
+    return 0;
+  n_groups = CLAMP(1, n_groups, n_methods);
+
+  for (i = 0; i < n_groups; ++i) {
+    memset(&groups[i], 0, sizeof(groups[i]));
+    groups[i].input = input;
+    groups[i].len = len;
+    groups[i].first = i;
+    groups[i].step = n_groups;
+    groups[i].n_methods = n_methods;
+    groups[i].methods = methods;
+    groups[i].results_out = results_out;
+    args[i] = &groups[i];
+  }
+  cpuworker_run_in_parallel(compress_group_run, args, n_groups, WQ_PRI_LOW);
+
+  for (i = 0; i < n_groups; ++i) {
+    if (groups[i].failed)
       rv = -1;
-    }
+  }
+
+  for (i = 0; i < n_methods; ++i) {
+    if (!results_out[i].body)
+      continue;
+    results_out[i].labels = config_lines_dup(labels_in);
+    cdm_labels_prepend_sha3(&results_out[i].labels, LABEL_SHA3_DIGEST,
+                            results_out[i].body,
+                            results_out[i].bodylen);
+    config_line_prepend(&results_out[i].labels,
+                        LABEL_COMPRESSION_TYPE,
+                        compression_method_get_name(methods[i]));
   }
   return rv;
 }
 
+/**
+ * As compress_multiple_in_groups(), but use as many groups as we have
+ * cpuworkers, so that the slowest method doesn't hold up the others.
+ */
+static int
+compress_multiple(compressed_result_t *results_out, int n_methods,
+                  const compress_method_t *methods,
+                  const uint8_t *input, size_t len,
+                  const config_line_t *labels_in)
+{
+  return compress_multiple_in_groups(results_out, n_methods, methods,
+                                     input, len, labels_in,
+                                     cpuworker_get_n_threads());
+}
+
 /**
  * Given an array of <b>n</b> compressed_result_t in <b>results</b>,
  * as produced by compress_multiple, store them all into the
@@ -1661,6 +2076,15 @@ consensus_diff_worker_replyfn(void *work_)
                               job->out,
                               description);
 
+  cdm_note_compressed(compress_diffs_with+1, job->out+1,
+                      n_diff_compression_methods()-1, job->out[0].bodylen);
+  time_t to_valid_after;
+  if (status == CDM_DIFF_PRESENT && flav >= 0 &&
+      consensus_cache_entry_get_valid_after(job->diff_to,
+                                            &to_valid_after) == 0) {
+    cdm_note_stored(flav, to_valid_after, 1);
+  }
+
   if (status != CDM_DIFF_PRESENT) {
     /* Failure! Nothing to do but complain */
     log_warn(LD_DIRSERV,
@@ -1735,6 +2159,7 @@ typedef struct consensus_compress_worker_job_t {
   char *consensus;
   size_t consensus_len;
   consensus_flavor_t flavor;
+  time_t valid_after;
   config_line_t *labels_in;
   compressed_result_t out[ARRAY_LENGTH(compress_consensus_with)];
 } consensus_compress_worker_job_t;
@@ -1814,16 +2239,20 @@ consensus_compress_worker_replyfn(void *work_)
                                ARRAY_LENGTH(compress_consensus_with)];
   memset(handles, 0, sizeof(handles));
 
-  store_multiple(handles,
-                 n_consensus_compression_methods(),
-                 compress_consensus_with,
-                 job->out,
-                 "consensus");
+  int status = store_multiple(handles,
+                              n_consensus_compression_methods(),
+                              compress_consensus_with,
+                              job->out,
+                              "consensus");
   mark_cdm_cache_dirty();
 
   unsigned u;
   consensus_flavor_t f = job->flavor;
   tor_assert((int)f < N_CONSENSUS_FLAVORS);
+  cdm_note_compressed(compress_consensus_with, job->out,
+                      n_consensus_compression_methods(), job->consensus_len);
+  if (status == CDM_DIFF_PRESENT)
+    cdm_note_stored(f, job->valid_after, 0);
   for (u = 0; u < ARRAY_LENGTH(handles); ++u) {
     if (handles[u] == NULL)
       continue;
@@ -1855,6 +2284,7 @@ consensus_queue_compression_work(const char *consensus,
   job->consensus = tor_memdup_nulterm(consensus, consensus_len);
   job->consensus_len = strlen(job->consensus);
   job->flavor = as_parsed->flavor;
+  job->valid_after = as_parsed->valid_after;
 
   char va_str[ISO_TIME_LEN+1];
   char vu_str[ISO_TIME_LEN+1];
@@ -59,8 +59,33 @@ struct sandbox_cfg_elem;
 int consdiffmgr_register_with_sandbox(struct sandbox_cfg_elem **cfg);
 void consdiffmgr_free_all(void);
 int consdiffmgr_validate(void);
+void consdiffmgr_log_heartbeat(void);
 
 #ifdef CONSDIFFMGR_PRIVATE
+/** The result of compressing a document with one compression method. */
+typedef struct compressed_result_t {
+  struct config_line_t *labels;
+  /**
+   * Output: Body of the diff, as compressed.
+   */
+  uint8_t *body;
+  /**
+   * Output: length of body_out
+   */
+  size_t bodylen;
+  /**
+   * Output: how many microseconds of CPU time the compressor spent making
+   * <b>body</b>.
+   */
+  int64_t usec;
+} compressed_result_t;
+
+STATIC int compress_multiple_in_groups(compressed_result_t *results_out,
+                                       int n_methods,
+                                       const enum compress_method_t *methods,
+                                       const uint8_t *input, size_t len,
+                                       const struct config_line_t *labels_in,
+                                       int n_groups);
 STATIC unsigned n_diff_compression_methods(void);
 STATIC unsigned n_consensus_compression_methods(void);
 STATIC consensus_cache_t *cdm_cache_get(void);
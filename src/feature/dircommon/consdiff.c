@@ -15,17 +15,18 @@
  * it, relying on gen_ed_diff to generate the ed diff and some digest helper
  * functions to generate the digest hashes.
  *
- * gen_ed_diff is the tricky bit. In it simplest form, it will take quadratic
- * time and linear space to generate an ed diff given two smartlists. As shown
- * in its comment section, calling calc_changes on the entire two consensuses
- * will calculate what is to be added and what is to be deleted in the diff.
- * Its comment section briefly explains how it works.
+ * gen_ed_diff is the tricky bit. In it simplest form, it will take
+ * O((N+M)D) time and linear space to generate an ed diff given two
+ * smartlists of N and M lines that differ by D lines. As shown in its comment
+ * section, calling myers_changes on the entire two consensuses will calculate
+ * what is to be added and what is to be deleted in the diff, using Myers'
+ * O(ND) algorithm.  Its comment section briefly explains how it works.
  *
  * In our case specific to consensuses, we take advantage of the fact that
  * consensuses list routers sorted by their identities. We use that
- * information to avoid running calc_changes on the whole smartlists.
+ * information to avoid running myers_changes on the whole smartlists.
  * gen_ed_diff will navigate through the two consensuses identity by identity
- * and will send small couples of slices to calc_changes, keeping the running
+ * and will send small couples of ranges to myers_changes, keeping the running
  * time near-linear. This is explained in more detail in the gen_ed_diff
  * comments.
  *
@@ -42,6 +43,7 @@
 #include "feature/dircommon/consdiff.h"
 #include "lib/memarea/memarea.h"
 #include "feature/dirparse/ns_parse.h"
+#include "ext/siphash.h"
 
 static const char* ns_diff_version = "network-status-diff-version 1";
 static const char* hash_token = "hash";
@@ -131,6 +133,11 @@ consensus_digest_eq,(const uint8_t *d1,
   return fast_memeq(d1, d2, DIGEST256_LEN);
 }
 
+#ifdef TOR_UNIT_TESTS
+/* The functions from here to calc_changes() are the quadratic diff engine
+ * that gen_ed_diff used before myers_changes().  We keep them in test builds
+ * so that the tests can check the two engines against each other. */
+
 /** Create (allocate) a new slice from a smartlist. Assumes that the start
  * and the end indexes are within the bounds of the initial smartlist. The end
  * element is not part of the resulting slice. If end is -1, the slice is to
@@ -360,6 +367,203 @@ calc_changes(smartlist_slice_t *slice1,
     tor_free(right);
   }
 }
+#endif /* defined(TOR_UNIT_TESTS) */
+
+/** Set up <b>st</b> to find the changes between <b>cons1</b> and
+ * <b>cons2</b> with myers_changes(), recording them in <b>changed1</b> and
+ * <b>changed2</b>. */
+STATIC void
+myers_state_init(myers_state_t *st,
+                 const smartlist_t *cons1, const smartlist_t *cons2,
+                 bitarray_t *changed1, bitarray_t *changed2)
+{
+  const int len1 = smartlist_len(cons1), len2 = smartlist_len(cons2);
+  memset(st, 0, sizeof(*st));
+  st->lines1 = (const cdline_t **) cons1->list;
+  st->lines2 = (const cdline_t **) cons2->list;
+  st->hashes1 = tor_calloc(len1 + 1, sizeof(uint32_t));
+  st->hashes2 = tor_calloc(len2 + 1, sizeof(uint32_t));
+  /* Diagonals run from -len2-1 to len1+1. */
+  st->fdiag_mem = tor_calloc(len1 + len2 + 3, sizeof(int));
+  st->bdiag_mem = tor_calloc(len1 + len2 + 3, sizeof(int));
+  st->fdiag = st->fdiag_mem + len2 + 1;
+  st->bdiag = st->bdiag_mem + len2 + 1;
+  st->changed1 = changed1;
+  st->changed2 = changed2;
+}
+
+/** Release the storage held by <b>st</b>. */
+STATIC void
+myers_state_clear(myers_state_t *st)
+{
+  tor_free(st->hashes1);
+  tor_free(st->hashes2);
+  tor_free(st->fdiag_mem);
+  tor_free(st->bdiag_mem);
+  st->fdiag = st->bdiag = NULL;
+}
+
+/** Return true iff line <b>x</b> of the first consensus in <b>st</b> is the
+ * same as line <b>y</b> of the second.  Both lines must have been hashed. */
+static inline int
+myers_lines_eq(const myers_state_t *st, int x, int y)
+{
+  return st->hashes1[x] == st->hashes2[y] &&
+    lines_eq(st->lines1[x], st->lines2[y]);
+}
+
+/** Helper for myers_changes(): find the middle snake of a shortest edit
+ * script from lines [<b>xoff</b>, <b>xlim</b>) of the first consensus to
+ * lines [<b>yoff</b>, <b>ylim</b>) of the second, and store a point on it in
+ * *<b>xmid_out</b> and *<b>ymid_out</b>.
+ *
+ * This searches forward from the top-left corner and backward from the
+ * bottom-right corner at the same time, one edit at a time, until the two
+ * searches meet; see Myers, "An O(ND) Difference Algorithm and Its
+ * Variations", section 4b.  Both ranges must be nonempty, and must differ in
+ * their first lines and in their last lines.
+ */
+static void
+myers_middle_snake(const myers_state_t *st,
+                   int xoff, int xlim, int yoff, int ylim,
+                   int *xmid_out, int *ymid_out)
+{
+  int *fd = st->fdiag, *bd = st->bdiag;
+  /* Diagonal k holds the points where x - y == k. */
+  const int dmin = xoff - ylim, dmax = xlim - yoff;
+  const int fmid = xoff - yoff, bmid = xlim - ylim;
+  int fmin = fmid, fmax = fmid, bmin = bmid, bmax = bmid;
+  /* If the diagonals of the two corners differ by an odd number, the
+   * searches can only meet while extending the forward one. */
+  const int odd = (fmid - bmid) & 1;
+
+  fd[fmid] = xoff;
+  bd[bmid] = xlim;
+
+  for (;;) {
+    int k;
+
+    /* Extend the forward search by one edit on each of its diagonals. */
+    if (fmin > dmin)
+      fd[--fmin - 1] = -1;
+    else
+      ++fmin;
+    if (fmax < dmax)
+      fd[++fmax + 1] = -1;
+    else
+      --fmax;
+    for (k = fmax; k >= fmin; k -= 2) {
+      int x, y;
+      const int lo = fd[k - 1], hi = fd[k + 1];
+      x = lo < hi ? hi : lo + 1;
+      y = x - k;
+      while (x < xlim && y < ylim && myers_lines_eq(st, x, y)) {
+        ++x;
+        ++y;
+      }
+      fd[k] = x;
+      if (odd && bmin <= k && k <= bmax && bd[k] <= x) {
+        *xmid_out = x;
+        *ymid_out = y;
+        return;
+      }
+    }
+
+    /* Likewise extend the backward search. */
+    if (bmin > dmin)
+      bd[--bmin - 1] = INT_MAX;
+    else
+      ++bmin;
+    if (bmax < dmax)
+      bd[++bmax + 1] = INT_MAX;
+    else
+      --bmax;
+    for (k = bmax; k >= bmin; k -= 2) {
+      int x, y;
+      const int lo = bd[k - 1], hi = bd[k + 1];
+      x = lo < hi ? lo : hi - 1;
+      y = x - k;
+      while (x > xoff && y > yoff && myers_lines_eq(st, x - 1, y - 1)) {
+        --x;
+        --y;
+      }
+      bd[k] = x;
+      if (!odd && fmin <= k && k <= fmax && x <= fd[k]) {
+        *xmid_out = x;
+        *ymid_out = y;
+        return;
+      }
+    }
+  }
+}
+
+/** Helper for myers_changes(): as myers_changes(), but every line in the
+ * ranges must already have been hashed. */
+static void
+myers_changes_hashed(const myers_state_t *st,
+                     int xoff, int xlim, int yoff, int ylim)
+{
+  /* Skip the lines that are the same at the start and at the end. */
+  while (xoff < xlim && yoff < ylim && myers_lines_eq(st, xoff, yoff)) {
+    ++xoff;
+    ++yoff;
+  }
+  while (xoff < xlim && yoff < ylim &&
+         myers_lines_eq(st, xlim - 1, ylim - 1)) {
+    --xlim;
+    --ylim;
+  }
+
+  if (xoff == xlim) {
+    while (yoff < ylim)
+      bitarray_set(st->changed2, yoff++);
+  } else if (yoff == ylim) {
+    while (xoff < xlim)
+      bitarray_set(st->changed1, xoff++);
+  } else {
+    int xmid, ymid;
+    myers_middle_snake(st, xoff, xlim, yoff, ylim, &xmid, &ymid);
+    myers_changes_hashed(st, xoff, xmid, yoff, ymid);
+    myers_changes_hashed(st, xmid, xlim, ymid, ylim);
+  }
+}
+
+/** Find a shortest set of changes that turns lines [<b>xoff</b>,
+ * <b>xlim</b>) of the first consensus in <b>st</b> into lines [<b>yoff</b>,
+ * <b>ylim</b>) of the second, and set the bits for the deleted and added
+ * lines in st-\>changed1 and st-\>changed2.
+ *
+ * This does the same job as calc_changes(), but in O((N+M)D) time for
+ * ranges of N and M lines that differ by D lines, rather than O(NM).  We
+ * hash the lines that are left once the common start and end are trimmed
+ * off, so that most comparisons in the search are integer comparisons.
+ */
+STATIC void
+myers_changes(const myers_state_t *st,
+              int xoff, int xlim, int yoff, int ylim)
+{
+  int i;
+
+  while (xoff < xlim && yoff < ylim &&
+         lines_eq(st->lines1[xoff], st->lines2[yoff])) {
+    ++xoff;
+    ++yoff;
+  }
+  while (xoff < xlim && yoff < ylim &&
+         lines_eq(st->lines1[xlim - 1], st->lines2[ylim - 1])) {
+    --xlim;
+    --ylim;
+  }
+  if (xoff < xlim && yoff < ylim) {
+    for (i = xoff; i < xlim; ++i)
+      st->hashes1[i] = (uint32_t) siphash24g(st->lines1[i]->s,
+                                             st->lines1[i]->len);
+    for (i = yoff; i < ylim; ++i)
+      st->hashes2[i] = (uint32_t) siphash24g(st->lines2[i]->s,
+                                             st->lines2[i]->len);
+  }
+  myers_changes_hashed(st, xoff, xlim, yoff, ylim);
+}
 
 /* This table is from crypto.c. The SP and PAD defines are different. */
 #define NOT_VALID_BASE64 255
@@ -608,16 +812,16 @@ preprocess_consensus(memarea_t *area,
  * in one of the inputs, or are newly allocated lines in the provided memarea.
  *
  * This implementation is consensus-specific. To generate an ed diff for any
- * given input in quadratic time, you can replace all the code until the
+ * given input in O((N+M)D) time, you can replace all the code until the
  * navigation in reverse order with the following:
  *
  *   int len1 = smartlist_len(cons1);
  *   int len2 = smartlist_len(cons2);
  *   bitarray_t *changed1 = bitarray_init_zero(len1);
  *   bitarray_t *changed2 = bitarray_init_zero(len2);
- *   cons1_sl = smartlist_slice(cons1, 0, -1);
- *   cons2_sl = smartlist_slice(cons2, 0, -1);
- *   calc_changes(cons1_sl, cons2_sl, changed1, changed2);
+ *   myers_state_t myers;
+ *   myers_state_init(&myers, cons1, cons2, changed1, changed2);
+ *   myers_changes(&myers, 0, len1, 0, len2);
  */
 STATIC smartlist_t *
 gen_ed_diff(const smartlist_t *cons1_orig, const smartlist_t *cons2,
@@ -636,11 +840,13 @@ gen_ed_diff(const smartlist_t *cons1_orig, const smartlist_t *cons2,
     smartlist_add(result, remove_trailer);
   }
 
-  /* Initialize the changed bitarrays to zero, so that calc_changes only needs
-   * to set the ones that matter and leave the rest untouched.
+  /* Initialize the changed bitarrays to zero, so that myers_changes only
+   * needs to set the ones that matter and leave the rest untouched.
    */
   bitarray_t *changed1 = bitarray_init_zero(len1);
   bitarray_t *changed2 = bitarray_init_zero(len2);
+  myers_state_t myers;
+  myers_state_init(&myers, cons1, cons2, changed1, changed2);
   int i1=-1, i2=-1;
   int start1=0, start2=0;
 
@@ -720,11 +926,10 @@ gen_ed_diff(const smartlist_t *cons1_orig, const smartlist_t *cons2,
       }
     }
 
-    /* Make slices out of these chunks (up to the common router entry) and
-     * calculate the changes for them.
-     * Error if any of the two slices are longer than 10K lines. That should
-     * never happen with any pair of real consensuses. Feeding more than 10K
-     * lines to calc_changes would be very slow anyway.
+    /* Calculate the changes for these chunks (up to the common router
+     * entry).
+     * Error if any of the two chunks are longer than 10K lines. That should
+     * never happen with any pair of real consensuses.
      */
 #define MAX_LINE_COUNT (10000)
     if (i1-start1 > MAX_LINE_COUNT || i2-start2 > MAX_LINE_COUNT) {
@@ -733,11 +938,7 @@ gen_ed_diff(const smartlist_t *cons1_orig, const smartlist_t *cons2,
       goto error_cleanup;
     }
 
-    smartlist_slice_t *cons1_sl = smartlist_slice(cons1, start1, i1);
-    smartlist_slice_t *cons2_sl = smartlist_slice(cons2, start2, i2);
-    calc_changes(cons1_sl, cons2_sl, changed1, changed2);
-    tor_free(cons1_sl);
-    tor_free(cons2_sl);
+    myers_changes(&myers, start1, i1, start2, i2);
     start1 = i1, start2 = i2;
   }
 
@@ -812,6 +1013,7 @@ gen_ed_diff(const smartlist_t *cons1_orig, const smartlist_t *cons2,
   smartlist_free(cons1);
   bitarray_free(changed1);
   bitarray_free(changed2);
+  myers_state_clear(&myers);
 
   return result;
 
@@ -820,6 +1022,7 @@ gen_ed_diff(const smartlist_t *cons1_orig, const smartlist_t *cons2,
   smartlist_free(cons1);
   bitarray_free(changed1);
   bitarray_free(changed2);
+  myers_state_clear(&myers);
 
   smartlist_free(result);
 
@@ -846,20 +1049,22 @@ get_linenum(const char **s, int *num_out)
   }
 }
 
-/** Apply the ed diff, starting at <b>diff_starting_line</b>, to the consensus
- * and return a new consensus, also as a line-based smartlist. Will return
+/** Parse the ed diff in <b>diff</b>, starting at line
+ * <b>diff_starting_line</b>, for a consensus of <b>n_lines1</b> lines.  On
+ * success, return a newly allocated array of its commands, in the order they
+ * appear in the diff, and set *<b>n_commands_out</b> to their number.  Return
  * NULL if the ed diff is not properly formatted.
- *
- * All cdline_t objects in the resulting object are references to lines
- * in one of the inputs; nothing is copied.
  */
-STATIC smartlist_t *
-apply_ed_diff(const smartlist_t *cons1, const smartlist_t *diff,
-              int diff_starting_line)
+STATIC ed_command_t *
+parse_ed_diff(const smartlist_t *diff, int diff_starting_line,
+              int n_lines1, int *n_commands_out)
 {
   int diff_len = smartlist_len(diff);
-  int j = smartlist_len(cons1);
-  smartlist_t *cons2 = smartlist_new();
+  /* The lines of the consensus that are left for later commands to use are
+   * 1 through j. */
+  int j = n_lines1;
+  int n_commands = 0, n_allocated = 16;
+  ed_command_t *commands = tor_calloc(n_allocated, sizeof(ed_command_t));
 
   for (int i=diff_starting_line; i<diff_len; ++i) {
     const cdline_t *diff_cdline = smartlist_get(diff, i);
@@ -888,7 +1093,7 @@ apply_ed_diff(const smartlist_t *cons1, const smartlist_t *diff,
       ++ptr;
       if (*ptr == '$') {
         end_was_eof = 1;
-        end = smartlist_len(cons1);
+        end = n_lines1;
         ++ptr;
       } else if (get_linenum(&ptr, &end) < 0) {
         log_warn(LD_CONSDIFF, "Could not apply consensus diff because "
@@ -951,22 +1156,22 @@ apply_ed_diff(const smartlist_t *cons1, const smartlist_t *diff,
       goto error_cleanup;
     }
 
-    /* Add unchanged lines. */
-    for (; j && j > end; --j) {
-      cdline_t *cons_line = smartlist_get(cons1, j-1);
-      smartlist_add(cons2, cons_line);
+    if (n_commands == n_allocated) {
+      n_allocated *= 2;
+      commands = tor_reallocarray(commands, n_allocated,
+                                  sizeof(ed_command_t));
     }
+    ed_command_t *command = &commands[n_commands++];
+    command->start = start;
+    command->end = end;
+    command->action = action;
+    command->added_start = command->added_end = i+1;
 
-    /* Ignore removed lines. */
-    if (action == 'c' || action == 'd') {
-      while (--j >= start) {
-        /* Skip line */
-      }
-    }
+    /* Later commands may only use the lines before this one.  (If start is
+     * 0, this leaves none at all.) */
+    j = (action == 'a') ? end : start - 1;
 
-    /* Add new lines in reverse order, since it will all be reversed at the
-     * end.
-     */
+    /* Find the lines to add. */
     if (action == 'a' || action == 'c') {
       int added_end = i;
 
@@ -991,10 +1196,63 @@ apply_ed_diff(const smartlist_t *cons1, const smartlist_t *diff,
         goto error_cleanup;
       }
 
-      while (added_i > added_end) {
-        cdline_t *added_line = smartlist_get(diff, added_i--);
-        smartlist_add(cons2, added_line);
-      }
+      command->added_end = i;
+    }
+  }
+
+  *n_commands_out = n_commands;
+  return commands;
+
+ error_cleanup:
+
+  tor_free(commands);
+
+  return NULL;
+}
+
+/** Apply the ed diff, starting at <b>diff_starting_line</b>, to the consensus
+ * and return a new consensus, also as a line-based smartlist. Will return
+ * NULL if the ed diff is not properly formatted.
+ *
+ * All cdline_t objects in the resulting object are references to lines
+ * in one of the inputs; nothing is copied.
+ */
+STATIC smartlist_t *
+apply_ed_diff(const smartlist_t *cons1, const smartlist_t *diff,
+              int diff_starting_line)
+{
+  int j = smartlist_len(cons1);
+  int n_commands;
+  ed_command_t *commands = parse_ed_diff(diff, diff_starting_line, j,
+                                         &n_commands);
+  smartlist_t *cons2;
+
+  if (!commands) {
+    /* Reason already logged by parse_ed_diff. */
+    return NULL;
+  }
+
+  cons2 = smartlist_new();
+  for (int c = 0; c < n_commands; ++c) {
+    const ed_command_t *command = &commands[c];
+
+    /* Add unchanged lines. */
+    for (; j && j > command->end; --j) {
+      cdline_t *cons_line = smartlist_get(cons1, j-1);
+      smartlist_add(cons2, cons_line);
+    }
+
+    /* Ignore removed lines. */
+    if (command->action == 'c' || command->action == 'd') {
+      j = command->start - 1;
+    }
+
+    /* Add new lines in reverse order, since it will all be reversed at the
+     * end.
+     */
+    for (int i = command->added_end - 1; i >= command->added_start; --i) {
+      cdline_t *added_line = smartlist_get(diff, i);
+      smartlist_add(cons2, added_line);
     }
   }
 
@@ -1006,13 +1264,112 @@ apply_ed_diff(const smartlist_t *cons1, const smartlist_t *diff,
 
   /* Reverse the whole thing since we did it from the end. */
   smartlist_reverse(cons2);
+  tor_free(commands);
   return cons2;
+}
 
- error_cleanup:
+/** Return a pointer to the start of the line <b>n</b> lines after the one
+ * that starts at <b>s</b>.  The caller must make sure that there are at
+ * least <b>n</b> NL-terminated lines before <b>eos</b>. */
+static const char *
+skip_lines(const char *s, const char *eos, int n)
+{
+  while (n--) {
+    const char *eol = memchr(s, '\n', eos - s);
+    tor_assert(eol);
+    s = eol + 1;
+  }
+  return s;
+}
 
-  smartlist_free(cons2);
+/** How many bytes of output apply_ed_diff_to_str() collects before adding
+ * them to its digest. */
+#define APPLY_DIGEST_CHUNK (1<<16)
 
-  return NULL;
+/** Apply the ed diff, starting at <b>diff_starting_line</b>, to the
+ * <b>cons1_len</b>-byte consensus <b>cons1</b>, which must hold
+ * <b>n_lines1</b> NL-terminated lines.  Return the new consensus as a newly
+ * allocated NUL-terminated string, and add its contents to <b>digest</b>.
+ * Will return NULL if the ed diff is not properly formatted.
+ *
+ * This gives the same result as apply_ed_diff() followed by
+ * consensus_join_lines(), but never splits <b>cons1</b> into lines: it
+ * walks the commands forward through <b>cons1</b>, copying unchanged runs of
+ * lines straight into a single buffer of the right size, and hashes that
+ * buffer while its end is still in the cache.
+ */
+STATIC char *
+apply_ed_diff_to_str(const char *cons1, size_t cons1_len, int n_lines1,
+                     const smartlist_t *diff, int diff_starting_line,
+                     crypto_digest_t *digest)
+{
+  int n_commands;
+  ed_command_t *commands = parse_ed_diff(diff, diff_starting_line, n_lines1,
+                                         &n_commands);
+  const char *in = cons1, *eos = cons1 + cons1_len;
+  char *result, *out, *hashed;
+  size_t result_len = cons1_len + 1;
+  /* The number of lines of cons1 that we have copied or skipped. */
+  int line = 0;
+
+  if (!commands) {
+    /* Reason already logged by parse_ed_diff. */
+    return NULL;
+  }
+
+  for (int c = 0; c < n_commands; ++c) {
+    for (int i = commands[c].added_start; i < commands[c].added_end; ++i) {
+      const cdline_t *added_line = smartlist_get(diff, i);
+      result_len += added_line->len + 1;
+    }
+  }
+  result = out = hashed = tor_malloc(result_len);
+
+  /* The commands run from the end of cons1 to its start, so take them in
+   * reverse. */
+  for (int c = n_commands - 1; c >= 0; --c) {
+    const ed_command_t *command = &commands[c];
+    int keep_until = command->action == 'a' ?
+      command->start : command->start - 1;
+
+    /* Copy unchanged lines. */
+    if (keep_until > line) {
+      const char *next = skip_lines(in, eos, keep_until - line);
+      memcpy(out, in, next - in);
+      out += next - in;
+      in = next;
+      line = keep_until;
+    }
+
+    /* Skip removed lines. */
+    if (command->action != 'a' && command->end > line) {
+      in = skip_lines(in, eos, command->end - line);
+      line = command->end;
+    }
+
+    /* Add new lines. */
+    for (int i = command->added_start; i < command->added_end; ++i) {
+      const cdline_t *added_line = smartlist_get(diff, i);
+      memcpy(out, added_line->s, added_line->len);
+      out += added_line->len;
+      *out++ = '\n';
+    }
+
+    if (out - hashed >= APPLY_DIGEST_CHUNK) {
+      crypto_digest_add_bytes(digest, hashed, out - hashed);
+      hashed = out;
+    }
+  }
+
+  /* Copy remaining unchanged lines. */
+  memcpy(out, in, eos - in);
+  out += eos - in;
+  crypto_digest_add_bytes(digest, hashed, out - hashed);
+  *out++ = '\0';
+  tor_assert(out <= result + result_len);
+
+  tor_free(commands);
+  return result;
 }
 
 /** Generate a consensus diff as a smartlist from two given consensuses, also
@@ -1181,23 +1538,20 @@ consdiff_get_digests(const smartlist_t *diff,
   return 1;
 }
 
-/** Apply the consensus diff to the given consensus and return a new
- * consensus, also as a line-based smartlist. Will return NULL if the diff
- * could not be applied. Neither the consensus nor the diff are modified in
- * any way, so it's up to the caller to free their resources.
- */
-char *
-consdiff_apply_diff(const smartlist_t *cons1,
-                    const smartlist_t *diff,
-                    const consensus_digest_t *digests1)
+/** Helper for applying a consensus diff: check that <b>digests1</b> is the
+ * digest of the base consensus that the header of <b>diff</b> names, and
+ * store the digest that the header gives for the resulting consensus in
+ * <b>e_cons2_hash_out</b>.  Return 0 if the base consensus matches, and -1
+ * otherwise. */
+static int
+check_diff_base_digest(const smartlist_t *diff,
+                       const consensus_digest_t *digests1,
+                       char *e_cons2_hash_out)
 {
-  smartlist_t *cons2 = NULL;
-  char *cons2_str = NULL;
   char e_cons1_hash[DIGEST256_LEN];
-  char e_cons2_hash[DIGEST256_LEN];
 
-  if (consdiff_get_digests(diff, e_cons1_hash, e_cons2_hash) != 0) {
-    goto error_cleanup;
+  if (consdiff_get_digests(diff, e_cons1_hash, e_cons2_hash_out) != 0) {
+    return -1;
   }
 
   /* See that the consensus that was given to us matches its hash. */
@@ -1214,6 +1568,59 @@ consdiff_apply_diff(const smartlist_t *cons1,
                   e_cons1_hash, DIGEST256_LEN);
     log_warn(LD_CONSDIFF, "Expected: %s; found: %s",
              hex_digest1, e_hex_digest1);
+    return -1;
+  }
+
+  return 0;
+}
+
+/** Helper for applying a consensus diff: return 0 if <b>cons2_digests</b>,
+ * the digest of the consensus that we built, matches <b>e_cons2_hash</b>,
+ * the digest that the diff header gives for it.  Otherwise return -1. */
+static int
+check_diff_result_digest(const consensus_digest_t *cons2_digests,
+                         const char *e_cons2_hash)
+{
+  /* See that the resulting consensus matches its hash. */
+  if (!consensus_digest_eq(cons2_digests->sha3_256,
+                           (const uint8_t*)e_cons2_hash)) {
+    log_warn(LD_CONSDIFF, "Refusing to apply consensus diff because "
+        "the resulting consensus doesn't match the digest as found in "
+        "the consensus diff header.");
+    char hex_digest2[HEX_DIGEST256_LEN+1];
+    char e_hex_digest2[HEX_DIGEST256_LEN+1];
+    base16_encode(hex_digest2, HEX_DIGEST256_LEN+1,
+        (const char *)cons2_digests->sha3_256, DIGEST256_LEN);
+    base16_encode(e_hex_digest2, HEX_DIGEST256_LEN+1,
+        e_cons2_hash, DIGEST256_LEN);
+    log_warn(LD_CONSDIFF, "Expected: %s; found: %s",
+             hex_digest2, e_hex_digest2);
+    return -1;
+  }
+
+  return 0;
+}
+
+#ifdef TOR_UNIT_TESTS
+/* We apply consensus diffs with consdiff_apply_diff_to_str() now.  We keep
+ * this in test builds, so that the tests can check the two against each
+ * other. */
+
+/** Apply the consensus diff to the given consensus and return a new
+ * consensus, also as a line-based smartlist. Will return NULL if the diff
+ * could not be applied. Neither the consensus nor the diff are modified in
+ * any way, so it's up to the caller to free their resources.
+ */
+char *
+consdiff_apply_diff(const smartlist_t *cons1,
+                    const smartlist_t *diff,
+                    const consensus_digest_t *digests1)
+{
+  smartlist_t *cons2 = NULL;
+  char *cons2_str = NULL;
+  char e_cons2_hash[DIGEST256_LEN];
+
+  if (check_diff_base_digest(diff, digests1, e_cons2_hash) < 0) {
     goto error_cleanup;
   }
 
@@ -1238,20 +1645,7 @@ consdiff_apply_diff(const smartlist_t *cons1,
     /* LCOV_EXCL_STOP */
   }
 
-  /* See that the resulting consensus matches its hash. */
-  if (!consensus_digest_eq(cons2_digests.sha3_256,
-                           (const uint8_t*)e_cons2_hash)) {
-    log_warn(LD_CONSDIFF, "Refusing to apply consensus diff because "
-        "the resulting consensus doesn't match the digest as found in "
-        "the consensus diff header.");
-    char hex_digest2[HEX_DIGEST256_LEN+1];
-    char e_hex_digest2[HEX_DIGEST256_LEN+1];
-    base16_encode(hex_digest2, HEX_DIGEST256_LEN+1,
-        (const char *)cons2_digests.sha3_256, DIGEST256_LEN);
-    base16_encode(e_hex_digest2, HEX_DIGEST256_LEN+1,
-        e_cons2_hash, DIGEST256_LEN);
-    log_warn(LD_CONSDIFF, "Expected: %s; found: %s",
-             hex_digest2, e_hex_digest2);
+  if (check_diff_result_digest(&cons2_digests, e_cons2_hash) < 0) {
     goto error_cleanup;
   }
 
@@ -1267,6 +1661,56 @@ consdiff_apply_diff(const smartlist_t *cons1,
 
   return cons2_str;
 }
+#endif /* defined(TOR_UNIT_TESTS) */
+
+/** As consdiff_apply_diff(), but take the consensus as the
+ * <b>cons1_len</b>-byte string <b>cons1</b>, which must hold
+ * <b>n_lines1</b> NL-terminated lines.
+ *
+ * This uses apply_ed_diff_to_str(), so the only copy of the consensus that
+ * it makes is the result.
+ */
+STATIC char *
+consdiff_apply_diff_to_str(const char *cons1, size_t cons1_len,
+                           int n_lines1,
+                           const smartlist_t *diff,
+                           const consensus_digest_t *digests1)
+{
+  char *cons2_str = NULL;
+  char e_cons2_hash[DIGEST256_LEN];
+  crypto_digest_t *digest = NULL;
+  consensus_digest_t cons2_digests;
+
+  if (check_diff_base_digest(diff, digests1, e_cons2_hash) < 0) {
+    goto error_cleanup;
+  }
+
+  /* Skip the first two lines. */
+  digest = crypto_digest256_new(DIGEST_SHA3_256);
+  cons2_str = apply_ed_diff_to_str(cons1, cons1_len, n_lines1, diff, 2,
+                                   digest);
+
+  /* ed diff could not be applied - reason already logged by parse_ed_diff. */
+  if (!cons2_str) {
+    goto error_cleanup;
+  }
+
+  crypto_digest_get_digest(digest, (char *)cons2_digests.sha3_256,
+                           DIGEST256_LEN);
+  if (check_diff_result_digest(&cons2_digests, e_cons2_hash) < 0) {
+    goto error_cleanup;
+  }
+
+  goto done;
+
+ error_cleanup:
+  tor_free(cons2_str); /* Sets it to NULL */
+
+ done:
+  crypto_digest_free(digest);
+
+  return cons2_str;
+}
 
 /** Any consensus line longer than this means that the input is invalid. */
 #define CONSENSUS_LINE_MAX_LEN (1<<20)
@@ -1309,6 +1753,35 @@ consensus_split_lines(smartlist_t *out,
   return 0;
 }
 
+/**
+ * Helper: Return the number of NL-terminated lines in <b>s</b>, or -1 if
+ * consensus_split_lines() would reject it.
+ */
+static int
+consensus_count_lines(const char *s, size_t len)
+{
+  const char *end_of_str = s + len;
+  int n = 0;
+
+  while (s < end_of_str) {
+    const char *eol = memchr(s, '\n', end_of_str - s);
+    if (!eol) {
+      /* File doesn't end with newline. */
+      return -1;
+    }
+    if (eol - s > CONSENSUS_LINE_MAX_LEN) {
+      /* Line is far too long. */
+      return -1;
+    }
+    if (n == INT_MAX) {
+      return -1;
+    }
+    ++n;
+    s = eol+1;
+  }
+  return n;
+}
+
 /** Given a list of cdline_t, return a newly allocated string containing
  * all of the lines, terminated with NL, concatenated.
  *
@@ -1382,8 +1855,8 @@ consensus_diff_apply(const char *consensus,
                      size_t diff_len)
 {
   consensus_digest_t d1;
-  smartlist_t *lines1 = NULL, *lines2 = NULL;
-  int r1;
+  smartlist_t *lines2 = NULL;
+  int r1, n_lines1;
   char *result = NULL;
   memarea_t *area = memarea_new();
 
@@ -1391,17 +1864,19 @@ consensus_diff_apply(const char *consensus,
   if (BUG(r1 < 0))
     return NULL; // LCOV_EXCL_LINE
 
-  lines1 = smartlist_new();
+  /* We only split the diff into lines: the consensus is much bigger, and
+   * consdiff_apply_diff_to_str() can walk it as it is. */
   lines2 = smartlist_new();
-  if (consensus_split_lines(lines1, consensus, consensus_len, area) < 0)
+  n_lines1 = consensus_count_lines(consensus, consensus_len);
+  if (n_lines1 < 0)
     goto done;
   if (consensus_split_lines(lines2, diff, diff_len, area) < 0)
     goto done;
 
-  result = consdiff_apply_diff(lines1, lines2, &d1);
+  result = consdiff_apply_diff_to_str(consensus, consensus_len, n_lines1,
+                                      lines2, &d1);
 
  done:
-  smartlist_free(lines1);
   smartlist_free(lines2);
   memarea_drop_all(area);
 
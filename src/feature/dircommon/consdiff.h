@@ -36,9 +36,11 @@ STATIC smartlist_t *consdiff_gen_diff(const smartlist_t *cons1,
                                       const consensus_digest_t *digests1,
                                       const consensus_digest_t *digests2,
                                       struct memarea_t *area);
+#ifdef TOR_UNIT_TESTS
 STATIC char *consdiff_apply_diff(const smartlist_t *cons1,
                                  const smartlist_t *diff,
                                  const consensus_digest_t *digests1);
+#endif /* defined(TOR_UNIT_TESTS) */
 STATIC int consdiff_get_digests(const smartlist_t *diff,
                                 char *digest1_out,
                                 char *digest2_out);
@@ -55,29 +57,81 @@ typedef struct smartlist_slice_t {
   /** Length of the slice, i.e. the number of elements it holds. */
   int len;
 } smartlist_slice_t;
+
+/** One command from an ed diff, as parsed by parse_ed_diff(). */
+typedef struct ed_command_t {
+  /** The first and last lines of the base consensus that a 'c' or 'd'
+   * command replaces, counting from 1.  For an 'a' command, both are the
+   * line to add after. */
+  int start, end;
+  /** The command: 'a', 'c', or 'd'. */
+  char action;
+  /** The lines of the diff to add: those from <b>added_start</b> up to but
+   * not including <b>added_end</b>.  Empty for 'd' commands. */
+  int added_start, added_end;
+} ed_command_t;
+
+/** State for myers_changes(). */
+typedef struct myers_state_t {
+  /** The lines of each consensus. */
+  const cdline_t **lines1, **lines2;
+  /** A hash of each line of each consensus, for the lines that
+   * myers_changes() has needed to compare. */
+  uint32_t *hashes1, *hashes2;
+  /** The furthest point that the forward and backward searches have reached
+   * on each diagonal, indexed by x-y.  These point into <b>fdiag_mem</b> and
+   * <b>bdiag_mem</b>, so that they can be indexed with negative numbers. */
+  int *fdiag, *bdiag;
+  int *fdiag_mem, *bdiag_mem;
+  /** Where to record deleted lines of the first consensus and added lines of
+   * the second. */
+  bitarray_t *changed1, *changed2;
+} myers_state_t;
+
+STATIC void myers_state_init(myers_state_t *st,
+                             const smartlist_t *cons1,
+                             const smartlist_t *cons2,
+                             bitarray_t *changed1, bitarray_t *changed2);
+STATIC void myers_state_clear(myers_state_t *st);
+STATIC void myers_changes(const myers_state_t *st,
+                          int xoff, int xlim, int yoff, int ylim);
 STATIC smartlist_t *gen_ed_diff(const smartlist_t *cons1,
                                 const smartlist_t *cons2,
                                 struct memarea_t *area);
 STATIC smartlist_t *apply_ed_diff(const smartlist_t *cons1,
                                   const smartlist_t *diff,
                                   int start_line);
+STATIC ed_command_t *parse_ed_diff(const smartlist_t *diff,
+                                   int diff_starting_line,
+                                   int n_lines1, int *n_commands_out);
+STATIC char *apply_ed_diff_to_str(const char *cons1, size_t cons1_len,
+                                  int n_lines1,
+                                  const smartlist_t *diff,
+                                  int diff_starting_line,
+                                  struct crypto_digest_t *digest);
+STATIC char *consdiff_apply_diff_to_str(const char *cons1, size_t cons1_len,
+                                        int n_lines1,
+                                        const smartlist_t *diff,
+                                        const consensus_digest_t *digests1);
+#ifdef TOR_UNIT_TESTS
 STATIC void calc_changes(smartlist_slice_t *slice1, smartlist_slice_t *slice2,
                          bitarray_t *changed1, bitarray_t *changed2);
 STATIC smartlist_slice_t *smartlist_slice(const smartlist_t *list,
                                           int start, int end);
-STATIC int next_router(const smartlist_t *cons, int cur);
 STATIC int *lcs_lengths(const smartlist_slice_t *slice1,
                         const smartlist_slice_t *slice2,
                         int direction);
 STATIC void trim_slices(smartlist_slice_t *slice1, smartlist_slice_t *slice2);
-STATIC int base64cmp(const cdline_t *hash1, const cdline_t *hash2);
-STATIC int get_id_hash(const cdline_t *line, cdline_t *hash_out);
-STATIC int is_valid_router_entry(const cdline_t *line);
 STATIC int smartlist_slice_string_pos(const smartlist_slice_t *slice,
                                       const cdline_t *string);
 STATIC void set_changed(bitarray_t *changed1, bitarray_t *changed2,
                         const smartlist_slice_t *slice1,
                         const smartlist_slice_t *slice2);
+#endif /* defined(TOR_UNIT_TESTS) */
+STATIC int next_router(const smartlist_t *cons, int cur);
+STATIC int base64cmp(const cdline_t *hash1, const cdline_t *hash2);
+STATIC int get_id_hash(const cdline_t *line, cdline_t *hash_out);
+STATIC int is_valid_router_entry(const cdline_t *line);
 STATIC int consensus_split_lines(smartlist_t *out,
                                  const char *s, size_t len,
                                  struct memarea_t *area);
@@ -13,6 +13,7 @@
 
 #include "core/or/or.h"
 #include "app/config/config.h"
+#include "core/mainloop/cpuworker.h"
 #include "core/or/versions.h"
 #include "feature/client/entrynodes.h"
 #include "feature/dirauth/dirvote.h"
@@ -28,7 +29,10 @@
 #include "feature/nodelist/networkstatus.h"
 #include "feature/nodelist/nickname.h"
 #include "lib/crypt_ops/crypto_format.h"
+#include "lib/evloop/workqueue.h"
+#include "lib/lock/compat_mutex.h"
 #include "lib/memarea/memarea.h"
+#include "lib/thread/threads.h"
 
 #include "feature/dirauth/vote_microdesc_hash_st.h"
 #include "feature/nodelist/authority_cert_st.h"
@@ -200,25 +204,40 @@ router_get_networkstatus_v3_hashes(const char *s, size_t len,
 static inline const char *
 find_start_of_next_routerstatus(const char *s, const char *s_eos)
 {
-  const char *eos, *footer, *sig;
-  if ((eos = tor_memstr(s, s_eos - s, "\nr ")))
-    ++eos;
-  else
-    eos = s_eos;
-
-  footer = tor_memstr(s, eos-s, "\ndirectory-footer");
-  sig = tor_memstr(s, eos-s, "\ndirectory-signature");
+  /* Look at the start of each line in turn, rather than searching the rest
+   * of the document for each of the three strings we want. */
+  const char *eol = s;
+  while ((eol = memchr(eol, '\n', s_eos - eol))) {
+    const char *line = eol + 1;
+    const size_t left = s_eos - line;
+    if ((left >= 2 && fast_memeq(line, "r ", 2)) ||
+        (left >= 16 && fast_memeq(line, "directory-footer", 16)) ||
+        (left >= 19 && fast_memeq(line, "directory-signature", 19)))
+      return line;
+    eol = line;
+  }
+  return s_eos;
+}
 
-  if (footer && sig)
-    return MIN(footer, sig) + 1;
-  else if (footer)
-    return footer+1;
-  else if (sig)
-    return sig+1;
-  else
-    return eos;
+/** Like escaped(), but allocate the result in <b>area</b> rather than in a
+ * static buffer, so that we can use it while parsing routerstatus entries
+ * outside the main thread. */
+static const char *
+escaped_in_area(memarea_t *area, const char *s)
+{
+  char *esc = esc_for_log(s);
+  const char *result = memarea_strdup(area, esc);
+  tor_free(esc);
+  return result;
 }
 
+/** Held around summarize_protover_flags() while we parse routerstatus
+ * entries, once we have started parsing them on more than one thread: the
+ * protover summaries share a cache. */
+static tor_mutex_t protover_lock;
+/** True iff we have initialized <b>protover_lock</b>. */
+static int protover_lock_initialized = 0;
+
 /** Parse the GuardFraction string from a consensus or vote.
  *
  *  If <b>vote</b> or <b>vote_rs</b> are set the document getting
@@ -251,7 +270,9 @@ routerstatus_parse_guardfraction(const char *guardfraction_str,
   guardfraction = (uint32_t)tor_parse_ulong(end_of_header+1,
                                             10, 0, 100, &ok, NULL);
   if (!ok) {
-    log_warn(LD_DIR, "Invalid GuardFraction %s", escaped(guardfraction_str));
+    char *esc = esc_for_log(guardfraction_str);
+    log_warn(LD_DIR, "Invalid GuardFraction %s", esc);
+    tor_free(esc);
     return -1;
   }
 
@@ -342,21 +363,21 @@ routerstatus_parse_entry_from_string(memarea_t *area,
   if (!is_legal_nickname(tok->args[0])) {
     log_warn(LD_DIR,
              "Invalid nickname %s in router status; skipping.",
-             escaped(tok->args[0]));
+             escaped_in_area(area, tok->args[0]));
     goto err;
   }
   strlcpy(rs->nickname, tok->args[0], sizeof(rs->nickname));
 
   if (digest_from_base64(rs->identity_digest, tok->args[1])) {
     log_warn(LD_DIR, "Error decoding identity digest %s",
-             escaped(tok->args[1]));
+             escaped_in_area(area, tok->args[1]));
     goto err;
   }
 
   if (flav == FLAV_NS) {
     if (digest_from_base64(rs->descriptor_digest, tok->args[2])) {
       log_warn(LD_DIR, "Error decoding descriptor digest %s",
-               escaped(tok->args[2]));
+               escaped_in_area(area, tok->args[2]));
       goto err;
     }
   }
@@ -372,7 +393,7 @@ routerstatus_parse_entry_from_string(memarea_t *area,
 
   if (tor_inet_aton(tok->args[5+offset], &in) == 0) {
     log_warn(LD_DIR, "Error parsing router address in network-status %s",
-             escaped(tok->args[5+offset]));
+             escaped_in_area(area, tok->args[5+offset]));
     goto err;
   }
   rs->addr = ntohl(in.s_addr);
@@ -400,7 +421,7 @@ routerstatus_parse_entry_from_string(memarea_t *area,
         vote_rs->flags |= (UINT64_C(1)<<p);
       } else {
         log_warn(LD_DIR, "Flags line had a flag %s not listed in known_flags.",
-                 escaped(tok->args[i]));
+                 escaped_in_area(area, tok->args[i]));
         goto err;
       }
     }
@@ -457,7 +478,11 @@ routerstatus_parse_entry_from_string(memarea_t *area,
       }
     }
 
+    if (protover_lock_initialized)
+      tor_mutex_acquire(&protover_lock);
     summarize_protover_flags(&rs->pv, protocols, version);
+    if (protover_lock_initialized)
+      tor_mutex_release(&protover_lock);
   }
 
   /* handle weighting/bandwidth info */
@@ -471,7 +496,8 @@ routerstatus_parse_entry_from_string(memarea_t *area,
                                     10, 0, UINT32_MAX,
                                     &ok, NULL);
         if (!ok) {
-          log_warn(LD_DIR, "Invalid Bandwidth %s", escaped(tok->args[i]));
+          log_warn(LD_DIR, "Invalid Bandwidth %s",
+                   escaped_in_area(area, tok->args[i]));
           goto err;
         }
         rs->has_bandwidth = 1;
@@ -482,7 +508,7 @@ routerstatus_parse_entry_from_string(memarea_t *area,
                                       10, 0, UINT32_MAX, &ok, NULL);
         if (!ok) {
           log_warn(LD_DIR, "Invalid Measured Bandwidth %s",
-                   escaped(tok->args[i]));
+                   escaped_in_area(area, tok->args[i]));
           goto err;
         }
         vote_rs->has_measured_bw = 1;
@@ -504,7 +530,7 @@ routerstatus_parse_entry_from_string(memarea_t *area,
     if (strcmpstart(tok->args[0], "accept ") &&
         strcmpstart(tok->args[0], "reject ")) {
       log_warn(LD_DIR, "Unknown exit policy summary type %s.",
-               escaped(tok->args[0]));
+               escaped_in_area(area, tok->args[0]));
       goto err;
     }
     /* XXX weasel: parse this into ports and represent them somehow smart,
@@ -547,14 +573,18 @@ routerstatus_parse_entry_from_string(memarea_t *area,
       tor_assert(tok->n_args);
       if (digest256_from_base64(rs->descriptor_digest, tok->args[0])) {
         log_warn(LD_DIR, "Error decoding microdescriptor digest %s",
-                 escaped(tok->args[0]));
+                 escaped_in_area(area, tok->args[0]));
         goto err;
       }
     } else {
+      /* Not hex_str() or fmt_addr32(): we might not be the main thread. */
+      char hexid[HEX_DIGEST_LEN+1], addrbuf[INET_NTOA_BUF_LEN];
+      base16_encode(hexid, sizeof(hexid), rs->identity_digest, DIGEST_LEN);
+      in.s_addr = htonl(rs->addr);
+      tor_inet_ntoa(&in, addrbuf, sizeof(addrbuf));
       log_info(LD_BUG, "Found an entry in networkstatus with no "
                "microdescriptor digest. (Router %s ($%s) at %s:%d.)",
-               rs->nickname, hex_str(rs->identity_digest, DIGEST_LEN),
-               fmt_addr32(rs->addr), rs->or_port);
+               rs->nickname, hexid, addrbuf, rs->or_port);
     }
   }
 
@@ -563,7 +593,10 @@ routerstatus_parse_entry_from_string(memarea_t *area,
 
   goto done;
  err:
-  dump_desc(s_dup, "routerstatus entry");
+  /* dump_desc() is only safe on the main thread: if we're parsing in a
+   * worker, parse_routerstatus_chunk() leaves this to its caller. */
+  if (in_main_thread())
+    dump_desc(s_dup, "routerstatus entry");
   if (rs && !vote_rs)
     routerstatus_free(rs);
   rs = NULL;
@@ -1054,6 +1087,116 @@ extract_shared_random_srvs(networkstatus_t *ns, smartlist_t *tokens)
   }
 }
 
+/** Don't split the routerstatus entries of a consensus into chunks of less
+ * than this many bytes: a few hundred entries' worth. */
+#define MIN_ROUTERSTATUS_CHUNK_LEN (64*1024)
+
+/** A run of consecutive routerstatus entries from a consensus, for
+ * parse_routerstatus_chunk() to parse on whichever thread gets it. */
+typedef struct routerstatus_chunk_t {
+  /** The first entry, and the end of the last one. */
+  const char *start, *end;
+  /** The consensus method and flavor of the consensus. */
+  int consensus_method;
+  consensus_flavor_t flav;
+  /** Output: the routerstatus_t for every entry that we could parse, in
+   * order. */
+  smartlist_t *routerstatuses;
+  /** Output: the start of every entry that we couldn't parse outside the
+   * main thread, so that the main thread can dump_desc() it. */
+  smartlist_t *failed;
+} routerstatus_chunk_t;
+
+/** Parse every routerstatus entry in the routerstatus_chunk_t <b>arg</b>.
+ * Safe to call from any thread. */
+static void
+parse_routerstatus_chunk(void *arg)
+{
+  routerstatus_chunk_t *chunk = arg;
+  memarea_t *area = memarea_new();
+  smartlist_t *tokens = smartlist_new();
+  const char *s = chunk->start;
+  const int in_main = in_main_thread();
+
+  while (chunk->end - s >= 2 && fast_memeq(s, "r ", 2)) {
+    const char *entry = s;
+    routerstatus_t *rs;
+    rs = routerstatus_parse_entry_from_string(area, &s, chunk->end, tokens,
+                                              NULL, NULL,
+                                              chunk->consensus_method,
+                                              chunk->flav);
+    if (rs)
+      smartlist_add(chunk->routerstatuses, rs);
+    else if (!in_main)
+      smartlist_add(chunk->failed, (void*)entry);
+  }
+
+  smartlist_free(tokens);
+  memarea_drop_all(area);
+}
+
+/** Parse the routerstatus entries of the consensus <b>ns</b>, which run
+ * from <b>start</b> up to <b>end</b>, and add them to
+ * ns-\>routerstatus_list in order.  If the consensus is big enough and we
+ * have cpuworkers, split it at entry boundaries and parse the pieces on
+ * several threads at once. */
+static void
+parse_consensus_routerstatuses(networkstatus_t *ns, consensus_flavor_t flav,
+                               const char *start, const char *end)
+{
+  const size_t len = end - start;
+  int n_chunks = cpuworker_get_n_threads() + 1;
+  routerstatus_chunk_t *chunks;
+  void **args;
+  const char *prev = start;
+  int i;
+
+  if ((size_t)n_chunks > len / MIN_ROUTERSTATUS_CHUNK_LEN)
+    n_chunks = (int)(len / MIN_ROUTERSTATUS_CHUNK_LEN);
+  if (n_chunks < 1)
+    n_chunks = 1;
+
+  if (n_chunks > 1 && !protover_lock_initialized) {
+    tor_mutex_init(&protover_lock);
+    protover_lock_initialized = 1;
+  }
+
+  chunks = tor_calloc(n_chunks, sizeof(routerstatus_chunk_t));
+  args = tor_calloc(n_chunks, sizeof(void *));
+  for (i = 0; i < n_chunks; ++i) {
+    routerstatus_chunk_t *chunk = &chunks[i];
+    chunk->start = prev;
+    if (i == n_chunks - 1) {
+      chunk->end = end;
+    } else {
+      /* Cut at the first entry that starts after our share of the bytes. */
+      const char *cut = start + (len / n_chunks) * (i + 1);
+      if (cut < prev)
+        cut = prev;
+      chunk->end = find_start_of_next_routerstatus(cut, end);
+    }
+    prev = chunk->end;
+    chunk->consensus_method = ns->consensus_method;
+    chunk->flav = flav;
+    chunk->routerstatuses = smartlist_new();
+    chunk->failed = smartlist_new();
+    args[i] = chunk;
+  }
+
+  cpuworker_run_in_parallel(parse_routerstatus_chunk, args, n_chunks,
+                            WQ_PRI_HIGH);
+
+  for (i = 0; i < n_chunks; ++i) {
+    smartlist_add_all(ns->routerstatus_list, chunks[i].routerstatuses);
+    SMARTLIST_FOREACH(chunks[i].failed, const char *, entry,
+                      dump_desc(entry, "routerstatus entry"));
+    smartlist_free(chunks[i].routerstatuses);
+    smartlist_free(chunks[i].failed);
+  }
+  tor_free(chunks);
+  tor_free(args);
+}
+
 /** Parse a v3 networkstatus vote, opinion, or consensus (depending on
  * ns_type), from <b>s</b>, and return the result.  Return NULL on failure. */
 networkstatus_t *
@@ -1436,25 +1579,32 @@ networkstatus_parse_vote_from_string(const char *s,
   s = end_of_header;
   ns->routerstatus_list = smartlist_new();
 
-  while (eos - s >= 2 && fast_memeq(s, "r ", 2)) {
-    if (ns->type != NS_TYPE_CONSENSUS) {
-      vote_routerstatus_t *rs = tor_malloc_zero(sizeof(vote_routerstatus_t));
-      if (routerstatus_parse_entry_from_string(rs_area, &s, eos, rs_tokens, ns,
-                                               rs, 0, 0)) {
-        smartlist_add(ns->routerstatus_list, rs);
-      } else {
-        vote_routerstatus_free(rs);
-      }
+  if (ns->type == NS_TYPE_CONSENSUS) {
+    /* Every entry runs up to the next "r " line, so the entries stop at the
+     * footer or the first signature. */
+    const char *end_of_entries = s;
+    if (eos - s >= 2 && fast_memeq(s, "r ", 2)) {
+      const char *footer = tor_memstr(s, eos-s, "\ndirectory-footer");
+      const char *sig = tor_memstr(s, footer ? footer-s : eos-s,
+                                   "\ndirectory-signature");
+      if (sig)
+        end_of_entries = sig + 1;
+      else if (footer)
+        end_of_entries = footer + 1;
+      else
+        end_of_entries = eos;
+      parse_consensus_routerstatuses(ns, flav, s, end_of_entries);
+    }
+    s = end_of_entries;
+  }
+  while (ns->type != NS_TYPE_CONSENSUS &&
+         eos - s >= 2 && fast_memeq(s, "r ", 2)) {
+    vote_routerstatus_t *rs = tor_malloc_zero(sizeof(vote_routerstatus_t));
+    if (routerstatus_parse_entry_from_string(rs_area, &s, eos, rs_tokens, ns,
+                                             rs, 0, 0)) {
+      smartlist_add(ns->routerstatus_list, rs);
     } else {
-      routerstatus_t *rs;
-      if ((rs = routerstatus_parse_entry_from_string(rs_area, &s, eos,
-                                                     rs_tokens,
-                                                     NULL, NULL,
-                                                     ns->consensus_method,
-                                                     flav))) {
-        /* Use exponential-backoff scheduling when downloading microdescs */
-        smartlist_add(ns->routerstatus_list, rs);
-      }
+      vote_routerstatus_free(rs);
     }
   }
   for (i = 1; i < smartlist_len(ns->routerstatus_list); ++i) {
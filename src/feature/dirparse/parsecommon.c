@@ -19,6 +19,10 @@
 
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #define MIN_ANNOTATION A_PURPOSE
 #define MAX_ANNOTATION A_UNKNOWN_
 
@@ -155,6 +159,39 @@ tokenize_string(memarea_t *area,
   return 0;
 }
 
+/** Return a pointer to the first character in <b>s</b> that is whitespace,
+ * <b>#</b> or NUL, or <b>eos</b> if there is none.  Behaves the same as
+ * find_whitespace_eos(), but looks at 16 bytes at a time where it can:
+ * tokens are arguments such as digests and keys often enough that this is
+ * worthwhile. */
+static inline const char *
+find_token_end(const char *s, const char *eos)
+{
+#ifdef __SSE2__
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i tab = _mm_set1_epi8('\t');
+  const __m128i cr = _mm_set1_epi8('\r');
+  const __m128i nl = _mm_set1_epi8('\n');
+  const __m128i hash = _mm_set1_epi8('#');
+  const __m128i nul = _mm_setzero_si128();
+  while (eos - s >= 16) {
+    const __m128i v = _mm_loadu_si128((const __m128i *)s);
+    const __m128i hits =
+      _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, space),
+                                _mm_cmpeq_epi8(v, tab)),
+                   _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, cr),
+                                             _mm_cmpeq_epi8(v, nl)),
+                                _mm_or_si128(_mm_cmpeq_epi8(v, hash),
+                                             _mm_cmpeq_epi8(v, nul))));
+    const int mask = _mm_movemask_epi8(hits);
+    if (mask)
+      return s + __builtin_ctz(mask);
+    s += 16;
+  }
+#endif /* defined(__SSE2__) */
+  return find_whitespace_eos(s, eos);
+}
+
 /** Helper: parse space-separated arguments from the string <b>s</b> ending at
  * <b>eol</b>, and store them in the args field of <b>tok</b>.  Store the
  * number of parsed elements into the n_args field of <b>tok</b>.  Allocate
@@ -167,6 +204,7 @@ get_token_arguments(memarea_t *area, directory_token_t *tok,
 /** Largest number of arguments we'll accept to any token, ever. */
 #define MAX_ARGS 512
   char *mem = memarea_strndup(area, s, eol-s);
+  const char *end = mem + strlen(mem);
   char *cp = mem;
   int j = 0;
   char *args[MAX_ARGS];
@@ -174,11 +212,11 @@ get_token_arguments(memarea_t *area, directory_token_t *tok,
     if (j == MAX_ARGS)
       return -1;
     args[j++] = cp;
-    cp = (char*)find_whitespace(cp);
-    if (!cp || !*cp)
+    cp = (char*)find_token_end(cp, end);
+    if (!*cp)
       break; /* End of the line. */
     *cp++ = '\0';
-    cp = (char*)eat_whitespace(cp);
+    cp = (char*)eat_whitespace_eos(cp, end);
   }
   tok->n_args = j;
   tok->args = memarea_memdup(area, args, j*sizeof(char*));
@@ -278,6 +316,7 @@ get_next_token(memarea_t *area,
 
   const char *next, *eol;
   size_t obname_len;
+  char first_char;
   int i;
   directory_token_t *tok;
   obj_syntax o_syn = NO_OBJ;
@@ -298,20 +337,24 @@ get_next_token(memarea_t *area,
     RET_ERR("Line far too long");
   }
 
-  next = find_whitespace_eos(*s, eol);
+  next = find_token_end(*s, eol);
 
   if (mem_eq_token(*s, next-*s, "opt")) {
     /* Skip past an "opt" at the start of the line. */
     *s = eat_whitespace_eos_no_nl(next, eol);
-    next = find_whitespace_eos(*s, eol);
+    next = find_token_end(*s, eol);
   } else if (*s == eos) {  /* If no "opt", and end-of-line, line is invalid */
     RET_ERR("Unexpected EOF");
   }
 
   /* Search the table for the appropriate entry.  (I tried a binary search
-   * instead, but it wasn't any faster.) */
+   * instead, but it wasn't any faster.)  Most entries differ from the
+   * keyword in their first character, so check that before comparing the
+   * whole thing. */
+  first_char = (next > *s) ? **s : '\0';
   for (i = 0; table[i].t ; ++i) {
-    if (mem_eq_token(*s, next-*s, table[i].t)) {
+    if (table[i].t[0] == first_char &&
+        mem_eq_token(*s, next-*s, table[i].t)) {
       /* We've found the keyword. */
       kwd = table[i].t;
       tok->tp = table[i].v;
@@ -355,11 +398,14 @@ get_next_token(memarea_t *area,
     o_syn = OBJ_OK;
   }
 
-  /* Check whether there's an object present */
+  /* Check whether there's an object present.  Look at the start of the
+   * next line before searching for its end, since it usually isn't one. */
   *s = eat_whitespace_eos(eol, eos);  /* Scan from end of first line */
   tor_assert(eos >= *s);
+  if (eos-*s < 11 || fast_memneq(*s, "-----BEGIN ", 11)) /* No object. */
+    goto check_object;
   eol = memchr(*s, '\n', eos-*s);
-  if (!eol || eol-*s<11 || strcmpstart(*s, "-----BEGIN ")) /* No object. */
+  if (!eol || eol-*s<11) /* No object. */
     goto check_object;
 
   if (eol - *s <= 16 || memchr(*s+11,'\0',eol-*s-16) || /* no short lines, */
@@ -854,6 +854,7 @@ router_parse_entry_from_string(const char *s, const char *end,
       (!router->ipv6_exit_policy ||
        short_policy_is_reject_star(router->ipv6_exit_policy)))
     router->policy_is_reject_star = 1;
+  router->compiled_exit_policy = compiled_policy_get(router->exit_policy);
 
   if ((tok = find_opt_by_keyword(tokens, K_FAMILY)) && tok->n_args) {
     int i;
@@ -40,6 +40,7 @@
 #include "core/or/or.h"
 #include "app/config/config.h"
 #include "core/mainloop/connection.h"
+#include "core/mainloop/cpuworker.h"
 #include "core/mainloop/mainloop.h"
 #include "core/mainloop/netstatus.h"
 #include "core/or/channel.h"
@@ -81,6 +82,7 @@
 #include "feature/relay/routermode.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "lib/crypt_ops/crypto_util.h"
+#include "lib/evloop/workqueue.h"
 
 #include "feature/dirauth/dirvote.h"
 #include "feature/dirauth/authmode.h"
@@ -454,6 +456,44 @@ networkstatus_get_voter_sig_by_alg(const networkstatus_voter_info_t *voter,
   return NULL;
 }
 
+/** Return true iff <b>sig</b> claims to be made with the signing key in
+ * <b>cert</b>, by the authority that <b>cert</b> belongs to. */
+static int
+document_signature_matches_cert(const document_signature_t *sig,
+                                const authority_cert_t *cert)
+{
+  char key_digest[DIGEST_LEN];
+
+  if (crypto_pk_get_digest(cert->signing_key, key_digest)<0)
+    return 0;
+  return tor_memeq(sig->signing_key_digest, key_digest, DIGEST_LEN) &&
+    tor_memeq(sig->identity_digest, cert->cache_info.identity_digest,
+              DIGEST_LEN);
+}
+
+/** Return true iff <b>sig</b> is a good signature on <b>consensus</b> with
+ * the signing key in <b>cert</b>.  Doesn't log or change anything, so it is
+ * safe to call from any thread. */
+static int
+document_signature_is_good(const networkstatus_t *consensus,
+                           const document_signature_t *sig,
+                           const authority_cert_t *cert)
+{
+  const int dlen = sig->alg == DIGEST_SHA1 ? DIGEST_LEN : DIGEST256_LEN;
+  const size_t signed_digest_len = crypto_pk_keysize(cert->signing_key);
+  char *signed_digest = tor_malloc(signed_digest_len);
+  int is_good;
+
+  is_good = crypto_pk_public_checksig(cert->signing_key,
+                                      signed_digest,
+                                      signed_digest_len,
+                                      sig->signature,
+                                      sig->signature_len) >= dlen &&
+    tor_memeq(signed_digest, consensus->digests.d[sig->alg], dlen);
+  tor_free(signed_digest);
+  return is_good;
+}
+
 /** Check whether the signature <b>sig</b> is correctly signed with the
  * signing key in <b>cert</b>.  Return -1 if <b>cert</b> doesn't match the
  * signing key; otherwise set the good_signature or bad_signature flag on
@@ -463,16 +503,7 @@ networkstatus_check_document_signature(const networkstatus_t *consensus,
                                        document_signature_t *sig,
                                        const authority_cert_t *cert)
 {
-  char key_digest[DIGEST_LEN];
-  const int dlen = sig->alg == DIGEST_SHA1 ? DIGEST_LEN : DIGEST256_LEN;
-  char *signed_digest;
-  size_t signed_digest_len;
-
-  if (crypto_pk_get_digest(cert->signing_key, key_digest)<0)
-    return -1;
-  if (tor_memneq(sig->signing_key_digest, key_digest, DIGEST_LEN) ||
-      tor_memneq(sig->identity_digest, cert->cache_info.identity_digest,
-                 DIGEST_LEN))
+  if (!document_signature_matches_cert(sig, cert))
     return -1;
 
   if (authority_cert_is_blacklisted(cert)) {
@@ -486,23 +517,89 @@ networkstatus_check_document_signature(const networkstatus_t *consensus,
     return 0;
   }
 
-  signed_digest_len = crypto_pk_keysize(cert->signing_key);
-  signed_digest = tor_malloc(signed_digest_len);
-  if (crypto_pk_public_checksig(cert->signing_key,
-                                signed_digest,
-                                signed_digest_len,
-                                sig->signature,
-                                sig->signature_len) < dlen ||
-      tor_memneq(signed_digest, consensus->digests.d[sig->alg], dlen)) {
+  if (!document_signature_is_good(consensus, sig, cert)) {
     log_warn(LD_DIR, "Got a bad signature on a networkstatus vote");
     sig->bad_signature = 1;
   } else {
     sig->good_signature = 1;
   }
-  tor_free(signed_digest);
   return 0;
 }
 
+/** One signature for check_signature_job_fn() to verify. */
+typedef struct signature_check_job_t {
+  const networkstatus_t *consensus;
+  document_signature_t *sig;
+  const authority_cert_t *cert;
+  /** Output: true iff the signature is good. */
+  int is_good;
+} signature_check_job_t;
+
+/** Verify the signature in the signature_check_job_t <b>arg</b>.  Safe to
+ * call from any thread. */
+static void
+check_signature_job_fn(void *arg)
+{
+  signature_check_job_t *job = arg;
+  job->is_good = document_signature_is_good(job->consensus, job->sig,
+                                            job->cert);
+}
+
+/** If we have cpuworkers, verify the signatures on <b>consensus</b> that we
+ * have current, usable certificates for on several threads at once, and set
+ * their good_signature or bad_signature flags.  Leave every other signature
+ * for networkstatus_check_consensus_signature() to handle as usual. */
+static void
+check_consensus_signatures_in_parallel(networkstatus_t *consensus)
+{
+  smartlist_t *jobs;
+  const time_t now = time(NULL);
+
+  if (cpuworker_get_n_threads() == 0)
+    return;
+
+  jobs = smartlist_new();
+  SMARTLIST_FOREACH_BEGIN(consensus->voters, networkstatus_voter_info_t *,
+                          voter) {
+    SMARTLIST_FOREACH_BEGIN(voter->sigs, document_signature_t *, sig) {
+      const authority_cert_t *cert;
+      signature_check_job_t *job;
+      if (sig->good_signature || sig->bad_signature || !sig->signature)
+        continue;
+      if (!trusteddirserver_get_by_v3_auth_digest(sig->identity_digest))
+        continue;
+      cert = authority_cert_get_by_digests(sig->identity_digest,
+                                           sig->signing_key_digest);
+      if (!cert || cert->expires < now ||
+          !document_signature_matches_cert(sig, cert) ||
+          authority_cert_is_blacklisted(cert))
+        continue;
+      job = tor_malloc_zero(sizeof(signature_check_job_t));
+      job->consensus = consensus;
+      job->sig = sig;
+      job->cert = cert;
+      smartlist_add(jobs, job);
+    } SMARTLIST_FOREACH_END(sig);
+  } SMARTLIST_FOREACH_END(voter);
+
+  if (smartlist_len(jobs) > 1) {
+    cpuworker_run_in_parallel(check_signature_job_fn,
+                              jobs->list, smartlist_len(jobs),
+                              WQ_PRI_HIGH);
+    SMARTLIST_FOREACH_BEGIN(jobs, signature_check_job_t *, job) {
+      if (job->is_good) {
+        job->sig->good_signature = 1;
+      } else {
+        log_warn(LD_DIR, "Got a bad signature on a networkstatus vote");
+        job->sig->bad_signature = 1;
+      }
+    } SMARTLIST_FOREACH_END(job);
+  }
+
+  SMARTLIST_FOREACH(jobs, signature_check_job_t *, job, tor_free(job));
+  smartlist_free(jobs);
+}
+
 /** Given a v3 networkstatus consensus in <b>consensus</b>, check every
  * as-yet-unchecked signature on <b>consensus</b>.  Return 1 if there is a
  * signature from every recognized authority on it, 0 if there are
@@ -532,6 +629,8 @@ networkstatus_check_consensus_signature(networkstatus_t *consensus,
 
   tor_assert(consensus->type == NS_TYPE_CONSENSUS);
 
+  check_consensus_signatures_in_parallel(consensus);
+
   SMARTLIST_FOREACH_BEGIN(consensus->voters, networkstatus_voter_info_t *,
                           voter) {
     int good_here = 0;
@@ -1888,6 +1987,10 @@ networkstatus_set_current_consensus(const char *consensus,
   time_t current_valid_after = 0;
   int free_consensus = 1; /* Free 'c' at the end of the function */
   int checked_protocols_already = 0;
+  /* How long did we spend parsing this consensus and checking its
+   * signatures, and how long did we keep the main thread in all? */
+  monotime_t start_time, parsed_time, checked_time;
+  int checked_signatures = 0;
 
   if (flav < 0) {
     /* XXXX we don't handle unrecognized flavors yet. */
@@ -1896,9 +1999,11 @@ networkstatus_set_current_consensus(const char *consensus,
   }
 
   /* Make sure it's parseable. */
+  monotime_get(&start_time);
   c = networkstatus_parse_vote_from_string(consensus,
                                            consensus_len,
                                            NULL, NS_TYPE_CONSENSUS);
+  monotime_get(&parsed_time);
   if (!c) {
     log_warn(LD_DIR, "Unable to parse networkstatus consensus");
     result = -2;
@@ -1975,7 +2080,10 @@ networkstatus_set_current_consensus(const char *consensus,
   }
 
   /* Make sure it's signed enough. */
-  if ((r=networkstatus_check_consensus_signature(c, 1))<0) {
+  r = networkstatus_check_consensus_signature(c, 1);
+  monotime_get(&checked_time);
+  checked_signatures = 1;
+  if (r<0) {
     if (r == -1) {
       /* Okay, so it _might_ be signed enough if we get more certificates. */
       if (!was_waiting_for_certs) {
@@ -2154,6 +2262,19 @@ networkstatus_set_current_consensus(const char *consensus,
 
   result = 0;
  done:
+  {
+    monotime_t end_time;
+    monotime_get(&end_time);
+    log_info(LD_DIR, "Loading a %s consensus of %"TOR_PRIuSZ" bytes held "
+             "the main thread for %"PRId64" msec: %"PRId64" msec parsing "
+             "with up to %d threads, %"PRId64" msec checking signatures.",
+             flavor, consensus_len,
+             monotime_diff_msec(&start_time, &end_time),
+             monotime_diff_msec(&start_time, &parsed_time),
+             cpuworker_get_n_threads() + 1,
+             checked_signatures ?
+               monotime_diff_msec(&parsed_time, &checked_time) : 0);
+  }
   if (free_consensus)
     networkstatus_vote_free(c);
   tor_free(consensus_fname);
@@ -540,18 +540,13 @@ bridge_get_advertised_bandwidth_bounded(routerinfo_t *router)
   return result;
 }
 
-/** Given a list of routers and a weighting rule as in
- * smartlist_choose_node_by_bandwidth_weights, compute weighted bandwidth
- * values for each node and store them in a freshly allocated
- * *<b>bandwidths_out</b> of the same length as <b>sl</b>, and holding results
- * as doubles. If <b>total_bandwidth_out</b> is non-NULL, set it to the total
- * of all the bandwidths.
- * Return 0 on success, -1 on failure. */
+/** As compute_weighted_bandwidths(), but always compute the weights from
+ * scratch. */
 static int
-compute_weighted_bandwidths(const smartlist_t *sl,
-                            bandwidth_weight_rule_t rule,
-                            double **bandwidths_out,
-                            double *total_bandwidth_out)
+compute_weighted_bandwidths_uncached(const smartlist_t *sl,
+                                     bandwidth_weight_rule_t rule,
+                                     double **bandwidths_out,
+                                     double *total_bandwidth_out)
 {
   int64_t weight_scale;
   double Wg = -1, Wm = -1, We = -1, Wd = -1;
@@ -755,6 +750,234 @@ compute_weighted_bandwidths(const smartlist_t *sl,
   return 0;
 }
 
+/** A table for choosing a node from the whole nodelist at random, weighted
+ * by its bandwidth for some rule, in constant time.
+ *
+ * We use Vose's alias method: each node owns one column of the table.  To
+ * choose a node, we pick a column uniformly at random, and then either take
+ * the column's own node or its alias, depending on a biased coin flip.  The
+ * columns and thresholds are arranged so that each node comes out with
+ * probability proportional to its weight. */
+typedef struct node_weight_table_t {
+  /** The nodelist that this table was built from. */
+  const smartlist_t *nodelist;
+  /** The value of nodelist_get_generation() when we built this table. */
+  uint64_t generation;
+  /** Number of nodes in <b>nodelist</b> when we built this table. */
+  int n_nodes;
+  /** For each node, its weighted bandwidth, as computed by
+   * compute_weighted_bandwidths_uncached(). */
+  double *weights;
+  /** Sum of all the elements of <b>weights</b>. */
+  double total;
+  /** For each column, the probability of taking the column's own node
+   * rather than its alias, scaled so that UINT64_MAX means "always".  NULL
+   * if <b>total</b> is zero, so that no node can be chosen. */
+  uint64_t *threshold;
+  /** For each column, the index of its alias node.  NULL iff
+   * <b>threshold</b> is NULL. */
+  int *alias;
+} node_weight_table_t;
+
+/** Cached weight tables, indexed by bandwidth_weight_rule_t.  Each one is
+ * rebuilt the first time we need it after the nodelist changes. */
+static node_weight_table_t *weight_tables[WEIGHT_FOR_DIR + 1];
+
+/** Release all storage held in <b>table</b>. */
+static void
+node_weight_table_free_(node_weight_table_t *table)
+{
+  if (!table)
+    return;
+  tor_free(table->weights);
+  tor_free(table->threshold);
+  tor_free(table->alias);
+  tor_free(table);
+}
+#define node_weight_table_free(table) \
+  FREE_AND_NULL(node_weight_table_t, node_weight_table_free_, (table))
+
+/** Return true iff <b>table</b> is non-NULL and still describes the current
+ * nodelist. */
+static int
+node_weight_table_is_current(const node_weight_table_t *table)
+{
+  const smartlist_t *nodes = nodelist_get_list();
+  return table &&
+    table->nodelist == nodes &&
+    table->generation == nodelist_get_generation() &&
+    table->n_nodes == smartlist_len(nodes);
+}
+
+/** Convert the probability <b>p</b> to a threshold for comparing against a
+ * uniformly random uint64_t. */
+static uint64_t
+probability_to_u64_threshold(double p)
+{
+  const double two_to_64 = 18446744073709551616.0;
+  if (p <= 0.0)
+    return 0;
+  if (p * two_to_64 >= two_to_64)
+    return UINT64_MAX;
+  return (uint64_t) (p * two_to_64);
+}
+
+/** Fill in the threshold and alias columns of <b>table</b>, whose weights
+ * and total are already set. */
+static void
+node_weight_table_build_alias(node_weight_table_t *table)
+{
+  const int n = table->n_nodes;
+  double *scaled = tor_calloc(n, sizeof(double));
+  int *small = tor_calloc(n, sizeof(int));
+  int *large = tor_calloc(n, sizeof(int));
+  int n_small = 0, n_large = 0, i;
+
+  table->threshold = tor_calloc(n, sizeof(uint64_t));
+  table->alias = tor_calloc(n, sizeof(int));
+
+  /* Scale the weights so that they average to 1, and split them into the
+   * ones that need to borrow probability from another column and the ones
+   * that have some to spare. */
+  for (i = 0; i < n; ++i) {
+    scaled[i] = table->weights[i] * n / table->total;
+    if (scaled[i] < 1.0)
+      small[n_small++] = i;
+    else
+      large[n_large++] = i;
+  }
+
+  /* Fill up each small column with probability from a large one. */
+  while (n_small && n_large) {
+    const int s = small[--n_small];
+    const int l = large[n_large - 1];
+    table->threshold[s] = probability_to_u64_threshold(scaled[s]);
+    table->alias[s] = l;
+    scaled[l] = (scaled[l] + scaled[s]) - 1.0;
+    if (scaled[l] < 1.0) {
+      --n_large;
+      small[n_small++] = l;
+    }
+  }
+
+  /* Whatever is left over should have a probability of 1, give or take
+   * rounding error. */
+  while (n_large) {
+    i = large[--n_large];
+    table->threshold[i] = UINT64_MAX;
+    table->alias[i] = i;
+  }
+  while (n_small) {
+    i = small[--n_small];
+    table->threshold[i] = UINT64_MAX;
+    table->alias[i] = i;
+  }
+
+  tor_free(scaled);
+  tor_free(small);
+  tor_free(large);
+}
+
+/** Return a weight table for choosing from the whole nodelist with
+ * <b>rule</b>, building it if we don't have a current one.  Return NULL if
+ * the nodelist is empty. */
+static const node_weight_table_t *
+node_weight_table_get(bandwidth_weight_rule_t rule)
+{
+  const smartlist_t *nodes;
+  node_weight_table_t *table;
+
+  if (node_weight_table_is_current(weight_tables[rule]))
+    return weight_tables[rule];
+
+  node_weight_table_free(weight_tables[rule]);
+  nodes = nodelist_get_list();
+  table = tor_malloc_zero(sizeof(node_weight_table_t));
+  table->nodelist = nodes;
+  table->generation = nodelist_get_generation();
+  table->n_nodes = smartlist_len(nodes);
+  if (compute_weighted_bandwidths_uncached(nodes, rule, &table->weights,
+                                           &table->total) < 0) {
+    tor_free(table);
+    return NULL;
+  }
+  if (table->total > 0.0)
+    node_weight_table_build_alias(table);
+
+  weight_tables[rule] = table;
+  return table;
+}
+
+/** Choose a random node index from <b>table</b>, with probability
+ * proportional to its weight.  <b>table</b> must have a nonzero total. */
+static int
+node_weight_table_sample(const node_weight_table_t *table)
+{
+  const int col = crypto_rand_int(table->n_nodes);
+  const uint64_t threshold = table->threshold[col];
+  uint64_t r;
+  crypto_rand((char *)&r, sizeof(r));
+  if (threshold == UINT64_MAX || r < threshold)
+    return col;
+  return table->alias[col];
+}
+
+/** Given a list of routers and a weighting rule as in
+ * smartlist_choose_node_by_bandwidth_weights, compute weighted bandwidth
+ * values for each node and store them in a freshly allocated
+ * *<b>bandwidths_out</b> of the same length as <b>sl</b>, and holding results
+ * as doubles. If <b>total_bandwidth_out</b> is non-NULL, set it to the total
+ * of all the bandwidths.
+ *
+ * If we have a current weight table for <b>rule</b> that holds every node
+ * in <b>sl</b>, copy the weights from there.
+ *
+ * Return 0 on success, -1 on failure. */
+static int
+compute_weighted_bandwidths(const smartlist_t *sl,
+                            bandwidth_weight_rule_t rule,
+                            double **bandwidths_out,
+                            double *total_bandwidth_out)
+{
+  const node_weight_table_t *table = weight_tables[rule];
+  double *bandwidths;
+  double total_bandwidth = 0.0;
+
+  if (smartlist_len(sl) == 0 || !node_weight_table_is_current(table))
+    goto uncached;
+
+  bandwidths = tor_calloc(smartlist_len(sl), sizeof(double));
+  SMARTLIST_FOREACH_BEGIN(sl, const node_t *, node) {
+    const int idx = node->nodelist_idx;
+    if (idx < 0 || idx >= table->n_nodes ||
+        smartlist_get(table->nodelist, idx) != node) {
+      /* Not a node from the nodelist: maybe a bridge, or a test. */
+      tor_free(bandwidths);
+      goto uncached;
+    }
+    bandwidths[node_sl_idx] = table->weights[idx];
+    total_bandwidth += table->weights[idx];
+  } SMARTLIST_FOREACH_END(node);
+
+  *bandwidths_out = bandwidths;
+  if (total_bandwidth_out)
+    *total_bandwidth_out = total_bandwidth;
+  return 0;
+
+ uncached:
+  return compute_weighted_bandwidths_uncached(sl, rule, bandwidths_out,
+                                              total_bandwidth_out);
+}
+
+/** Release all storage held by the weight tables for choosing nodes. */
+void
+node_select_free_all(void)
+{
+  unsigned i;
+  for (i = 0; i < ARRAY_LENGTH(weight_tables); ++i)
+    node_weight_table_free(weight_tables[i]);
+}
+
 /** For all nodes in <b>sl</b>, return the fraction of those nodes, weighted
  * by their weighted bandwidths with rule <b>rule</b>, for which we have
  * descriptors.
@@ -825,6 +1048,63 @@ routerlist_add_node_and_family(smartlist_t *sl, const routerinfo_t *router)
   nodelist_add_node_and_family(sl, node);
 }
 
+/** How many nodes do we sample from the whole nodelist in
+ * router_choose_random_node() before we give up and build the list of
+ * acceptable nodes instead? */
+#define MAX_NODE_SAMPLE_ATTEMPTS 64
+
+/** Helper for router_choose_random_node(): choose nodes from the whole
+ * nodelist, weighted with <b>rule</b>, until we find one that
+ * router_choose_random_node() would accept with <b>flags</b> and the
+ * exclusions <b>excludednodes</b>, <b>excludedsmartlist</b> and
+ * <b>excludedset</b>.
+ *
+ * Since every node's weight is independent of which other nodes are
+ * acceptable, this picks each acceptable node with the same probability as
+ * building the list of acceptable nodes and choosing from that, but it
+ * takes constant time when most nodes are acceptable.  Return NULL if we
+ * fail MAX_NODE_SAMPLE_ATTEMPTS times; the caller must then fall back to
+ * building the list, which keeps the overall distribution exact. */
+static const node_t *
+choose_random_node_by_sampling(bandwidth_weight_rule_t rule,
+                               router_crn_flags_t flags,
+                               const smartlist_t *excludednodes,
+                               const smartlist_t *excludedsmartlist,
+                               const routerset_t *excludedset)
+{
+  const node_weight_table_t *table = node_weight_table_get(rule);
+  int i;
+
+  if (!table || !table->threshold)
+    return NULL;
+
+  for (i = 0; i < MAX_NODE_SAMPLE_ATTEMPTS; ++i) {
+    const node_t *node = smartlist_get(table->nodelist,
+                                       node_weight_table_sample(table));
+    if (node_allows_single_hop_exits(node))
+      continue;
+    if ((flags & CRN_RENDEZVOUS_V3) &&
+        !node_supports_v3_rendezvous_point(node))
+      continue;
+    if (!router_node_is_running_candidate(node,
+                                          (flags & CRN_NEED_UPTIME) != 0,
+                                          (flags & CRN_NEED_CAPACITY) != 0,
+                                          (flags & CRN_NEED_GUARD) != 0,
+                                          (flags & CRN_NEED_DESC) != 0,
+                                          (flags & CRN_PREF_ADDR) != 0,
+                                          (flags & CRN_DIRECT_CONN) != 0))
+      continue;
+    if (smartlist_contains(excludednodes, node))
+      continue;
+    if (excludedsmartlist && smartlist_contains(excludedsmartlist, node))
+      continue;
+    if (excludedset && routerset_contains_node(excludedset, node))
+      continue;
+    return node;
+  }
+  return NULL;
+}
+
 /** Return a random running node from the nodelist. Never
  * pick a node that is in
  * <b>excludedsmartlist</b>, or which matches <b>excludedset</b>,
@@ -859,8 +1139,7 @@ router_choose_random_node(smartlist_t *excludedsmartlist,
   const int direct_conn = (flags & CRN_DIRECT_CONN) != 0;
   const int rendezvous_v3 = (flags & CRN_RENDEZVOUS_V3) != 0;
 
-  smartlist_t *sl=smartlist_new(),
-    *excludednodes=smartlist_new();
+  smartlist_t *sl, *excludednodes=smartlist_new();
   const node_t *choice = NULL;
   const routerinfo_t *r;
   bandwidth_weight_rule_t rule;
@@ -869,6 +1148,22 @@ router_choose_random_node(smartlist_t *excludedsmartlist,
   rule = weight_for_exit ? WEIGHT_FOR_EXIT :
     (need_guard ? WEIGHT_FOR_GUARD : WEIGHT_FOR_MID);
 
+  /* If the node_t is not found we won't be to exclude ourself but we
+   * won't be able to pick ourself in router_choose_random_node() so
+   * this is fine to at least try with our routerinfo_t object. */
+  if ((r = router_get_my_routerinfo()))
+    routerlist_add_node_and_family(excludednodes, r);
+
+  /* Usually most nodes are acceptable, so try sampling from the whole
+   * nodelist before we build the list of acceptable ones. */
+  choice = choose_random_node_by_sampling(rule, flags, excludednodes,
+                                          excludedsmartlist, excludedset);
+  if (choice) {
+    smartlist_free(excludednodes);
+    return choice;
+  }
+
+  sl = smartlist_new();
   SMARTLIST_FOREACH_BEGIN(nodelist_get_list(), node_t *, node) {
     if (node_allows_single_hop_exits(node)) {
       /* Exclude relays that allow single hop exit circuits. This is an
@@ -883,12 +1178,6 @@ router_choose_random_node(smartlist_t *excludedsmartlist,
     }
   } SMARTLIST_FOREACH_END(node);
 
-  /* If the node_t is not found we won't be to exclude ourself but we
-   * won't be able to pick ourself in router_choose_random_node() so
-   * this is fine to at least try with our routerinfo_t object. */
-  if ((r = router_get_my_routerinfo()))
-    routerlist_add_node_and_family(excludednodes, r);
-
   router_add_running_nodes_to_smartlist(sl, need_uptime, need_capacity,
                                         need_guard, need_desc, pref_addr,
                                         direct_conn);
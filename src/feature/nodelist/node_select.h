@@ -85,6 +85,8 @@ const routerstatus_t *router_pick_trusteddirserver(dirinfo_type_t type,
 const routerstatus_t *router_pick_fallback_dirserver(dirinfo_type_t type,
                                                      int flags);
 
+void node_select_free_all(void);
+
 #ifdef NODE_SELECT_PRIVATE
 STATIC int choose_array_element_by_weight(const uint64_t *entries,
                                           int n_entries);
@@ -177,6 +177,11 @@ HT_GENERATE2(nodelist_ed_map, node_t, ed_ht_ent, node_ed_id_hash,
 /** The global nodelist. */
 static nodelist_t *the_nodelist=NULL;
 
+/** Incremented whenever a node is added to or removed from the nodelist, or
+ * whenever something changes that could change a node's bandwidth weight for
+ * path selection.  See nodelist_get_generation(). */
+static uint64_t nodelist_generation = 0;
+
 /** Create an empty nodelist if we haven't done so already. */
 static void
 init_nodelist(void)
@@ -253,6 +258,7 @@ node_get_or_create(const char *identity_digest)
 
   smartlist_add(the_nodelist->nodes, node);
   node->nodelist_idx = smartlist_len(the_nodelist->nodes) - 1;
+  nodelist_note_node_changed();
 
   node->country = -1;
 
@@ -515,6 +521,7 @@ nodelist_set_routerinfo(routerinfo_t *ri, routerinfo_t **ri_old_out)
       *ri_old_out = NULL;
   }
   node->ri = ri;
+  nodelist_note_node_changed();
 
   node_add_to_ed25519_map(node);
 
@@ -609,6 +616,10 @@ nodelist_set_consensus(networkstatus_t *ns)
   if (ns->flavor == FLAV_MICRODESC)
     (void) get_microdesc_cache(); /* Make sure it exists first. */
 
+  /* Every node gets a new routerstatus, and the bandwidth weights may have
+   * changed too. */
+  nodelist_note_node_changed();
+
   SMARTLIST_FOREACH(the_nodelist->nodes, node_t *, node,
                     node->rs = NULL);
 
@@ -729,6 +740,7 @@ nodelist_remove_routerinfo(routerinfo_t *ri)
   node_t *node = node_get_mutable_by_id(ri->cache_info.identity_digest);
   if (node && node->ri == ri) {
     node->ri = NULL;
+    nodelist_note_node_changed();
     if (! node_is_usable(node)) {
       nodelist_drop_node(node, 1);
       node_free(node);
@@ -759,6 +771,7 @@ nodelist_drop_node(node_t *node, int remove_from_ht)
     tmp->nodelist_idx = idx;
   }
   node->nodelist_idx = -1;
+  nodelist_note_node_changed();
 }
 
 /** Return a newly allocated smartlist of the nodes that have <b>md</b> as
@@ -837,6 +850,7 @@ nodelist_free_all(void)
   } SMARTLIST_FOREACH_END(node);
 
   smartlist_free(the_nodelist->nodes);
+  nodelist_note_node_changed();
 
   address_set_free(the_nodelist->node_addrs);
   the_nodelist->node_addrs = NULL;
@@ -844,6 +858,28 @@ nodelist_free_all(void)
   tor_free(the_nodelist);
 }
 
+/** Return a number that changes whenever a node is added to or removed from
+ * the nodelist, gets a new routerstatus or routerinfo, or has one of the
+ * flags that we use to weight nodes changed by a directory authority.
+ *
+ * Code that caches something computed from the whole nodelist can remember
+ * this value, and recompute when it changes. Changes that can't affect a
+ * node's bandwidth weight, such as getting a new microdescriptor or being
+ * marked as down, don't change it. */
+uint64_t
+nodelist_get_generation(void)
+{
+  return nodelist_generation;
+}
+
+/** Note that the nodelist, or a node in it, has changed in a way that
+ * callers of nodelist_get_generation() might care about. */
+void
+nodelist_note_node_changed(void)
+{
+  ++nodelist_generation;
+}
+
 /** Check that the nodelist is internally consistent, and consistent with
  * the directory info it's derived from.
  */
@@ -43,6 +43,8 @@ smartlist_t *nodelist_find_nodes_with_microdesc(const microdesc_t *md);
 
 void nodelist_free_all(void);
 void nodelist_assert_ok(void);
+uint64_t nodelist_get_generation(void);
+void nodelist_note_node_changed(void);
 
 MOCK_DECL(const node_t *, node_get_by_nickname,
           (const char *nickname, unsigned flags));
@@ -55,6 +55,9 @@ struct routerinfo_t {
   uint32_t bandwidthcapacity;
   smartlist_t *exit_policy; /**< What streams will this OR permit
                              * to exit on IPv4?  NULL for 'reject *:*'. */
+  /** Compiled version of exit_policy, or NULL if we haven't compiled it.
+   * Must be rebuilt if exit_policy changes. */
+  struct compiled_policy_t *compiled_exit_policy;
   /** What streams will this OR permit to exit on IPv6?
    * NULL for 'reject *:*' */
   struct short_policy_t *ipv6_exit_policy;
@@ -21,6 +21,9 @@
  *      them to worker threads.
  *   <li>Expiring onionskins on the relay side if they have waited for
  *     too long.
+ *   <li>Dropping onionskins from the head of a queue, CoDel-style, when
+ *     every request we take from it has been waiting for longer than a
+ *     target delay for a while.  (See onion_queue_codel_dequeue().)
  * </ul>
  **/
 
@@ -33,9 +36,12 @@
 #include "core/or/circuitlist.h"
 #include "core/or/onion.h"
 #include "feature/nodelist/networkstatus.h"
+#include "lib/time/compat_time.h"
 
 #include "core/or/or_circuit_st.h"
 
+#include <math.h>
+
 /** Type for a linked list of circuits that are waiting for a free CPU worker
  * to process a waiting onion handshake. */
 typedef struct onion_queue_t {
@@ -44,8 +50,45 @@ typedef struct onion_queue_t {
   uint16_t handshake_type;
   create_cell_t *onionskin;
   time_t when_added;
+  /** Monotonic time, in msec, when this entry was added. */
+  uint64_t when_added_msec;
 } onion_queue_t;
 
+/** State for the CoDel controller on a single onion queue.
+ *
+ * This follows the CoDel algorithm of Nichols and Jacobson (RFC 8289): as
+ * long as the time that requests have waited on the queue (their "sojourn
+ * time") stays below a target delay at least once per interval, we do
+ * nothing.  Once it has been above the target for a whole interval, we
+ * start dropping requests from the head of the queue, at a rate that
+ * increases with the square root of the number of drops, until the sojourn
+ * time falls below the target again.
+ */
+typedef struct onion_codel_t {
+  /** If nonzero, the time (in msec) at which the sojourn time will have
+   * been above the target for a whole interval. */
+  uint64_t first_above_time;
+  /** While dropping, the time (in msec) at which we drop the next
+   * request. */
+  uint64_t drop_next;
+  /** Number of requests dropped since we entered the dropping state. */
+  unsigned count;
+  /** Value of count when we last left the dropping state. */
+  unsigned last_count;
+  /** True iff we are in the dropping state. */
+  unsigned dropping : 1;
+  /** Sojourn time (in msec) of the last request that we took from this
+   * queue. */
+  uint64_t last_sojourn_msec;
+  /** Number of requests that we have taken from this queue to process. */
+  uint64_t n_processed;
+  /** Number of requests that we have dropped from this queue. */
+  uint64_t n_dropped;
+} onion_codel_t;
+
+/** CoDel state for each of the queues in ol_list. */
+static onion_codel_t ol_codel[MAX_ONION_HANDSHAKE_TYPE+1];
+
 /** 5 seconds on the onion queue til we just send back a destroy */
 #define ONIONQUEUE_WAIT_CUTOFF 5
 
@@ -63,6 +106,7 @@ static int ol_entries[MAX_ONION_HANDSHAKE_TYPE+1];
 
 static int num_ntors_per_tap(void);
 static void onion_queue_entry_remove(onion_queue_t *victim);
+static void onion_queue_entry_drop(onion_queue_t *victim);
 
 /* XXXX Check lengths vs MAX_ONIONSKIN_{CHALLENGE,REPLY}_LEN.
  *
@@ -156,6 +200,7 @@ onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
   tmp->handshake_type = onionskin->handshake_type;
   tmp->onionskin = onionskin;
   tmp->when_added = now;
+  tmp->when_added_msec = monotime_coarse_absolute_msec();
 
   if (!have_room_for_onionskin(onionskin->handshake_type)) {
 #define WARN_TOO_MANY_CIRC_CREATIONS_INTERVAL (60)
@@ -190,18 +235,162 @@ onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
     if (now - head->when_added < (time_t)ONIONQUEUE_WAIT_CUTOFF)
       break;
 
-    circ = head->circ;
-    circ->onionqueue_entry = NULL;
-    onion_queue_entry_remove(head);
     log_info(LD_CIRC,
              "Circuit create request is too old; canceling due to overload.");
-    if (! TO_CIRCUIT(circ)->marked_for_close) {
-      circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_RESOURCELIMIT);
-    }
+    onion_queue_entry_drop(head);
   }
   return 0;
 }
 
+/** Remove the queue entry <b>victim</b> without processing it, and close
+ * its circuit. */
+static void
+onion_queue_entry_drop(onion_queue_t *victim)
+{
+  or_circuit_t *circ = victim->circ;
+  circ->onionqueue_entry = NULL;
+  onion_queue_entry_remove(victim);
+  if (! TO_CIRCUIT(circ)->marked_for_close) {
+    circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_RESOURCELIMIT);
+  }
+}
+
+/** Return the CoDel target delay for the onion queues, in msec.  Zero means
+ * that CoDel is disabled. */
+static uint32_t
+onion_queue_codel_target_msec(void)
+{
+#define DEFAULT_ONION_QUEUE_CODEL_TARGET 100
+#define MIN_ONION_QUEUE_CODEL_TARGET 0
+#define MAX_ONION_QUEUE_CODEL_TARGET 60000
+
+  return networkstatus_get_param(NULL, "OnionQueueCoDelTarget",
+                                 DEFAULT_ONION_QUEUE_CODEL_TARGET,
+                                 MIN_ONION_QUEUE_CODEL_TARGET,
+                                 MAX_ONION_QUEUE_CODEL_TARGET);
+}
+
+/** Return the CoDel interval for the onion queues, in msec: how long the
+ * sojourn time must stay above the target before we start dropping. */
+static uint32_t
+onion_queue_codel_interval_msec(void)
+{
+#define DEFAULT_ONION_QUEUE_CODEL_INTERVAL 1000
+#define MIN_ONION_QUEUE_CODEL_INTERVAL 1
+#define MAX_ONION_QUEUE_CODEL_INTERVAL 600000
+
+  return networkstatus_get_param(NULL, "OnionQueueCoDelInterval",
+                                 DEFAULT_ONION_QUEUE_CODEL_INTERVAL,
+                                 MIN_ONION_QUEUE_CODEL_INTERVAL,
+                                 MAX_ONION_QUEUE_CODEL_INTERVAL);
+}
+
+/** Return the time at which CoDel should drop its next request, given that
+ * it has dropped <b>count</b> so far, and the last drop was at <b>t</b>. */
+static uint64_t
+onion_queue_codel_control_law(uint64_t t, unsigned count, uint32_t interval)
+{
+  return t + (uint64_t)(interval / sqrt((double)count));
+}
+
+/** Update <b>codel</b>, the CoDel state of the queue of <b>type</b>, for
+ * taking <b>head</b> off the queue at <b>now</b>.  Return true iff the
+ * sojourn time has been above <b>target</b> for at least an interval, so
+ * that CoDel may drop <b>head</b>. */
+static int
+onion_queue_codel_ok_to_drop(onion_codel_t *codel, uint16_t type,
+                             const onion_queue_t *head, uint64_t now,
+                             uint32_t target, uint32_t interval)
+{
+  const uint64_t sojourn =
+    now > head->when_added_msec ? now - head->when_added_msec : 0;
+  codel->last_sojourn_msec = sojourn;
+
+  /* Never drop the last request on the queue: the queue can't be standing
+   * if it holds only one request. */
+  if (sojourn < target || ol_entries[type] <= 1) {
+    codel->first_above_time = 0;
+    return 0;
+  }
+  if (codel->first_above_time == 0) {
+    codel->first_above_time = now + interval;
+    return 0;
+  }
+  return now >= codel->first_above_time;
+}
+
+/** Take the next request that we should process from the queue of
+ * <b>type</b>, leaving it in place, and return it.  Before doing so, drop
+ * as many requests from the head of the queue as CoDel tells us to.  Return
+ * NULL if the queue is (or becomes) empty. */
+static onion_queue_t *
+onion_queue_codel_dequeue(uint16_t type)
+{
+  onion_codel_t *codel = &ol_codel[type];
+  onion_queue_t *head = TOR_TAILQ_FIRST(&ol_list[type]);
+  const uint32_t target = onion_queue_codel_target_msec();
+  const uint32_t interval = onion_queue_codel_interval_msec();
+  uint64_t now;
+  int ok_to_drop;
+
+  if (!head)
+    return NULL;
+  if (!target) {
+    codel->dropping = 0;
+    codel->first_above_time = 0;
+    return head;
+  }
+
+  now = monotime_coarse_absolute_msec();
+  ok_to_drop = onion_queue_codel_ok_to_drop(codel, type, head, now,
+                                            target, interval);
+  if (codel->dropping) {
+    if (!ok_to_drop) {
+      /* The sojourn time is below target again; stop dropping. */
+      codel->dropping = 0;
+    }
+    while (codel->dropping && now >= codel->drop_next) {
+      onion_queue_entry_drop(head);
+      ++codel->n_dropped;
+      ++codel->count;
+      head = TOR_TAILQ_FIRST(&ol_list[type]);
+      if (!head ||
+          !onion_queue_codel_ok_to_drop(codel, type, head, now,
+                                        target, interval)) {
+        codel->dropping = 0;
+      } else {
+        codel->drop_next = onion_queue_codel_control_law(codel->drop_next,
+                                                         codel->count,
+                                                         interval);
+      }
+    }
+  } else if (ok_to_drop) {
+    unsigned delta;
+    onion_queue_entry_drop(head);
+    ++codel->n_dropped;
+    head = TOR_TAILQ_FIRST(&ol_list[type]);
+    if (head)
+      onion_queue_codel_ok_to_drop(codel, type, head, now, target, interval);
+    codel->dropping = 1;
+    /* If we were dropping recently, start again at a similar rate rather
+     * than starting over.  (If we stopped before drop_next came around,
+     * that was recent too.) */
+    delta = codel->count - codel->last_count;
+    if (delta > 1 && (now < codel->drop_next ||
+                      now - codel->drop_next < 16 * (uint64_t)interval))
+      codel->count = delta;
+    else
+      codel->count = 1;
+    codel->drop_next = onion_queue_codel_control_law(now, codel->count,
+                                                     interval);
+    codel->last_count = codel->count;
+  }
+
+  if (head)
+    ++codel->n_processed;
+  return head;
+}
+
 /** Return a fairness parameter, to prefer processing NTOR style
  * handshakes but still slowly drain the TAP queue so we don't starve
  * it entirely. */
@@ -265,9 +454,13 @@ or_circuit_t *
 onion_next_task(create_cell_t **onionskin_out)
 {
   or_circuit_t *circ;
-  uint16_t handshake_to_choose = decide_next_handshake_type();
-  onion_queue_t *head = TOR_TAILQ_FIRST(&ol_list[handshake_to_choose]);
+  uint16_t handshake_to_choose;
+  onion_queue_t *head;
 
+  handshake_to_choose = decide_next_handshake_type();
+  /* CoDel never drops the last request on a queue, so this is NULL only if
+   * both queues are empty. */
+  head = onion_queue_codel_dequeue(handshake_to_choose);
   if (!head)
     return NULL; /* no onions pending, we're done */
 
@@ -291,6 +484,59 @@ onion_next_task(create_cell_t **onionskin_out)
   return circ;
 }
 
+/** Describe the state of the CoDel controller on the queue of
+ * <b>type</b>, as a newly allocated string. */
+static char *
+onion_queue_codel_describe(uint16_t type, const char *type_name)
+{
+  const onion_codel_t *codel = &ol_codel[type];
+  char *s = NULL;
+  tor_asprintf(&s, "%s queued=%d delay-msec=%"PRIu64" dropping=%d "
+               "processed=%"PRIu64" dropped=%"PRIu64,
+               type_name, ol_entries[type], codel->last_sojourn_msec,
+               (int)codel->dropping, codel->n_processed, codel->n_dropped);
+  return s;
+}
+
+/** Return a newly allocated string describing the onion queues and their
+ * CoDel controllers, for the "onion-queue/codel" GETINFO key. */
+char *
+onion_queue_get_codel_status_for_control(void)
+{
+  char *ntor = onion_queue_codel_describe(ONION_HANDSHAKE_TYPE_NTOR, "ntor");
+  char *tap = onion_queue_codel_describe(ONION_HANDSHAKE_TYPE_TAP, "tap");
+  char *s = NULL;
+  tor_asprintf(&s, "target-msec=%u interval-msec=%u\n%s\n%s",
+               (unsigned)onion_queue_codel_target_msec(),
+               (unsigned)onion_queue_codel_interval_msec(),
+               ntor, tap);
+  tor_free(ntor);
+  tor_free(tap);
+  return s;
+}
+
+/** Log the state of the onion queues' CoDel controllers, if we have
+ * handled any requests. */
+void
+onion_queue_log_heartbeat(void)
+{
+  const onion_codel_t *ntor = &ol_codel[ONION_HANDSHAKE_TYPE_NTOR];
+  const onion_codel_t *tap = &ol_codel[ONION_HANDSHAKE_TYPE_TAP];
+
+  if (!ntor->n_processed && !ntor->n_dropped &&
+      !tap->n_processed && !tap->n_dropped)
+    return;
+
+  log_notice(LD_HEARTBEAT,
+             "Onion queues since startup: %"PRIu64" ntor and %"PRIu64" TAP "
+             "requests dropped by CoDel. Last queue delays were "
+             "%"PRIu64" msec (ntor) and %"PRIu64" msec (TAP).%s",
+             ntor->n_dropped, tap->n_dropped,
+             ntor->last_sojourn_msec, tap->last_sojourn_msec,
+             (ntor->dropping || tap->dropping) ?
+               " We are currently dropping requests." : "");
+}
+
 /** Return the number of <b>handshake_type</b>-style create requests pending.
  */
 int
@@ -358,4 +604,5 @@ clear_pending_onions(void)
     tor_assert(TOR_TAILQ_EMPTY(&ol_list[i]));
   }
   memset(ol_entries, 0, sizeof(ol_entries));
+  memset(ol_codel, 0, sizeof(ol_codel));
 }
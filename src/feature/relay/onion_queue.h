@@ -19,5 +19,7 @@ or_circuit_t *onion_next_task(struct create_cell_t **onionskin_out);
 int onion_num_pending(uint16_t handshake_type);
 void onion_pending_remove(or_circuit_t *circ);
 void clear_pending_onions(void);
+char *onion_queue_get_codel_status_for_control(void);
+void onion_queue_log_heartbeat(void);
 
 #endif
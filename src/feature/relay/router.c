@@ -1557,6 +1557,9 @@ router_compare_to_my_exit_policy(const tor_addr_t *addr, uint16_t port)
    * summary. */
   if ((tor_addr_family(addr) == AF_INET ||
        tor_addr_family(addr) == AF_INET6)) {
+    if (me->compiled_exit_policy)
+      return compare_tor_addr_to_compiled_policy(addr, port,
+                         me->compiled_exit_policy) != ADDR_POLICY_ACCEPTED;
     return compare_tor_addr_to_addr_policy(addr, port,
                                me->exit_policy) != ADDR_POLICY_ACCEPTED;
 #if 0
@@ -2047,6 +2050,7 @@ router_build_fresh_descriptor(routerinfo_t **r, extrainfo_t **e)
   ri->policy_is_reject_star =
     policy_is_reject_star(ri->exit_policy, AF_INET, 1) &&
     policy_is_reject_star(ri->exit_policy, AF_INET6, 1);
+  ri->compiled_exit_policy = compiled_policy_get(ri->exit_policy);
 
   if (options->IPv6Exit) {
     char *p_tmp = policy_summarize(ri->exit_policy, AF_INET6);
@@ -203,6 +203,16 @@ clientmap_entry_new(geoip_client_action_t action, const tor_addr_t *addr,
   return entry;
 }
 
+/** Note that <b>ent</b> was last seen at time <b>now</b>. */
+static void
+clientmap_entry_set_last_seen(clientmap_entry_t *ent, time_t now)
+{
+  if (now / 60 <= (int)MAX_LAST_SEEN_IN_MINUTES && now >= 0)
+    ent->last_seen_in_minutes = (unsigned)(now/60);
+  else
+    ent->last_seen_in_minutes = 0;
+}
+
 /** Clear history of connecting clients used by entry and bridge stats. */
 static void
 client_history_clear(void)
@@ -233,9 +243,9 @@ geoip_note_client_seen(geoip_client_action_t action,
   clientmap_entry_t *ent;
 
   if (action == GEOIP_CLIENT_CONNECT) {
-    /* Only remember statistics if the DoS mitigation subsystem is enabled. If
-     * not, only if as entry guard or as bridge. */
-    if (!dos_enabled()) {
+    /* Only remember statistics if the DoS mitigation subsystem wants them for
+     * every client. If not, only if as entry guard or as bridge. */
+    if (!dos_wants_client_entries()) {
       if (!options->EntryStatistics && !should_record_bridge_info(options)) {
         return;
       }
@@ -256,10 +266,7 @@ geoip_note_client_seen(geoip_client_action_t action,
     ent = clientmap_entry_new(action, addr, transport_name);
     HT_INSERT(clientmap, &client_history, ent);
   }
-  if (now / 60 <= (int)MAX_LAST_SEEN_IN_MINUTES && now >= 0)
-    ent->last_seen_in_minutes = (unsigned)(now/60);
-  else
-    ent->last_seen_in_minutes = 0;
+  clientmap_entry_set_last_seen(ent, now);
 
   if (action == GEOIP_CLIENT_NETWORKSTATUS) {
     int country_idx = geoip_get_country_by_addr(addr);
@@ -272,6 +279,25 @@ geoip_note_client_seen(geoip_client_action_t action,
   }
 }
 
+/** Add an entry for a client connecting from <b>addr</b> with no transport,
+ * seen at time <b>now</b>, and return it. There must not be one already.
+ *
+ * The DoS mitigation subsystem uses this when it counts clients in its sketch
+ * and only wants entries for the addresses that the sketch flags. */
+clientmap_entry_t *
+geoip_add_client(const tor_addr_t *addr, time_t now)
+{
+  clientmap_entry_t *ent;
+
+  tor_assert(addr);
+  tor_assert(!geoip_lookup_client(addr, NULL, GEOIP_CLIENT_CONNECT));
+
+  ent = clientmap_entry_new(GEOIP_CLIENT_CONNECT, addr, NULL);
+  HT_INSERT(clientmap, &client_history, ent);
+  clientmap_entry_set_last_seen(ent, now);
+  return ent;
+}
+
 /** HT_FOREACH helper: remove a clientmap_entry_t from the hashtable if it's
  * older than a certain time. */
 static int
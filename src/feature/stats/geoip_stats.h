@@ -99,6 +99,7 @@ int should_record_bridge_info(const or_options_t *options);
 void geoip_note_client_seen(geoip_client_action_t action,
                             const tor_addr_t *addr, const char *transport_name,
                             time_t now);
+clientmap_entry_t *geoip_add_client(const tor_addr_t *addr, time_t now);
 void geoip_remove_old_clients(time_t cutoff);
 clientmap_entry_t *geoip_lookup_client(const tor_addr_t *addr,
                                        const char *transport_name,
@@ -121,38 +121,197 @@ chunk_repack(chunk_t *chunk)
   chunk->data = &chunk->mem[0];
 }
 
-/** Keep track of total size of allocated chunks for consistency asserts */
+/** Keep track of total size of allocated chunks for consistency asserts.
+ * This includes the chunks waiting on our freelists. */
 static size_t total_bytes_allocated_in_chunks = 0;
+
+/** A freelist of chunks of a single allocation size.
+ *
+ * Buffers allocate and free chunks of a handful of sizes at a very high
+ * rate, so we keep a few of each common size around instead of going back
+ * to malloc every time. */
+typedef struct chunk_freelist_t {
+  size_t alloc_size; /**< What size chunks does this freelist hold? */
+  int max_length; /**< Never allow more than this many chunks here. */
+  int slack; /**< When trimming this freelist, leave this many extra chunks
+              * beyond lowest_length. */
+  int cur_length; /**< How many chunks are on this freelist? */
+  int lowest_length; /**< What's the smallest value of cur_length since the
+                      * last time we trimmed this freelist? */
+  chunk_t *head; /**< First chunk on this freelist. */
+  uint64_t n_alloc; /**< How many chunks of this size have we malloced? */
+  uint64_t n_free; /**< How many chunks of this size have we given back to
+                    * the system? */
+  uint64_t n_hit; /**< How many allocations have we served from here? */
+} chunk_freelist_t;
+
+/** Macro to help define freelists. */
+#define FL(a,m,s) { a, m, s, 0, 0, NULL, 0, 0, 0 }
+
+/** Static array of freelists, sorted by alloc_len, terminated by an entry
+ * with alloc_size of 0.  Together they can hold at most 5 MB. */
+static chunk_freelist_t freelists[] = {
+  FL(4096, 256, 8), FL(8192, 128, 4), FL(16384, 64, 4), FL(32768, 32, 2),
+  FL(65536, 16, 2), FL(0, 0, 0)
+};
+#undef FL
+/** How many times have we looked for a chunk of a size that no freelist
+ * could help with? */
+static uint64_t n_freelist_miss = 0;
+
+/** Return the freelist to hold chunks of size <b>alloc</b>, or NULL if
+ * no freelist exists for that size. */
+static inline chunk_freelist_t *
+get_freelist(size_t alloc)
+{
+  int i;
+  for (i=0; (freelists[i].alloc_size <= alloc &&
+             freelists[i].alloc_size); ++i ) {
+    if (freelists[i].alloc_size == alloc) {
+      return &freelists[i];
+    }
+  }
+  return NULL;
+}
+
 static void
 buf_chunk_free_unchecked(chunk_t *chunk)
 {
+  size_t alloc;
+  chunk_freelist_t *freelist;
   if (!chunk)
     return;
+  alloc = CHUNK_ALLOC_SIZE(chunk->memlen);
 #ifdef DEBUG_CHUNK_ALLOC
-  tor_assert(CHUNK_ALLOC_SIZE(chunk->memlen) == chunk->DBG_alloc);
+  tor_assert(alloc == chunk->DBG_alloc);
 #endif
-  tor_assert(total_bytes_allocated_in_chunks >=
-             CHUNK_ALLOC_SIZE(chunk->memlen));
-  total_bytes_allocated_in_chunks -= CHUNK_ALLOC_SIZE(chunk->memlen);
+  freelist = get_freelist(alloc);
+  if (freelist && freelist->cur_length < freelist->max_length) {
+    chunk->next = freelist->head;
+    freelist->head = chunk;
+    ++freelist->cur_length;
+    return;
+  }
+  if (freelist)
+    ++freelist->n_free;
+  tor_assert(total_bytes_allocated_in_chunks >= alloc);
+  total_bytes_allocated_in_chunks -= alloc;
   tor_free(chunk);
 }
 static inline chunk_t *
 chunk_new_with_alloc_size(size_t alloc)
 {
   chunk_t *ch;
-  ch = tor_malloc(alloc);
-  ch->next = NULL;
-  ch->datalen = 0;
+  chunk_freelist_t *freelist;
+  tor_assert(alloc >= sizeof(chunk_t));
+  freelist = get_freelist(alloc);
+  if (freelist && freelist->head) {
+    ch = freelist->head;
+    freelist->head = ch->next;
+    if (--freelist->cur_length < freelist->lowest_length)
+      freelist->lowest_length = freelist->cur_length;
+    ++freelist->n_hit;
+  } else {
+    if (freelist)
+      ++freelist->n_alloc;
+    else
+      ++n_freelist_miss;
+    ch = tor_malloc(alloc);
+    total_bytes_allocated_in_chunks += alloc;
 #ifdef DEBUG_CHUNK_ALLOC
-  ch->DBG_alloc = alloc;
+    ch->DBG_alloc = alloc;
 #endif
+  }
+  ch->next = NULL;
+  ch->datalen = 0;
   ch->memlen = CHUNK_SIZE_WITH_ALLOC(alloc);
-  total_bytes_allocated_in_chunks += alloc;
   ch->data = &ch->mem[0];
   CHUNK_SET_SENTINEL(ch, alloc);
   return ch;
 }
 
+/** Remove from the freelists most chunks that have not been used since the
+ * last call to buf_shrink_freelists().   Return the amount of memory
+ * freed. */
+size_t
+buf_shrink_freelists(int free_all)
+{
+  int i;
+  size_t total_freed = 0;
+  for (i = 0; freelists[i].alloc_size; ++i) {
+    int slack = freelists[i].slack;
+    int n_to_free = free_all ? freelists[i].cur_length :
+      (freelists[i].lowest_length - slack);
+    int n_freed = 0;
+    if (n_to_free > freelists[i].cur_length)
+      n_to_free = freelists[i].cur_length;
+    if (n_to_free > 0) {
+      log_info(LD_MM, "Cleaning freelist for %d-byte chunks: "
+               "keeping %d, dropping %d.",
+               (int)freelists[i].alloc_size,
+               freelists[i].cur_length - n_to_free, n_to_free);
+    }
+    while (n_freed < n_to_free) {
+      chunk_t *chunk = freelists[i].head;
+      tor_assert(chunk);
+      freelists[i].head = chunk->next;
+      --freelists[i].cur_length;
+      ++freelists[i].n_free;
+      tor_free(chunk);
+      ++n_freed;
+    }
+    freelists[i].lowest_length = freelists[i].cur_length;
+    total_freed += n_freed * freelists[i].alloc_size;
+  }
+  tor_assert(total_bytes_allocated_in_chunks >= total_freed);
+  total_bytes_allocated_in_chunks -= total_freed;
+  return total_freed;
+}
+
+/** Describe the current status of the freelists at log level
+ * <b>severity</b>. */
+void
+buf_dump_freelist_sizes(int severity)
+{
+  int i;
+  tor_log(severity, LD_MM, "====== Buffer freelists:");
+  for (i = 0; freelists[i].alloc_size; ++i) {
+    uint64_t total = ((uint64_t)freelists[i].cur_length) *
+      freelists[i].alloc_size;
+    tor_log(severity, LD_MM,
+            "%"PRIu64" bytes in %d %d-byte chunks [%"PRIu64
+            " misses; %"PRIu64" frees; %"PRIu64" hits]",
+            (total),
+            freelists[i].cur_length, (int)freelists[i].alloc_size,
+            (freelists[i].n_alloc),
+            (freelists[i].n_free),
+            (freelists[i].n_hit));
+  }
+  tor_log(severity, LD_MM, "%"PRIu64" allocations in non-freelist sizes",
+          (n_freelist_miss));
+}
+
+/** Set *<b>n_bytes_out</b> to the number of bytes held on the chunk
+ * freelists, *<b>n_hits_out</b> to the number of chunk allocations served
+ * from them, and *<b>n_misses_out</b> to the number that needed a fresh
+ * allocation. */
+void
+buf_get_freelist_stats(size_t *n_bytes_out, uint64_t *n_hits_out,
+                       uint64_t *n_misses_out)
+{
+  int i;
+  size_t n_bytes = 0;
+  uint64_t n_hits = 0, n_misses = n_freelist_miss;
+  for (i = 0; freelists[i].alloc_size; ++i) {
+    n_bytes += freelists[i].cur_length * freelists[i].alloc_size;
+    n_hits += freelists[i].n_hit;
+    n_misses += freelists[i].n_alloc;
+  }
+  *n_bytes_out = n_bytes;
+  *n_hits_out = n_hits;
+  *n_misses_out = n_misses;
+}
+
 /** Expand <b>chunk</b> until it can hold <b>sz</b> bytes, and return a
  * new pointer to <b>chunk</b>.  Old pointers are no longer valid. */
 static inline chunk_t *
@@ -466,22 +625,34 @@ buf_copy(const buf_t *buf)
   return out;
 }
 
-/** Append a new chunk with enough capacity to hold <b>capacity</b> bytes to
- * the tail of <b>buf</b>.  If <b>capped</b>, don't allocate a chunk bigger
- * than MAX_CHUNK_ALLOC. */
+/** Return a new chunk, not yet on any buffer, with enough capacity to hold
+ * <b>capacity</b> bytes, and no smaller than <b>buf</b>'s default chunk
+ * size.  If <b>capped</b>, don't allocate a chunk bigger than
+ * MAX_CHUNK_ALLOC. */
 chunk_t *
-buf_add_chunk_with_capacity(buf_t *buf, size_t capacity, int capped)
+buf_chunk_new_with_capacity(const buf_t *buf, size_t capacity, int capped)
 {
-  chunk_t *chunk;
-
   if (CHUNK_ALLOC_SIZE(capacity) < buf->default_chunk_size) {
-    chunk = chunk_new_with_alloc_size(buf->default_chunk_size);
+    return chunk_new_with_alloc_size(buf->default_chunk_size);
   } else if (capped && CHUNK_ALLOC_SIZE(capacity) > MAX_CHUNK_ALLOC) {
-    chunk = chunk_new_with_alloc_size(MAX_CHUNK_ALLOC);
+    return chunk_new_with_alloc_size(MAX_CHUNK_ALLOC);
   } else {
-    chunk = chunk_new_with_alloc_size(buf_preferred_chunk_size(capacity));
+    return chunk_new_with_alloc_size(buf_preferred_chunk_size(capacity));
   }
+}
 
+/** Release <b>chunk</b>, which must not be on any buffer. */
+void
+buf_chunk_free(chunk_t *chunk)
+{
+  buf_chunk_free_unchecked(chunk);
+}
+
+/** Append <b>chunk</b>, which must not be on any buffer, to the tail of
+ * <b>buf</b>. */
+void
+buf_append_chunk(buf_t *buf, chunk_t *chunk)
+{
   chunk->inserted_time = monotime_coarse_get_stamp();
 
   if (buf->tail) {
@@ -493,6 +664,33 @@ buf_add_chunk_with_capacity(buf_t *buf, size_t capacity, int capped)
     buf->head = buf->tail = chunk;
   }
   check();
+}
+
+/** Append a new chunk with enough capacity to hold <b>capacity</b> bytes to
+ * the tail of <b>buf</b>.  If <b>capped</b>, don't allocate a chunk bigger
+ * than MAX_CHUNK_ALLOC. */
+chunk_t *
+buf_add_chunk_with_capacity(buf_t *buf, size_t capacity, int capped)
+{
+  chunk_t *chunk = buf_chunk_new_with_capacity(buf, capacity, capped);
+  buf_append_chunk(buf, chunk);
+  return chunk;
+}
+
+/** Append a new chunk to the tail of <b>buf</b> with room for exactly
+ * <b>capacity</b> bytes, unless that is smaller than <b>buf</b>'s default
+ * chunk size.  Unlike buf_add_chunk_with_capacity(), don't round the
+ * allocation up to a power of two. */
+chunk_t *
+buf_add_chunk_with_exact_capacity(buf_t *buf, size_t capacity)
+{
+  chunk_t *chunk;
+  tor_assert(capacity <= SIZE_T_CEILING - CHUNK_OVERHEAD);
+  if (CHUNK_ALLOC_SIZE(capacity) < buf->default_chunk_size)
+    chunk = chunk_new_with_alloc_size(buf->default_chunk_size);
+  else
+    chunk = chunk_new_with_alloc_size(CHUNK_ALLOC_SIZE(capacity));
+  buf_append_chunk(buf, chunk);
   return chunk;
 }
 
@@ -510,6 +708,8 @@ buf_get_oldest_chunk_timestamp(const buf_t *buf, uint32_t now)
   }
 }
 
+/** Return the number of bytes that we have allocated for buffer chunks,
+ * including the chunks on our freelists. */
 size_t
 buf_get_total_allocation(void)
 {
@@ -648,15 +848,22 @@ buf_get_bytes(buf_t *buf, char *string, size_t string_len)
 
 /** Move up to *<b>buf_flushlen</b> bytes from <b>buf_in</b> to
  * <b>buf_out</b>, and modify *<b>buf_flushlen</b> appropriately.
- * Return the number of bytes actually copied.
+ * Return the number of bytes actually moved.
+ *
+ * Whole chunks are relinked onto <b>buf_out</b> without copying; only
+ * when the last chunk we take is not wanted in its entirety do we copy the
+ * bytes we need from it.  If <b>n_copied_out</b> is provided, set it to the
+ * number of bytes that had to be copied.
  */
 int
-buf_move_to_buf(buf_t *buf_out, buf_t *buf_in, size_t *buf_flushlen)
+buf_move_to_buf_counted(buf_t *buf_out, buf_t *buf_in, size_t *buf_flushlen,
+                        size_t *n_copied_out)
 {
-  /* We can do way better here, but this doesn't turn up in any profiles. */
-  char b[4096];
   size_t cp, len;
 
+  if (n_copied_out)
+    *n_copied_out = 0;
+
   if (BUG(buf_out->datalen >= INT_MAX))
     return -1;
   if (BUG(buf_out->datalen >= INT_MAX - *buf_flushlen))
@@ -666,21 +873,70 @@ buf_move_to_buf(buf_t *buf_out, buf_t *buf_in, size_t *buf_flushlen)
   if (len > buf_in->datalen)
     len = buf_in->datalen;
 
-  cp = len; /* Remember the number of bytes we intend to copy. */
+  cp = len; /* Remember the number of bytes we intend to move. */
   tor_assert(cp < INT_MAX);
-  while (len) {
-    /* This isn't the most efficient implementation one could imagine, since
-     * it does two copies instead of 1, but I kinda doubt that this will be
-     * critical path. */
-    size_t n = len > sizeof(b) ? sizeof(b) : len;
-    buf_get_bytes(buf_in, b, n);
-    buf_add(buf_out, b, n);
-    len -= n;
+
+  if (len && buf_out->tail && buf_out->tail->datalen == 0) {
+    /* Don't leave an empty chunk stranded in the middle of buf_out. */
+    chunk_t *victim = buf_out->tail, *prev = NULL;
+    if (buf_out->head != victim) {
+      for (prev = buf_out->head; prev->next != victim; prev = prev->next)
+        ;
+    }
+    if (prev) {
+      prev->next = NULL;
+      buf_out->tail = prev;
+    } else {
+      buf_out->head = buf_out->tail = NULL;
+    }
+    buf_chunk_free_unchecked(victim);
+  }
+
+  while (len && buf_in->head->datalen <= len) {
+    chunk_t *chunk = buf_in->head;
+    buf_in->head = chunk->next;
+    if (buf_in->tail == chunk)
+      buf_in->tail = NULL;
+    buf_in->datalen -= chunk->datalen;
+    chunk->next = NULL;
+    len -= chunk->datalen;
+
+    if (chunk->datalen == 0) {
+      buf_chunk_free_unchecked(chunk);
+      continue;
+    }
+
+    /* Keep the chunk's original insertion time, so that the age of the
+     * data it holds is still visible to the OOM handler. */
+    if (buf_out->tail)
+      buf_out->tail->next = chunk;
+    else
+      buf_out->head = chunk;
+    buf_out->tail = chunk;
+    buf_out->datalen += chunk->datalen;
   }
+
+  if (len) {
+    /* We only want part of the head chunk, and buf_in still owns the
+     * rest: copy what we need. */
+    buf_add(buf_out, buf_in->head->data, len);
+    buf_drain(buf_in, len);
+    if (n_copied_out)
+      *n_copied_out = len;
+  }
+
   *buf_flushlen -= cp;
   return (int)cp;
 }
 
+/** As buf_move_to_buf_counted(), but don't report how many bytes were
+ * copied. */
+int
+buf_move_to_buf(buf_t *buf_out, buf_t *buf_in, size_t *buf_flushlen)
+{
+  return buf_move_to_buf_counted(buf_out, buf_in, buf_flushlen, NULL);
+}
+
 /** Moves all data from <b>buf_in</b> to <b>buf_out</b>, without copying.
  */
 void
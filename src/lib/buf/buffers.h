@@ -35,6 +35,10 @@ size_t buf_slack(const buf_t *buf);
 
 uint32_t buf_get_oldest_chunk_timestamp(const buf_t *buf, uint32_t now);
 size_t buf_get_total_allocation(void);
+size_t buf_shrink_freelists(int free_all);
+void buf_dump_freelist_sizes(int severity);
+void buf_get_freelist_stats(size_t *n_bytes_out, uint64_t *n_hits_out,
+                            uint64_t *n_misses_out);
 
 int buf_add(buf_t *buf, const char *string, size_t string_len);
 void buf_add_string(buf_t *buf, const char *string);
@@ -43,6 +47,8 @@ void buf_add_printf(buf_t *buf, const char *format, ...)
 void buf_add_vprintf(buf_t *buf, const char *format, va_list args)
   CHECK_PRINTF(2, 0);
 int buf_move_to_buf(buf_t *buf_out, buf_t *buf_in, size_t *buf_flushlen);
+int buf_move_to_buf_counted(buf_t *buf_out, buf_t *buf_in,
+                            size_t *buf_flushlen, size_t *n_copied_out);
 void buf_move_all(buf_t *buf_out, buf_t *buf_in);
 void buf_peek(const buf_t *buf, char *string, size_t string_len);
 void buf_drain(buf_t *buf, size_t n);
@@ -97,6 +103,11 @@ struct buf_t {
 };
 
 chunk_t *buf_add_chunk_with_capacity(buf_t *buf, size_t capacity, int capped);
+chunk_t *buf_add_chunk_with_exact_capacity(buf_t *buf, size_t capacity);
+chunk_t *buf_chunk_new_with_capacity(const buf_t *buf, size_t capacity,
+                                     int capped);
+void buf_chunk_free(chunk_t *chunk);
+void buf_append_chunk(buf_t *buf, chunk_t *chunk);
 /** If a read onto the end of a chunk would be smaller than this number, then
  * just start a new chunk. */
 #define MIN_READ_LEN 8
@@ -9,13 +9,29 @@
  * for them to send answers back to the main thread.
  *
  * The main structure here is a threadpool_t : it manages a set of worker
- * threads, a queue of pending work, and a reply queue.  Every piece of work
- * is a workqueue_entry_t, containing data to process and a function to
- * process it with.
+ * threads, each with its own queues of pending work, and a reply queue.
+ * Every piece of work is a workqueue_entry_t, containing data to process and
+ * a function to process it with.
  *
- * The main thread informs the worker threads of pending work by using a
- * condition variable.  The workers inform the main process of completed work
- * by using an alert_sockets_t object, as implemented in net/alertsock.c.
+ * New work goes onto the queue of an idle worker if there is one, and
+ * otherwise onto the queue of the next worker in turn.  A worker that runs
+ * out of work of its own steals from the other workers' queues before going
+ * to sleep, so no single lock is shared by all the workers.
+ *
+ * The main thread informs a worker thread of pending work by using that
+ * thread's condition variable.  The workers inform the main process of
+ * completed work by using an alert_sockets_t object, as implemented in
+ * net/alertsock.c.
+ *
+ * Each worker passes its answers back on a ring of its own in the reply
+ * queue, which only that worker writes and only the main thread reads, so
+ * that no lock is needed to pass an answer along.  (If the main thread falls
+ * far enough behind to fill a ring, the worker queues the rest behind it
+ * under a lock, and each worker's answers still arrive in order.)  A worker
+ * only sends an alert when no alert is already outstanding, and the main
+ * thread handles at most REPLYQUEUE_MAX_BATCH answers per wakeup, so that a
+ * burst of answers costs one wakeup per batch rather than one per answer,
+ * without starving the rest of the event loop.
  *
  * The main thread can also queue an "update" that will be handled by all the
  * workers.  This is useful for updating state that all the workers share.
@@ -52,15 +68,15 @@ struct threadpool_s {
    * thread. */
   struct workerthread_s **threads;
 
-  /** Condition variable that we wait on when we have no work, and which
-   * gets signaled when our queue becomes nonempty. */
-  tor_cond_t condition;
-  /** Queues of pending work that we have to do. The queue with priority
-   * <b>p</b> is work[p]. */
-  work_tailq_t work[WORKQUEUE_N_PRIORITIES];
-
-  /** Weak RNG, used to decide when to ignore priority. */
-  tor_weak_rng_t weak_rng;
+  /** Number of work items that have been queued on some thread, and not yet
+   * extracted or cancelled.  A worker never goes to sleep while this is
+   * nonzero. */
+  atomic_counter_t n_queued;
+  /** Number of worker threads that are waiting on their condition
+   * variables. */
+  atomic_counter_t n_idle;
+  /** Counter used to spread work over the threads when none is idle. */
+  atomic_counter_t next_thread;
 
   /** The current 'update generation' of the threadpool.  Any thread that is
    * at an earlier generation needs to run the update function. */
@@ -72,13 +88,17 @@ struct threadpool_s {
   void (*free_update_arg_fn)(void *);
   /** Array of n_threads update arguments. */
   void **update_args;
+  /** Function that each thread runs on its state when it has no work to
+   * do; see threadpool_set_idle_fn(). */
+  int (*idle_fn)(void *);
   /** Event to notice when another thread has sent a reply. */
   struct event *reply_event;
   void (*reply_cb)(threadpool_t *);
 
   /** Number of elements in threads. */
   int n_threads;
-  /** Mutex to protect all the above fields. */
+  /** Mutex to protect all the above fields, other than the atomic
+   * counters. */
   tor_mutex_t lock;
 
   /** A reply queue to use when constructing new threads. */
@@ -103,6 +123,10 @@ struct workqueue_entry_s {
    * is set when the workqueue_entry_t is created, and won't be cleared until
    * after it's handled in the main thread. */
   struct threadpool_s *on_pool;
+  /** The worker thread on whose queue this entry was placed.  This is set
+   * when the entry is queued, and never changes: a thread that steals the
+   * entry either runs it at once or puts it back on this thread's queue. */
+  struct workerthread_s *on_thread;
   /** True iff this entry is waiting for a worker to start processing it. */
   uint8_t pending;
   /** Priority of this entry. */
@@ -115,11 +139,61 @@ struct workqueue_entry_s {
   void *arg;
 };
 
+/** Number of answers that fit on a single reply ring. Must be a power of
+ * two. */
+#define REPLY_RING_SIZE 256
+/** Largest number of answers that we handle each time the main thread is
+ * woken up to process a reply queue. */
+#define REPLYQUEUE_MAX_BATCH 64
+
+/** A single-producer, single-consumer ring of answers, written by one
+ * worker thread and read by the main thread.
+ *
+ * The entries between <b>tail</b> and <b>head</b> (modulo REPLY_RING_SIZE)
+ * hold answers.  Only the producer advances <b>head</b>, after filling in
+ * an entry; only the consumer advances <b>tail</b>, after reading one.
+ *
+ * When the ring is full, the worker puts its answers on <b>overflow</b>
+ * instead, and keeps doing so until the main thread has emptied that list,
+ * so every answer on <b>overflow</b> is newer than every answer on the
+ * ring.  The main thread handles the list only once the ring is empty. */
+typedef struct reply_ring_t {
+  /** Number of answers ever put on this ring. */
+  atomic_counter_t head;
+  /** Number of answers ever taken off this ring. */
+  atomic_counter_t tail;
+  /** Number of answers on <b>overflow</b>. */
+  atomic_counter_t n_overflow;
+  /** Answers that didn't fit on the ring, oldest first.  Protected by the
+   * reply queue's lock. */
+  TOR_TAILQ_HEAD(, workqueue_entry_s) overflow;
+  /** Storage for the answers on this ring. */
+  workqueue_entry_t *entries[REPLY_RING_SIZE];
+} reply_ring_t;
+
 struct replyqueue_s {
-  /** Mutex to protect the answers field */
+  /** Mutex to protect the overflow lists of the reply rings. */
   tor_mutex_t lock;
-  /** Doubly-linked list of answers that the reply queue needs to handle. */
-  TOR_TAILQ_HEAD(, workqueue_entry_s) answers;
+
+  /** Array of the reply rings belonging to the threads that send answers
+   * to this queue.  Only touched from the main thread. */
+  reply_ring_t **rings;
+  /** Number of elements in rings. */
+  int n_rings;
+  /** Index of the ring that we should look at first next time we process
+   * this queue, so that no ring gets starved by the batch limit. */
+  int next_ring;
+
+  /** Nonzero iff a worker has alerted the main thread, and the main thread
+   * has not yet started handling the answers. */
+  atomic_counter_t alert_pending;
+
+  /** Number of times that the main thread has processed this queue. */
+  uint64_t n_wakeups;
+  /** Number of answers that the main thread has handled on this queue. */
+  uint64_t n_replies;
+  /** Largest number of answers handled in a single wakeup. */
+  unsigned max_replies_per_wakeup;
 
   /** Mechanism to wake up the main thread when it is receiving answers. */
   alert_sockets_t alert;
@@ -136,13 +210,36 @@ typedef struct workerthread_s {
   void *state;
   /** Reply queue to which we pass our results. */
   replyqueue_t *reply_queue;
+  /** Ring in reply_queue on which we put our results. */
+  reply_ring_t *reply_ring;
   /** The current update generation of this thread */
   unsigned generation;
   /** One over the probability of taking work from a lower-priority queue. */
   int32_t lower_priority_chance;
+
+  /** Mutex to protect the fields below. */
+  tor_mutex_t lock;
+  /** Condition variable that we wait on when we have no work, and which
+   * gets signaled when work is placed on our queue, or when there is an
+   * update for us to run. */
+  tor_cond_t condition;
+  /** Queues of pending work placed on this thread. The queue with priority
+   * <b>p</b> is work[p]. */
+  work_tailq_t work[WORKQUEUE_N_PRIORITIES];
+  /** True iff this thread is waiting on its condition variable. */
+  unsigned is_waiting : 1;
+  /** True iff the pool's generation may have changed since we last
+   * looked at it. */
+  unsigned update_pending : 1;
+  /** Weak RNG, used to decide when to ignore priority. Only used by this
+   * thread, or with this thread's lock held. */
+  tor_weak_rng_t weak_rng;
 } workerthread_t;
 
-static void queue_reply(replyqueue_t *queue, workqueue_entry_t *work);
+static void worker_thread_wake(workerthread_t *thread);
+static void queue_reply(replyqueue_t *queue, reply_ring_t *ring,
+                        workqueue_entry_t *work);
+static reply_ring_t *replyqueue_add_ring(replyqueue_t *queue);
 
 /** Allocate and return a new workqueue_entry_t, set up to run the function
  * <b>fn</b> in the worker thread, and <b>reply_fn</b> in the main
@@ -195,14 +292,16 @@ workqueue_entry_cancel(workqueue_entry_t *ent)
 {
   int cancelled = 0;
   void *result = NULL;
-  tor_mutex_acquire(&ent->on_pool->lock);
+  workerthread_t *thread = ent->on_thread;
+  tor_mutex_acquire(&thread->lock);
   workqueue_priority_t prio = ent->priority;
   if (ent->pending) {
-    TOR_TAILQ_REMOVE(&ent->on_pool->work[prio], ent, next_work);
+    TOR_TAILQ_REMOVE(&thread->work[prio], ent, next_work);
+    atomic_counter_sub(&ent->on_pool->n_queued, 1);
     cancelled = 1;
     result = ent->arg;
   }
-  tor_mutex_release(&ent->on_pool->lock);
+  tor_mutex_release(&thread->lock);
 
   if (cancelled) {
     workqueue_entry_free(ent);
@@ -210,35 +309,37 @@ workqueue_entry_cancel(workqueue_entry_t *ent)
   return result;
 }
 
-/**DOCDOC
-
-   must hold lock */
+/** Return true iff <b>thread</b> has work of its own on its queues.
+ *
+ * The caller must hold thread's lock. */
 static int
-worker_thread_has_work(workerthread_t *thread)
+worker_thread_has_queued_work(workerthread_t *thread)
 {
   unsigned i;
   for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
-    if (!TOR_TAILQ_EMPTY(&thread->in_pool->work[i]))
+    if (!TOR_TAILQ_EMPTY(&thread->work[i]))
         return 1;
   }
-  return thread->generation != thread->in_pool->generation;
+  return 0;
 }
 
-/** Extract the next workqueue_entry_t from the the thread's pool, removing
- * it from the relevant queues and marking it as non-pending.
+/** Extract the next workqueue_entry_t from the queues of <b>victim</b>, for
+ * <b>thread</b> to run, removing it from the relevant queue and marking it
+ * as non-pending.  <b>victim</b> is <b>thread</b> itself unless we are
+ * stealing work.
  *
- * The caller must hold the lock. */
+ * The caller must hold victim's lock. */
 static workqueue_entry_t *
-worker_thread_extract_next_work(workerthread_t *thread)
+worker_thread_extract_next_work(workerthread_t *thread,
+                                workerthread_t *victim)
 {
-  threadpool_t *pool = thread->in_pool;
   work_tailq_t *queue = NULL, *this_queue;
   unsigned i;
   for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
-    this_queue = &pool->work[i];
+    this_queue = &victim->work[i];
     if (!TOR_TAILQ_EMPTY(this_queue)) {
       queue = this_queue;
-      if (! tor_weak_random_one_in_n(&pool->weak_rng,
+      if (! tor_weak_random_one_in_n(&thread->weak_rng,
                                      thread->lower_priority_chance)) {
         /* Usually we'll just break now, so that we can get out of the loop
          * and use the queue where we found work. But with a small
@@ -255,9 +356,120 @@ worker_thread_extract_next_work(workerthread_t *thread)
   workqueue_entry_t *work = TOR_TAILQ_FIRST(queue);
   TOR_TAILQ_REMOVE(queue, work, next_work);
   work->pending = 0;
+  atomic_counter_sub(&thread->in_pool->n_queued, 1);
   return work;
 }
 
+/** Try to take a work item from the queue of some other thread in
+ * <b>thread</b>'s pool.  Return the item on success, or NULL if no other
+ * thread had any work queued.
+ *
+ * The caller must not hold any lock. */
+static workqueue_entry_t *
+worker_thread_steal_work(workerthread_t *thread)
+{
+  threadpool_t *pool = thread->in_pool;
+  workqueue_entry_t *work = NULL;
+  /* The set of threads never changes once they are running. */
+  const int n_threads = pool->n_threads;
+  int i;
+
+  for (i = 1; i < n_threads && !work; ++i) {
+    workerthread_t *victim = pool->threads[(thread->index + i) % n_threads];
+    tor_mutex_acquire(&victim->lock);
+    work = worker_thread_extract_next_work(thread, victim);
+    tor_mutex_release(&victim->lock);
+  }
+  return work;
+}
+
+/** Run the pending update function for <b>thread</b>, if the pool's update
+ * generation has changed since the thread last ran one.  Return true iff
+ * the thread should keep running.
+ *
+ * The caller must not hold any lock. */
+static int
+worker_thread_run_update(workerthread_t *thread)
+{
+  threadpool_t *pool = thread->in_pool;
+  void *arg;
+  workqueue_reply_t (*update_fn)(void*,void*);
+
+  tor_mutex_acquire(&pool->lock);
+  if (pool->generation == thread->generation) {
+    tor_mutex_release(&pool->lock);
+    return 1;
+  }
+  arg = pool->update_args[thread->index];
+  pool->update_args[thread->index] = NULL;
+  update_fn = pool->update_fn;
+  thread->generation = pool->generation;
+  tor_mutex_release(&pool->lock);
+
+  return update_fn(thread->state, arg) == WQ_RPL_REPLY;
+}
+
+/** Put <b>work</b>, which was just stolen and has not yet started, back at
+ * the head of the queue it came from.
+ *
+ * The caller must not hold any lock. */
+static void
+worker_thread_return_stolen_work(workqueue_entry_t *work)
+{
+  workerthread_t *victim = work->on_thread;
+
+  tor_mutex_acquire(&victim->lock);
+  work->pending = 1;
+  atomic_counter_add(&work->on_pool->n_queued, 1);
+  TOR_TAILQ_INSERT_HEAD(&victim->work[work->priority], work, next_work);
+  worker_thread_wake(victim);
+  tor_mutex_release(&victim->lock);
+}
+
+/** If an update is pending for <b>thread</b>, run it before <b>thread</b>
+ * runs <b>work</b>, which it has just stolen from another thread.  Return
+ * true iff the thread should keep running; if it should not, give
+ * <b>work</b> back to the thread it came from first.
+ *
+ * The caller must not hold any lock. */
+static int
+worker_thread_run_update_before_stolen_work(workerthread_t *thread,
+                                            workqueue_entry_t *work)
+{
+  int update_pending;
+
+  tor_mutex_acquire(&thread->lock);
+  update_pending = thread->update_pending;
+  thread->update_pending = 0;
+  tor_mutex_release(&thread->lock);
+
+  if (!update_pending || worker_thread_run_update(thread))
+    return 1;
+
+  worker_thread_return_stolen_work(work);
+  return 0;
+}
+
+/** Run the pool's idle function, if it has one, on <b>thread</b>'s state.
+ * Return true iff the idle function did some work, and wants to be called
+ * again.
+ *
+ * The caller must not hold any lock. */
+static int
+worker_thread_run_idle(workerthread_t *thread)
+{
+  threadpool_t *pool = thread->in_pool;
+  int (*idle_fn)(void *);
+
+  tor_mutex_acquire(&pool->lock);
+  idle_fn = pool->idle_fn;
+  tor_mutex_release(&pool->lock);
+
+  if (!idle_fn)
+    return 0;
+  return idle_fn(thread->state);
+}
+
 /**
  * Main function for the worker thread.
  */
@@ -269,78 +481,127 @@ worker_thread_main(void *thread_)
   workqueue_entry_t *work;
   workqueue_reply_t result;
 
-  tor_mutex_acquire(&pool->lock);
+  tor_mutex_acquire(&thread->lock);
   while (1) {
     /* lock must be held at this point. */
-    while (worker_thread_has_work(thread)) {
-      /* lock must be held at this point. */
-      if (thread->in_pool->generation != thread->generation) {
-        void *arg = thread->in_pool->update_args[thread->index];
-        thread->in_pool->update_args[thread->index] = NULL;
-        workqueue_reply_t (*update_fn)(void*,void*) =
-            thread->in_pool->update_fn;
-        thread->generation = thread->in_pool->generation;
-        tor_mutex_release(&pool->lock);
-
-        workqueue_reply_t r = update_fn(thread->state, arg);
-
-        if (r != WQ_RPL_REPLY) {
-          return;
-        }
+    if (thread->update_pending) {
+      thread->update_pending = 0;
+      tor_mutex_release(&thread->lock);
+      if (! worker_thread_run_update(thread))
+        return;
+      tor_mutex_acquire(&thread->lock);
+      continue;
+    }
 
-        tor_mutex_acquire(&pool->lock);
-        continue;
-      }
-      work = worker_thread_extract_next_work(thread);
-      if (BUG(work == NULL))
-        break;
-      tor_mutex_release(&pool->lock);
+    work = worker_thread_extract_next_work(thread, thread);
+    tor_mutex_release(&thread->lock);
+
+    if (!work) {
+      work = worker_thread_steal_work(thread);
+      /* An update may have been queued after we last looked, and the work
+       * we just stole may have been queued after the update.  Every thread
+       * must run an update before any work queued after it, so look again
+       * before running stolen work. */
+      if (work && ! worker_thread_run_update_before_stolen_work(thread,
+                                                                work))
+        return;
+    }
 
-      /* We run the work function without holding the thread lock. This
-       * is the main thread's first opportunity to give us more work. */
+    if (work) {
+      /* We run the work function without holding any lock. */
       result = work->fn(thread->state, work->arg);
 
       /* Queue the reply for the main thread. */
-      queue_reply(thread->reply_queue, work);
+      queue_reply(thread->reply_queue, thread->reply_ring, work);
 
       /* We may need to exit the thread. */
       if (result != WQ_RPL_REPLY) {
         return;
       }
-      tor_mutex_acquire(&pool->lock);
+      tor_mutex_acquire(&thread->lock);
+      continue;
     }
-    /* At this point the lock is held, and there is no work in this thread's
-     * queue. */
 
-    /* TODO: support an idle-function */
+    if (worker_thread_run_idle(thread)) {
+      /* Look for real work again before doing any more idle work. */
+      tor_mutex_acquire(&thread->lock);
+      continue;
+    }
+
+    tor_mutex_acquire(&thread->lock);
+    if (thread->update_pending || worker_thread_has_queued_work(thread))
+      continue;
+
+    /* There is no work anywhere that we can see.  Announce that we're idle
+     * before checking n_queued one last time: anybody who queues work after
+     * that check will see us in n_idle, and hand the work to us. */
+    thread->is_waiting = 1;
+    atomic_counter_add(&pool->n_idle, 1);
+    if (atomic_counter_get(&pool->n_queued) > 0) {
+      /* Some work is on its way to a queue; go look for it again. */
+      thread->is_waiting = 0;
+      atomic_counter_sub(&pool->n_idle, 1);
+      continue;
+    }
 
     /* Okay. Now, wait till somebody has work for us. */
-    if (tor_cond_wait(&pool->condition, &pool->lock, NULL) < 0) {
-      log_warn(LD_GENERAL, "Fail tor_cond_wait.");
+    while (thread->is_waiting) {
+      if (tor_cond_wait(&thread->condition, &thread->lock, NULL) < 0) {
+        log_warn(LD_GENERAL, "Fail tor_cond_wait.");
+      }
     }
   }
 }
 
-/** Put a reply on the reply queue.  The reply must not currently be on
- * any thread's work queue. */
+/** Wake <b>thread</b> if it is waiting for work.
+ *
+ * The caller must hold thread's lock. */
 static void
-queue_reply(replyqueue_t *queue, workqueue_entry_t *work)
+worker_thread_wake(workerthread_t *thread)
 {
-  int was_empty;
-  tor_mutex_acquire(&queue->lock);
-  was_empty = TOR_TAILQ_EMPTY(&queue->answers);
-  TOR_TAILQ_INSERT_TAIL(&queue->answers, work, next_work);
-  tor_mutex_release(&queue->lock);
+  if (thread->is_waiting) {
+    thread->is_waiting = 0;
+    atomic_counter_sub(&thread->in_pool->n_idle, 1);
+    tor_cond_signal_one(&thread->condition);
+  }
+}
 
-  if (was_empty) {
+/** Put a reply on the reply queue, using the ring <b>ring</b> if it has
+ * room and nothing is waiting on its overflow list.  The reply must not
+ * currently be on any thread's work queue.
+ *
+ * Only the thread that owns <b>ring</b> may call this function. */
+static void
+queue_reply(replyqueue_t *queue, reply_ring_t *ring,
+            workqueue_entry_t *work)
+{
+  const size_t head = atomic_counter_get(&ring->head);
+  if (atomic_counter_get(&ring->n_overflow) == 0 &&
+      head - atomic_counter_get(&ring->tail) < REPLY_RING_SIZE) {
+    ring->entries[head % REPLY_RING_SIZE] = work;
+    /* This publishes the entry to the main thread. */
+    atomic_counter_add(&ring->head, 1);
+  } else {
+    /* The main thread is far behind; fall back to the overflow list, behind
+     * any of our answers that are already there. */
+    tor_mutex_acquire(&queue->lock);
+    TOR_TAILQ_INSERT_TAIL(&ring->overflow, work, next_work);
+    atomic_counter_add(&ring->n_overflow, 1);
+    tor_mutex_release(&queue->lock);
+  }
+
+  /* Only the first answer since the main thread last looked needs to wake
+   * it up. */
+  if (atomic_counter_exchange(&queue->alert_pending, 1) == 0) {
     if (queue->alert.alert_fn(queue->alert.write_fd) < 0) {
       /* XXXX complain! */
     }
   }
 }
 
-/** Allocate and start a new worker thread to use state object <b>state</b>,
- * and send responses to <b>replyqueue</b>. */
+/** Allocate a new worker thread to use state object <b>state</b>, and send
+ * responses to <b>replyqueue</b>.  The thread isn't running until we call
+ * workerthread_start() on it. */
 static workerthread_t *
 workerthread_new(int32_t lower_priority_chance,
                  void *state, threadpool_t *pool, replyqueue_t *replyqueue)
@@ -348,19 +609,78 @@ workerthread_new(int32_t lower_priority_chance,
   workerthread_t *thr = tor_malloc_zero(sizeof(workerthread_t));
   thr->state = state;
   thr->reply_queue = replyqueue;
+  thr->reply_ring = replyqueue_add_ring(replyqueue);
   thr->in_pool = pool;
   thr->lower_priority_chance = lower_priority_chance;
+  tor_mutex_init_nonrecursive(&thr->lock);
+  tor_cond_init(&thr->condition);
+  unsigned i;
+  for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
+    TOR_TAILQ_INIT(&thr->work[i]);
+  }
+  {
+    unsigned seed;
+    crypto_rand((void*)&seed, sizeof(seed));
+    tor_init_weak_random(&thr->weak_rng, seed);
+  }
 
+  return thr;
+}
+
+/** Start running the worker thread <b>thr</b>.  Return 0 on success, -1 on
+ * failure. */
+static int
+workerthread_start(workerthread_t *thr)
+{
   if (spawn_func(worker_thread_main, thr) < 0) {
     //LCOV_EXCL_START
     tor_assert_nonfatal_unreached();
     log_err(LD_GENERAL, "Can't launch worker thread.");
-    tor_free(thr);
-    return NULL;
+    return -1;
     //LCOV_EXCL_STOP
   }
 
-  return thr;
+  return 0;
+}
+
+/** Place <b>ent</b> on the queue of some worker thread in <b>pool</b>,
+ * preferring one that is idle, and wake that thread if need be. */
+static void
+threadpool_place_work(threadpool_t *pool, workqueue_entry_t *ent)
+{
+  workerthread_t *thr = NULL;
+  /* The set of threads never changes once they are running. */
+  const int n_threads = pool->n_threads;
+  int i, start;
+
+  /* Count the work first, so that no worker that is about to sleep can miss
+   * it; see worker_thread_main(). */
+  atomic_counter_add(&pool->n_queued, 1);
+
+  atomic_counter_add(&pool->next_thread, 1);
+  start = (int)(atomic_counter_get(&pool->next_thread) % n_threads);
+
+  if (atomic_counter_get(&pool->n_idle) > 0) {
+    for (i = 0; i < n_threads; ++i) {
+      workerthread_t *cand = pool->threads[(start + i) % n_threads];
+      tor_mutex_acquire(&cand->lock);
+      if (cand->is_waiting) {
+        thr = cand;
+        break;
+      }
+      tor_mutex_release(&cand->lock);
+    }
+  }
+  if (!thr) {
+    thr = pool->threads[start];
+    tor_mutex_acquire(&thr->lock);
+  }
+
+  /* thr's lock is held at this point. */
+  ent->on_thread = thr;
+  TOR_TAILQ_INSERT_TAIL(&thr->work[ent->priority], ent, next_work);
+  worker_thread_wake(thr);
+  tor_mutex_release(&thr->lock);
 }
 
 /**
@@ -400,13 +720,7 @@ threadpool_queue_work_priority(threadpool_t *pool,
   ent->pending = 1;
   ent->priority = prio;
 
-  tor_mutex_acquire(&pool->lock);
-
-  TOR_TAILQ_INSERT_TAIL(&pool->work[prio], ent, next_work);
-
-  tor_cond_signal_one(&pool->condition);
-
-  tor_mutex_release(&pool->lock);
+  threadpool_place_work(pool, ent);
 
   return ent;
 }
@@ -466,7 +780,13 @@ threadpool_queue_update(threadpool_t *pool,
   pool->update_fn = fn;
   ++pool->generation;
 
-  tor_cond_signal_all(&pool->condition);
+  for (i = 0; i < n_threads; ++i) {
+    workerthread_t *thr = pool->threads[i];
+    tor_mutex_acquire(&thr->lock);
+    thr->update_pending = 1;
+    worker_thread_wake(thr);
+    tor_mutex_release(&thr->lock);
+  }
 
   tor_mutex_release(&pool->lock);
 
@@ -481,6 +801,30 @@ threadpool_queue_update(threadpool_t *pool,
   return 0;
 }
 
+/**
+ * Set the idle function for every thread in a pool to <b>idle_fn</b>.  A
+ * worker thread that has no work to do runs <b>idle_fn</b> on its state
+ * before it goes to sleep, so that it can get ready for future work.  The
+ * idle function should do a small amount of work and then return: it returns
+ * true if it should be called again, or false once it has nothing left to
+ * do.  A worker checks for real work in between calls to the idle function.
+ */
+void
+threadpool_set_idle_fn(threadpool_t *pool, int (*idle_fn)(void *))
+{
+  int i;
+  tor_mutex_acquire(&pool->lock);
+  pool->idle_fn = idle_fn;
+  /* Wake everybody up, so that they notice the new idle function. */
+  for (i = 0; i < pool->n_threads; ++i) {
+    workerthread_t *thr = pool->threads[i];
+    tor_mutex_acquire(&thr->lock);
+    worker_thread_wake(thr);
+    tor_mutex_release(&thr->lock);
+  }
+  tor_mutex_release(&pool->lock);
+}
+
 /** Don't have more than this many threads per pool. */
 #define MAX_THREADS 1024
 
@@ -492,20 +836,25 @@ threadpool_queue_update(threadpool_t *pool,
 #define CHANCE_PERMISSIVE 37
 #define CHANCE_STRICT INT32_MAX
 
-/** Launch threads until we have <b>n</b>. */
+/** Launch threads until we have <b>n</b>.
+ *
+ * Running workers look at each other's queues through pool->threads
+ * without holding the pool lock, so we only do this once, before any of
+ * the pool's threads are running. */
 static int
 threadpool_start_threads(threadpool_t *pool, int n)
 {
-  if (BUG(n < 0))
+  int i;
+  if (BUG(n < 1))
+    return -1; // LCOV_EXCL_LINE
+  if (BUG(pool->n_threads))
     return -1; // LCOV_EXCL_LINE
   if (n > MAX_THREADS)
     n = MAX_THREADS;
 
   tor_mutex_acquire(&pool->lock);
 
-  if (pool->n_threads < n)
-    pool->threads = tor_reallocarray(pool->threads,
-                                     sizeof(workerthread_t*), n);
+  pool->threads = tor_calloc(n, sizeof(workerthread_t*));
 
   while (pool->n_threads < n) {
     /* For half of our threads, we'll choose lower priorities permissively;
@@ -516,17 +865,20 @@ threadpool_start_threads(threadpool_t *pool, int n)
     void *state = pool->new_thread_state_fn(pool->new_thread_state_arg);
     workerthread_t *thr = workerthread_new(chance,
                                            state, pool, pool->reply_queue);
+    thr->index = pool->n_threads;
+    pool->threads[pool->n_threads++] = thr;
+  }
 
-    if (!thr) {
+  for (i = 0; i < pool->n_threads; ++i) {
+    if (workerthread_start(pool->threads[i]) < 0) {
       //LCOV_EXCL_START
       tor_assert_nonfatal_unreached();
-      pool->free_thread_state_fn(state);
+      /* The threads we already started may look at the queues of the
+       * others, so we can't free any of them here. */
       tor_mutex_release(&pool->lock);
       return -1;
       //LCOV_EXCL_STOP
     }
-    thr->index = pool->n_threads;
-    pool->threads[pool->n_threads++] = thr;
   }
   tor_mutex_release(&pool->lock);
 
@@ -550,16 +902,9 @@ threadpool_new(int n_threads,
   threadpool_t *pool;
   pool = tor_malloc_zero(sizeof(threadpool_t));
   tor_mutex_init_nonrecursive(&pool->lock);
-  tor_cond_init(&pool->condition);
-  unsigned i;
-  for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
-    TOR_TAILQ_INIT(&pool->work[i]);
-  }
-  {
-    unsigned seed;
-    crypto_rand((void*)&seed, sizeof(seed));
-    tor_init_weak_random(&pool->weak_rng, seed);
-  }
+  atomic_counter_init(&pool->n_queued);
+  atomic_counter_init(&pool->n_idle);
+  atomic_counter_init(&pool->next_thread);
 
   pool->new_thread_state_fn = new_thread_state_fn;
   pool->new_thread_state_arg = arg;
@@ -569,9 +914,8 @@ threadpool_new(int n_threads,
   if (threadpool_start_threads(pool, n_threads) < 0) {
     //LCOV_EXCL_START
     tor_assert_nonfatal_unreached();
-    tor_cond_uninit(&pool->condition);
-    tor_mutex_uninit(&pool->lock);
-    tor_free(pool);
+    /* Threads that did start still refer to the pool, so we can't free it
+     * here. */
     return NULL;
     //LCOV_EXCL_STOP
   }
@@ -604,11 +948,43 @@ replyqueue_new(uint32_t alertsocks_flags)
   }
 
   tor_mutex_init(&rq->lock);
-  TOR_TAILQ_INIT(&rq->answers);
+  atomic_counter_init(&rq->alert_pending);
 
   return rq;
 }
 
+/** Allocate a new reply ring for a worker thread to send answers on, and
+ * add it to <b>queue</b>.  Must only be called from the main thread. */
+static reply_ring_t *
+replyqueue_add_ring(replyqueue_t *queue)
+{
+  reply_ring_t *ring = tor_malloc_zero(sizeof(reply_ring_t));
+  atomic_counter_init(&ring->head);
+  atomic_counter_init(&ring->tail);
+  atomic_counter_init(&ring->n_overflow);
+  TOR_TAILQ_INIT(&ring->overflow);
+
+  queue->rings = tor_reallocarray(queue->rings, queue->n_rings + 1,
+                                  sizeof(reply_ring_t *));
+  queue->rings[queue->n_rings++] = ring;
+  return ring;
+}
+
+/** Set *<b>n_wakeups_out</b> to the number of times that the main thread
+ * has processed <b>queue</b>, *<b>n_replies_out</b> to the number of
+ * answers it has handled there, and *<b>max_per_wakeup_out</b> to the
+ * largest number of answers it has handled in a single wakeup. */
+void
+replyqueue_get_stats(const replyqueue_t *queue,
+                     uint64_t *n_wakeups_out,
+                     uint64_t *n_replies_out,
+                     unsigned *max_per_wakeup_out)
+{
+  *n_wakeups_out = queue->n_wakeups;
+  *n_replies_out = queue->n_replies;
+  *max_per_wakeup_out = queue->max_replies_per_wakeup;
+}
+
 /** Internal: Run from the libevent mainloop when there is work to handle in
  * the reply queue handler. */
 static void
@@ -646,14 +1022,29 @@ threadpool_register_reply_event(threadpool_t *tp,
   return event_add(tp->reply_event, NULL);
 }
 
+/** Run the reply function for <b>work</b>, and release it. */
+static void
+handle_reply(workqueue_entry_t *work)
+{
+  work->on_pool = NULL;
+  work->reply_fn(work->arg);
+  workqueue_entry_free(work);
+}
+
 /**
- * Process all pending replies on a reply queue. The main thread should call
+ * Process pending replies on a reply queue. The main thread should call
  * this function every time the socket returned by replyqueue_get_socket() is
  * readable.
+ *
+ * We handle at most REPLYQUEUE_MAX_BATCH replies here; if there are more,
+ * we alert ourselves so that we come back to them after the event loop has
+ * had a chance to run other events.
  */
 void
 replyqueue_process(replyqueue_t *queue)
 {
+  int n_handled = 0, more = 0;
+  int i;
   int r = queue->alert.drain_fn(queue->alert.read_fd);
   if (r < 0) {
     //LCOV_EXCL_START
@@ -664,19 +1055,65 @@ replyqueue_process(replyqueue_t *queue)
     //LCOV_EXCL_STOP
   }
 
-  tor_mutex_acquire(&queue->lock);
-  while (!TOR_TAILQ_EMPTY(&queue->answers)) {
-    /* lock must be held at this point.*/
-    workqueue_entry_t *work = TOR_TAILQ_FIRST(&queue->answers);
-    TOR_TAILQ_REMOVE(&queue->answers, work, next_work);
-    tor_mutex_release(&queue->lock);
-    work->on_pool = NULL;
+  /* Any answer queued after this point will send a new alert, so we can't
+   * miss it. */
+  atomic_counter_exchange(&queue->alert_pending, 0);
+
+  for (i = 0; i < queue->n_rings && !more; ++i) {
+    const int idx = (queue->next_ring + i) % queue->n_rings;
+    reply_ring_t *ring = queue->rings[idx];
+    size_t tail = atomic_counter_get(&ring->tail);
+    const size_t head = atomic_counter_get(&ring->head);
+
+    while (tail != head && n_handled < REPLYQUEUE_MAX_BATCH) {
+      workqueue_entry_t *work = ring->entries[tail % REPLY_RING_SIZE];
+      /* Give the slot back to the worker before running the reply
+       * function, which may take a while. */
+      atomic_counter_add(&ring->tail, 1);
+      ++tail;
+      handle_reply(work);
+      ++n_handled;
+    }
+    if (tail != head) {
+      more = 1;
+    } else if (atomic_counter_get(&ring->n_overflow) &&
+               tail == atomic_counter_get(&ring->head)) {
+      /* The ring is empty, so the oldest answer from this worker that we
+       * haven't handled is at the front of its overflow list. */
+      tor_mutex_acquire(&queue->lock);
+      while (!TOR_TAILQ_EMPTY(&ring->overflow)) {
+        /* lock must be held at this point.*/
+        if (n_handled >= REPLYQUEUE_MAX_BATCH) {
+          more = 1;
+          break;
+        }
+        workqueue_entry_t *work = TOR_TAILQ_FIRST(&ring->overflow);
+        TOR_TAILQ_REMOVE(&ring->overflow, work, next_work);
+        atomic_counter_sub(&ring->n_overflow, 1);
+        tor_mutex_release(&queue->lock);
 
-    work->reply_fn(work->arg);
-    workqueue_entry_free(work);
+        handle_reply(work);
+        ++n_handled;
 
-    tor_mutex_acquire(&queue->lock);
+        tor_mutex_acquire(&queue->lock);
+      }
+      tor_mutex_release(&queue->lock);
+    }
+    if (more)
+      queue->next_ring = idx;
   }
+  if (!more && queue->n_rings)
+    queue->next_ring = (queue->next_ring + 1) % queue->n_rings;
 
-  tor_mutex_release(&queue->lock);
+  ++queue->n_wakeups;
+  queue->n_replies += n_handled;
+  if ((unsigned)n_handled > queue->max_replies_per_wakeup)
+    queue->max_replies_per_wakeup = n_handled;
+
+  if (more &&
+      atomic_counter_exchange(&queue->alert_pending, 1) == 0) {
+    if (queue->alert.alert_fn(queue->alert.write_fd) < 0) {
+      /* XXXX complain! */
+    }
+  }
 }
@@ -52,6 +52,7 @@ int threadpool_queue_update(threadpool_t *pool,
                             workqueue_reply_t (*fn)(void *, void *),
                             void (*free_fn)(void *),
                             void *arg);
+void threadpool_set_idle_fn(threadpool_t *pool, int (*idle_fn)(void *));
 void *workqueue_entry_cancel(workqueue_entry_t *pending_work);
 threadpool_t *threadpool_new(int n_threads,
                              replyqueue_t *replyqueue,
@@ -62,6 +63,10 @@ replyqueue_t *threadpool_get_replyqueue(threadpool_t *tp);
 
 replyqueue_t *replyqueue_new(uint32_t alertsocks_flags);
 void replyqueue_process(replyqueue_t *queue);
+void replyqueue_get_stats(const replyqueue_t *queue,
+                          uint64_t *n_wakeups_out,
+                          uint64_t *n_replies_out,
+                          unsigned *max_per_wakeup_out);
 
 int threadpool_register_reply_event(threadpool_t *tp,
                                     void (*cb)(threadpool_t *tp));
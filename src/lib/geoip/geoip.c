@@ -22,6 +22,10 @@
  * function.  See the scripts and the README file in src/config for more
  * information about how those files are generated.
  *
+ * geoip_load_file() also accepts a compiled database, as made by the
+ * tor-geoip-compile tool with geoip_compile_db().  Such a database is
+ * mmap'd instead of parsed, and searched in place: see geoip_db_t.
+ *
  * Tor uses GeoIP information in order to implement user requests (such as
  * ExcludeNodes {cc}), and to keep track of how much usage relays are getting
  * for each country.
@@ -35,7 +39,9 @@
 #include "lib/crypt_ops/crypto_digest.h"
 #include "lib/ctime/di_ops.h"
 #include "lib/encoding/binascii.h"
+#include "lib/arch/bytes.h"
 #include "lib/fs/files.h"
+#include "lib/fs/mmap.h"
 #include "lib/log/escape.h"
 #include "lib/malloc/malloc.h"
 #include "lib/net/address.h" //????
@@ -74,6 +80,48 @@ static strmap_t *country_idxplus1_by_lc_code = NULL;
  * by their respective ip_low. */
 static smartlist_t *geoip_ipv4_entries = NULL, *geoip_ipv6_entries = NULL;
 
+/** A compiled GeoIP database for one address family, mapped from disk.
+ *
+ * The file starts with a GEOIP_DB_HEADER_LEN byte header: the magic
+ * GEOIP_DB_MAGIC, then the format version, the address family (4 or 6), the
+ * number of countries and the number of ranges as 32-bit integers, then the
+ * SHA1 digest of the text file that it was compiled from, and 4 bytes of
+ * zeros.  Next come the 2-letter code of each country, then three arrays
+ * with one element per range: the highest address of each range, its lowest
+ * address, and the index of its country as a 16-bit integer.  Each section
+ * is padded to a multiple of 8 bytes, and all integers are in network
+ * order.
+ *
+ * The range arrays are stored in Eytzinger order, starting at index 1: the
+ * children of element k are elements 2k and 2k+1.  A search then walks down
+ * the array from its start, so the first few levels of every search share
+ * the same cache lines.  Addresses are stored as 4-byte integers for IPv4
+ * and as 16 raw bytes for IPv6. */
+typedef struct geoip_db_t {
+  /** The mapped file. */
+  tor_mmap_t *map;
+  /** Number of ranges in the database. */
+  uint32_t n_entries;
+  /** Length in bytes of the addresses in <b>highs</b> and <b>lows</b>. */
+  size_t key_len;
+  /** Highest address of each range, indexed from 1 to <b>n_entries</b>. */
+  const uint8_t *highs;
+  /** Lowest address of each range, in the same order as <b>highs</b>. */
+  const uint8_t *lows;
+  /** Country of each range, as an index in the file's country list. */
+  const uint16_t *countries;
+  /** Number of countries in the file's country list. */
+  uint32_t n_countries;
+  /** Map from the file's country indices to our own geoip_countries
+   * indices. */
+  intptr_t *country_idx;
+} geoip_db_t;
+
+/** Compiled databases, if we loaded our tables from them rather than from
+ * text files. At most one of geoip_ipv4_db and geoip_ipv4_entries is set, and
+ * likewise for IPv6. */
+static geoip_db_t *geoip_ipv4_db = NULL, *geoip_ipv6_db = NULL;
+
 /** SHA1 digest of the GeoIP files to include in extra-info descriptors. */
 static char geoip_digest[DIGEST_LEN];
 static char geoip6_digest[DIGEST_LEN];
@@ -105,20 +153,14 @@ geoip_get_country,(const char *country))
   return (country_t)idx;
 }
 
-/** Add an entry to a GeoIP table, mapping all IP addresses between <b>low</b>
- * and <b>high</b>, inclusive, to the 2-letter country code <b>country</b>. */
-static void
-geoip_add_entry(const tor_addr_t *low, const tor_addr_t *high,
-                const char *country)
+/** Return the index of the 2-letter country code <b>country</b> in
+ * geoip_countries, adding it if it isn't there yet. */
+static intptr_t
+geoip_get_or_add_country(const char *country)
 {
   intptr_t idx;
   void *idxplus1_;
 
-  IF_BUG_ONCE(tor_addr_family(low) != tor_addr_family(high))
-    return;
-  IF_BUG_ONCE(tor_addr_compare(high, low, CMP_EXACT) < 0)
-    return;
-
   idxplus1_ = strmap_get_lc(country_idxplus1_by_lc_code, country);
 
   if (!idxplus1_) {
@@ -135,6 +177,23 @@ geoip_add_entry(const tor_addr_t *low, const tor_addr_t *high,
     geoip_country_t *c = smartlist_get(geoip_countries, (int)idx);
     tor_assert(!strcasecmp(c->countrycode, country));
   }
+  return idx;
+}
+
+/** Add an entry to a GeoIP table, mapping all IP addresses between <b>low</b>
+ * and <b>high</b>, inclusive, to the 2-letter country code <b>country</b>. */
+static void
+geoip_add_entry(const tor_addr_t *low, const tor_addr_t *high,
+                const char *country)
+{
+  intptr_t idx;
+
+  IF_BUG_ONCE(tor_addr_family(low) != tor_addr_family(high))
+    return;
+  IF_BUG_ONCE(tor_addr_compare(high, low, CMP_EXACT) < 0)
+    return;
+
+  idx = geoip_get_or_add_country(country);
 
   if (tor_addr_family(low) == AF_INET) {
     geoip_ipv4_entry_t *ent = tor_malloc_zero(sizeof(geoip_ipv4_entry_t));
@@ -296,6 +355,351 @@ init_geoip_countries(void)
   strmap_set_lc(country_idxplus1_by_lc_code, "??", (void*)(1));
 }
 
+/** Magic bytes at the start of a compiled GeoIP database. */
+#define GEOIP_DB_MAGIC "TorGeoDB"
+#define GEOIP_DB_MAGIC_LEN 8
+/** Version of the compiled GeoIP database format that we read and write. */
+#define GEOIP_DB_VERSION 1
+/** Length of the header of a compiled GeoIP database. */
+#define GEOIP_DB_HEADER_LEN (GEOIP_DB_MAGIC_LEN + 16 + DIGEST_LEN + 4)
+/** Largest number of ranges that we accept in a compiled GeoIP database. */
+#define GEOIP_DB_MAX_ENTRIES (1u << 28)
+
+/** Return <b>n</b> rounded up to a multiple of 8. */
+static inline size_t
+geoip_db_pad(size_t n)
+{
+  return (n + 7) & ~(size_t)7;
+}
+
+/** Return the total length of a compiled GeoIP database with
+ * <b>n_countries</b> countries and <b>n_entries</b> ranges whose addresses
+ * are <b>key_len</b> bytes long. */
+static size_t
+geoip_db_len(uint32_t n_countries, uint32_t n_entries, size_t key_len)
+{
+  size_t n_slots = (size_t) n_entries + 1;
+  return GEOIP_DB_HEADER_LEN + geoip_db_pad(2 * (size_t) n_countries) +
+         2 * geoip_db_pad(n_slots * key_len) +
+         geoip_db_pad(n_slots * sizeof(uint16_t));
+}
+
+/** Given the index at which a search through an array in Eytzinger order
+ * fell off the bottom, return the index of the last element at which the
+ * search went left, or 0 if it never did. */
+static inline uint32_t
+geoip_db_eytzinger_unwind(uint32_t k)
+{
+  while (k & 1)
+    k >>= 1;
+  return k >> 1;
+}
+
+/** Return our country index for the range at index <b>k</b> of <b>db</b>. */
+static inline int
+geoip_db_country_at(const geoip_db_t *db, uint32_t k)
+{
+  uint16_t c = tor_ntohs(db->countries[k]);
+  if (c >= db->n_countries)
+    return 0;
+  return (int) db->country_idx[c];
+}
+
+/** Return the country of the IPv4 address <b>ipaddr</b>, in host order,
+ * according to <b>db</b>; or 0 if it isn't in any range. */
+static int
+geoip_db_lookup_ipv4(const geoip_db_t *db, uint32_t ipaddr)
+{
+  const uint32_t *highs = (const uint32_t *) db->highs;
+  const uint32_t *lows = (const uint32_t *) db->lows;
+  uint32_t k = 1;
+
+  /* Find the first range whose high address is not below ipaddr. */
+  while (k <= db->n_entries)
+    k = 2 * k + (tor_ntohl(highs[k]) < ipaddr);
+  k = geoip_db_eytzinger_unwind(k);
+
+  if (k == 0 || tor_ntohl(lows[k]) > ipaddr)
+    return 0;
+  return geoip_db_country_at(db, k);
+}
+
+/** Return the country of the IPv6 address <b>addr</b> according to
+ * <b>db</b>; or 0 if it isn't in any range. */
+static int
+geoip_db_lookup_ipv6(const geoip_db_t *db, const struct in6_addr *addr)
+{
+  const uint8_t *key = addr->s6_addr;
+  uint32_t k = 1;
+
+  while (k <= db->n_entries)
+    k = 2 * k + (fast_memcmp(db->highs + 16 * (size_t) k, key, 16) < 0);
+  k = geoip_db_eytzinger_unwind(k);
+
+  if (k == 0 || fast_memcmp(db->lows + 16 * (size_t) k, key, 16) > 0)
+    return 0;
+  return geoip_db_country_at(db, k);
+}
+
+#define geoip_db_free(db) FREE_AND_NULL(geoip_db_t, geoip_db_free_, (db))
+
+/** Release all storage held by <b>db</b>, and unmap its file. */
+static void
+geoip_db_free_(geoip_db_t *db)
+{
+  if (!db)
+    return;
+  tor_munmap_file(db->map);
+  tor_free(db->country_idx);
+  tor_free(db);
+}
+
+/** Check that the mapped file <b>map</b> is a well-formed compiled GeoIP
+ * database for <b>family</b>. On success, return a new geoip_db_t that takes
+ * ownership of <b>map</b>, and copy the digest of its source text file into
+ * <b>digest_out</b>. On failure, set *<b>err_out</b> to a description of
+ * the problem and return NULL. */
+static geoip_db_t *
+geoip_db_new_from_map(tor_mmap_t *map, sa_family_t family,
+                      char *digest_out, const char **err_out)
+{
+  const uint8_t *data = (const uint8_t *) map->data;
+  const uint8_t *cp;
+  uint32_t version, db_family, n_countries, n_entries, i;
+  size_t key_len = (family == AF_INET) ? 4 : 16;
+  size_t n_slots;
+  geoip_db_t *db;
+
+  if (map->size < GEOIP_DB_HEADER_LEN ||
+      fast_memneq(data, GEOIP_DB_MAGIC, GEOIP_DB_MAGIC_LEN)) {
+    *err_out = "not a compiled GeoIP database";
+    return NULL;
+  }
+  cp = data + GEOIP_DB_MAGIC_LEN;
+  version = tor_ntohl(get_uint32(cp));
+  db_family = tor_ntohl(get_uint32(cp + 4));
+  n_countries = tor_ntohl(get_uint32(cp + 8));
+  n_entries = tor_ntohl(get_uint32(cp + 12));
+  if (version != GEOIP_DB_VERSION) {
+    *err_out = "unsupported format version";
+    return NULL;
+  }
+  if (db_family != ((family == AF_INET) ? 4 : 6)) {
+    *err_out = "wrong address family";
+    return NULL;
+  }
+  if (n_countries == 0 || n_countries > UINT16_MAX + 1 ||
+      n_entries > GEOIP_DB_MAX_ENTRIES) {
+    *err_out = "too many entries";
+    return NULL;
+  }
+  if (map->size != geoip_db_len(n_countries, n_entries, key_len)) {
+    *err_out = "wrong length";
+    return NULL;
+  }
+
+  /* Check every country code before we add any of them to
+   * geoip_countries, so that a bad file leaves our country list alone. */
+  cp = data + GEOIP_DB_HEADER_LEN;
+  for (i = 0; i < 2 * n_countries; ++i) {
+    if (!TOR_ISPRINT(cp[i])) {
+      *err_out = "bad country code";
+      return NULL;
+    }
+  }
+
+  db = tor_malloc_zero(sizeof(geoip_db_t));
+  db->n_entries = n_entries;
+  db->key_len = key_len;
+  db->n_countries = n_countries;
+  db->country_idx = tor_calloc(n_countries, sizeof(intptr_t));
+
+  for (i = 0; i < n_countries; ++i) {
+    char code[3];
+    memcpy(code, cp + 2 * i, 2);
+    code[2] = '\0';
+    db->country_idx[i] = geoip_get_or_add_country(code);
+  }
+  cp += geoip_db_pad(2 * (size_t) n_countries);
+
+  n_slots = (size_t) n_entries + 1;
+  db->highs = cp;
+  cp += geoip_db_pad(n_slots * key_len);
+  db->lows = cp;
+  cp += geoip_db_pad(n_slots * key_len);
+  db->countries = (const uint16_t *) cp;
+
+  memcpy(digest_out, data + GEOIP_DB_MAGIC_LEN + 16, DIGEST_LEN);
+  db->map = map;
+  return db;
+}
+
+/** Fill <b>perm</b> so that perm[k] is the index in sorted order of the
+ * element at index k of an array of <b>n</b> elements in Eytzinger order.
+ * Called recursively on the subtree at <b>k</b>, whose first element in
+ * sorted order is <b>i</b>; return the index after its last one. */
+static uint32_t
+geoip_db_eytzinger_fill(uint32_t *perm, uint32_t i, uint32_t k, uint32_t n)
+{
+  if (k <= n) {
+    i = geoip_db_eytzinger_fill(perm, i, 2 * k, n);
+    perm[k] = i++;
+    i = geoip_db_eytzinger_fill(perm, i, 2 * k + 1, n);
+  }
+  return i;
+}
+
+/** Compile the GeoIP table for <b>family</b>, as loaded from a text file,
+ * into the format described at geoip_db_t. On success, set *<b>out</b> to a
+ * newly allocated buffer holding the result and *<b>len_out</b> to its
+ * length, and return 0. Return -1 if we have no table for <b>family</b>
+ * from a text file, or if its ranges overlap. */
+int
+geoip_compile_db(sa_family_t family, char **out, size_t *len_out)
+{
+  const smartlist_t *entries;
+  uint32_t n_entries, n_countries, k, *perm = NULL;
+  size_t key_len, len;
+  uint8_t *buf, *cp, *highs, *lows;
+  uint16_t *countries;
+  const char *digest;
+
+  tor_assert(family == AF_INET || family == AF_INET6);
+  tor_assert(out);
+  tor_assert(len_out);
+
+  entries = (family == AF_INET) ? geoip_ipv4_entries : geoip_ipv6_entries;
+  if (!entries || !geoip_countries)
+    return -1;
+  if (smartlist_len(geoip_countries) > UINT16_MAX + 1 ||
+      (uint32_t) smartlist_len(entries) > GEOIP_DB_MAX_ENTRIES)
+    return -1;
+  n_entries = smartlist_len(entries);
+  n_countries = smartlist_len(geoip_countries);
+  key_len = (family == AF_INET) ? 4 : 16;
+  digest = (family == AF_INET) ? geoip_digest : geoip6_digest;
+
+  /* Lookups need the ranges to be disjoint, so that their high addresses
+   * are in the same order as their low ones. */
+  for (k = 1; k < n_entries; ++k) {
+    int overlap;
+    if (family == AF_INET) {
+      const geoip_ipv4_entry_t *a = smartlist_get(entries, k - 1);
+      const geoip_ipv4_entry_t *b = smartlist_get(entries, k);
+      overlap = b->ip_low <= a->ip_high;
+    } else {
+      const geoip_ipv6_entry_t *a = smartlist_get(entries, k - 1);
+      const geoip_ipv6_entry_t *b = smartlist_get(entries, k);
+      overlap = fast_memcmp(b->ip_low.s6_addr, a->ip_high.s6_addr, 16) <= 0;
+    }
+    if (overlap) {
+      log_warn(LD_GENERAL, "Can't compile GEOIP %s table: ranges %u and %u "
+               "overlap.", family == AF_INET ? "IPv4" : "IPv6", k - 1, k);
+      return -1;
+    }
+  }
+
+  len = geoip_db_len(n_countries, n_entries, key_len);
+  buf = tor_malloc_zero(len);
+
+  memcpy(buf, GEOIP_DB_MAGIC, GEOIP_DB_MAGIC_LEN);
+  cp = buf + GEOIP_DB_MAGIC_LEN;
+  set_uint32(cp, tor_htonl(GEOIP_DB_VERSION));
+  set_uint32(cp + 4, tor_htonl(family == AF_INET ? 4 : 6));
+  set_uint32(cp + 8, tor_htonl(n_countries));
+  set_uint32(cp + 12, tor_htonl(n_entries));
+  memcpy(cp + 16, digest, DIGEST_LEN);
+
+  cp = buf + GEOIP_DB_HEADER_LEN;
+  SMARTLIST_FOREACH_BEGIN(geoip_countries, const geoip_country_t *, c) {
+    memcpy(cp + 2 * c_sl_idx, c->countrycode, 2);
+  } SMARTLIST_FOREACH_END(c);
+  cp += geoip_db_pad(2 * (size_t) n_countries);
+
+  highs = cp;
+  cp += geoip_db_pad(((size_t) n_entries + 1) * key_len);
+  lows = cp;
+  cp += geoip_db_pad(((size_t) n_entries + 1) * key_len);
+  countries = (uint16_t *) cp;
+
+  perm = tor_calloc((size_t) n_entries + 1, sizeof(uint32_t));
+  geoip_db_eytzinger_fill(perm, 0, 1, n_entries);
+  for (k = 1; k <= n_entries; ++k) {
+    intptr_t country;
+    if (family == AF_INET) {
+      const geoip_ipv4_entry_t *e = smartlist_get(entries, perm[k]);
+      set_uint32(highs + 4 * (size_t) k, tor_htonl(e->ip_high));
+      set_uint32(lows + 4 * (size_t) k, tor_htonl(e->ip_low));
+      country = e->country;
+    } else {
+      const geoip_ipv6_entry_t *e = smartlist_get(entries, perm[k]);
+      memcpy(highs + 16 * (size_t) k, e->ip_high.s6_addr, 16);
+      memcpy(lows + 16 * (size_t) k, e->ip_low.s6_addr, 16);
+      country = e->country;
+    }
+    countries[k] = tor_htons((uint16_t) country);
+  }
+  tor_free(perm);
+
+  *out = (char *) buf;
+  *len_out = len;
+  return 0;
+}
+
+/** Forget the GeoIP table for <b>family</b>, whether it came from a text
+ * file or a compiled database. */
+static void
+geoip_clear_table(sa_family_t family)
+{
+  if (family == AF_INET) {
+    if (geoip_ipv4_entries) {
+      SMARTLIST_FOREACH(geoip_ipv4_entries, geoip_ipv4_entry_t *, e,
+                        tor_free(e));
+      smartlist_free(geoip_ipv4_entries);
+    }
+    geoip_db_free(geoip_ipv4_db);
+  } else { /* AF_INET6 */
+    if (geoip_ipv6_entries) {
+      SMARTLIST_FOREACH(geoip_ipv6_entries, geoip_ipv6_entry_t *, e,
+                        tor_free(e));
+      smartlist_free(geoip_ipv6_entries);
+    }
+    geoip_db_free(geoip_ipv6_db);
+  }
+}
+
+/** Replace the GeoIP table for <b>family</b> with the compiled database in
+ * <b>map</b>, which we take ownership of. <b>filename</b> is only used for
+ * logging. Return 0 on success, -1 on failure. */
+static int
+geoip_load_db(sa_family_t family, const char *filename, tor_mmap_t *map,
+              int severity)
+{
+  char digest[DIGEST_LEN];
+  const char *err = NULL;
+  geoip_db_t *db;
+
+  db = geoip_db_new_from_map(map, family, digest, &err);
+  if (!db) {
+    log_fn(severity, LD_GENERAL, "Failed to load compiled GEOIP file %s: %s.",
+           filename, err);
+    tor_munmap_file(map);
+    return -1;
+  }
+
+  geoip_clear_table(family);
+  if (family == AF_INET) {
+    geoip_ipv4_db = db;
+    memcpy(geoip_digest, digest, DIGEST_LEN);
+  } else {
+    geoip_ipv6_db = db;
+    memcpy(geoip6_digest, digest, DIGEST_LEN);
+  }
+  log_notice(LD_GENERAL, "Loaded compiled GEOIP %s file %s with %u ranges.",
+             (family == AF_INET) ? "IPv4" : "IPv6", filename, db->n_entries);
+  return 0;
+}
+
 /** Clear appropriate GeoIP database, based on <b>family</b>, and
  * reload it from the file <b>filename</b>. Return 0 on success, -1 on
  * failure.
@@ -313,36 +717,39 @@ init_geoip_countries(void)
  *
  * It also recognizes, and skips over, blank lines and lines that start
  * with '#' (comments).
+ *
+ * If the file is a compiled database instead, as made by geoip_compile_db(),
+ * map it into memory and use it as it is.
  */
 int
 geoip_load_file(sa_family_t family, const char *filename, int severity)
 {
   FILE *f;
+  tor_mmap_t *map;
   crypto_digest_t *geoip_digest_env = NULL;
 
   tor_assert(family == AF_INET || family == AF_INET6);
 
+  if (!geoip_countries)
+    init_geoip_countries();
+
+  map = tor_mmap_file(filename);
+  if (map && map->size >= GEOIP_DB_MAGIC_LEN &&
+      fast_memeq(map->data, GEOIP_DB_MAGIC, GEOIP_DB_MAGIC_LEN)) {
+    return geoip_load_db(family, filename, map, severity);
+  }
+  tor_munmap_file(map);
+
   if (!(f = tor_fopen_cloexec(filename, "r"))) {
     log_fn(severity, LD_GENERAL, "Failed to open GEOIP file %s.",
            filename);
     return -1;
   }
-  if (!geoip_countries)
-    init_geoip_countries();
 
+  geoip_clear_table(family);
   if (family == AF_INET) {
-    if (geoip_ipv4_entries) {
-      SMARTLIST_FOREACH(geoip_ipv4_entries, geoip_ipv4_entry_t *, e,
-                        tor_free(e));
-      smartlist_free(geoip_ipv4_entries);
-    }
     geoip_ipv4_entries = smartlist_new();
   } else { /* AF_INET6 */
-    if (geoip_ipv6_entries) {
-      SMARTLIST_FOREACH(geoip_ipv6_entries, geoip_ipv6_entry_t *, e,
-                        tor_free(e));
-      smartlist_free(geoip_ipv6_entries);
-    }
     geoip_ipv6_entries = smartlist_new();
   }
   geoip_digest_env = crypto_digest_new();
@@ -385,6 +792,8 @@ int
 geoip_get_country_by_ipv4(uint32_t ipaddr)
 {
   geoip_ipv4_entry_t *ent;
+  if (geoip_ipv4_db)
+    return geoip_db_lookup_ipv4(geoip_ipv4_db, ipaddr);
   if (!geoip_ipv4_entries)
     return -1;
   ent = smartlist_bsearch(geoip_ipv4_entries, &ipaddr,
@@ -402,6 +811,8 @@ geoip_get_country_by_ipv6(const struct in6_addr *addr)
 {
   geoip_ipv6_entry_t *ent;
 
+  if (geoip_ipv6_db)
+    return geoip_db_lookup_ipv6(geoip_ipv6_db, addr);
   if (!geoip_ipv6_entries)
     return -1;
   ent = smartlist_bsearch(geoip_ipv6_entries, addr,
@@ -455,9 +866,9 @@ geoip_is_loaded,(sa_family_t family))
   if (geoip_countries == NULL)
     return 0;
   if (family == AF_INET)
-    return geoip_ipv4_entries != NULL;
+    return geoip_ipv4_entries != NULL || geoip_ipv4_db != NULL;
   else                          /* AF_INET6 */
-    return geoip_ipv6_entries != NULL;
+    return geoip_ipv6_entries != NULL || geoip_ipv6_db != NULL;
 }
 
 /** Return the hex-encoded SHA1 digest of the loaded GeoIP file. The
@@ -483,20 +894,10 @@ clear_geoip_db(void)
   }
 
   strmap_free(country_idxplus1_by_lc_code, NULL);
-  if (geoip_ipv4_entries) {
-    SMARTLIST_FOREACH(geoip_ipv4_entries, geoip_ipv4_entry_t *, ent,
-                      tor_free(ent));
-    smartlist_free(geoip_ipv4_entries);
-  }
-  if (geoip_ipv6_entries) {
-    SMARTLIST_FOREACH(geoip_ipv6_entries, geoip_ipv6_entry_t *, ent,
-                      tor_free(ent));
-    smartlist_free(geoip_ipv6_entries);
-  }
+  geoip_clear_table(AF_INET);
+  geoip_clear_table(AF_INET6);
   geoip_countries = NULL;
   country_idxplus1_by_lc_code = NULL;
-  geoip_ipv4_entries = NULL;
-  geoip_ipv6_entries = NULL;
 }
 
 /** Release all storage held in this file. */
@@ -38,6 +38,7 @@ struct smartlist_t;
 const struct smartlist_t *geoip_get_countries(void);
 
 int geoip_load_file(sa_family_t family, const char *filename, int severity);
+int geoip_compile_db(sa_family_t family, char **out, size_t *len_out);
 MOCK_DECL(int, geoip_get_country_by_addr, (const struct tor_addr_t *addr));
 MOCK_DECL(int, geoip_get_n_countries, (void));
 const char *geoip_get_country_name(country_t num);
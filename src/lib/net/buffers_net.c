@@ -25,6 +25,18 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+
+#if defined(HAVE_SYS_UIO_H) && defined(HAVE_READV) && \
+  defined(HAVE_WRITEV) && !defined(_WIN32)
+/** Defined if we can fill or flush several chunks with one readv() or
+ * writev() call. */
+#define USE_VECTORED_IO
+/** Largest number of chunks that we'll read or write in one syscall. */
+#define BUF_MAX_IOV 16
+#endif
 
 #ifdef PARANOIA
 /** Helper: If PARANOIA is defined, assert that the buffer in local variable
@@ -34,6 +46,7 @@
 #define check() STMT_NIL
 #endif /* defined(PARANOIA) */
 
+#ifndef USE_VECTORED_IO
 /** Read up to <b>at_most</b> bytes from the file descriptor <b>fd</b> into
  * <b>chunk</b> (which must be on <b>buf</b>). If we get an EOF, set
  * *<b>reached_eof</b> to 1. Uses <b>tor_socket_recv()</b> iff <b>is_socket</b>
@@ -81,6 +94,85 @@ read_to_chunk(buf_t *buf, chunk_t *chunk, tor_socket_t fd, size_t at_most,
   }
 }
 
+#else /* defined(USE_VECTORED_IO) */
+
+/** Helper for buf_read_from_fd(): read up to *<b>at_most</b> bytes from
+ * <b>fd</b> onto the end of <b>buf</b> with a single readv() call, using the
+ * free space in the tail chunk and as many new chunks as we need.  If we
+ * can't read that much in one call, lower *<b>at_most</b> to the amount we
+ * tried to read.  Return values are as for read_to_chunk(). */
+static int
+read_to_chunks_vectored(buf_t *buf, tor_socket_t fd, size_t *at_most,
+                        int *reached_eof, int *error)
+{
+  struct iovec iov[BUF_MAX_IOV];
+  chunk_t *chunks[BUF_MAX_IOV];
+  int n_iov = 0, n_new, i;
+  size_t room = 0;
+  ssize_t read_result;
+  size_t remaining;
+
+  if (buf->tail && CHUNK_REMAINING_CAPACITY(buf->tail) >= MIN_READ_LEN) {
+    chunks[n_iov] = buf->tail;
+    iov[n_iov].iov_base = CHUNK_WRITE_PTR(buf->tail);
+    size_t cap = CHUNK_REMAINING_CAPACITY(buf->tail);
+    iov[n_iov].iov_len = cap < *at_most ? cap : *at_most;
+    room += iov[n_iov].iov_len;
+    ++n_iov;
+  }
+  n_new = n_iov;
+  /* We add the new chunks to the buffer only once we know that they got
+   * some data: a buffer may not hold an empty chunk other than its tail. */
+  while (room < *at_most && n_iov < BUF_MAX_IOV) {
+    chunk_t *chunk = buf_chunk_new_with_capacity(buf, *at_most - room, 1);
+    chunks[n_iov] = chunk;
+    iov[n_iov].iov_base = CHUNK_WRITE_PTR(chunk);
+    iov[n_iov].iov_len = chunk->memlen;
+    if (iov[n_iov].iov_len > *at_most - room)
+      iov[n_iov].iov_len = *at_most - room;
+    room += iov[n_iov].iov_len;
+    ++n_iov;
+  }
+  *at_most = room;
+
+  read_result = readv(fd, iov, n_iov);
+
+  remaining = read_result > 0 ? (size_t)read_result : 0;
+  for (i = 0; i < n_iov; ++i) {
+    size_t n = remaining < iov[i].iov_len ? remaining : iov[i].iov_len;
+    if (i >= n_new) {
+      if (n == 0) {
+        buf_chunk_free(chunks[i]);
+        continue;
+      }
+      buf_append_chunk(buf, chunks[i]);
+    }
+    chunks[i]->datalen += n;
+    remaining -= n;
+  }
+
+  if (read_result < 0) {
+    int e = tor_socket_errno(fd);
+    if (!ERRNO_IS_EAGAIN(e)) { /* it's a real error */
+      if (error)
+        *error = e;
+      return -1;
+    }
+    return 0; /* would block. */
+  } else if (read_result == 0) {
+    log_debug(LD_NET,"Encountered eof on fd %d", (int)fd);
+    *reached_eof = 1;
+    return 0;
+  } else { /* actually got bytes. */
+    buf->datalen += read_result;
+    log_debug(LD_NET,"Read %ld bytes into %d chunks. %d on inbuf.",
+              (long)read_result, n_iov, (int)buf->datalen);
+    tor_assert(read_result < INT_MAX);
+    return (int)read_result;
+  }
+}
+#endif /* !defined(USE_VECTORED_IO) */
+
 /** Read from file descriptor <b>fd</b>, writing onto end of <b>buf</b>.  Read
  * at most <b>at_most</b> bytes, growing the buffer as necessary.  If recv()
  * returns 0 (because of EOF), set *<b>reached_eof</b> to 1 and return 0.
@@ -110,6 +202,10 @@ buf_read_from_fd(buf_t *buf, int fd, size_t at_most,
 
   while (at_most > total_read) {
     size_t readlen = at_most - total_read;
+#ifdef USE_VECTORED_IO
+    (void)is_socket;
+    r = read_to_chunks_vectored(buf, fd, &readlen, reached_eof, socket_error);
+#else
     chunk_t *chunk;
     if (!buf->tail || CHUNK_REMAINING_CAPACITY(buf->tail) < MIN_READ_LEN) {
       chunk = buf_add_chunk_with_capacity(buf, at_most, 1);
@@ -124,6 +220,7 @@ buf_read_from_fd(buf_t *buf, int fd, size_t at_most,
 
     r = read_to_chunk(buf, chunk, fd, readlen,
                       reached_eof, socket_error, is_socket);
+#endif /* defined(USE_VECTORED_IO) */
     check();
     if (r < 0)
       return r; /* Error */
@@ -136,6 +233,7 @@ buf_read_from_fd(buf_t *buf, int fd, size_t at_most,
   return (int)total_read;
 }
 
+#ifndef USE_VECTORED_IO
 /** Helper for buf_flush_to_socket(): try to write <b>sz</b> bytes from chunk
  * <b>chunk</b> of buffer <b>buf</b> onto file descriptor <b>fd</b>.  On
  * success, deduct the bytes written from *<b>buf_flushlen</b>.  Return the
@@ -175,6 +273,55 @@ flush_chunk(tor_socket_t fd, buf_t *buf, chunk_t *chunk, size_t sz,
   }
 }
 
+#else /* defined(USE_VECTORED_IO) */
+
+/** Helper for buf_flush_to_fd(): try to write *<b>sz</b> bytes from the
+ * front of <b>buf</b> onto file descriptor <b>fd</b>, taking them from as
+ * many chunks as we can with a single writev() call.  If they span too many
+ * chunks, lower *<b>sz</b> to the amount we tried to write.  On success,
+ * deduct the bytes written from *<b>buf_flushlen</b>, and return the number
+ * of bytes written.  Return 0 on blocking, and -1 on failure.
+ */
+static int
+flush_chunks_vectored(tor_socket_t fd, buf_t *buf, size_t *sz,
+                      size_t *buf_flushlen)
+{
+  struct iovec iov[BUF_MAX_IOV];
+  int n_iov = 0;
+  chunk_t *chunk;
+  size_t total = 0;
+  ssize_t write_result;
+
+  for (chunk = buf->head; chunk && total < *sz && n_iov < BUF_MAX_IOV;
+       chunk = chunk->next) {
+    iov[n_iov].iov_base = chunk->data;
+    iov[n_iov].iov_len = chunk->datalen;
+    if (iov[n_iov].iov_len > *sz - total)
+      iov[n_iov].iov_len = *sz - total;
+    total += iov[n_iov].iov_len;
+    ++n_iov;
+  }
+  *sz = total;
+
+  write_result = writev(fd, iov, n_iov);
+
+  if (write_result < 0) {
+    int e = tor_socket_errno(fd);
+
+    if (!ERRNO_IS_EAGAIN(e)) { /* it's a real error */
+      return -1;
+    }
+    log_debug(LD_NET,"write() would block, returning.");
+    return 0;
+  } else {
+    *buf_flushlen -= write_result;
+    buf_drain(buf, write_result);
+    tor_assert(write_result < INT_MAX);
+    return (int)write_result;
+  }
+}
+#endif /* !defined(USE_VECTORED_IO) */
+
 /** Write data from <b>buf</b> to the file descriptor <b>fd</b>.  Write at most
  * <b>sz</b> bytes, decrement *<b>buf_flushlen</b> by
  * the number of bytes actually written, and remove the written bytes
@@ -203,12 +350,18 @@ buf_flush_to_fd(buf_t *buf, int fd, size_t sz,
   while (sz) {
     size_t flushlen0;
     tor_assert(buf->head);
+#ifdef USE_VECTORED_IO
+    (void)is_socket;
+    flushlen0 = sz;
+    r = flush_chunks_vectored(fd, buf, &flushlen0, buf_flushlen);
+#else
     if (buf->head->datalen >= sz)
       flushlen0 = sz;
     else
       flushlen0 = buf->head->datalen;
 
     r = flush_chunk(fd, buf, buf->head, flushlen0, buf_flushlen, is_socket);
+#endif /* defined(USE_VECTORED_IO) */
     check();
     if (r < 0)
       return r;
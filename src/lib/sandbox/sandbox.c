@@ -211,6 +211,7 @@ static int filter_nopar_gen[] = {
     SCMP_SYS(prlimit64),
 #endif
     SCMP_SYS(read),
+    SCMP_SYS(readv),
     SCMP_SYS(rt_sigreturn),
     SCMP_SYS(sched_getaffinity),
 #ifdef __NR_sched_yield
@@ -771,6 +772,14 @@ sb_setsockopt(scmp_filter_ctx ctx, sandbox_cfg_t *filter)
   if (rc)
     return rc;
 
+#ifdef SO_REUSEPORT
+  rc = seccomp_rule_add_2(ctx, SCMP_ACT_ALLOW, SCMP_SYS(setsockopt),
+      SCMP_CMP(1, SCMP_CMP_EQ, SOL_SOCKET),
+      SCMP_CMP(2, SCMP_CMP_EQ, SO_REUSEPORT));
+  if (rc)
+    return rc;
+#endif /* defined(SO_REUSEPORT) */
+
   rc = seccomp_rule_add_2(ctx, SCMP_ACT_ALLOW, SCMP_SYS(setsockopt),
       SCMP_CMP(1, SCMP_CMP_EQ, SOL_SOCKET),
       SCMP_CMP(2, SCMP_CMP_EQ, SO_SNDBUF));
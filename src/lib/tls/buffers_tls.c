@@ -10,6 +10,7 @@
  **/
 
 #define BUFFERS_PRIVATE
+#define BUFFERS_TLS_PRIVATE
 #include "orconfig.h"
 #include <stddef.h>
 #include "lib/buf/buffers.h"
@@ -23,6 +24,22 @@
 #include <unistd.h>
 #endif
 
+/** If true, size TLS reads and writes to whole TLS records. */
+static int tls_record_batching = 1;
+
+/** Enable record batching in buf_read_from_tls() and buf_flush_to_tls() if
+ * <b>enabled</b> is true; otherwise disable it.
+ *
+ * With record batching, we read into chunks large enough for a whole
+ * record, and before writing, we gather up to a record's worth of data into
+ * the first chunk of the buffer, so that we don't send a short TLS record
+ * for every chunk. */
+void
+buf_tls_set_record_batching(int enabled)
+{
+  tls_record_batching = !!enabled;
+}
+
 /** As read_to_chunk(), but return (negative) error code on error, blocking,
  * or TLS, and the number of bytes read otherwise. */
 static inline int
@@ -77,7 +94,13 @@ buf_read_from_tls(buf_t *buf, tor_tls_t *tls, size_t at_most)
     size_t readlen = at_most - total_read;
     chunk_t *chunk;
     if (!buf->tail || CHUNK_REMAINING_CAPACITY(buf->tail) < MIN_READ_LEN) {
-      chunk = buf_add_chunk_with_capacity(buf, at_most, 1);
+      if (tls_record_batching && at_most < TLS_RECORD_MAX_PAYLOAD) {
+        /* Room for one whole record, and no more. */
+        chunk = buf_add_chunk_with_exact_capacity(buf,
+                                                  TLS_RECORD_MAX_PAYLOAD);
+      } else {
+        chunk = buf_add_chunk_with_capacity(buf, at_most, 1);
+      }
       if (readlen > chunk->memlen)
         readlen = chunk->memlen;
     } else {
@@ -135,15 +158,51 @@ flush_chunk_tls(tor_tls_t *tls, buf_t *buf, chunk_t *chunk,
   return r;
 }
 
+/** Return the number of TLS records that it takes to carry <b>n</b> bytes
+ * written with a single call to tor_tls_write(). */
+STATIC size_t
+tls_records_for_write(size_t n)
+{
+  return (n + TLS_RECORD_MAX_PAYLOAD - 1) / TLS_RECORD_MAX_PAYLOAD;
+}
+
+/** Helper for buf_flush_to_tls(): we're about to write up to <b>sz</b>
+ * bytes from the start of <b>buf</b>.  If the first chunk holds less than
+ * a full TLS record of that, and there is more data behind it, pull the
+ * data up into the first chunk so that we can write it as a single record.
+ * Otherwise, leave the buffer alone.  Return the number of bytes we can
+ * write from the first chunk. */
+STATIC size_t
+buf_tls_coalesce_head(buf_t *buf, size_t sz)
+{
+  size_t want;
+  if (!buf->head)
+    return 0;
+
+  want = sz < TLS_RECORD_MAX_PAYLOAD ? sz : TLS_RECORD_MAX_PAYLOAD;
+  if (want > buf->datalen)
+    want = buf->datalen;
+  if (buf->head->next && buf->head->datalen < want) {
+    const char *head;
+    size_t len;
+    buf_pullup(buf, want, &head, &len);
+  }
+
+  return buf->head->datalen < sz ? buf->head->datalen : sz;
+}
+
 /** As buf_flush_to_socket(), but writes data to a TLS connection.  Can write
  * more than <b>flushlen</b> bytes.
+ *
+ * If <b>stats</b> is provided, add the number of TLS records we wrote, and
+ * the number of bytes they carried, to it.
  */
 int
 buf_flush_to_tls(buf_t *buf, tor_tls_t *tls, size_t flushlen,
-              size_t *buf_flushlen)
+                 size_t *buf_flushlen, tls_flush_stats_t *stats)
 {
   int r;
-  size_t flushed = 0;
+  size_t flushed = 0, n_records = 0;
   ssize_t sz;
   tor_assert(buf_flushlen);
   if (BUG(*buf_flushlen > buf->datalen)) {
@@ -160,7 +219,9 @@ buf_flush_to_tls(buf_t *buf, tor_tls_t *tls, size_t flushlen,
 
   do {
     size_t flushlen0;
-    if (buf->head) {
+    if (tls_record_batching) {
+      flushlen0 = buf_tls_coalesce_head(buf, sz);
+    } else if (buf->head) {
       if ((ssize_t)buf->head->datalen >= sz)
         flushlen0 = sz;
       else
@@ -171,12 +232,21 @@ buf_flush_to_tls(buf_t *buf, tor_tls_t *tls, size_t flushlen,
 
     r = flush_chunk_tls(tls, buf, buf->head, flushlen0, buf_flushlen);
     if (r < 0)
-      return r;
+      break;
     flushed += r;
+    n_records += tls_records_for_write(r);
     sz -= r;
     if (r == 0) /* Can't flush any more now. */
       break;
   } while (sz > 0);
+
+  if (stats && flushed) {
+    ++stats->n_flushes;
+    stats->n_records += n_records;
+    stats->n_bytes += flushed;
+  }
+  if (r < 0)
+    return r;
   tor_assert(flushed < INT_MAX);
   return (int)flushed;
 }
@@ -12,12 +12,36 @@
 #ifndef TOR_BUFFERS_TLS_H
 #define TOR_BUFFERS_TLS_H
 
+#include "lib/cc/torint.h"
+#include "lib/testsupport/testsupport.h"
+
 struct buf_t;
 struct tor_tls_t;
 
+/** The largest number of bytes that a single TLS record can carry. */
+#define TLS_RECORD_MAX_PAYLOAD 16384
+
+/** Running totals of the TLS writes made by buf_flush_to_tls(). */
+typedef struct tls_flush_stats_t {
+  /** How many calls to buf_flush_to_tls() have written anything? */
+  uint64_t n_flushes;
+  /** How many TLS records have those calls written? */
+  uint64_t n_records;
+  /** How many bytes of data did those records carry? */
+  uint64_t n_bytes;
+} tls_flush_stats_t;
+
+void buf_tls_set_record_batching(int enabled);
+
 int buf_read_from_tls(struct buf_t *buf,
                       struct tor_tls_t *tls, size_t at_most);
 int buf_flush_to_tls(struct buf_t *buf, struct tor_tls_t *tls,
-                     size_t sz, size_t *buf_flushlen);
+                     size_t sz, size_t *buf_flushlen,
+                     tls_flush_stats_t *stats);
+
+#ifdef BUFFERS_TLS_PRIVATE
+STATIC size_t tls_records_for_write(size_t n);
+STATIC size_t buf_tls_coalesce_head(struct buf_t *buf, size_t sz);
+#endif
 
 #endif /* !defined(TOR_BUFFERS_TLS_H) */
@@ -10,6 +10,9 @@
 
 #include "orconfig.h"
 
+#define EXPOSE_ROUTERDESC_TOKEN_TABLE
+#define TOR_CHANNEL_INTERNAL_
+
 #include "core/or/or.h"
 #include "core/crypto/onion_tap.h"
 #include "core/crypto/relay_crypto.h"
@@ -22,25 +25,69 @@
 #include <openssl/obj_mac.h>
 #endif
 
+#include "core/or/channel.h"
+#include "core/or/circid_map.h"
 #include "core/or/circuitlist.h"
+#include "core/or/circuitmux.h"
+#include "core/or/circuitmux_ewma.h"
+#include "core/or/command.h"
+#include "core/or/connection_or.h"
+#include "core/or/policies.h"
+#include "core/or/relay.h"
+#include "core/or/scheduler.h"
+#include "core/mainloop/connection.h"
+#include "core/mainloop/cpuworker.h"
+#include "core/mainloop/mainloop.h"
 #include "app/config/config.h"
 #include "app/main/subsysmgr.h"
 #include "lib/crypt_ops/crypto_curve25519.h"
 #include "lib/crypt_ops/crypto_dh.h"
 #include "core/crypto/onion_ntor.h"
 #include "lib/crypt_ops/crypto_ed25519.h"
+#include "lib/crypt_ops/crypto_format.h"
 #include "lib/crypt_ops/crypto_rand.h"
+#include "lib/crypt_ops/crypto_util.h"
+#include "lib/encoding/confline.h"
+#include "lib/evloop/compat_libevent.h"
+#include "lib/memarea/memarea.h"
 #include "feature/dircommon/consdiff.h"
 #include "lib/compress/compress.h"
 
 #include "core/or/cell_st.h"
+#include "core/or/cell_queue_st.h"
+#include "core/or/or_connection_st.h"
 #include "core/or/or_circuit_st.h"
 
 #include "lib/crypt_ops/digestset.h"
+#include "ext/ht.h"
+#include "ext/siphash.h"
 #include "lib/crypt_ops/crypto_init.h"
+#include "lib/geoip/geoip.h"
 
 #include "feature/dirparse/microdesc_parse.h"
+#include "feature/dirparse/ns_parse.h"
+#include "feature/dirparse/parsecommon.h"
+#include "feature/dirparse/routerparse.h"
 #include "feature/nodelist/microdesc.h"
+#include "feature/nodelist/networkstatus.h"
+#include "feature/nodelist/node_select.h"
+#include "feature/nodelist/nodelist.h"
+#include "feature/nodelist/routerlist.h"
+#include "feature/relay/router.h"
+
+#include "feature/nodelist/networkstatus_st.h"
+#include "feature/nodelist/node_st.h"
+#include "feature/nodelist/routerinfo_st.h"
+
+#ifdef HAVE_CFLAG_WOVERLENGTH_STRINGS
+DISABLE_GCC_WARNING(overlength-strings)
+/* We allow huge string constants in the benchmarks, but not in the code
+ * at large. */
+#endif
+#include "test/test_descriptors.inc"
+#ifdef HAVE_CFLAG_WOVERLENGTH_STRINGS
+ENABLE_GCC_WARNING(overlength-strings)
+#endif
 
 #if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_PROCESS_CPUTIME_ID)
 static uint64_t nanostart;
@@ -229,13 +276,31 @@ bench_onion_ntor_impl(void)
   start = perftime();
   for (i = 0; i < iters; ++i) {
     uint8_t key_out[CPATH_KEY_MATERIAL_LEN];
-    onion_skin_ntor_server_handshake(os, keymap, NULL, nodeid, or,
+    onion_skin_ntor_server_handshake(os, keymap, NULL, NULL, nodeid, or,
                                 key_out, sizeof(key_out));
   }
   end = perftime();
   printf("Server-side: %f usec\n",
          NANOCOUNT(start, end, iters)/1e3);
 
+  {
+    curve25519_keypair_t *ephemeral =
+      tor_calloc(iters, sizeof(curve25519_keypair_t));
+    for (i = 0; i < iters; ++i)
+      curve25519_keypair_generate(&ephemeral[i], 0);
+    start = perftime();
+    for (i = 0; i < iters; ++i) {
+      uint8_t key_out[CPATH_KEY_MATERIAL_LEN];
+      onion_skin_ntor_server_handshake(os, keymap, NULL, &ephemeral[i],
+                                       nodeid, or, key_out, sizeof(key_out));
+    }
+    end = perftime();
+    printf("Server-side, with precomputed ephemeral key: %f usec\n",
+           NANOCOUNT(start, end, iters)/1e3);
+    memwipe(ephemeral, 0, iters * sizeof(curve25519_keypair_t));
+    tor_free(ephemeral);
+  }
+
   start = perftime();
   for (i = 0; i < iters; ++i) {
     uint8_t key_out[CPATH_KEY_MATERIAL_LEN];
@@ -441,6 +506,115 @@ bench_dmap(void)
   smartlist_free(sl2);
 }
 
+/** An entry in the global (channel, circuit ID) map that circuitlist.c
+ * used before it kept a circid_map_t on each channel; bench_circid() uses
+ * it as a baseline. */
+typedef struct bench_chan_circid_t {
+  HT_ENTRY(bench_chan_circid_t) node;
+  void *chan;
+  circid_t circ_id;
+  void *circuit;
+} bench_chan_circid_t;
+
+static inline int
+bench_chan_circid_eq(bench_chan_circid_t *a, bench_chan_circid_t *b)
+{
+  return a->chan == b->chan && a->circ_id == b->circ_id;
+}
+
+static inline unsigned int
+bench_chan_circid_hash(bench_chan_circid_t *a)
+{
+  uintptr_t chan = (uintptr_t) a->chan;
+  uint32_t array[2];
+  array[0] = a->circ_id;
+  array[1] = (uint32_t) (chan >> 6);
+  return (unsigned) siphash24g(array, sizeof(array));
+}
+
+static HT_HEAD(bench_chan_circid_map, bench_chan_circid_t)
+     bench_chan_circid_map = HT_INITIALIZER();
+HT_PROTOTYPE(bench_chan_circid_map, bench_chan_circid_t, node,
+             bench_chan_circid_hash, bench_chan_circid_eq)
+HT_GENERATE2(bench_chan_circid_map, bench_chan_circid_t, node,
+             bench_chan_circid_hash, bench_chan_circid_eq, 0.6,
+             tor_reallocarray_, tor_free_)
+
+/** Run benchmarks for looking up circuits by channel and circuit ID, with
+ * the per-channel circid_map_t against a single global hash table, for a
+ * range of circuit counts.  We look circuits up in random order, and in
+ * runs of 8 on the same circuit, as when cells arrive back to back. */
+static void
+bench_circid(void)
+{
+  const int n_chans = 1000;
+  const int n_lookups = 1<<20;
+  const int run_len = 8;
+  int n_circs, i, j;
+  uint64_t start, end;
+
+  reset_perftime();
+
+  for (n_circs = 1000; n_circs <= 100000; n_circs *= 10) {
+    circid_map_t *maps = tor_calloc(n_chans, sizeof(circid_map_t));
+    bench_chan_circid_t *ents = tor_calloc(n_circs, sizeof(*ents));
+    int *order = tor_calloc(n_lookups, sizeof(int));
+    int hits = 0;
+
+    for (i = 0; i < n_circs; ++i) {
+      ents[i].chan = &maps[i % n_chans];
+      do {
+        crypto_rand((char*)&ents[i].circ_id, sizeof(circid_t));
+      } while (circid_map_find(&maps[i % n_chans], ents[i].circ_id));
+      ents[i].circuit = &ents[i];
+      circid_map_find_or_insert(&maps[i % n_chans],
+                                ents[i].circ_id)->circuit = ents[i].circuit;
+      HT_INSERT(bench_chan_circid_map, &bench_chan_circid_map, &ents[i]);
+    }
+
+    for (j = 0; j <= 1; ++j) {
+      const int run = j ? run_len : 1;
+      for (i = 0; i < n_lookups; i += run) {
+        int k, which = crypto_rand_int(n_circs);
+        for (k = 0; k < run && i + k < n_lookups; ++k)
+          order[i + k] = which;
+      }
+
+      start = perftime();
+      for (i = 0; i < n_lookups; ++i) {
+        bench_chan_circid_t search, *found;
+        search.chan = ents[order[i]].chan;
+        search.circ_id = ents[order[i]].circ_id;
+        found = HT_FIND(bench_chan_circid_map, &bench_chan_circid_map,
+                        &search);
+        hits += found && found->circuit == ents[order[i]].circuit;
+      }
+      end = perftime();
+      printf("%6d circuits, runs of %d: global map:  %.2f ns per lookup\n",
+             n_circs, run, NANOCOUNT(start, end, n_lookups));
+
+      start = perftime();
+      for (i = 0; i < n_lookups; ++i) {
+        const bench_chan_circid_t *e = &ents[order[i]];
+        circid_map_ent_t *found = circid_map_find(e->chan, e->circ_id);
+        hits += found && found->circuit == e->circuit;
+      }
+      end = perftime();
+      printf("%6d circuits, runs of %d: circid_map:  %.2f ns per lookup\n",
+             n_circs, run, NANOCOUNT(start, end, n_lookups));
+    }
+    /* We need to use this, or else the loops get optimized out. */
+    printf("Hits == %d\n", hits);
+
+    HT_CLEAR(bench_chan_circid_map, &bench_chan_circid_map);
+    for (i = 0; i < n_chans; ++i)
+      circid_map_clear(&maps[i]);
+    tor_free(maps);
+    tor_free(ents);
+    tor_free(order);
+  }
+}
+
 static void
 bench_siphash(void)
 {
@@ -555,6 +729,222 @@ bench_cell_ops(void)
   tor_free(cell);
 }
 
+/** Set up Libevent, unless an earlier benchmark already has. */
+static void
+bench_init_libevent(void)
+{
+  static int initialized = 0;
+  tor_libevent_cfg cfg;
+
+  if (initialized)
+    return;
+  memset(&cfg, 0, sizeof(cfg));
+  tor_libevent_initialize(&cfg);
+  initialized = 1;
+}
+
+/** Return a new channel that circuits can be attached to, for
+ * bench_cell_batch(). */
+static channel_t *
+bench_channel_new(void)
+{
+  channel_t *chan = tor_malloc_zero(sizeof(channel_t));
+  channel_init(chan);
+  chan->state = CHANNEL_STATE_OPEN;
+  chan->wide_circ_ids = 1;
+  chan->cmux = circuitmux_alloc();
+  circuitmux_set_policy(chan->cmux, &ewma_policy);
+  return chan;
+}
+
+/** Release a channel from bench_channel_new(), which must have no circuits
+ * left. */
+static void
+bench_channel_free(channel_t *chan)
+{
+  scheduler_release_channel(chan);
+  circuitmux_free(chan->cmux);
+  circid_map_clear(&chan->circid_map);
+  tor_free(chan);
+}
+
+/** Run benchmarks for forwarding relay cells through a middle relay with
+ * command_process_relay_cells(), one at a time and in runs of every size up
+ * to RELAY_CELL_BATCH_MAX. */
+static void
+bench_cell_batch(void)
+{
+  const int iters = 1<<16;
+  const circid_t circ_id = 42;
+  int i, batch;
+  uint64_t start, end;
+  channel_t *p_chan, *n_chan;
+  or_circuit_t *or_circ;
+  cell_t *cells = tor_calloc(RELAY_CELL_BATCH_MAX, sizeof(cell_t));
+  cell_t **cell_ptrs = tor_calloc(RELAY_CELL_BATCH_MAX, sizeof(cell_t *));
+  char key1[CIPHER_KEY_LEN], key2[CIPHER_KEY_LEN];
+
+  /* Forwarded cells go onto a circuit queue, which the OOM handler checks,
+   * and wake up the scheduler.  Our options were never validated, so fill
+   * in what those need. */
+  bench_init_libevent();
+  get_options_mutable()->MaxMemInQueues = 1<<30;
+  if (!get_options()->SchedulerTypes_) {
+    int *type = tor_malloc_zero(sizeof(int));
+    *type = SCHEDULER_VANILLA;
+    get_options_mutable()->SchedulerTypes_ = smartlist_new();
+    smartlist_add(get_options_mutable()->SchedulerTypes_, type);
+  }
+  scheduler_init();
+
+  p_chan = bench_channel_new();
+  n_chan = bench_channel_new();
+  or_circ = or_circuit_new(circ_id, p_chan);
+  circuit_set_n_circid_chan(TO_CIRCUIT(or_circ), circ_id, n_chan);
+  TO_CIRCUIT(or_circ)->purpose = CIRCUIT_PURPOSE_OR;
+  TO_CIRCUIT(or_circ)->state = CIRCUIT_STATE_OPEN;
+
+  crypto_rand(key1, sizeof(key1));
+  crypto_rand(key2, sizeof(key2));
+  or_circ->crypto.f_crypto = crypto_cipher_new(key1);
+  or_circ->crypto.b_crypto = crypto_cipher_new(key2);
+  or_circ->crypto.f_digest = crypto_digest_new();
+  or_circ->crypto.b_digest = crypto_digest_new();
+
+  /* Random payloads stay random when we decrypt them, so (almost) none of
+   * these cells is recognized, and every one gets relayed. Since the
+   * circuit ID is the same on both channels, relaying leaves each cell as
+   * we found it. */
+  for (i = 0; i < RELAY_CELL_BATCH_MAX; ++i) {
+    cells[i].circ_id = circ_id;
+    cells[i].command = CELL_RELAY;
+    crypto_rand((char*)cells[i].payload, sizeof(cells[i].payload));
+    cell_ptrs[i] = &cells[i];
+  }
+
+  reset_perftime();
+
+  for (batch = 1; batch <= RELAY_CELL_BATCH_MAX; batch *= 2) {
+    const int n_batches = iters / batch;
+    start = perftime();
+    for (i = 0; i < n_batches; ++i) {
+      command_process_relay_cells(p_chan, cell_ptrs, batch);
+      /* Pretend the scheduler flushed the circuit every so often. */
+      if (TO_CIRCUIT(or_circ)->n_chan_cells.n >= 1024) {
+        cell_queue_clear(&TO_CIRCUIT(or_circ)->n_chan_cells);
+        circuitmux_set_num_cells(n_chan->cmux, TO_CIRCUIT(or_circ), 0);
+      }
+    }
+    end = perftime();
+    tor_assert(! TO_CIRCUIT(or_circ)->marked_for_close);
+    printf("Forwarded cells, batches of %2d: %.2f ns per cell "
+           "(%.0f cells/sec)\n",
+           batch,
+           NANOCOUNT(start,end,n_batches*batch),
+           1e9 / NANOCOUNT(start,end,n_batches*batch));
+  }
+
+  /* This is the only circuit the benchmarks make. */
+  circuit_free_all();
+  bench_channel_free(p_chan);
+  bench_channel_free(n_chan);
+  tor_free(cells);
+  tor_free(cell_ptrs);
+}
+
+/** The OR connection that bench_cell_write() writes cells onto. */
+static or_connection_t *bench_write_or_conn = NULL;
+
+/** Channel write_packed_cell method for bench_cell_write(): put the cell on
+ * bench_write_or_conn's outbuf, as channel_tls_t does.  Once the outbuf
+ * holds a megabyte or more, empty it again, so that we don't measure memory
+ * growth. */
+static int
+bench_write_packed_cell(channel_t *chan, packed_cell_t *cell)
+{
+  connection_t *conn = TO_CONN(bench_write_or_conn);
+  connection_buf_add(cell->body, get_cell_network_size(chan->wide_circ_ids),
+                     conn);
+  if (buf_datalen(conn->outbuf) >= (1<<20)) {
+    buf_clear(conn->outbuf);
+    conn->outbuf_flushlen = 0;
+  }
+  return 0;
+}
+
+/** Return a newly allocated packed copy of <b>cell</b>. */
+static packed_cell_t *
+bench_packed_cell_new(const cell_t *cell)
+{
+  cell_queue_t queue;
+  packed_cell_t *packed;
+  cell_queue_init(&queue);
+  cell_queue_append_packed_copy(NULL, &queue, 1, cell, 1, 0);
+  packed = TOR_SIMPLEQ_FIRST(&queue.head);
+  TOR_SIMPLEQ_REMOVE_HEAD(&queue.head, next);
+  return packed;
+}
+
+/** Run benchmarks for writing packed cells to a channel with
+ * channel_write_packed_cell(), one at a time, and with
+ * channel_write_packed_cells(), in runs of a range of sizes. */
+static void
+bench_cell_write(void)
+{
+  const int iters = 1<<16;
+  int i, j, batch;
+  uint64_t start, end;
+  channel_t *chan;
+  cell_t cell;
+
+  tor_init_connection_lists();
+  bench_write_or_conn = or_connection_new(CONN_TYPE_OR, AF_INET);
+  bench_write_or_conn->wide_circ_ids = 1;
+  chan = bench_channel_new();
+  chan->write_packed_cell = bench_write_packed_cell;
+  memset(&cell, 0, sizeof(cell));
+  cell.circ_id = 42;
+  cell.command = CELL_RELAY;
+  crypto_rand((char*)cell.payload, sizeof(cell.payload));
+
+  reset_perftime();
+
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    channel_write_packed_cell(chan, bench_packed_cell_new(&cell));
+  }
+  end = perftime();
+  printf("One cell at a time:  %.2f ns per cell (%.0f cells/sec)\n",
+         NANOCOUNT(start,end,iters),
+         1e9 / NANOCOUNT(start,end,iters));
+
+  for (batch = 1; batch <= CELL_WRITE_BATCH_MAX; batch *= 2) {
+    const int n_batches = iters / batch;
+    cell_queue_t queue;
+    cell_queue_init(&queue);
+
+    start = perftime();
+    for (i = 0; i < n_batches; ++i) {
+      for (j = 0; j < batch; ++j)
+        cell_queue_append_packed_copy(NULL, &queue, 1, &cell, 1, 0);
+      channel_write_packed_cells(chan, &queue);
+    }
+    end = perftime();
+    printf("Batches of %2d cells: %.2f ns per cell (%.0f cells/sec)\n",
+           batch,
+           NANOCOUNT(start,end,n_batches*batch),
+           1e9 / NANOCOUNT(start,end,n_batches*batch));
+  }
+
+  circuitmux_free(chan->cmux);
+  tor_free(chan);
+  {
+    connection_t *conn = TO_CONN(bench_write_or_conn);
+    connection_free(conn);
+    bench_write_or_conn = NULL;
+  }
+}
+
 static void
 bench_dh(void)
 {
@@ -642,6 +1032,294 @@ bench_ecdh_p224(void)
 }
 #endif
 
+/** One relay in the made-up consensuses from bench_make_consensus(). */
+typedef struct bench_relay_t {
+  char id[DIGEST_LEN];
+  /** The relay's descriptor digest in an ns consensus, or (all of it) its
+   * microdescriptor digest in a microdesc consensus. */
+  char desc_digest[DIGEST256_LEN];
+  int nickname;
+  int published;
+  int bandwidth;
+  int is_guard;
+} bench_relay_t;
+
+/** Return a new list of <b>n_relays</b> made-up relays for
+ * bench_make_consensus(), sorted by identity. */
+static smartlist_t *
+bench_make_relays(int n_relays)
+{
+  smartlist_t *relays = smartlist_new();
+  int i;
+
+  for (i = 0; i < n_relays; ++i) {
+    bench_relay_t *r = tor_malloc_zero(sizeof(bench_relay_t));
+    crypto_rand(r->id, DIGEST_LEN);
+    crypto_rand(r->desc_digest, DIGEST256_LEN);
+    r->nickname = i;
+    r->published = crypto_rand_int(3600);
+    r->bandwidth = 10 + crypto_rand_int(50000);
+    r->is_guard = crypto_rand_int(3) == 0;
+    smartlist_add(relays, r);
+  }
+  smartlist_sort_digests(relays);
+  return relays;
+}
+
+/** Return a newly allocated consensus of flavor <b>flavor</b> listing
+ * <b>relays</b>, which must be sorted by identity, valid after <b>hour</b>
+ * o'clock.  Nothing in it is signed, but it parses the same way as a real
+ * one. */
+static char *
+bench_make_consensus(consensus_flavor_t flavor, const smartlist_t *relays,
+                     int hour)
+{
+  const int is_md = (flavor == FLAV_MICRODESC);
+  smartlist_t *chunks = smartlist_new();
+  char *result;
+
+  smartlist_add_asprintf(chunks,
+    "network-status-version 3%s\n"
+    "vote-status consensus\n"
+    "consensus-method 28\n"
+    "valid-after 2019-02-13 %02d:00:00\n"
+    "fresh-until 2019-02-13 %02d:00:00\n"
+    "valid-until 2019-02-13 %02d:00:00\n"
+    "voting-delay 300 300\n"
+    "client-versions 0.3.5.7,0.3.5.8,0.4.0.1-alpha\n"
+    "server-versions 0.3.5.7,0.3.5.8,0.4.0.1-alpha\n"
+    "known-flags Authority BadExit Exit Fast Guard HSDir NoEdConsensus "
+    "Running Stable StaleDesc V2Dir Valid\n"
+    "recommended-client-protocols Cons=1-2 Desc=1-2 DirCache=1 HSDir=1 "
+    "HSIntro=3 HSRend=1 Link=4 Microdesc=1-2 Relay=2\n"
+    "params CircuitPriorityHalflifeMsec=30000 NumNTorsPerTAP=100 "
+    "UseOptimisticData=1 bwauthpid=1 cbttestfreq=10 pb_disablepct=0\n"
+    "dir-source test0 D586D18309DED4CD6D57C18FDB97EFA96D330566 "
+    "test0.example.com 127.0.0.1 80 443\n"
+    "contact Nobody <nobody@example.com>\n"
+    "vote-digest 5AEA0C5BC2EA7D86B2EE2EFA7A1C1C31AD5DB1AC\n",
+    is_md ? " microdesc" : "", hour, hour + 1, hour + 3);
+
+  SMARTLIST_FOREACH_BEGIN(relays, const bench_relay_t *, r) {
+    char id_b64[BASE64_DIGEST_LEN+1], d_b64[BASE64_DIGEST256_LEN+1];
+    char r_digest[BASE64_DIGEST_LEN+2] = "";
+    digest_to_base64(id_b64, r->id);
+    if (is_md) {
+      digest256_to_base64(d_b64, r->desc_digest);
+    } else {
+      digest_to_base64(d_b64, r->desc_digest);
+      tor_snprintf(r_digest, sizeof(r_digest), "%s ", d_b64);
+    }
+    smartlist_add_asprintf(chunks,
+      "r relay%d %s %s2019-02-13 %02d:%02d:%02d 10.%d.%d.%d 9001 0\n"
+      "%s"
+      "%s%s%s"
+      "s Fast%s Running Stable V2Dir Valid\n"
+      "v Tor 0.3.5.7\n"
+      "pr Cons=1-2 Desc=1-2 DirCache=1-2 HSDir=1-2 HSIntro=3-4 HSRend=1-2 "
+      "Link=1-5 LinkAuth=1,3 Microdesc=1-2 Relay=1-2\n"
+      "w Bandwidth=%d\n"
+      "%s",
+      r->nickname, id_b64, r_digest,
+      (r->published / 3600) % 24, (r->published / 60) % 60,
+      r->published % 60,
+      (uint8_t)r->id[0], (uint8_t)r->id[1], (uint8_t)r->id[2],
+      (r->nickname % 5 == 0) ? "a [2001:db8::1]:9001\n" : "",
+      is_md ? "m " : "", is_md ? d_b64 : "", is_md ? "\n" : "",
+      r->is_guard ? " Guard" : "", r->bandwidth,
+      is_md ? "" : "p reject 1-65535\n");
+  } SMARTLIST_FOREACH_END(r);
+
+  smartlist_add_strdup(chunks,
+    "directory-footer\n"
+    "bandwidth-weights Wbd=0 Wbe=0 Wbg=4194 Wbm=10000 Wdb=10000 Web=10000 "
+    "Wed=10000 Wee=10000 Weg=10000 Wem=10000 Wgb=10000 Wgd=0 Wgg=5806 "
+    "Wgm=5806 Wmb=10000 Wmd=0 Wme=0 Wmg=4194 Wmm=10000\n"
+    "directory-signature sha256 D586D18309DED4CD6D57C18FDB97EFA96D330566 "
+    "A3F2F9B48D0E4E7A1A4A8F0E5A1B7C3D2E6F0A11\n"
+    "-----BEGIN SIGNATURE-----\n"
+    "AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA\n"
+    "AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA\n"
+    "AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA\n"
+    "AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA\n"
+    "-----END SIGNATURE-----\n");
+
+  result = smartlist_join_strings(chunks, "", 0, NULL);
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  return result;
+}
+
+static void
+bench_consensus_parse(void)
+{
+  const int n_relays = 7000, n_rounds = 10;
+  smartlist_t *relays = bench_make_relays(n_relays);
+  char *consensus = bench_make_consensus(FLAV_MICRODESC, relays, 12);
+  size_t len = strlen(consensus);
+  uint64_t start, end;
+  int i;
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < n_rounds; ++i) {
+    networkstatus_t *ns = networkstatus_parse_vote_from_string(consensus,
+                                         len, NULL, NS_TYPE_CONSENSUS);
+    tor_assert(ns);
+    tor_assert(smartlist_len(ns->routerstatus_list) == n_relays);
+    networkstatus_vote_free(ns);
+  }
+  end = perftime();
+  printf("Consensus parse (%d relays, %d bytes): %.2f msec, "
+         "%.2f usec per entry\n", n_relays, (int)len,
+         NANOCOUNT(start, end, n_rounds) / 1e6,
+         NANOCOUNT(start, end, n_rounds * n_relays) / 1e3);
+  tor_free(consensus);
+  SMARTLIST_FOREACH(relays, bench_relay_t *, r, tor_free(r));
+  smartlist_free(relays);
+}
+
+/** Time parsing a big consensus without cpuworkers, and then with them. */
+static void
+bench_consensus_parse_threads(void)
+{
+  bench_consensus_parse();
+
+  bench_init_libevent();
+  if (init_keys_client() < 0) {
+    printf("Couldn't initialize keys; skipping.\n");
+    return;
+  }
+  cpu_init();
+  printf("With %d cpuworker threads:\n", cpuworker_get_n_threads());
+  bench_consensus_parse();
+}
+
+static void
+bench_routerdesc_tokenize(void)
+{
+  const int N = 20000;
+  const char *end = TEST_DESCRIPTORS + strlen(TEST_DESCRIPTORS);
+  smartlist_t *tokens = smartlist_new();
+  memarea_t *area = memarea_new();
+  uint64_t start, end_time;
+  int i, n_tokens = 0;
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < N; ++i) {
+    int r = tokenize_string(area, TEST_DESCRIPTORS, end, tokens,
+                            routerdesc_token_table, TS_NOCHECK);
+    tor_assert(r == 0);
+    n_tokens = smartlist_len(tokens);
+    SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
+    smartlist_clear(tokens);
+    memarea_clear(area);
+  }
+  end_time = perftime();
+  printf("Router descriptor tokenize (%d tokens): %.2f usec, "
+         "%.2f nsec per token\n", n_tokens,
+         NANOCOUNT(start, end_time, N) / 1e3,
+         NANOCOUNT(start, end_time, N * n_tokens));
+  smartlist_free(tokens);
+  memarea_drop_all(area);
+}
+
+/** Change <b>relays</b> the way an hour usually changes the consensus: a
+ * few relays leave and join, some publish new descriptors, and most get a
+ * new bandwidth. */
+static void
+bench_churn_relays(smartlist_t *relays, int hour)
+{
+  int i;
+  SMARTLIST_FOREACH_BEGIN(relays, bench_relay_t *, r) {
+    if (crypto_rand_int(100) < 2) {
+      tor_free(r);
+      SMARTLIST_DEL_CURRENT_KEEPORDER(relays, r);
+      continue;
+    }
+    if (crypto_rand_int(100) < 15) {
+      crypto_rand(r->desc_digest, DIGEST256_LEN);
+      r->published = hour * 3600 - crypto_rand_int(3600);
+    }
+    if (crypto_rand_int(100) < 60)
+      r->bandwidth = 10 + crypto_rand_int(50000);
+    if (crypto_rand_int(100) < 3)
+      r->is_guard = !r->is_guard;
+  } SMARTLIST_FOREACH_END(r);
+
+  for (i = smartlist_len(relays) / 50; i > 0; --i) {
+    bench_relay_t *r = tor_malloc_zero(sizeof(bench_relay_t));
+    crypto_rand(r->id, DIGEST_LEN);
+    crypto_rand(r->desc_digest, DIGEST256_LEN);
+    r->nickname = crypto_rand_int(1000000);
+    r->published = hour * 3600 - crypto_rand_int(3600);
+    r->bandwidth = 10 + crypto_rand_int(50000);
+    smartlist_add(relays, r);
+  }
+  smartlist_sort_digests(relays);
+}
+
+/** How many hours of consensuses bench_consdiff() diffs across. */
+#define BENCH_CONSDIFF_N_HOURS 3
+
+static void
+bench_consdiff(void)
+{
+  const int n_relays = 7000, n_rounds = 5, n_hours = BENCH_CONSDIFF_N_HOURS;
+  smartlist_t *relays = bench_make_relays(n_relays);
+  char *consensuses[BENCH_CONSDIFF_N_HOURS + 1];
+  int i, h;
+
+  for (h = 0; h <= n_hours; ++h) {
+    if (h)
+      bench_churn_relays(relays, h);
+    consensuses[h] = bench_make_consensus(FLAV_NS, relays, h + 1);
+  }
+
+  /* Diff the newest consensus against each older one, the way a cache
+   * does. */
+  for (h = n_hours - 1; h >= 0; --h) {
+    const char *base = consensuses[h], *target = consensuses[n_hours];
+    uint64_t start, end;
+    char *diff = NULL;
+    reset_perftime();
+    start = perftime();
+    for (i = 0; i < n_rounds; ++i) {
+      tor_free(diff);
+      diff = consensus_diff_generate(base, strlen(base),
+                                     target, strlen(target));
+      tor_assert(diff);
+    }
+    end = perftime();
+
+    uint64_t apply_start, apply_end;
+    char *applied = NULL;
+    apply_start = perftime();
+    for (i = 0; i < n_rounds; ++i) {
+      tor_free(applied);
+      applied = consensus_diff_apply(base, strlen(base),
+                                     diff, strlen(diff));
+      tor_assert(applied);
+    }
+    apply_end = perftime();
+    tor_assert(!strcmp(applied, target));
+    printf("Diff across %d hour%s (%d relays): %.2f msec, "
+           "%d byte diff, %.2f msec to apply\n",
+           n_hours - h, n_hours - h == 1 ? "" : "s",
+           smartlist_len(relays), NANOCOUNT(start, end, n_rounds) / 1e6,
+           (int)strlen(diff),
+           NANOCOUNT(apply_start, apply_end, n_rounds) / 1e6);
+    tor_free(applied);
+    tor_free(diff);
+  }
+
+  for (h = 0; h <= n_hours; ++h)
+    tor_free(consensuses[h]);
+  SMARTLIST_FOREACH(relays, bench_relay_t *, r, tor_free(r));
+  smartlist_free(relays);
+}
+
 static void
 bench_md_parse(void)
 {
@@ -675,6 +1353,347 @@ bench_md_parse(void)
 
   end = perftime();
   printf("Microdesc parse: %f nsec\n", NANOCOUNT(start, end, N));
+
+  bench_consensus_parse();
+  bench_routerdesc_tokenize();
+}
+
+/** Write a made-up GeoIP text file for <b>family</b> with <b>n</b> ranges to
+ * a temporary file, and return its name. */
+static char *
+bench_geoip_write_file(sa_family_t family, int n)
+{
+  smartlist_t *lines = smartlist_new();
+  const char *tmpdir = getenv("TMPDIR");
+  char *fname = NULL, *content;
+  int i;
+
+  for (i = 0; i < n; ++i) {
+    char cc[3] = { 'A' + crypto_rand_int(26), 'A' + crypto_rand_int(16), 0 };
+    if (family == AF_INET) {
+      uint32_t step = UINT32_MAX / n;
+      uint32_t low = (uint32_t)i * step;
+      smartlist_add_asprintf(lines, "%u,%u,%s\n", low,
+                             low + 1 + crypto_rand_int(step - 1), cc);
+    } else {
+      /* One range at the start of each 2000:i::/32. */
+      uint64_t prefix = UINT64_C(0x2000000000000000) + ((uint64_t)i << 32);
+      smartlist_add_asprintf(lines,
+                             "%x:%x:%x:%x::,%x:%x:%x:%x:ffff:ffff:ffff:ffff,"
+                             "%s\n",
+                             (unsigned)(prefix >> 48) & 0xffff,
+                             (unsigned)(prefix >> 32) & 0xffff,
+                             (unsigned)(prefix >> 16) & 0xffff,
+                             (unsigned)prefix & 0xffff,
+                             (unsigned)(prefix >> 48) & 0xffff,
+                             (unsigned)(prefix >> 32) & 0xffff,
+                             (unsigned)(prefix >> 16) & 0xffff,
+                             (unsigned)crypto_rand_int(0x10000),
+                             cc);
+    }
+  }
+  content = smartlist_join_strings(lines, "", 0, NULL);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+
+  tor_asprintf(&fname, "%s/tor-bench-geoip%s-%d", tmpdir ? tmpdir : "/tmp",
+               family == AF_INET ? "" : "6", (int) getpid());
+  if (write_str_to_file(fname, content, 0) < 0)
+    tor_free(fname);
+  tor_free(content);
+  return fname;
+}
+
+/** Time <b>n</b> lookups of random addresses in the GeoIP table for
+ * <b>family</b>, and print the result with <b>label</b>. */
+static void
+bench_geoip_lookups(sa_family_t family, const char *label)
+{
+  const int N = 1000000;
+  uint64_t start, end;
+  uint32_t *v4 = tor_calloc(N, sizeof(uint32_t));
+  struct in6_addr *v6 = tor_calloc(N, sizeof(struct in6_addr));
+  int i, sum = 0;
+
+  crypto_rand((char *) v4, N * sizeof(uint32_t));
+  for (i = 0; i < N; ++i) {
+    /* Land near the ranges that bench_geoip_write_file() made up. */
+    crypto_rand((char *) v6[i].s6_addr, 16);
+    set_uint16(v6[i].s6_addr, tor_htons(0x2000));
+    set_uint16(v6[i].s6_addr + 2, tor_htons(crypto_rand_int(0x10000)));
+    set_uint16(v6[i].s6_addr + 4, 0);
+  }
+
+  reset_perftime();
+  start = perftime();
+  if (family == AF_INET) {
+    for (i = 0; i < N; ++i)
+      sum += geoip_get_country_by_ipv4(v4[i]);
+  } else {
+    for (i = 0; i < N; ++i)
+      sum += geoip_get_country_by_ipv6(&v6[i]);
+  }
+  end = perftime();
+  printf("  %s lookups: %.2f nsec each, %.2f M/sec (checksum %d)\n",
+         label, NANOCOUNT(start, end, N),
+         1000.0 / NANOCOUNT(start, end, N), sum);
+
+  tor_free(v4);
+  tor_free(v6);
+}
+
+/** Compare loading and searching GeoIP tables from text files and from
+ * compiled files. */
+static void
+bench_geoip(void)
+{
+  const int n_ranges[2] = { 200000, 60000 };
+  const sa_family_t families[2] = { AF_INET, AF_INET6 };
+  int f;
+
+  for (f = 0; f < 2; ++f) {
+    sa_family_t family = families[f];
+    char *fname = bench_geoip_write_file(family, n_ranges[f]);
+    char *fname_db = NULL, *buf = NULL;
+    size_t len = 0;
+    uint64_t start, end;
+
+    if (!fname) {
+      printf("Couldn't write a GeoIP file.\n");
+      return;
+    }
+    printf("GeoIP %s, %d ranges:\n", family == AF_INET ? "IPv4" : "IPv6",
+           n_ranges[f]);
+
+    reset_perftime();
+    start = perftime();
+    geoip_load_file(family, fname, LOG_WARN);
+    end = perftime();
+    printf("  Text load: %.2f msec\n", NANOCOUNT(start, end, 1) / 1e6);
+    bench_geoip_lookups(family, "Text");
+
+    if (geoip_compile_db(family, &buf, &len) < 0) {
+      printf("Couldn't compile the GeoIP file.\n");
+      goto next;
+    }
+    tor_asprintf(&fname_db, "%s.db", fname);
+    write_bytes_to_file(fname_db, buf, len, 1);
+
+    reset_perftime();
+    start = perftime();
+    geoip_load_file(family, fname_db, LOG_WARN);
+    end = perftime();
+    printf("  Compiled load: %.2f msec, %lu bytes mapped\n",
+           NANOCOUNT(start, end, 1) / 1e6, (unsigned long) len);
+    bench_geoip_lookups(family, "Compiled");
+
+  next:
+    geoip_free_all();
+    tor_unlink(fname);
+    if (fname_db)
+      tor_unlink(fname_db);
+    tor_free(fname);
+    tor_free(fname_db);
+    tor_free(buf);
+  }
+}
+
+/** Helper for bench_policy: return a new exit policy that looks like
+ * one that a relay might have. */
+static smartlist_t *
+bench_policy_make(int i)
+{
+  static const int ports[] = { 22, 25, 80, 110, 143, 443, 993, 995, 5222,
+                               6667, 8080, 8443 };
+  smartlist_t *policy = NULL, *addrs = smartlist_new();
+  config_line_t *cfg = NULL;
+  tor_addr_t addr;
+  char *lines = NULL;
+  int options = EXIT_POLICY_IPV6_ENABLED | EXIT_POLICY_REJECT_PRIVATE;
+
+  /* Every relay rejects its own address. */
+  tor_addr_from_ipv4h(&addr, crypto_rand_int(0x7fffffff) | 0x40000000u);
+  smartlist_add(addrs, &addr);
+
+  switch (i % 4) {
+    case 0:
+      options |= EXIT_POLICY_ADD_DEFAULT;
+      break;
+    case 1:
+      options |= EXIT_POLICY_ADD_REDUCED;
+      break;
+    case 2: {
+      smartlist_t *items = smartlist_new();
+      int j, n = 1 + crypto_rand_int(ARRAY_LENGTH(ports));
+      for (j = 0; j < n; ++j)
+        smartlist_add_asprintf(items, "accept *:%d",
+                               ports[crypto_rand_int(ARRAY_LENGTH(ports))]);
+      smartlist_add_strdup(items, "reject *:*");
+      lines = smartlist_join_strings(items, ",", 0, NULL);
+      SMARTLIST_FOREACH(items, char *, cp, tor_free(cp));
+      smartlist_free(items);
+      break;
+    }
+    default:
+      lines = tor_strdup("reject *:*");
+      break;
+  }
+  if (lines)
+    config_line_append(&cfg, "ExitPolicy", lines);
+
+  policies_parse_exit_policy(cfg, &policy, options, addrs);
+
+  config_free_lines(cfg);
+  tor_free(lines);
+  smartlist_free(addrs);
+  return policy;
+}
+
+static void
+bench_policy(void)
+{
+  const int n_policies = 7000, n_lookups = 200;
+  static const uint16_t ports[] = { 22, 53, 80, 443, 6667, 8080, 9001 };
+  smartlist_t **policies = tor_calloc(n_policies, sizeof(smartlist_t *));
+  compiled_policy_t **compiled = tor_calloc(n_policies,
+                                            sizeof(compiled_policy_t *));
+  tor_addr_t *addrs = tor_calloc(n_lookups, sizeof(tor_addr_t));
+  uint16_t *lookup_ports = tor_calloc(n_lookups, sizeof(uint16_t));
+  smartlist_t *distinct = smartlist_new();
+  uint64_t start, end;
+  int i, j, n_distinct = 0, accepted_linear = 0, accepted_compiled = 0;
+
+  for (i = 0; i < n_policies; ++i)
+    policies[i] = bench_policy_make(i);
+  for (i = 0; i < n_lookups; ++i) {
+    tor_addr_from_ipv4h(&addrs[i], crypto_rand_int(0x7fffffff) << 1);
+    lookup_ports[i] = ports[crypto_rand_int(ARRAY_LENGTH(ports))];
+  }
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < n_policies; ++i)
+    compiled[i] = compiled_policy_get(policies[i]);
+  end = perftime();
+  for (i = 0; i < n_policies; ++i)
+    smartlist_add(distinct, compiled[i]);
+  smartlist_sort_pointers(distinct);
+  for (i = 0; i < smartlist_len(distinct); ++i) {
+    if (i == 0 || smartlist_get(distinct, i) != smartlist_get(distinct, i-1))
+      ++n_distinct;
+  }
+  printf("Compiling %d exit policies (%d distinct): %.2f msec\n",
+         n_policies, n_distinct, NANOCOUNT(start, end, 1) / 1e6);
+
+  start = perftime();
+  for (j = 0; j < n_lookups; ++j) {
+    for (i = 0; i < n_policies; ++i) {
+      if (compare_tor_addr_to_addr_policy(&addrs[j], lookup_ports[j],
+                                          policies[i]) == ADDR_POLICY_ACCEPTED)
+        ++accepted_linear;
+    }
+  }
+  end = perftime();
+  printf("Linear evaluation: %.2f nsec per policy, %.2f msec per "
+         "consensus (%d accepted)\n",
+         NANOCOUNT(start, end, n_lookups * n_policies),
+         NANOCOUNT(start, end, n_lookups) / 1e6, accepted_linear);
+
+  start = perftime();
+  for (j = 0; j < n_lookups; ++j) {
+    for (i = 0; i < n_policies; ++i) {
+      if (compare_tor_addr_to_compiled_policy(&addrs[j], lookup_ports[j],
+                                    compiled[i]) == ADDR_POLICY_ACCEPTED)
+        ++accepted_compiled;
+    }
+  }
+  end = perftime();
+  printf("Compiled evaluation: %.2f nsec per policy, %.2f msec per "
+         "consensus (%d accepted)\n",
+         NANOCOUNT(start, end, n_lookups * n_policies),
+         NANOCOUNT(start, end, n_lookups) / 1e6, accepted_compiled);
+
+  for (i = 0; i < n_policies; ++i) {
+    compiled_policy_free(compiled[i]);
+    addr_policy_list_free(policies[i]);
+  }
+  smartlist_free(distinct);
+  tor_free(policies);
+  tor_free(compiled);
+  tor_free(addrs);
+  tor_free(lookup_ports);
+}
+
+static void
+bench_node_select(void)
+{
+  const int n_nodes = 7000, n_paths = 100000, n_paths_list = 1000;
+  routerinfo_t **routers = tor_calloc(n_nodes, sizeof(routerinfo_t *));
+  uint64_t start, end;
+  int i, n_chosen = 0;
+
+  /* We can't install a consensus without signatures here, so make nodes
+   * from routerinfos, and set their flags by hand. */
+  for (i = 0; i < n_nodes; ++i) {
+    routerinfo_t *ri = routers[i] = tor_malloc_zero(sizeof(routerinfo_t));
+    node_t *node;
+    crypto_rand(ri->cache_info.identity_digest, DIGEST_LEN);
+    ri->bandwidthrate = ri->bandwidthcapacity =
+      20000 + crypto_rand_int(80000);
+    ri->onion_curve25519_pkey =
+      tor_malloc_zero(sizeof(curve25519_public_key_t));
+    crypto_rand((char *)ri->onion_curve25519_pkey->public_key,
+                CURVE25519_PUBKEY_LEN);
+    node = nodelist_set_routerinfo(ri, NULL);
+    node->is_running = node->is_valid = 1;
+    node->is_fast = node->is_stable = 1;
+    node->is_possible_guard = (i % 3 == 0);
+    node->is_exit = (i % 6 == 1);
+  }
+  nodelist_note_node_changed();
+
+  /* One guard, one middle and one exit per path. */
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < n_paths; ++i) {
+    n_chosen += !! router_choose_random_node(NULL, NULL,
+                      CRN_NEED_GUARD|CRN_NEED_UPTIME|CRN_NEED_CAPACITY);
+    n_chosen += !! router_choose_random_node(NULL, NULL, CRN_NEED_CAPACITY);
+    n_chosen += !! router_choose_random_node(NULL, NULL,
+                      CRN_WEIGHT_AS_EXIT|CRN_NEED_CAPACITY);
+  }
+  end = perftime();
+  printf("Sampling from weight tables (%d nodes): %.2f usec per path, "
+         "%.0f paths per second (%d chosen)\n", n_nodes,
+         NANOCOUNT(start, end, n_paths) / 1e3,
+         1e9 / NANOCOUNT(start, end, n_paths), n_chosen);
+
+  /* Make the weight tables stale, so that we recompute every weight as we
+   * would without them. */
+  nodelist_note_node_changed();
+  n_chosen = 0;
+  start = perftime();
+  for (i = 0; i < n_paths_list; ++i) {
+    smartlist_t *sl = smartlist_new();
+    router_add_running_nodes_to_smartlist(sl, 1, 1, 1, 0, 0, 0);
+    n_chosen += !! node_sl_choose_by_bandwidth(sl, WEIGHT_FOR_GUARD);
+    smartlist_clear(sl);
+    router_add_running_nodes_to_smartlist(sl, 0, 1, 0, 0, 0, 0);
+    n_chosen += !! node_sl_choose_by_bandwidth(sl, WEIGHT_FOR_MID);
+    n_chosen += !! node_sl_choose_by_bandwidth(sl, WEIGHT_FOR_EXIT);
+    smartlist_free(sl);
+  }
+  end = perftime();
+  printf("Filtering the nodelist for each choice (%d nodes): %.2f usec per "
+         "path, %.0f paths per second (%d chosen)\n", n_nodes,
+         NANOCOUNT(start, end, n_paths_list) / 1e3,
+         1e9 / NANOCOUNT(start, end, n_paths_list), n_chosen);
+
+  nodelist_free_all();
+  node_select_free_all();
+  for (i = 0; i < n_nodes; ++i)
+    routerinfo_free(routers[i]);
+  tor_free(routers);
 }
 
 typedef void (*bench_fn)(void);
@@ -689,6 +1708,7 @@ typedef struct benchmark_t {
 
 static struct benchmark_t benchmarks[] = {
   ENT(dmap),
+  ENT(circid),
   ENT(siphash),
   ENT(digest),
   ENT(aes),
@@ -698,6 +1718,8 @@ static struct benchmark_t benchmarks[] = {
 
   ENT(cell_aes),
   ENT(cell_ops),
+  ENT(cell_batch),
+  ENT(cell_write),
   ENT(dh),
 
 #ifdef ENABLE_OPENSSL
@@ -706,6 +1728,11 @@ static struct benchmark_t benchmarks[] = {
 #endif
 
   ENT(md_parse),
+  ENT(geoip),
+  ENT(policy),
+  ENT(node_select),
+  ENT(consensus_parse_threads),
+  ENT(consdiff),
   {NULL,NULL,0}
 };
 
@@ -746,15 +1773,30 @@ main(int argc, const char **argv)
     }
     size_t f1len = strlen(f1);
     size_t f2len = strlen(f2);
+    uint64_t start, end;
+    reset_perftime();
+    start = perftime();
     for (i = 0; i < N; ++i) {
       char *diff = consensus_diff_generate(f1, f1len, f2, f2len);
       tor_free(diff);
     }
+    end = perftime();
     char *diff = consensus_diff_generate(f1, f1len, f2, f2len);
+    if (! diff) {
+      fprintf(stderr, "Couldn't generate a diff.\n");
+      return 1;
+    }
+    char *applied = consensus_diff_apply(f1, f1len, diff, strlen(diff));
+    /* Timings go to stderr, so that the diff on stdout stays usable. */
+    fprintf(stderr, "Generated a %d byte diff in %.2f msec; it %s.\n",
+            (int)strlen(diff), NANOCOUNT(start, end, N) / 1e6,
+            (applied && !strcmp(applied, f2)) ?
+              "applies cleanly" : "DOES NOT APPLY");
     printf("%s", diff);
     tor_free(f1);
     tor_free(f2);
     tor_free(diff);
+    tor_free(applied);
     return 0;
   }
 
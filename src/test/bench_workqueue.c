@@ -0,0 +1,214 @@
+/* Copyright (c) 2019, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file bench_workqueue.c
+ * \brief Microbenchmark for the threadpool in workqueue.c.
+ *
+ * For each thread count from 1 up to the requested maximum, we push a
+ * stream of small jobs through a fresh threadpool, keeping a fixed number
+ * of them in flight, and report how many jobs per second went through the
+ * pool, and how long jobs waited between being queued and starting to run.
+ **/
+
+#include "core/or/or.h"
+#include "lib/thread/threads.h"
+#include "lib/evloop/workqueue.h"
+#include "lib/crypt_ops/crypto_rand.h"
+#include "lib/evloop/compat_libevent.h"
+#include "lib/crypt_ops/crypto_init.h"
+#include "lib/container/order.h"
+#include "lib/time/compat_time.h"
+
+#include <stdio.h>
+
+static int opt_max_threads = 8;
+static int opt_n_items = 100000;
+static int opt_n_inflight = 1000;
+static int opt_work_loops = 200;
+
+typedef struct bench_job_t {
+  monotime_t queued_at;
+  int64_t wait_nsec;
+  uint64_t result;
+} bench_job_t;
+
+typedef struct bench_run_t {
+  threadpool_t *tp;
+  int n_sent;
+  int n_received;
+  double *wait_usec;
+} bench_run_t;
+
+static bench_run_t run;
+
+static workqueue_reply_t
+workqueue_do_job(void *state, void *work)
+{
+  bench_job_t *job = work;
+  monotime_t now;
+  uint64_t x = 0;
+  int i;
+  (void)state;
+
+  monotime_get(&now);
+  job->wait_nsec = monotime_diff_nsec(&job->queued_at, &now);
+  for (i = 0; i < opt_work_loops; ++i)
+    x = x * 6364136223846793005 + 1442695040888963407;
+  job->result = x;
+  return WQ_RPL_REPLY;
+}
+
+static workqueue_reply_t
+workqueue_do_shutdown(void *state, void *work)
+{
+  (void)state;
+  (void)work;
+  return WQ_RPL_SHUTDOWN;
+}
+
+static void *
+new_state(void *arg)
+{
+  (void)arg;
+  return tor_malloc_zero(1);
+}
+
+static void
+free_state(void *arg)
+{
+  tor_free(arg);
+}
+
+static void handle_reply(void *arg);
+
+static void
+add_job(void)
+{
+  bench_job_t *job = tor_malloc_zero(sizeof(*job));
+  monotime_get(&job->queued_at);
+  ++run.n_sent;
+  threadpool_queue_work(run.tp, workqueue_do_job, handle_reply, job);
+}
+
+static void
+handle_reply(void *arg)
+{
+  bench_job_t *job = arg;
+  run.wait_usec[run.n_received++] = job->wait_nsec / 1000.0;
+  tor_free(job);
+}
+
+static void
+replysock_readable_cb(threadpool_t *tp)
+{
+  (void)tp;
+  while (run.n_sent < opt_n_items &&
+         run.n_sent - run.n_received < opt_n_inflight)
+    add_job();
+
+  if (run.n_received == opt_n_items)
+    tor_libevent_exit_loop_after_delay(tor_libevent_get_base(), NULL);
+}
+
+/** Push opt_n_items jobs through a new pool of <b>n_threads</b> threads,
+ * and print the results. */
+static void
+bench_threads(int n_threads)
+{
+  replyqueue_t *rq;
+  monotime_t start, end;
+  int64_t elapsed_usec;
+
+  memset(&run, 0, sizeof(run));
+  run.wait_usec = tor_calloc(opt_n_items, sizeof(double));
+
+  rq = replyqueue_new(0);
+  tor_assert(rq);
+  run.tp = threadpool_new(n_threads, rq, new_state, free_state, NULL);
+  tor_assert(run.tp);
+  {
+    int r = threadpool_register_reply_event(run.tp, replysock_readable_cb);
+    tor_assert(r == 0);
+  }
+
+  monotime_get(&start);
+  while (run.n_sent < opt_n_inflight && run.n_sent < opt_n_items)
+    add_job();
+  tor_libevent_run_event_loop(tor_libevent_get_base(), 0);
+  monotime_get(&end);
+
+  elapsed_usec = monotime_diff_usec(&start, &end);
+  printf("%3d threads: %10.0f jobs/sec; queue wait "
+         "median %8.1f usec, p99 %8.1f usec\n",
+         n_threads,
+         opt_n_items * 1e6 / (elapsed_usec ? elapsed_usec : 1),
+         find_nth_double(run.wait_usec, opt_n_items, opt_n_items / 2),
+         find_nth_double(run.wait_usec, opt_n_items,
+                         (int)(opt_n_items * 0.99)));
+
+  /* The threadpool can't be freed, but we can tell its threads to exit. */
+  threadpool_queue_update(run.tp, NULL, workqueue_do_shutdown, NULL, NULL);
+  tor_free(run.wait_usec);
+}
+
+static void
+help(void)
+{
+  puts(
+     "Options:\n"
+     "  -h            Display this information\n"
+     "  -N <items>    Run this many items of work for each thread count\n"
+     "  -T <threads>  Try every power of two threads up to this many\n"
+     "  -I <inflight> Keep this many requests queued at once\n"
+     "  -W <loops>    Make each item of work spin this many times");
+}
+
+int
+main(int argc, char **argv)
+{
+  tor_libevent_cfg evcfg;
+  int i;
+
+  for (i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "-T") && i+1<argc) {
+      opt_max_threads = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-N") && i+1<argc) {
+      opt_n_items = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-I") && i+1<argc) {
+      opt_n_inflight = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-W") && i+1<argc) {
+      opt_work_loops = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-h")) {
+      help();
+      return 0;
+    } else {
+      help();
+      return 1;
+    }
+  }
+
+  if (opt_max_threads < 1 || opt_n_items < 1 || opt_n_inflight < 1 ||
+      opt_work_loops < 0) {
+    help();
+    return 1;
+  }
+
+  init_logging(1);
+  network_init();
+  monotime_init();
+  if (crypto_global_init(1, NULL, NULL) < 0) {
+    printf("Couldn't initialize crypto subsystem; exiting.\n");
+    return 1;
+  }
+
+  memset(&evcfg, 0, sizeof(evcfg));
+  tor_libevent_initialize(&evcfg);
+
+  for (i = 1; i < opt_max_threads; i *= 2) {
+    bench_threads(i);
+  }
+  bench_threads(opt_max_threads);
+
+  return 0;
+}
@@ -220,6 +220,7 @@ test_ntor_handshake(void *arg)
   /* server-side */
   di_digest256_map_t *s_keymap=NULL;
   curve25519_keypair_t s_keypair;
+  curve25519_keypair_t s_ephemeral;
   uint8_t s_buf[NTOR_REPLY_LEN];
   uint8_t s_keys[400];
 
@@ -244,7 +245,7 @@ test_ntor_handshake(void *arg)
   memset(s_buf, 0, NTOR_REPLY_LEN);
   memset(s_keys, 0, 40);
   tt_int_op(0, OP_EQ, onion_skin_ntor_server_handshake(c_buf, s_keymap, NULL,
-                                                    node_id,
+                                                    NULL, node_id,
                                                     s_buf, s_keys, 400));
 
   /* client handshake 2 */
@@ -256,6 +257,21 @@ test_ntor_handshake(void *arg)
   memset(s_buf, 0, 40);
   tt_mem_op(c_keys,OP_NE, s_buf, 40);
 
+  /* Now do the server handshake again, with an ephemeral keypair that we
+   * made in advance. */
+  curve25519_keypair_generate(&s_ephemeral, 0);
+  memset(s_buf, 0, NTOR_REPLY_LEN);
+  memset(s_keys, 0, 40);
+  tt_int_op(0, OP_EQ, onion_skin_ntor_server_handshake(c_buf, s_keymap, NULL,
+                                                    &s_ephemeral, node_id,
+                                                    s_buf, s_keys, 400));
+  tt_mem_op(s_buf, OP_EQ, s_ephemeral.pubkey.public_key,
+            CURVE25519_PUBKEY_LEN);
+  memset(c_keys, 0, 40);
+  tt_int_op(0, OP_EQ, onion_skin_ntor_client_handshake(c_state, s_buf,
+                                                       c_keys, 400, NULL));
+  tt_mem_op(c_keys,OP_EQ, s_keys, 400);
+
   /* Now try with a bogus server response. Zero input should trigger
    * All The Problems. */
   memset(c_keys, 0, 400);
@@ -354,6 +370,114 @@ test_onion_queues(void *arg)
   tor_free(onionskin);
 }
 
+/** Add a new ntor create request, on a new circuit, to the onion queue. */
+static or_circuit_t *
+add_ntor_onion_request(void)
+{
+  uint8_t buf[NTOR_ONIONSKIN_LEN] = {0};
+  or_circuit_t *circ = or_circuit_new(0, NULL);
+  create_cell_t *create = tor_malloc_zero(sizeof(create_cell_t));
+  TO_CIRCUIT(circ)->purpose = CIRCUIT_PURPOSE_OR;
+  create_cell_init(create, CELL_CREATE2, ONION_HANDSHAKE_TYPE_NTOR,
+                   NTOR_ONIONSKIN_LEN, buf);
+  tor_assert(onion_pending_add(circ, create) == 0);
+  return circ;
+}
+
+/** Run unit tests for the CoDel controller on the onion queues. */
+static void
+test_onion_queue_codel(void *arg)
+{
+  const int64_t msec = 1000000;
+  int64_t now = 1000 * msec;
+  create_cell_t *onionskin = NULL;
+  or_circuit_t *circ, *first = NULL;
+  char *status = NULL;
+  int i;
+  (void)arg;
+
+  monotime_enable_test_mocking();
+  monotime_coarse_set_mock_time_nsec(now);
+
+  /* With short delays, nothing gets dropped. */
+  for (i = 0; i < 10; ++i)
+    add_ntor_onion_request();
+  for (i = 0; i < 10; ++i) {
+    now += 20 * msec;
+    monotime_coarse_set_mock_time_nsec(now);
+    circ = onion_next_task(&onionskin);
+    tt_assert(circ);
+    tt_assert(! TO_CIRCUIT(circ)->marked_for_close);
+    tor_free(onionskin);
+  }
+  status = onion_queue_get_codel_status_for_control();
+  tt_assert(strstr(status, "ntor queued=0 "));
+  tt_assert(strstr(status, "dropping=0 processed=10 dropped=0"));
+  tor_free(status);
+
+  /* Now build a standing queue, and take a request from it every 200 msec:
+   * every request has been waiting for longer than the 100 msec target. */
+  for (i = 0; i < 50; ++i) {
+    circ = add_ntor_onion_request();
+    if (!first)
+      first = circ;
+  }
+  now += 500 * msec;
+  monotime_coarse_set_mock_time_nsec(now);
+  /* The first request over the target starts the clock, but is not
+   * dropped. */
+  tt_ptr_op(first, OP_EQ, onion_next_task(&onionskin));
+  tor_free(onionskin);
+  tt_int_op(49, OP_EQ, onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR));
+
+  /* A full interval later, we drop the head of the queue, and enter the
+   * dropping state. */
+  now += 1000 * msec;
+  monotime_coarse_set_mock_time_nsec(now);
+  circ = onion_next_task(&onionskin);
+  tt_assert(circ);
+  tor_free(onionskin);
+  tt_int_op(47, OP_EQ, onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR));
+  status = onion_queue_get_codel_status_for_control();
+  tt_assert(strstr(status, "ntor queued=47 delay-msec=1500 dropping=1 "
+                   "processed=12 dropped=1"));
+  tor_free(status);
+
+  /* While the queue stays standing, we keep dropping, faster and faster. */
+  for (i = 0; i < 10; ++i) {
+    now += 1000 * msec;
+    monotime_coarse_set_mock_time_nsec(now);
+    tt_assert(onion_next_task(&onionskin));
+    tor_free(onionskin);
+  }
+  status = onion_queue_get_codel_status_for_control();
+  tt_assert(strstr(status, "ntor queued=5 delay-msec=11500 dropping=1 "
+                   "processed=22 dropped=33"));
+  tor_free(status);
+
+  /* Once the requests are fresh again, we stop dropping. */
+  while (onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR)) {
+    tt_assert(onion_next_task(&onionskin));
+    tor_free(onionskin);
+  }
+  for (i = 0; i < 10; ++i)
+    add_ntor_onion_request();
+  now += 10 * msec;
+  monotime_coarse_set_mock_time_nsec(now);
+  tt_assert(onion_next_task(&onionskin));
+  tor_free(onionskin);
+  tt_int_op(9, OP_EQ, onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR));
+  status = onion_queue_get_codel_status_for_control();
+  tt_assert(strstr(status, "dropping=0"));
+
+ done:
+  tor_free(status);
+  tor_free(onionskin);
+  clear_pending_onions();
+  circuit_free_all();
+  monotime_disable_test_mocking();
+}
+
 static crypto_cipher_t *crypto_rand_aes_cipher = NULL;
 
 // Mock replacement for crypto_rand: Generates bytes from a provided AES_CTR
@@ -820,6 +944,7 @@ static struct testcase_t test_array[] = {
   ENT(onion_handshake),
   { "bad_onion_handshake", test_bad_onion_handshake, 0, NULL, NULL },
   ENT(onion_queues),
+  FORK(onion_queue_codel),
   { "ntor_handshake", test_ntor_handshake, 0, NULL, NULL },
   { "fast_handshake", test_fast_handshake, 0, NULL, NULL },
   FORK(circuit_timeout),
@@ -4,13 +4,17 @@
 /* See LICENSE for licensing information */
 
 #define BUFFERS_PRIVATE
+#define BUFFERS_TLS_PRIVATE
 #define PROTO_HTTP_PRIVATE
 #include "core/or/or.h"
 #include "lib/buf/buffers.h"
 #include "lib/tls/buffers_tls.h"
 #include "lib/tls/tortls.h"
 #include "lib/compress/compress.h"
+#include "lib/crypt_ops/crypto_digest.h"
 #include "lib/crypt_ops/crypto_rand.h"
+#include "lib/net/buffers_net.h"
+#include "lib/time/compat_time.h"
 #include "core/proto/proto_http.h"
 #include "core/proto/proto_socks.h"
 #include "test/test.h"
@@ -295,6 +299,7 @@ test_buffer_pullup(void *arg)
   buf_free(buf);
   buf = NULL;
 
+  buf_shrink_freelists(1);
   tt_int_op(buf_get_total_allocation(), OP_EQ, 0);
  done:
   buf_free(buf);
@@ -367,6 +372,91 @@ test_buffer_copy(void *arg)
     buf_free(buf2);
 }
 
+/* Moving data between buffers should hand over whole chunks, and copy only
+ * the part of a chunk that we don't want all of. */
+static void
+test_buffer_move_zero_copy(void *arg)
+{
+  buf_t *buf_in = NULL, *buf_out = NULL;
+  chunk_t *first, *second;
+  char *mem = NULL, *out = NULL;
+  size_t flushlen, n_copied = 99, sz;
+  int i;
+  (void)arg;
+
+  mem = tor_malloc(20000);
+  for (i = 0; i < 20000; ++i)
+    mem[i] = (char)(i * 7);
+
+  buf_in = buf_new_with_capacity(4096);
+  buf_out = buf_new_with_capacity(4096);
+  for (i = 0; i < 20; ++i)
+    buf_add(buf_in, mem + i*1000, 1000);
+  first = buf_in->head;
+  second = first->next;
+  tt_ptr_op(second, OP_NE, NULL);
+  tt_ptr_op(second->next, OP_NE, NULL);
+
+  /* Move exactly the first chunk: nothing gets copied. */
+  flushlen = first->datalen;
+  sz = flushlen;
+  tt_int_op(buf_move_to_buf_counted(buf_out, buf_in, &flushlen, &n_copied),
+            OP_EQ, (int)sz);
+  tt_int_op(flushlen, OP_EQ, 0);
+  tt_int_op(n_copied, OP_EQ, 0);
+  tt_ptr_op(buf_out->head, OP_EQ, first);
+  tt_ptr_op(buf_out->tail, OP_EQ, first);
+  tt_ptr_op(buf_in->head, OP_EQ, second);
+  buf_assert_ok(buf_in);
+  buf_assert_ok(buf_out);
+
+  /* Move the second chunk and ten bytes of the third: only the ten bytes
+   * are copied. */
+  flushlen = second->datalen + 10;
+  sz = flushlen;
+  tt_int_op(buf_move_to_buf_counted(buf_out, buf_in, &flushlen, &n_copied),
+            OP_EQ, (int)sz);
+  tt_int_op(n_copied, OP_EQ, 10);
+  tt_ptr_op(first->next, OP_EQ, second);
+  tt_int_op(buf_datalen(buf_out), OP_EQ, sz + first->datalen);
+  buf_assert_ok(buf_in);
+  buf_assert_ok(buf_out);
+
+  /* Move everything that's left. */
+  flushlen = 100000;
+  sz = buf_datalen(buf_in);
+  tt_int_op(buf_move_to_buf_counted(buf_out, buf_in, &flushlen, &n_copied),
+            OP_EQ, (int)sz);
+  tt_int_op(n_copied, OP_EQ, 0);
+  tt_int_op(flushlen, OP_EQ, 100000 - sz);
+  tt_int_op(buf_datalen(buf_in), OP_EQ, 0);
+  tt_ptr_op(buf_in->head, OP_EQ, NULL);
+  tt_ptr_op(buf_in->tail, OP_EQ, NULL);
+  buf_assert_ok(buf_out);
+
+  out = buf_extract(buf_out, &sz);
+  tt_int_op(sz, OP_EQ, 20000);
+  tt_mem_op(out, OP_EQ, mem, 20000);
+  buf_clear(buf_out);
+
+  /* An empty chunk at the end of the output buffer doesn't get stranded in
+   * the middle of it. */
+  buf_add(buf_in, mem, 100);
+  buf_add_chunk_with_capacity(buf_out, 100, 1);
+  tt_int_op(buf_out->tail->datalen, OP_EQ, 0);
+  flushlen = 100;
+  tt_int_op(buf_move_to_buf(buf_out, buf_in, &flushlen), OP_EQ, 100);
+  tt_ptr_op(buf_out->head, OP_EQ, buf_out->tail);
+  tt_int_op(buf_out->head->datalen, OP_EQ, 100);
+  buf_assert_ok(buf_out);
+
+ done:
+  buf_free(buf_in);
+  buf_free(buf_out);
+  tor_free(mem);
+  tor_free(out);
+}
+
 static void
 test_buffer_allocation_tracking(void *arg)
 {
@@ -377,6 +467,7 @@ test_buffer_allocation_tracking(void *arg)
   (void)arg;
 
   crypto_rand(junk, 16384);
+  buf_shrink_freelists(1);
   tt_int_op(buf_get_total_allocation(), OP_EQ, 0);
 
   buf1 = buf_new();
@@ -400,13 +491,13 @@ test_buffer_allocation_tracking(void *arg)
   buf_get_bytes(buf1, junk, 4096); /* drop a 1k chunk... */
   tt_int_op(buf_allocation(buf1), OP_EQ, 3*4096); /* now 3 4k chunks */
 
-  tt_int_op(buf_get_total_allocation(), OP_EQ, 12288); /* that chunk was really
-                                                       freed. */
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 16384); /* that chunk went onto
+                                                       the freelist. */
 
   buf_add(buf2, junk, 4000);
   tt_int_op(buf_allocation(buf2), OP_EQ, 4096); /* another 4k chunk. */
   /*
-   * We bounce back up to 16384 by allocating a new chunk.
+   * We stay at 16384 by taking that chunk back off the freelist.
    */
   tt_int_op(buf_get_total_allocation(), OP_EQ, 16384);
   buf_add(buf2, junk, 4000);
@@ -424,9 +515,11 @@ test_buffer_allocation_tracking(void *arg)
   buf2 = NULL;
 
   tt_int_op(buf_get_total_allocation(), OP_LT, 4008000);
+  buf_shrink_freelists(1);
   tt_int_op(buf_get_total_allocation(), OP_EQ, buf_allocation(buf1));
   buf_free(buf1);
   buf1 = NULL;
+  buf_shrink_freelists(1);
   tt_int_op(buf_get_total_allocation(), OP_EQ, 0);
 
  done:
@@ -435,6 +528,228 @@ test_buffer_allocation_tracking(void *arg)
   tor_free(junk);
 }
 
+static void
+test_buffer_freelists(void *arg)
+{
+  buf_t *buf = NULL;
+  char tmp[4000];
+  size_t n_bytes;
+  uint64_t n_hits, n_misses, hits0, misses0;
+  int i;
+  (void)arg;
+
+  /* Start without any chunks left over from other tests. */
+  buf_shrink_freelists(1);
+  buf_get_freelist_stats(&n_bytes, &hits0, &misses0);
+  tt_u64_op(n_bytes, OP_EQ, 0);
+
+  crypto_rand(tmp, sizeof(tmp));
+  buf = buf_new();
+
+  buf_add(buf, tmp, sizeof(tmp));
+  buf_get_freelist_stats(&n_bytes, &n_hits, &n_misses);
+  tt_u64_op(n_bytes, OP_EQ, 0);
+  tt_u64_op(n_hits, OP_EQ, hits0);
+  tt_u64_op(n_misses, OP_EQ, misses0 + 1);
+
+  /* Draining the buffer puts its chunk on the freelist; we still count it
+   * as allocated. */
+  buf_drain(buf, sizeof(tmp));
+  tt_int_op(buf_allocation(buf), OP_EQ, 0);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 4096);
+  buf_get_freelist_stats(&n_bytes, &n_hits, &n_misses);
+  tt_u64_op(n_bytes, OP_EQ, 4096);
+
+  /* And the next chunk we need comes off the freelist. */
+  buf_add(buf, tmp, sizeof(tmp));
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 4096);
+  buf_get_freelist_stats(&n_bytes, &n_hits, &n_misses);
+  tt_u64_op(n_bytes, OP_EQ, 0);
+  tt_u64_op(n_hits, OP_EQ, hits0 + 1);
+  tt_u64_op(n_misses, OP_EQ, misses0 + 1);
+  tt_mem_op(buf->head->data, OP_EQ, tmp, sizeof(tmp));
+
+  /* Put 20 chunks on the freelist.  The first shrink keeps them, since we
+   * were using them; the second frees all those that were idle in between,
+   * except for a little slack. */
+  for (i = 1; i < 20; ++i)
+    buf_add(buf, tmp, sizeof(tmp));
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 20*4096);
+  buf_clear(buf);
+  tt_int_op(buf_shrink_freelists(0), OP_EQ, 0);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 20*4096);
+  tt_int_op(buf_shrink_freelists(0), OP_EQ, 12*4096);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 8*4096);
+
+  buf_free(buf);
+  tt_int_op(buf_shrink_freelists(1), OP_EQ, 8*4096);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 0);
+
+ done:
+  buf_free(buf);
+}
+
+/** Make a connected pair of nonblocking sockets in <b>s</b>.  Return 0 on
+ * success, -1 on failure. */
+static int
+make_nonblocking_socketpair(tor_socket_t s[2])
+{
+  if (tor_socketpair(AF_UNIX, SOCK_STREAM, 0, s) < 0)
+    return -1;
+  if (set_socket_nonblocking(s[0]) < 0 || set_socket_nonblocking(s[1]) < 0)
+    return -1;
+  return 0;
+}
+
+static void
+test_buffer_socket_rw(void *arg)
+{
+  tor_socket_t s[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  buf_t *out = NULL, *in = NULL;
+  char *data = tor_malloc(10000), *tmp = tor_malloc(10005);
+  size_t flushlen;
+  int i, r, eof = 0, err = 0;
+  (void)arg;
+
+  crypto_rand(data, 10000);
+  tt_int_op(make_nonblocking_socketpair(s), OP_EQ, 0);
+
+  out = buf_new();
+  in = buf_new();
+  for (i = 0; i < 10; ++i)
+    buf_add(out, data + i*1000, 1000);
+  tt_assert(out->head->next && out->head->next->next);
+
+  /* Flush all three chunks at once. */
+  flushlen = buf_datalen(out);
+  r = buf_flush_to_socket(out, s[0], flushlen, &flushlen);
+  tt_int_op(r, OP_EQ, 10000);
+  tt_int_op(flushlen, OP_EQ, 0);
+  tt_int_op(buf_datalen(out), OP_EQ, 0);
+
+  /* Read onto the end of a partly full chunk, and into a new one. */
+  buf_add(in, data, 3000);
+  buf_add(in, "Hello", 5);
+  buf_drain(in, 3000);
+  tt_int_op(buf_slack(in), OP_GT, 0);
+  tt_int_op(buf_slack(in), OP_LT, 10000);
+  r = buf_read_from_socket(in, s[1], 20000, &eof, &err);
+  tt_int_op(r, OP_EQ, 10000);
+  tt_int_op(eof, OP_EQ, 0);
+  buf_assert_ok(in);
+  tt_int_op(buf_datalen(in), OP_EQ, 10005);
+  tt_ptr_op(in->head->next, OP_NE, NULL);
+  buf_get_bytes(in, tmp, 10005);
+  tt_mem_op(tmp, OP_EQ, "Hello", 5);
+  tt_mem_op(tmp+5, OP_EQ, data, 10000);
+
+  /* Nothing more to read: we would block. */
+  r = buf_read_from_socket(in, s[1], 20000, &eof, &err);
+  tt_int_op(r, OP_EQ, 0);
+  tt_int_op(eof, OP_EQ, 0);
+  buf_assert_ok(in);
+
+  tor_close_socket(s[0]);
+  s[0] = TOR_INVALID_SOCKET;
+  r = buf_read_from_socket(in, s[1], 20000, &eof, &err);
+  tt_int_op(r, OP_EQ, 0);
+  tt_int_op(eof, OP_EQ, 1);
+  tt_int_op(buf_datalen(in), OP_EQ, 0);
+  buf_assert_ok(in);
+
+ done:
+  if (SOCKET_OK(s[0]))
+    tor_close_socket(s[0]);
+  if (SOCKET_OK(s[1]))
+    tor_close_socket(s[1]);
+  buf_free(out);
+  buf_free(in);
+  tor_free(data);
+  tor_free(tmp);
+}
+
+/** Throughput benchmark: move a large amount of data through a socketpair
+ * with buf_flush_to_socket() and buf_read_from_socket(), and make sure it
+ * all arrives intact.  Run with --notice to see the results. */
+static void
+test_buffer_bulk_transfer(void *arg)
+{
+  const size_t TOTAL = 32*1024*1024;
+  const size_t BLOCK = 256*1024;
+  tor_socket_t s[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  buf_t *out = NULL, *in = NULL;
+  char *block = tor_malloc(BLOCK), *tmp = tor_malloc(BLOCK);
+  crypto_digest_t *d_sent = crypto_digest256_new(DIGEST_SHA256);
+  crypto_digest_t *d_rcvd = crypto_digest256_new(DIGEST_SHA256);
+  char sent_digest[DIGEST256_LEN], rcvd_digest[DIGEST256_LEN];
+  size_t n_queued = 0, n_received = 0;
+  int n_flushes = 0, n_reads = 0, eof = 0, err = 0;
+  monotime_t start, end;
+  int64_t usec;
+  (void)arg;
+
+  crypto_rand(block, BLOCK);
+  tt_int_op(make_nonblocking_socketpair(s), OP_EQ, 0);
+  out = buf_new();
+  in = buf_new();
+
+  monotime_get(&start);
+  while (n_received < TOTAL) {
+    size_t flushlen;
+    int r;
+    if (n_queued < TOTAL && buf_datalen(out) < BLOCK) {
+      /* Queue the data a cell at a time, the way an OR connection would,
+       * so that it lands in default-sized chunks. */
+      size_t off;
+      for (off = 0; off < BLOCK; off += 512)
+        buf_add(out, block + off, 512);
+      crypto_digest_add_bytes(d_sent, block, BLOCK);
+      n_queued += BLOCK;
+    }
+    flushlen = buf_datalen(out);
+    if (flushlen) {
+      r = buf_flush_to_socket(out, s[0], flushlen, &flushlen);
+      tt_int_op(r, OP_GE, 0);
+      ++n_flushes;
+    }
+    r = buf_read_from_socket(in, s[1], BLOCK, &eof, &err);
+    tt_int_op(r, OP_GE, 0);
+    tt_int_op(eof, OP_EQ, 0);
+    ++n_reads;
+    n_received += r;
+    while (buf_datalen(in)) {
+      size_t n = MIN(buf_datalen(in), BLOCK);
+      buf_get_bytes(in, tmp, n);
+      crypto_digest_add_bytes(d_rcvd, tmp, n);
+    }
+  }
+  monotime_get(&end);
+
+  tt_int_op(n_received, OP_EQ, TOTAL);
+  crypto_digest_get_digest(d_sent, sent_digest, sizeof(sent_digest));
+  crypto_digest_get_digest(d_rcvd, rcvd_digest, sizeof(rcvd_digest));
+  tt_mem_op(sent_digest, OP_EQ, rcvd_digest, DIGEST256_LEN);
+
+  usec = monotime_diff_usec(&start, &end);
+  log_notice(LD_GENERAL, "Moved %d MB in %.1f msec (%.1f MB/sec), "
+             "with %d flushes and %d reads.",
+             (int)(TOTAL >> 20), usec / 1000.0,
+             usec ? (TOTAL >> 20) * 1e6 / usec : 0.0,
+             n_flushes, n_reads);
+
+ done:
+  if (SOCKET_OK(s[0]))
+    tor_close_socket(s[0]);
+  if (SOCKET_OK(s[1]))
+    tor_close_socket(s[1]);
+  buf_free(out);
+  buf_free(in);
+  tor_free(block);
+  tor_free(tmp);
+  crypto_digest_free(d_sent);
+  crypto_digest_free(d_rcvd);
+}
+
 static void
 test_buffer_time_tracking(void *arg)
 {
@@ -689,6 +1004,7 @@ test_buffers_tls_read_mocked(void *arg)
   n_remaining = 64*1024;
 
   MOCK(tor_tls_read, mock_tls_read);
+  buf_tls_set_record_batching(0);
 
   buf = buf_new();
 
@@ -698,13 +1014,90 @@ test_buffers_tls_read_mocked(void *arg)
   next_reply_val[0] = 5000;
   next_reply_val[1] = 5000;
   tt_int_op(6000, OP_EQ, buf_read_from_tls(buf, NULL, 6000));
+  buf_free(buf);
+
+  /* With record batching, a new chunk has room for a whole record, so
+   * these reads all land in the first chunk. */
+  buf_tls_set_record_batching(1);
+  buf = buf_new();
+  next_reply_val[0] = 1024;
+  tt_int_op(128, OP_EQ, buf_read_from_tls(buf, NULL, 128));
+  next_reply_val[0] = 5000;
+  next_reply_val[1] = 5000;
+  tt_int_op(5000, OP_EQ, buf_read_from_tls(buf, NULL, 6000));
+  next_reply_val[0] = 6000;
+  tt_int_op(6000, OP_EQ, buf_read_from_tls(buf, NULL, 6000));
+  tt_ptr_op(buf->head, OP_EQ, buf->tail);
+  tt_int_op(buf->head->memlen, OP_EQ, TLS_RECORD_MAX_PAYLOAD);
+  tt_int_op(buf_datalen(buf), OP_EQ, 11128);
 
  done:
+  buf_tls_set_record_batching(1);
   UNMOCK(tor_tls_read);
   tor_free(mem);
   buf_free(buf);
 }
 
+static void
+test_buffers_tls_coalesce(void *arg)
+{
+  buf_t *buf = NULL;
+  chunk_t *head;
+  char *mem = NULL, *out = NULL;
+  size_t head_len;
+  int i;
+  (void)arg;
+
+  tt_int_op(tls_records_for_write(0), OP_EQ, 0);
+  tt_int_op(tls_records_for_write(1), OP_EQ, 1);
+  tt_int_op(tls_records_for_write(TLS_RECORD_MAX_PAYLOAD), OP_EQ, 1);
+  tt_int_op(tls_records_for_write(TLS_RECORD_MAX_PAYLOAD+1), OP_EQ, 2);
+
+  mem = tor_malloc(40000);
+  crypto_rand(mem, 40000);
+  out = tor_malloc(40000);
+
+  buf = buf_new_with_capacity(4096);
+  tt_int_op(buf_tls_coalesce_head(buf, 1000), OP_EQ, 0);
+
+  for (i = 0; i < 40; ++i)
+    buf_add(buf, mem + i*1000, 1000);
+  head_len = buf->head->datalen;
+  tt_int_op(head_len, OP_LT, TLS_RECORD_MAX_PAYLOAD);
+
+  /* If we only want a little, the first chunk will do. */
+  tt_int_op(buf_tls_coalesce_head(buf, 1000), OP_EQ, 1000);
+  tt_int_op(buf->head->datalen, OP_EQ, head_len);
+
+  /* If we want a lot, we get one full record in the first chunk. */
+  tt_int_op(buf_tls_coalesce_head(buf, 40000), OP_EQ,
+            TLS_RECORD_MAX_PAYLOAD);
+  tt_int_op(buf->head->datalen, OP_GE, TLS_RECORD_MAX_PAYLOAD);
+  tt_int_op(buf_datalen(buf), OP_EQ, 40000);
+  buf_assert_ok(buf);
+
+  /* Once the first chunk holds a full record, we leave it alone. */
+  head = buf->head;
+  head_len = buf->head->datalen;
+  tt_int_op(buf_tls_coalesce_head(buf, 40000), OP_EQ,
+            MIN(head_len, 40000));
+  tt_ptr_op(buf->head, OP_EQ, head);
+  tt_int_op(buf->head->datalen, OP_EQ, head_len);
+
+  /* Near the end of the buffer, we get whatever is left. */
+  buf_get_bytes(buf, out, 35000);
+  tt_int_op(buf_tls_coalesce_head(buf, 40000), OP_EQ, 5000);
+  tt_int_op(buf->head->datalen, OP_EQ, 5000);
+  buf_assert_ok(buf);
+  buf_get_bytes(buf, out + 35000, 5000);
+  tt_mem_op(out, OP_EQ, mem, 40000);
+
+ done:
+  buf_free(buf);
+  tor_free(mem);
+  tor_free(out);
+}
+
 static void
 test_buffers_chunk_size(void *arg)
 {
@@ -799,12 +1192,17 @@ struct testcase_t buffer_tests[] = {
   { "basic", test_buffers_basic, TT_FORK, NULL, NULL },
   { "copy", test_buffer_copy, TT_FORK, NULL, NULL },
   { "pullup", test_buffer_pullup, TT_FORK, NULL, NULL },
+  { "move_zero_copy", test_buffer_move_zero_copy, 0, NULL, NULL },
   { "startswith", test_buffer_peek_startswith, 0, NULL, NULL },
   { "allocation_tracking", test_buffer_allocation_tracking, TT_FORK,
     NULL, NULL },
   { "time_tracking", test_buffer_time_tracking, TT_FORK, NULL, NULL },
+  { "freelists", test_buffer_freelists, TT_FORK, NULL, NULL },
+  { "socket_rw", test_buffer_socket_rw, TT_FORK, NULL, NULL },
+  { "bulk_transfer", test_buffer_bulk_transfer, TT_FORK, NULL, NULL },
   { "tls_read_mocked", test_buffers_tls_read_mocked, 0,
     NULL, NULL },
+  { "tls_coalesce", test_buffers_tls_coalesce, 0, NULL, NULL },
   { "chunk_size", test_buffers_chunk_size, 0, NULL, NULL },
   { "find_contentlen", test_buffers_find_contentlen, 0, NULL, NULL },
 
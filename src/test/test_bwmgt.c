@@ -7,12 +7,25 @@
  */
 
 #define TOKEN_BUCKET_PRIVATE
+#define CONFIG_PRIVATE
+#define CONNECTION_PRIVATE
 
 #include "core/or/or.h"
 #include "test/test.h"
 
+#include "app/config/config.h"
+#include "core/mainloop/connection.h"
+#include "core/or/orconn_event.h"
+#include "feature/dircommon/directory.h"
+#include "feature/hs/hs_ident.h"
+#include "feature/stats/rephist.h"
+#include "lib/encoding/confline.h"
 #include "lib/evloop/token_bucket.h"
 
+#include "feature/dircommon/dir_connection_st.h"
+#include "core/or/edge_connection_st.h"
+#include "core/or/or_connection_st.h"
+
 // an imaginary time, in timestamp units. Chosen so it will roll over.
 static const uint32_t START_TS = UINT32_MAX-10;
 static const int32_t KB = 1024;
@@ -220,6 +233,318 @@ test_bwmgt_token_buf_helpers(void *arg)
   ;
 }
 
+/* Test parsing the bandwidth class options. */
+static void
+test_bwmgt_class_limits_parse(void *arg)
+{
+  or_options_t *options = options_new();
+  uint32_t rates[N_BW_CLASSES], bursts[N_BW_CLASSES];
+  char *msg = NULL;
+  (void)arg;
+
+  /* Nothing set: no class has a limit. */
+  tt_int_op(connection_bucket_parse_class_limits(options, rates, bursts,
+                                                 &msg), OP_EQ, 0);
+  tt_uint_op(rates[BW_CLASS_EXIT], OP_EQ, 0);
+
+  /* The burst defaults to the rate; class names are case-insensitive. */
+  config_line_append(&options->BandwidthClassRate, "BandwidthClassRate",
+                     "exit 100 KBytes");
+  config_line_append(&options->BandwidthClassRate, "BandwidthClassRate",
+                     "Dir 50 KBytes");
+  config_line_append(&options->BandwidthClassBurst, "BandwidthClassBurst",
+                     "Dir 200 KBytes");
+  tt_int_op(connection_bucket_parse_class_limits(options, rates, bursts,
+                                                 &msg), OP_EQ, 0);
+  tt_uint_op(rates[BW_CLASS_EXIT], OP_EQ, 100*KB);
+  tt_uint_op(bursts[BW_CLASS_EXIT], OP_EQ, 100*KB);
+  tt_uint_op(rates[BW_CLASS_DIR], OP_EQ, 50*KB);
+  tt_uint_op(bursts[BW_CLASS_DIR], OP_EQ, 200*KB);
+  tt_uint_op(rates[BW_CLASS_RELAY_OR], OP_EQ, 0);
+
+  /* A class may only appear once. */
+  config_line_append(&options->BandwidthClassRate, "BandwidthClassRate",
+                     "Exit 1 MByte");
+  tt_int_op(connection_bucket_parse_class_limits(options, NULL, NULL,
+                                                 &msg), OP_EQ, -1);
+  tt_str_op(msg, OP_EQ, "BandwidthClassRate is set more than once for Exit.");
+  tor_free(msg);
+  config_free_lines(options->BandwidthClassRate);
+  options->BandwidthClassRate = NULL;
+
+  /* Unknown classes, bad amounts, and bursts without rates are errors. */
+  config_line_append(&options->BandwidthClassRate, "BandwidthClassRate",
+                     "Relay 1 MByte");
+  tt_int_op(connection_bucket_parse_class_limits(options, NULL, NULL,
+                                                 &msg), OP_EQ, -1);
+  tt_assert(!strcmpstart(msg, "BandwidthClassRate line \"Relay 1 MByte\" "
+                         "does not start with a bandwidth class."));
+  tor_free(msg);
+  config_free_lines(options->BandwidthClassRate);
+  options->BandwidthClassRate = NULL;
+
+  config_line_append(&options->BandwidthClassRate, "BandwidthClassRate",
+                     "Exit lots");
+  tt_int_op(connection_bucket_parse_class_limits(options, NULL, NULL,
+                                                 &msg), OP_EQ, -1);
+  tor_free(msg);
+  config_free_lines(options->BandwidthClassRate);
+  options->BandwidthClassRate = NULL;
+
+  tt_int_op(connection_bucket_parse_class_limits(options, NULL, NULL,
+                                                 &msg), OP_EQ, -1);
+  tt_str_op(msg, OP_EQ, "BandwidthClassBurst is set for Dir, but "
+            "BandwidthClassRate is not.");
+  tor_free(msg);
+
+  config_line_append(&options->BandwidthClassRate, "BandwidthClassRate",
+                     "Dir 1 MByte");
+  tt_int_op(connection_bucket_parse_class_limits(options, NULL, NULL,
+                                                 &msg), OP_EQ, -1);
+  tt_str_op(msg, OP_EQ, "BandwidthClassBurst for Dir must be at least equal "
+            "to its BandwidthClassRate.");
+
+ done:
+  tor_free(msg);
+  or_options_free(options);
+}
+
+/* Test which bandwidth class each kind of connection falls in. */
+static void
+test_bwmgt_class_of_conn(void *arg)
+{
+  const time_t now = 1000000;
+  or_connection_t *or_conn = or_connection_new(CONN_TYPE_OR, AF_INET);
+  edge_connection_t *exit_conn = edge_connection_new(CONN_TYPE_EXIT, AF_INET);
+  dir_connection_t *dir_conn = dir_connection_new(AF_INET);
+  connection_t *ap_conn = connection_new(CONN_TYPE_AP, AF_INET);
+  (void)arg;
+
+  /* An OR connection we haven't used for our own circuits is relayed. */
+  tt_int_op(connection_get_bw_class(TO_CONN(or_conn), now), OP_EQ,
+            BW_CLASS_RELAY_OR);
+  tt_int_op(connection_get_bw_class(TO_CONN(exit_conn), now), OP_EQ,
+            BW_CLASS_EXIT);
+  exit_conn->hs_ident = tor_malloc_zero(sizeof(hs_ident_edge_conn_t));
+  tt_int_op(connection_get_bw_class(TO_CONN(exit_conn), now), OP_EQ,
+            BW_CLASS_ONION_SERVICE);
+  /* A linked exit connection is a tunneled directory request. */
+  TO_CONN(exit_conn)->linked = 1;
+  tt_int_op(connection_get_bw_class(TO_CONN(exit_conn), now), OP_EQ,
+            BW_CLASS_DIR);
+  TO_CONN(exit_conn)->linked = 0;
+  /* Only directory connections that serve requests are in a class. */
+  TO_CONN(dir_conn)->purpose = DIR_PURPOSE_FETCH_CONSENSUS;
+  tt_int_op(connection_get_bw_class(TO_CONN(dir_conn), now), OP_EQ, -1);
+  TO_CONN(dir_conn)->purpose = DIR_PURPOSE_SERVER;
+  tt_int_op(connection_get_bw_class(TO_CONN(dir_conn), now), OP_EQ,
+            BW_CLASS_DIR);
+  tt_int_op(connection_get_bw_class(ap_conn, now), OP_EQ, -1);
+
+ done:
+  connection_free_minimal(TO_CONN(or_conn));
+  connection_free_minimal(TO_CONN(exit_conn));
+  connection_free_minimal(TO_CONN(dir_conn));
+  connection_free_minimal(ap_conn);
+}
+
+/* Check that an onion service's connection to a loopback target, and a
+ * tunneled directory request, are held to their class limits even though
+ * no other limit applies to them. */
+static void
+test_bwmgt_class_local_conns(void *arg)
+{
+  const time_t now = 1000000;
+  or_options_t *options = get_options_mutable();
+  edge_connection_t *hs_conn = edge_connection_new(CONN_TYPE_EXIT, AF_INET);
+  edge_connection_t *begindir_conn =
+    edge_connection_new(CONN_TYPE_EXIT, AF_INET);
+  connection_t *conn = TO_CONN(hs_conn);
+  (void)arg;
+
+  monotime_enable_test_mocking();
+  monotime_coarse_set_mock_time_nsec(UINT64_C(1000000000));
+  rep_hist_init();
+
+  options->CountPrivateBandwidth = 0;
+  options->BandwidthRate = options->BandwidthBurst = 1024*KB;
+  options->RelayBandwidthRate = options->RelayBandwidthBurst = 0;
+  config_line_append(&options->BandwidthClassRate, "BandwidthClassRate",
+                     "OnionService 10 KBytes");
+  connection_bucket_init();
+
+  hs_conn->hs_ident = tor_malloc_zero(sizeof(hs_ident_edge_conn_t));
+  tor_addr_from_ipv4h(&conn->addr, 0x7f000001);
+  tt_int_op(connection_get_bw_class(conn, now), OP_EQ,
+            BW_CLASS_ONION_SERVICE);
+
+  /* The onion service class bucket starts full... */
+  conn->outbuf_flushlen = 1 << 20;
+  tt_int_op(connection_bucket_write_limit(conn, now), OP_EQ, 10*KB);
+  tt_int_op(connection_bucket_read_limit(conn, now), OP_EQ, 10*KB);
+
+  /* ... and what the connection transfers comes out of it. */
+  connection_buckets_decrement(conn, now, 4*KB, 10*KB);
+  tt_int_op(connection_bucket_write_limit(conn, now), OP_EQ, 0);
+  tt_int_op(connection_bucket_read_limit(conn, now), OP_EQ, 6*KB);
+
+  /* Without a class limit, the local connection is unlimited again. */
+  config_free_lines(options->BandwidthClassRate);
+  options->BandwidthClassRate = NULL;
+  connection_bucket_adjust(options);
+  tt_int_op(connection_bucket_write_limit(conn, now), OP_EQ, 1 << 20);
+  tt_int_op(connection_bucket_read_limit(conn, now), OP_EQ, 1 << 14);
+
+  /* A linked connection for a tunneled directory request gets the Dir
+   * limit. */
+  config_line_append(&options->BandwidthClassRate, "BandwidthClassRate",
+                     "Dir 20 KBytes");
+  connection_bucket_adjust(options);
+  conn = TO_CONN(begindir_conn);
+  conn->linked = 1;
+  tt_int_op(connection_bucket_read_limit(conn, now), OP_EQ, 16*KB);
+  connection_buckets_decrement(conn, now, 15*KB, 0);
+  tt_int_op(connection_bucket_read_limit(conn, now), OP_EQ, 5*KB);
+
+ done:
+  connection_free_minimal(TO_CONN(hs_conn));
+  connection_free_minimal(TO_CONN(begindir_conn));
+  config_free_lines(options->BandwidthClassRate);
+  options->BandwidthClassRate = NULL;
+  rep_hist_free_all();
+  monotime_disable_test_mocking();
+}
+
+/** How many connections of each kind the simulation runs. */
+#define SIM_CONNS_PER_KIND 4
+/** How long the simulation runs, in msec. */
+#define SIM_MSEC 30000
+
+/** Return Jain's fairness index for the <b>n</b> values in <b>x</b>: 1.0
+ * when they are all equal, and 1/n when one of them has everything. */
+static double
+jain_fairness(const uint64_t *x, int n)
+{
+  double sum = 0, sum_sq = 0;
+  int i;
+  for (i = 0; i < n; ++i) {
+    sum += (double)x[i];
+    sum_sq += (double)x[i] * (double)x[i];
+  }
+  return sum_sq > 0 ? (sum * sum) / (n * sum_sq) : 1.0;
+}
+
+/* Simulate OR, exit, and directory connections that always have data to
+ * write, under a global limit, with separate limits on the exit and
+ * directory classes.  Check that we write at the global rate, that each
+ * limited class gets its rate, and that the connections in each class share
+ * it fairly. */
+static void
+test_bwmgt_class_simulation(void *arg)
+{
+  const int n_kinds = 3, n_conns = n_kinds * SIM_CONNS_PER_KIND;
+  const uint32_t global_rate = 1024*KB, exit_rate = 256*KB, dir_rate = 128*KB;
+  const time_t now = 1000000;
+  or_options_t *options = get_options_mutable();
+  connection_t *conns[3 * SIM_CONNS_PER_KIND];
+  uint64_t written[3 * SIM_CONNS_PER_KIND];
+  uint64_t class_total[3], total = 0;
+  uint32_t now_ts, n_steps, step;
+  double secs, expected;
+  int i, kind;
+  (void)arg;
+
+  memset(conns, 0, sizeof(conns));
+  memset(written, 0, sizeof(written));
+  memset(class_total, 0, sizeof(class_total));
+  monotime_enable_test_mocking();
+  monotime_coarse_set_mock_time_nsec(UINT64_C(1000000000));
+  rep_hist_init();
+
+  options->BandwidthRate = options->BandwidthBurst = global_rate;
+  options->RelayBandwidthRate = options->RelayBandwidthBurst = 0;
+  config_line_append(&options->BandwidthClassRate, "BandwidthClassRate",
+                     "Exit 256 KBytes");
+  config_line_append(&options->BandwidthClassRate, "BandwidthClassRate",
+                     "Dir 128 KBytes");
+  connection_bucket_init();
+  now_ts = monotime_coarse_get_stamp();
+
+  /* Kind 0 is relayed OR connections, kind 1 is exits, kind 2 is dir. */
+  for (i = 0; i < n_conns; ++i) {
+    kind = i % n_kinds;
+    if (kind == 0) {
+      or_connection_t *or_conn = or_connection_new(CONN_TYPE_OR, AF_INET);
+      token_bucket_rw_init(&or_conn->bucket, GB, GB, now_ts);
+      conns[i] = TO_CONN(or_conn);
+      conns[i]->state = OR_CONN_STATE_OPEN;
+    } else if (kind == 1) {
+      conns[i] = TO_CONN(edge_connection_new(CONN_TYPE_EXIT, AF_INET));
+    } else {
+      conns[i] = TO_CONN(dir_connection_new(AF_INET));
+      conns[i]->purpose = DIR_PURPOSE_SERVER;
+    }
+    tor_addr_from_ipv4h(&conns[i]->addr, 0x12000001 + i);
+  }
+
+  n_steps = (uint32_t)
+    (monotime_msec_to_approx_coarse_stamp_units(SIM_MSEC) / TICKS_PER_STEP);
+  for (step = 0; step < n_steps; ++step) {
+    now_ts += TICKS_PER_STEP;
+    /* Start with a different connection each time, so that nobody is
+     * always first in line. */
+    for (i = 0; i < n_conns; ++i) {
+      const int idx = (i + step) % n_conns;
+      connection_t *conn = conns[idx];
+      ssize_t n;
+      connection_bucket_refill_single(conn, now_ts);
+      conn->outbuf_flushlen = 1 << 20;
+      n = connection_bucket_write_limit(conn, now);
+      if (n > 0) {
+        connection_buckets_decrement(conn, now, 0, n);
+        written[idx] += n;
+      }
+    }
+  }
+
+  for (i = 0; i < n_conns; ++i) {
+    class_total[i % n_kinds] += written[i];
+    total += written[i];
+  }
+  secs = monotime_coarse_stamp_units_to_approx_msec(
+                          (uint64_t)n_steps * TICKS_PER_STEP) / 1000.0;
+
+  /* Each bucket starts full, so expect one burst on top of the rate. */
+  expected = global_rate * secs + global_rate;
+  tt_double_op(total, OP_GT, expected * 0.97);
+  tt_double_op(total, OP_LT, expected * 1.03);
+  expected = exit_rate * secs + exit_rate;
+  tt_double_op(class_total[1], OP_GT, expected * 0.97);
+  tt_double_op(class_total[1], OP_LT, expected * 1.03);
+  expected = dir_rate * secs + dir_rate;
+  tt_double_op(class_total[2], OP_GT, expected * 0.97);
+  tt_double_op(class_total[2], OP_LT, expected * 1.03);
+  /* The OR connections get whatever is left. */
+  tt_u64_op(class_total[0], OP_GT, class_total[1] + class_total[2]);
+
+  for (kind = 0; kind < n_kinds; ++kind) {
+    uint64_t per_conn[SIM_CONNS_PER_KIND];
+    for (i = 0; i < SIM_CONNS_PER_KIND; ++i)
+      per_conn[i] = written[i * n_kinds + kind];
+    tt_double_op(jain_fairness(per_conn, SIM_CONNS_PER_KIND), OP_GT, 0.99);
+  }
+
+ done:
+  for (i = 0; i < n_conns; ++i) {
+    if (conns[i])
+      connection_free_minimal(conns[i]);
+  }
+  config_free_lines(options->BandwidthClassRate);
+  options->BandwidthClassRate = NULL;
+  rep_hist_free_all();
+  monotime_disable_test_mocking();
+}
+
 #define BWMGT(name)                                          \
   { #name, test_bwmgt_ ## name , 0, NULL, NULL }
 
@@ -229,5 +554,9 @@ struct testcase_t bwmgt_tests[] = {
   BWMGT(token_buf_dec),
   BWMGT(token_buf_refill),
   BWMGT(token_buf_helpers),
+  BWMGT(class_limits_parse),
+  BWMGT(class_of_conn),
+  { "class_local_conns", test_bwmgt_class_local_conns, TT_FORK, NULL, NULL },
+  { "class_simulation", test_bwmgt_class_simulation, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
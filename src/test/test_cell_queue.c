@@ -1,15 +1,18 @@
 /* Copyright (c) 2013-2019, The Tor Project, Inc. */
 /* See LICENSE for licensing information */
 
+#define CELL_POOL_PRIVATE
 #define CIRCUITLIST_PRIVATE
 #define RELAY_PRIVATE
 #include "core/or/or.h"
+#include "core/or/cell_pool.h"
 #include "core/or/circuitlist.h"
 #include "core/or/relay.h"
 #include "test/test.h"
 
 #include "core/or/cell_st.h"
 #include "core/or/cell_queue_st.h"
+#include "core/or/destroy_cell_queue_st.h"
 #include "core/or/or_circuit_st.h"
 #include "core/or/origin_circuit_st.h"
 
@@ -139,9 +142,139 @@ test_circuit_n_cells(void *arg)
   circuit_free_(TO_CIRCUIT(origin_c));
 }
 
+static void
+test_cell_pool(void *arg)
+{
+  cell_pool_t *pool = cell_pool_new("Test", 100);
+  const int N = 1000;
+  char **items = tor_calloc(N, sizeof(char *));
+  size_t cost, n_slabs;
+  int i;
+  (void)arg;
+
+  cost = cell_pool_item_cost(pool);
+  tt_u64_op(cost, OP_GE, 100);
+  tt_u64_op(cost, OP_LT, 128);
+  tt_u64_op(cell_pool_get_allocation(pool), OP_EQ, 0);
+
+  for (i = 0; i < N; ++i) {
+    items[i] = cell_pool_get(pool);
+    tt_assert(tor_mem_is_zero(items[i], 100));
+    memset(items[i], i & 0xff, 100);
+  }
+  cell_pool_assert_ok(pool);
+  for (i = 0; i < N; ++i) {
+    tt_int_op(items[i][0], OP_EQ, (char)(i & 0xff));
+    tt_int_op(items[i][99], OP_EQ, (char)(i & 0xff));
+  }
+  n_slabs = cell_pool_get_n_slabs(pool);
+  /* The items should be packed into as few slabs as will hold them. */
+  tt_u64_op(n_slabs, OP_GE, (N * cost + CELL_POOL_SLAB_SIZE - 1) /
+            CELL_POOL_SLAB_SIZE);
+  tt_u64_op(n_slabs, OP_LE, (N * cost + CELL_POOL_SLAB_SIZE - 1) /
+            CELL_POOL_SLAB_SIZE + 1);
+  tt_u64_op(cell_pool_get_n_used(pool), OP_EQ, N);
+  tt_u64_op(cell_pool_get_allocation(pool), OP_EQ, N * cost);
+
+  /* Free every other item: no slab becomes empty, and the free space is
+   * reused before we allocate anything new. */
+  for (i = 0; i < N; i += 2) {
+    cell_pool_release(pool, items[i]);
+    items[i] = NULL;
+  }
+  cell_pool_assert_ok(pool);
+  tt_u64_op(cell_pool_get_n_used(pool), OP_EQ, N/2);
+  tt_u64_op(cell_pool_get_allocation(pool), OP_EQ, (N/2) * cost);
+  tt_u64_op(cell_pool_get_n_empty_slabs(pool), OP_EQ, 0);
+  for (i = 0; i < N; i += 2) {
+    items[i] = cell_pool_get(pool);
+    tt_assert(tor_mem_is_zero(items[i], 100));
+  }
+  cell_pool_assert_ok(pool);
+  tt_u64_op(cell_pool_get_n_slabs(pool), OP_EQ, n_slabs);
+
+  /* Free everything, keeping two empty slabs around. */
+  cell_pool_set_max_idle(pool, 2 * CELL_POOL_SLAB_SIZE);
+  for (i = 0; i < N; ++i) {
+    cell_pool_release(pool, items[i]);
+    items[i] = NULL;
+  }
+  cell_pool_assert_ok(pool);
+  tt_u64_op(cell_pool_get_n_used(pool), OP_EQ, 0);
+  tt_u64_op(cell_pool_get_n_slabs(pool), OP_EQ, 2);
+  tt_u64_op(cell_pool_get_n_empty_slabs(pool), OP_EQ, 2);
+  tt_u64_op(cell_pool_get_allocation(pool), OP_EQ, 2 * CELL_POOL_SLAB_SIZE);
+
+  /* An empty slab gets reused. */
+  items[0] = cell_pool_get(pool);
+  tt_u64_op(cell_pool_get_n_slabs(pool), OP_EQ, 2);
+  tt_u64_op(cell_pool_get_n_empty_slabs(pool), OP_EQ, 1);
+  cell_pool_release(pool, items[0]);
+  items[0] = NULL;
+
+  cell_pool_trim(pool, 0);
+  cell_pool_assert_ok(pool);
+  tt_u64_op(cell_pool_get_n_slabs(pool), OP_EQ, 0);
+  tt_u64_op(cell_pool_get_allocation(pool), OP_EQ, 0);
+
+ done:
+  for (i = 0; i < N; ++i) {
+    if (items[i])
+      cell_pool_release(pool, items[i]);
+  }
+  tor_free(items);
+  cell_pool_free(pool);
+}
+
+static void
+test_cell_queue_allocation(void *arg)
+{
+  destroy_cell_queue_t dq;
+  cell_queue_t cq;
+  packed_cell_t *pc;
+  size_t base;
+  int i;
+  (void)arg;
+
+  cell_queue_init(&cq);
+  destroy_cell_queue_init(&dq);
+
+  base = cell_queues_get_total_allocation();
+  for (i = 0; i < 10; ++i)
+    cell_queue_append(&cq, packed_cell_new());
+  tt_u64_op(cell_queues_get_total_allocation(), OP_EQ,
+            base + 10 * packed_cell_mem_cost());
+
+  /* Destroy cells count too, and turning one into a packed cell frees it. */
+  destroy_cell_queue_append(&dq, 7, 1);
+  tt_u64_op(cell_queues_get_total_allocation(), OP_GT,
+            base + 10 * packed_cell_mem_cost());
+  destroy_cell_queue_clear(&dq);
+  /* (The destroy cell's slab is empty now, but we keep it for reuse.) */
+  tt_u64_op(cell_queues_get_total_allocation(), OP_EQ,
+            base + 10 * packed_cell_mem_cost() + CELL_POOL_SLAB_SIZE);
+  base += CELL_POOL_SLAB_SIZE;
+
+  pc = cell_queue_pop(&cq);
+  packed_cell_free(pc);
+  tt_u64_op(cell_queues_get_total_allocation(), OP_EQ,
+            base + 9 * packed_cell_mem_cost());
+  cell_queue_clear(&cq);
+
+  /* The slab we used is now empty, but we are keeping it for reuse. */
+  tt_u64_op(cell_queues_get_total_allocation(), OP_GE, base);
+  dump_cell_pool_usage(LOG_INFO);
+
+ done:
+  cell_queue_clear(&cq);
+  destroy_cell_queue_clear(&dq);
+}
+
 struct testcase_t cell_queue_tests[] = {
   { "basic", test_cq_manip, TT_FORK, NULL, NULL, },
   { "circ_n_cells", test_circuit_n_cells, TT_FORK, NULL, NULL },
+  { "pool", test_cell_pool, 0, NULL, NULL },
+  { "allocation", test_cell_queue_allocation, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
@@ -301,6 +301,7 @@ free_fake_channel(channel_t *chan)
 
   if (chan->cmux)
     circuitmux_free(chan->cmux);
+  circid_map_clear(&chan->circid_map);
 
   tor_free(chan);
 }
@@ -669,7 +670,86 @@ test_channel_outbound_cell(void *arg)
   if (circ) {
     circuit_free_(TO_CIRCUIT(circ));
   }
-  tor_free(p_cell);
+  packed_cell_free(p_cell);
+  channel_free_all();
+  UNMOCK(scheduler_release_channel);
+  monotime_disable_test_mocking();
+}
+
+/* Test that when we flush many cells at once, so that they are written in
+ * runs of at most CELL_WRITE_BATCH_MAX, every one of them still reaches the
+ * lower layer and is counted, and that a run written to a closing channel
+ * is discarded. */
+static void
+test_channel_outbound_cell_batch(void *arg)
+{
+  channel_t *chan = NULL;
+  origin_circuit_t *circ = NULL;
+  cell_queue_t *queue, run;
+  ssize_t flushed;
+  int i;
+
+  (void) arg;
+
+  monotime_enable_test_mocking();
+  monotime_set_mock_time_nsec(UINT64_C(1000000000) * 12345);
+  cmux_ewma_set_options(NULL,NULL);
+  MOCK(scheduler_release_channel, scheduler_release_channel_mock);
+
+  test_chan_accept_cells = 1;
+  test_cells_written = 0;
+  cell_queue_init(&run);
+
+  circ = origin_circuit_new();
+  tt_assert(circ);
+  TO_CIRCUIT(circ)->purpose = CIRCUIT_PURPOSE_C_GENERAL;
+  queue = &TO_CIRCUIT(circ)->n_chan_cells;
+  chan = new_fake_channel();
+  tt_assert(chan);
+  chan->state = CHANNEL_STATE_OPENING;
+  channel_change_state_open(chan);
+  channel_mark_outgoing(chan);
+  channel_register(chan);
+  circuit_set_n_circid_chan(TO_CIRCUIT(circ), 42, chan);
+
+  for (i = 0; i < CELL_WRITE_BATCH_MAX + 8 + 3; ++i)
+    cell_queue_append(queue, packed_cell_new());
+  update_circuit_on_cmux(TO_CIRCUIT(circ), CELL_DIRECTION_OUT);
+  tt_int_op(circuitmux_num_cells(chan->cmux), OP_EQ,
+            CELL_WRITE_BATCH_MAX + 8 + 3);
+
+  /* A full batch, then the leftover. */
+  flushed = channel_flush_some_cells(chan, CELL_WRITE_BATCH_MAX + 8);
+  tt_i64_op(flushed, OP_EQ, CELL_WRITE_BATCH_MAX + 8);
+  tt_int_op(test_cells_written, OP_EQ, CELL_WRITE_BATCH_MAX + 8);
+  tt_int_op(circuitmux_num_cells(chan->cmux), OP_EQ, 3);
+  tt_int_op(queue->n, OP_EQ, 3);
+  tt_u64_op(chan->n_cells_xmitted, OP_EQ, CELL_WRITE_BATCH_MAX + 8);
+  tt_u64_op(chan->n_bytes_xmitted, OP_EQ,
+            get_cell_network_size(0) * (CELL_WRITE_BATCH_MAX + 8));
+
+  flushed = channel_flush_some_cells(chan, 10);
+  tt_i64_op(flushed, OP_EQ, 3);
+  tt_int_op(test_cells_written, OP_EQ, CELL_WRITE_BATCH_MAX + 8 + 3);
+  tt_int_op(circuitmux_num_cells(chan->cmux), OP_EQ, 0);
+  tt_int_op(channel_more_to_flush(chan), OP_EQ, 0);
+  tt_u64_op(chan->n_cells_xmitted, OP_EQ, CELL_WRITE_BATCH_MAX + 8 + 3);
+
+  /* On a closing channel, a run of cells is freed without being written. */
+  for (i = 0; i < 3; ++i)
+    cell_queue_append(&run, packed_cell_new());
+  chan->state = CHANNEL_STATE_CLOSING;
+  tt_int_op(channel_write_packed_cells(chan, &run), OP_LT, 0);
+  chan->state = CHANNEL_STATE_OPEN;
+  tt_int_op(run.n, OP_EQ, 0);
+  tt_int_op(test_cells_written, OP_EQ, CELL_WRITE_BATCH_MAX + 8 + 3);
+  tt_u64_op(chan->n_cells_xmitted, OP_EQ, CELL_WRITE_BATCH_MAX + 8 + 3);
+
+ done:
+  cell_queue_clear(&run);
+  if (circ) {
+    circuit_free_(TO_CIRCUIT(circ));
+  }
   channel_free_all();
   UNMOCK(scheduler_release_channel);
   monotime_disable_test_mocking();
@@ -1549,6 +1629,8 @@ struct testcase_t channel_tests[] = {
     NULL, NULL },
   { "outbound_cell", test_channel_outbound_cell, TT_FORK,
     NULL, NULL },
+  { "outbound_cell_batch", test_channel_outbound_cell_batch, TT_FORK,
+    NULL, NULL },
   { "id_map", test_channel_id_map, TT_FORK,
     NULL, NULL },
   { "lifecycle", test_channel_lifecycle, TT_FORK,
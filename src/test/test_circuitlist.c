@@ -4,9 +4,11 @@
 #define TOR_CHANNEL_INTERNAL_
 #define CIRCUITBUILD_PRIVATE
 #define CIRCUITLIST_PRIVATE
+#define CIRCID_MAP_PRIVATE
 #define HS_CIRCUITMAP_PRIVATE
 #include "core/or/or.h"
 #include "core/or/channel.h"
+#include "core/or/circid_map.h"
 #include "core/or/circuitbuild.h"
 #include "core/or/circuitlist.h"
 #include "core/or/circuitmux_ewma.h"
@@ -464,8 +466,94 @@ test_hs_circuitmap_isolation(void *arg)
   circuit_free_(TO_CIRCUIT(circ4));
 }
 
+/** Test the open-addressing map from circuit ID to circuit: lookups,
+ * growth, removal from the middle of probe runs, and shrinking. */
+static void
+test_circid_map(void *arg)
+{
+  circid_map_t map;
+  circid_map_ent_t *ent, removed;
+  const unsigned n = 5000;
+  circid_t *ids = tor_calloc(n, sizeof(circid_t));
+  unsigned i;
+  char *fake_circs = tor_malloc(n);
+
+  (void)arg;
+  memset(&map, 0, sizeof(map));
+
+  /* An empty map holds nothing and has no storage. */
+  tt_ptr_op(circid_map_find(&map, 7), OP_EQ, NULL);
+  tt_int_op(circid_map_remove(&map, 7, NULL), OP_EQ, 0);
+  tt_ptr_op(map.slots, OP_EQ, NULL);
+
+  /* Pick distinct IDs, spread over the whole range, including 0. */
+  for (i = 0; i < n; ++i)
+    ids[i] = (circid_t)(i * 2654435761u);
+
+  for (i = 0; i < n; ++i) {
+    ent = circid_map_find_or_insert(&map, ids[i]);
+    tt_assert(ent);
+    tt_ptr_op(ent->circuit, OP_EQ, NULL);
+    ent->circuit = (circuit_t *)(fake_circs + i);
+  }
+  circid_map_assert_ok(&map);
+  tt_uint_op(circid_map_size(&map), OP_EQ, n);
+  tt_uint_op(map.n_slots, OP_GE, n);
+
+  /* Looking an ID up twice takes the cached path the second time. */
+  for (i = 0; i < n; ++i) {
+    ent = circid_map_find(&map, ids[i]);
+    tt_assert(ent);
+    tt_ptr_op(ent->circuit, OP_EQ, fake_circs + i);
+    tt_ptr_op(circid_map_find(&map, ids[i]), OP_EQ, ent);
+  }
+  /* Inserting an ID that is there already gives back the same entry. */
+  ent = circid_map_find_or_insert(&map, ids[3]);
+  tt_ptr_op(ent->circuit, OP_EQ, fake_circs + 3);
+  tt_uint_op(circid_map_size(&map), OP_EQ, n);
+  tt_ptr_op(circid_map_find(&map, 2), OP_EQ, NULL);
+
+  /* Remove every other ID; the rest must stay reachable. */
+  for (i = 0; i < n; i += 2) {
+    tt_int_op(circid_map_remove(&map, ids[i], &removed), OP_EQ, 1);
+    tt_uint_op(removed.circ_id, OP_EQ, ids[i]);
+    tt_ptr_op(removed.circuit, OP_EQ, fake_circs + i);
+    tt_int_op(circid_map_remove(&map, ids[i], NULL), OP_EQ, 0);
+  }
+  circid_map_assert_ok(&map);
+  for (i = 0; i < n; ++i) {
+    ent = circid_map_find(&map, ids[i]);
+    if (i % 2) {
+      tt_assert(ent);
+      tt_ptr_op(ent->circuit, OP_EQ, fake_circs + i);
+    } else {
+      tt_ptr_op(ent, OP_EQ, NULL);
+    }
+  }
+
+  /* Remove nearly everything: the map should shrink as it empties. */
+  for (i = 1; i < n - 2; i += 2)
+    tt_int_op(circid_map_remove(&map, ids[i], NULL), OP_EQ, 1);
+  circid_map_assert_ok(&map);
+  tt_uint_op(circid_map_size(&map), OP_EQ, 1);
+  tt_uint_op(map.n_slots, OP_EQ, CIRCID_MAP_MIN_SLOTS);
+  tt_ptr_op(circid_map_find(&map, ids[n-1])->circuit, OP_EQ,
+            fake_circs + n - 1);
+
+  /* Removing the last entry releases the storage. */
+  tt_int_op(circid_map_remove(&map, ids[n-1], NULL), OP_EQ, 1);
+  tt_uint_op(circid_map_size(&map), OP_EQ, 0);
+  tt_ptr_op(map.slots, OP_EQ, NULL);
+
+ done:
+  circid_map_clear(&map);
+  tor_free(ids);
+  tor_free(fake_circs);
+}
+
 struct testcase_t circuitlist_tests[] = {
   { "maps", test_clist_maps, TT_FORK, NULL, NULL },
+  { "circid_map", test_circid_map, TT_FORK, NULL, NULL },
   { "rend_token_maps", test_rend_token_maps, TT_FORK, NULL, NULL },
   { "pick_circid", test_pick_circid, TT_FORK, NULL, NULL },
   { "hs_circuitmap_isolation", test_hs_circuitmap_isolation,
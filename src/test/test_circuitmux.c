@@ -11,8 +11,10 @@
 #include "core/or/circuitmux_ewma.h"
 #include "core/or/relay.h"
 #include "core/or/scheduler.h"
+#include "lib/time/tvdiff.h"
 #include "test/test.h"
 
+#include "core/or/circuit_st.h"
 #include "core/or/destroy_cell_queue_st.h"
 
 #include <math.h>
@@ -81,7 +83,7 @@ test_cmux_destroy_cell_queue(void *arg)
   circuitmux_free(cmux);
   channel_free(ch);
   packed_cell_free(pc);
-  tor_free(dc);
+  destroy_cell_free(dc);
 }
 
 static void
@@ -125,9 +127,317 @@ test_cmux_compute_ticks(void *arg)
   ;
 }
 
+/** Test that the calendar queue EWMA policy picks circuits in order of
+ * their cell counts, round-robin among circuits with equal counts, and
+ * that this survives a rebase. */
+static void
+test_cmux_ewma_calendar_order(void *arg)
+{
+  const int64_t NS_PER_S = 1000 * 1000 * 1000;
+  const int64_t START_NS = UINT64_C(1217709000)*NS_PER_S;
+  const circuitmux_policy_t *pol = &ewma_calendar_policy;
+  circuitmux_t *cmux = NULL;
+  circuitmux_policy_data_t *pol_data = NULL;
+  circuitmux_policy_circ_data_t *cdata[3] = { NULL, NULL, NULL };
+  circuit_t *circs = NULL;
+  int i;
+  (void)arg;
+
+  circuitmux_ewma_free_all();
+  monotime_enable_test_mocking();
+  monotime_coarse_set_mock_time_nsec(START_NS);
+  cmux_ewma_set_options(NULL, NULL);
+
+  cmux = circuitmux_alloc();
+  circs = tor_calloc(3, sizeof(circuit_t));
+  pol_data = pol->alloc_cmux_data(cmux);
+  tt_ptr_op(pol->pick_active_circuit(cmux, pol_data), OP_EQ, NULL);
+  for (i = 0; i < 3; ++i) {
+    cdata[i] = pol->alloc_circ_data(cmux, pol_data, &circs[i],
+                                    CELL_DIRECTION_OUT, 0);
+    pol->notify_circ_active(cmux, pol_data, &circs[i], cdata[i]);
+  }
+
+  /* Equal counts: first come, first served, and sending moves a circuit
+   * behind the others. */
+  tt_ptr_op(pol->pick_active_circuit(cmux, pol_data), OP_EQ, &circs[0]);
+  pol->notify_xmit_cells(cmux, pol_data, &circs[0], cdata[0], 10);
+  tt_ptr_op(pol->pick_active_circuit(cmux, pol_data), OP_EQ, &circs[1]);
+  pol->notify_xmit_cells(cmux, pol_data, &circs[1], cdata[1], 100);
+  tt_ptr_op(pol->pick_active_circuit(cmux, pol_data), OP_EQ, &circs[2]);
+  pol->notify_xmit_cells(cmux, pol_data, &circs[2], cdata[2], 1);
+  tt_ptr_op(pol->pick_active_circuit(cmux, pol_data), OP_EQ, &circs[2]);
+
+  /* Deactivating the lowest circuit exposes the next lowest. */
+  pol->notify_circ_inactive(cmux, pol_data, &circs[2], cdata[2]);
+  tt_ptr_op(pol->pick_active_circuit(cmux, pol_data), OP_EQ, &circs[0]);
+
+  /* A long time later, a cell is worth so much relative to the base tick
+   * that sending forces a rebase.  By then the old counts have decayed to
+   * nothing, so only the new cells matter. */
+  monotime_coarse_set_mock_time_nsec(START_NS + NS_PER_S * 100000);
+  pol->notify_xmit_cells(cmux, pol_data, &circs[0], cdata[0], 1);
+  tt_ptr_op(pol->pick_active_circuit(cmux, pol_data), OP_EQ, &circs[1]);
+  pol->notify_xmit_cells(cmux, pol_data, &circs[1], cdata[1], 5);
+  tt_ptr_op(pol->pick_active_circuit(cmux, pol_data), OP_EQ, &circs[0]);
+
+  /* Reactivating a circuit scales its old count down to nothing. */
+  pol->notify_circ_active(cmux, pol_data, &circs[2], cdata[2]);
+  tt_ptr_op(pol->pick_active_circuit(cmux, pol_data), OP_EQ, &circs[2]);
+
+ done:
+  for (i = 0; i < 3; ++i) {
+    if (cdata[i])
+      pol->free_circ_data(cmux, pol_data, &circs[i], cdata[i]);
+  }
+  if (pol_data)
+    pol->free_cmux_data(cmux, pol_data);
+  circuitmux_free(cmux);
+  tor_free(circs);
+  monotime_disable_test_mocking();
+}
+
+/** Test that a cmux using the heap EWMA policy and one using the calendar
+ * queue EWMA policy can be compared, as happens after the policy for new
+ * channels changes. */
+static void
+test_cmux_ewma_compare_mixed(void *arg)
+{
+  const int64_t NS_PER_S = 1000 * 1000 * 1000;
+  const int64_t START_NS = UINT64_C(1217709000)*NS_PER_S;
+  const circuitmux_policy_t *pols[2] = { &ewma_policy, &ewma_calendar_policy };
+  circuitmux_t *cmux[2] = { NULL, NULL };
+  circuitmux_policy_data_t *pol_data[2] = { NULL, NULL };
+  circuitmux_policy_circ_data_t *cdata[2] = { NULL, NULL };
+  circuit_t *circs = NULL;
+  int i;
+  (void)arg;
+
+  circuitmux_ewma_free_all();
+  monotime_enable_test_mocking();
+  monotime_coarse_set_mock_time_nsec(START_NS);
+  cmux_ewma_set_options(NULL, NULL);
+
+  /* Both policies share one comparator, so that circuitmux_compare_muxes()
+   * will use it for a mixed pair. */
+  tt_ptr_op(ewma_policy.cmp_cmux, OP_EQ, ewma_calendar_policy.cmp_cmux);
+
+  circs = tor_calloc(2, sizeof(circuit_t));
+  for (i = 0; i < 2; ++i) {
+    cmux[i] = circuitmux_alloc();
+    pol_data[i] = pols[i]->alloc_cmux_data(cmux[i]);
+  }
+  /* Nothing active anywhere: no preference. */
+  tt_int_op(ewma_policy.cmp_cmux(cmux[0], pol_data[0],
+                                 cmux[1], pol_data[1]), OP_EQ, 0);
+
+  for (i = 0; i < 2; ++i) {
+    cdata[i] = pols[i]->alloc_circ_data(cmux[i], pol_data[i], &circs[i],
+                                        CELL_DIRECTION_OUT, 0);
+    pols[i]->notify_circ_active(cmux[i], pol_data[i], &circs[i], cdata[i]);
+  }
+
+  /* The heap rescales its counts to the tick of each send, but the
+   * calendar queue keeps them relative to its base tick.  Fewer cells sent
+   * at the same time must still compare as less. */
+  monotime_coarse_set_mock_time_nsec(START_NS + NS_PER_S * 25);
+  pols[0]->notify_xmit_cells(cmux[0], pol_data[0], &circs[0], cdata[0], 5);
+  pols[1]->notify_xmit_cells(cmux[1], pol_data[1], &circs[1], cdata[1], 6);
+  tt_int_op(ewma_policy.cmp_cmux(cmux[0], pol_data[0],
+                                 cmux[1], pol_data[1]), OP_LT, 0);
+  tt_int_op(ewma_calendar_policy.cmp_cmux(cmux[1], pol_data[1],
+                                          cmux[0], pol_data[0]), OP_GT, 0);
+
+  /* A few ticks later, a couple more cells on the heap's circuit make it
+   * the less preferred one. */
+  monotime_coarse_set_mock_time_nsec(START_NS + NS_PER_S * 55);
+  pols[0]->notify_xmit_cells(cmux[0], pol_data[0], &circs[0], cdata[0], 2);
+  tt_int_op(ewma_policy.cmp_cmux(cmux[0], pol_data[0],
+                                 cmux[1], pol_data[1]), OP_GT, 0);
+  tt_int_op(ewma_calendar_policy.cmp_cmux(cmux[1], pol_data[1],
+                                          cmux[0], pol_data[0]), OP_LT, 0);
+
+ done:
+  for (i = 0; i < 2; ++i) {
+    if (cdata[i])
+      pols[i]->free_circ_data(cmux[i], pol_data[i], &circs[i], cdata[i]);
+    if (pol_data[i])
+      pols[i]->free_cmux_data(cmux[i], pol_data[i]);
+    circuitmux_free(cmux[i]);
+  }
+  tor_free(circs);
+  monotime_disable_test_mocking();
+}
+
+/** Number of circuits that always have cells to send, in
+ * test_cmux_ewma_simulation(). */
+#define SIM_N_BULK 50
+/** Number of circuits that occasionally have one cell to send. */
+#define SIM_N_INTERACTIVE 50
+/** Each interactive circuit gets a cell once every this many steps. */
+#define SIM_INTERACTIVE_PERIOD 500
+/** Number of cells to send in the simulation. */
+#define SIM_N_STEPS 200000
+/** Simulated time between two cells, in msec.  This is fast enough that
+ * the simulation crosses many EWMA ticks, and forces the calendar queue to
+ * rebase. */
+#define SIM_MSEC_PER_STEP 5
+
+/** Results of one run of simulate_ewma_policy(). */
+typedef struct ewma_sim_result_t {
+  /** Nanoseconds of real time per pick-and-send. */
+  double ns_per_pick;
+  /** Jain's fairness index over the cells sent by the bulk circuits. */
+  double bulk_fairness;
+  /** Mean and max number of steps that an interactive cell waited. */
+  double mean_interactive_delay;
+  int max_interactive_delay;
+} ewma_sim_result_t;
+
+/** Drive <b>pol</b> through a deterministic mix of bulk and interactive
+ * circuits, calling its methods directly the way circuitmux.c does, and
+ * record how it did in *<b>result_out</b>.  The simulated clock starts at
+ * <b>start_ns</b>, which must not be before the time of any earlier run. */
+static void
+simulate_ewma_policy(const circuitmux_policy_t *pol, int64_t start_ns,
+                     ewma_sim_result_t *result_out)
+{
+  const int64_t NS_PER_MS = 1000 * 1000;
+  const int n_circs = SIM_N_BULK + SIM_N_INTERACTIVE;
+  circuitmux_t *cmux = circuitmux_alloc();
+  circuitmux_policy_data_t *pol_data = pol->alloc_cmux_data(cmux);
+  circuitmux_policy_circ_data_t **cdata;
+  circuit_t *circs;
+  int *active_since, *n_sent;
+  uint64_t n_bulk_sent = 0, n_bulk_sent_sq = 0;
+  uint64_t total_delay = 0, n_interactive_sent = 0;
+  struct timeval start, end;
+  int step, i;
+
+  memset(result_out, 0, sizeof(*result_out));
+  circs = tor_calloc(n_circs, sizeof(circuit_t));
+  cdata = tor_calloc(n_circs, sizeof(*cdata));
+  active_since = tor_calloc(n_circs, sizeof(int));
+  n_sent = tor_calloc(n_circs, sizeof(int));
+  for (i = 0; i < n_circs; ++i) {
+    cdata[i] = pol->alloc_circ_data(cmux, pol_data, &circs[i],
+                                    CELL_DIRECTION_OUT, 0);
+    active_since[i] = -1;
+  }
+  for (i = 0; i < SIM_N_BULK; ++i)
+    pol->notify_circ_active(cmux, pol_data, &circs[i], cdata[i]);
+
+  tor_gettimeofday(&start);
+  for (step = 0; step < SIM_N_STEPS; ++step) {
+    circuit_t *circ;
+    int idx;
+
+    monotime_coarse_set_mock_time_nsec(start_ns +
+                                       step * SIM_MSEC_PER_STEP * NS_PER_MS);
+
+    /* Spread the interactive circuits' cells evenly over each period. */
+    idx = SIM_N_BULK +
+      (step % SIM_INTERACTIVE_PERIOD) * SIM_N_INTERACTIVE /
+      SIM_INTERACTIVE_PERIOD;
+    if (step % (SIM_INTERACTIVE_PERIOD / SIM_N_INTERACTIVE) == 0 &&
+        active_since[idx] < 0) {
+      active_since[idx] = step;
+      pol->notify_circ_active(cmux, pol_data, &circs[idx], cdata[idx]);
+    }
+
+    circ = pol->pick_active_circuit(cmux, pol_data);
+    tor_assert(circ);
+    idx = (int)(circ - circs);
+    pol->notify_xmit_cells(cmux, pol_data, circ, cdata[idx], 1);
+    ++n_sent[idx];
+    if (idx >= SIM_N_BULK) {
+      int delay = step - active_since[idx];
+      total_delay += delay;
+      ++n_interactive_sent;
+      result_out->max_interactive_delay =
+        MAX(result_out->max_interactive_delay, delay);
+      active_since[idx] = -1;
+      pol->notify_circ_inactive(cmux, pol_data, circ, cdata[idx]);
+    }
+  }
+  tor_gettimeofday(&end);
+
+  for (i = 0; i < SIM_N_BULK; ++i) {
+    n_bulk_sent += n_sent[i];
+    n_bulk_sent_sq += (uint64_t)n_sent[i] * n_sent[i];
+  }
+  result_out->ns_per_pick =
+    tv_udiff(&start, &end) * 1000.0 / SIM_N_STEPS;
+  result_out->bulk_fairness = ((double)n_bulk_sent) * n_bulk_sent /
+    (((double)SIM_N_BULK) * n_bulk_sent_sq);
+  if (n_interactive_sent)
+    result_out->mean_interactive_delay =
+      ((double)total_delay) / n_interactive_sent;
+
+  for (i = 0; i < n_circs; ++i) {
+    if (i < SIM_N_BULK || active_since[i] >= 0)
+      pol->notify_circ_inactive(cmux, pol_data, &circs[i], cdata[i]);
+    pol->free_circ_data(cmux, pol_data, &circs[i], cdata[i]);
+  }
+  pol->free_cmux_data(cmux, pol_data);
+  circuitmux_free(cmux);
+  tor_free(circs);
+  tor_free(cdata);
+  tor_free(active_since);
+  tor_free(n_sent);
+}
+
+/** Run the same simulated workload through the heap and calendar queue
+ * EWMA policies, and check that the calendar queue is about as fair. */
+static void
+test_cmux_ewma_simulation(void *arg)
+{
+  const int64_t NS_PER_S = 1000 * 1000 * 1000;
+  const int64_t START_NS = UINT64_C(1217709000)*NS_PER_S;
+  const int64_t RUN_NS = ((int64_t)SIM_N_STEPS) * SIM_MSEC_PER_STEP * 1000000;
+  ewma_sim_result_t heap, cal;
+  (void)arg;
+
+  circuitmux_ewma_free_all();
+  monotime_enable_test_mocking();
+  monotime_coarse_set_mock_time_nsec(START_NS);
+  cmux_ewma_set_options(NULL, NULL);
+
+  simulate_ewma_policy(&ewma_policy, START_NS, &heap);
+  simulate_ewma_policy(&ewma_calendar_policy, START_NS + RUN_NS, &cal);
+
+  log_info(LD_GENERAL, "heap: %.1f ns/pick, bulk fairness %.4f, "
+           "interactive delay mean %.2f max %d",
+           heap.ns_per_pick, heap.bulk_fairness,
+           heap.mean_interactive_delay, heap.max_interactive_delay);
+  log_info(LD_GENERAL, "calendar: %.1f ns/pick, bulk fairness %.4f, "
+           "interactive delay mean %.2f max %d",
+           cal.ns_per_pick, cal.bulk_fairness,
+           cal.mean_interactive_delay, cal.max_interactive_delay);
+
+  /* Both should share the bulk circuits' bandwidth almost exactly evenly,
+   * and should send interactive cells almost at once. */
+  tt_double_op(heap.bulk_fairness, OP_GT, 0.999);
+  tt_double_op(cal.bulk_fairness, OP_GT, 0.999);
+  tt_double_op(heap.mean_interactive_delay, OP_LT, 2.0);
+  tt_double_op(cal.mean_interactive_delay, OP_LT, 2.0);
+  /* At worst, the calendar queue might make an interactive cell wait for
+   * one round-robin pass over bulk circuits that share its bucket. */
+  tt_int_op(cal.max_interactive_delay, OP_LE,
+            heap.max_interactive_delay + SIM_N_BULK);
+
+ done:
+  monotime_disable_test_mocking();
+}
+
 struct testcase_t circuitmux_tests[] = {
   { "destroy_cell_queue", test_cmux_destroy_cell_queue, TT_FORK, NULL, NULL },
   { "compute_ticks", test_cmux_compute_ticks, TT_FORK, NULL, NULL },
+  { "ewma_calendar_order", test_cmux_ewma_calendar_order, TT_FORK,
+    NULL, NULL },
+  { "ewma_compare_mixed", test_cmux_ewma_compare_mixed, TT_FORK,
+    NULL, NULL },
+  { "ewma_simulation", test_cmux_ewma_simulation, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
@@ -788,6 +788,135 @@ test_conn_download_status(void *arg)
   /* the teardown function removes all the connections in the global list*/;
 }
 
+/* Test that linked connections hand data to one another without copying,
+ * and keep count of what they moved. */
+static void
+test_conn_linked_zero_copy(void *arg)
+{
+  connection_t *dirconn = NULL, *exitconn = NULL;
+  uint64_t moved_before, copied_before, moved_after, copied_after;
+  char data[10000];
+  (void)arg;
+
+  dirconn = TO_CONN(dir_connection_new(AF_INET));
+  exitconn = TO_CONN(edge_connection_new(CONN_TYPE_EXIT, AF_INET));
+  dirconn->state = DIR_CONN_STATE_SERVER_WRITING;
+  exitconn->state = EXIT_CONN_STATE_OPEN;
+  connection_link_connections(dirconn, exitconn);
+  connection_get_linked_bytes_stats(&moved_before, &copied_before);
+
+  memset(data, 'x', sizeof(data));
+  connection_buf_add(data, sizeof(data), dirconn);
+  tt_int_op(dirconn->outbuf_flushlen, OP_EQ, sizeof(data));
+
+  /* Flushing the whole outbuf takes over its chunks outright. */
+  tt_int_op(connection_flush_to_linked_conn(dirconn), OP_EQ, sizeof(data));
+  tt_int_op(connection_get_outbuf_len(dirconn), OP_EQ, 0);
+  tt_int_op(connection_get_inbuf_len(exitconn), OP_EQ, sizeof(data));
+  tt_u64_op(exitconn->n_linked_bytes_moved, OP_EQ, sizeof(data));
+  tt_u64_op(exitconn->n_linked_bytes_copied, OP_EQ, 0);
+  tt_u64_op(dirconn->n_linked_bytes_moved, OP_EQ, 0);
+
+  /* Flushing only part of a chunk has to copy. */
+  connection_buf_add(data, 1000, dirconn);
+  dirconn->outbuf_flushlen = 400;
+  tt_int_op(connection_flush_to_linked_conn(dirconn), OP_EQ, 400);
+  tt_int_op(connection_get_outbuf_len(dirconn), OP_EQ, 600);
+  tt_u64_op(exitconn->n_linked_bytes_moved, OP_EQ, sizeof(data));
+  tt_u64_op(exitconn->n_linked_bytes_copied, OP_EQ, 400);
+
+  connection_get_linked_bytes_stats(&moved_after, &copied_after);
+  tt_u64_op(moved_after - moved_before, OP_EQ,
+            exitconn->n_linked_bytes_moved);
+  tt_u64_op(copied_after - copied_before, OP_EQ,
+            exitconn->n_linked_bytes_copied);
+
+ done:
+  if (dirconn)
+    dirconn->linked_conn = NULL;
+  if (exitconn)
+    exitconn->linked_conn = NULL;
+  connection_free_minimal(dirconn);
+  connection_free_minimal(exitconn);
+}
+
+/* Test that a readable listener accepts a budgeted number of connections
+ * each time, and that we count them. */
+static void
+test_conn_listener_accept_budget(void *arg)
+{
+  connection_t *listener = NULL;
+  tor_socket_t clients[LISTENER_ACCEPT_BUDGET + 3];
+  struct sockaddr_in sin;
+  socklen_t sin_len = (socklen_t)sizeof(sin);
+  uint64_t n_wakeups, n_accepts;
+  int max_per_wakeup;
+  unsigned i;
+  (void)arg;
+
+  tor_init_connection_lists();
+  for (i = 0; i < ARRAY_LENGTH(clients); ++i)
+    clients[i] = TOR_INVALID_SOCKET;
+
+  listener = connection_new(CONN_TYPE_CONTROL_LISTENER, AF_INET);
+  listener->s = tor_open_socket_nonblocking(AF_INET, SOCK_STREAM,
+                                            IPPROTO_TCP);
+  tt_assert(SOCKET_OK(listener->s));
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(0x7f000001);
+  tt_int_op(bind(listener->s, (struct sockaddr *)&sin, sin_len), OP_EQ, 0);
+  tt_int_op(listen(listener->s, 2 * LISTENER_ACCEPT_BUDGET), OP_EQ, 0);
+  tt_int_op(getsockname(listener->s, (struct sockaddr *)&sin, &sin_len),
+            OP_EQ, 0);
+
+  for (i = 0; i < ARRAY_LENGTH(clients); ++i) {
+    clients[i] = tor_open_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    tt_assert(SOCKET_OK(clients[i]));
+    tt_int_op(connect(clients[i], (struct sockaddr *)&sin, sin_len),
+              OP_EQ, 0);
+  }
+
+  /* The first wakeup stops at the budget... */
+  tt_int_op(connection_handle_listener_read(listener, CONN_TYPE_CONTROL),
+            OP_EQ, 0);
+  tt_int_op(smartlist_len(get_connection_array()), OP_EQ,
+            LISTENER_ACCEPT_BUDGET);
+  connection_get_accept_stats(&n_wakeups, &n_accepts, &max_per_wakeup);
+  tt_u64_op(n_wakeups, OP_EQ, 1);
+  tt_u64_op(n_accepts, OP_EQ, LISTENER_ACCEPT_BUDGET);
+  tt_int_op(max_per_wakeup, OP_EQ, LISTENER_ACCEPT_BUDGET);
+
+  /* ... the next one takes the rest... */
+  tt_int_op(connection_handle_listener_read(listener, CONN_TYPE_CONTROL),
+            OP_EQ, 0);
+  tt_int_op(smartlist_len(get_connection_array()), OP_EQ,
+            ARRAY_LENGTH(clients));
+
+  /* ... and one with nothing to accept is harmless. */
+  tt_int_op(connection_handle_listener_read(listener, CONN_TYPE_CONTROL),
+            OP_EQ, 0);
+  tt_int_op(smartlist_len(get_connection_array()), OP_EQ,
+            ARRAY_LENGTH(clients));
+  tt_assert(!listener->marked_for_close);
+
+  connection_get_accept_stats(&n_wakeups, &n_accepts, &max_per_wakeup);
+  tt_u64_op(n_wakeups, OP_EQ, 3);
+  tt_u64_op(n_accepts, OP_EQ, ARRAY_LENGTH(clients));
+  tt_int_op(max_per_wakeup, OP_EQ, LISTENER_ACCEPT_BUDGET);
+
+ done:
+  SMARTLIST_FOREACH(get_connection_array(), connection_t *, conn,
+                    connection_mark_for_close(conn));
+  close_closeable_connections();
+  for (i = 0; i < ARRAY_LENGTH(clients); ++i) {
+    if (SOCKET_OK(clients[i]))
+      tor_close_socket(clients[i]);
+  }
+  if (listener)
+    connection_free_minimal(listener);
+}
+
 static node_t test_node;
 
 static node_t *
@@ -898,5 +1027,8 @@ struct testcase_t connection_tests[] = {
                           test_conn_download_status_st, FLAV_NS),
 //CONNECTION_TESTCASE(func_suffix, TT_FORK, setup_func_pair),
   { "failed_orconn_tracker", test_failed_orconn_tracker, TT_FORK, NULL, NULL },
+  { "linked_zero_copy", test_conn_linked_zero_copy, TT_FORK, NULL, NULL },
+  { "listener_accept_budget", test_conn_listener_accept_budget, TT_FORK,
+    NULL, NULL },
   END_OF_TESTCASES
 };
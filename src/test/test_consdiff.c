@@ -8,9 +8,21 @@
 #include "test/test.h"
 
 #include "feature/dircommon/consdiff.h"
+#include "lib/crypt_ops/crypto_rand.h"
+#include "lib/encoding/binascii.h"
 #include "lib/memarea/memarea.h"
 #include "test/log_test_helpers.h"
 
+#ifdef HAVE_SYS_RESOURCE_H
+#include <sys/resource.h>
+#endif
+#ifdef HAVE_SYS_WAIT_H
+#include <sys/wait.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
 #define tt_str_eq_line(a,b) \
   tt_assert(line_str_eq((b),(a)))
 
@@ -343,6 +355,132 @@ test_consdiff_calc_changes(void *arg)
   memarea_drop_all(area);
 }
 
+/** Helper: Add between 0 and <b>max_lines</b> random lines to <b>sl</b>,
+ * using few enough distinct lines that they often match. */
+static void
+add_random_lines(smartlist_t *sl, int max_lines, memarea_t *area)
+{
+  static const char *choices[] = { "a", "b", "c", "dd", "e f" };
+  int i, n = crypto_rand_int(max_lines + 1);
+  for (i = 0; i < n; ++i)
+    smartlist_add_linecpy(sl, area,
+                          choices[crypto_rand_int(ARRAY_LENGTH(choices))]);
+}
+
+static void
+test_consdiff_myers_changes(void *arg)
+{
+  smartlist_t *sl1 = smartlist_new();
+  smartlist_t *sl2 = smartlist_new();
+  smartlist_t *diff = NULL, *sl3 = NULL;
+  smartlist_slice_t *sls1 = NULL, *sls2 = NULL;
+  bitarray_t *changed1 = NULL, *changed2 = NULL;
+  bitarray_t *old_changed1 = NULL, *old_changed2 = NULL;
+  myers_state_t myers;
+  memarea_t *area = memarea_new();
+  int iter;
+
+  (void)arg;
+  memset(&myers, 0, sizeof(myers));
+
+  for (iter = 0; iter < 1000; ++iter) {
+    int len1, len2, i1, i2, kept1 = 0, kept2 = 0, old_kept1 = 0, i;
+
+    smartlist_clear(sl1);
+    smartlist_clear(sl2);
+    add_random_lines(sl1, 40, area);
+    /* Usually make the second list an edited copy of the first, so that we
+     * exercise long common runs as well as unrelated lists. */
+    if (crypto_rand_int(4)) {
+      SMARTLIST_FOREACH_BEGIN(sl1, cdline_t *, line) {
+        int r = crypto_rand_int(8);
+        if (r == 0)
+          continue;
+        if (r == 1)
+          add_random_lines(sl2, 3, area);
+        smartlist_add(sl2, line);
+      } SMARTLIST_FOREACH_END(line);
+    } else {
+      add_random_lines(sl2, 40, area);
+    }
+    len1 = smartlist_len(sl1);
+    len2 = smartlist_len(sl2);
+
+    changed1 = bitarray_init_zero(len1);
+    changed2 = bitarray_init_zero(len2);
+    myers_state_init(&myers, sl1, sl2, changed1, changed2);
+    myers_changes(&myers, 0, len1, 0, len2);
+    myers_state_clear(&myers);
+
+    /* The lines that we kept must be the same in both lists. */
+    i1 = i2 = 0;
+    for (;;) {
+      while (i1 < len1 && bitarray_is_set(changed1, i1))
+        ++i1;
+      while (i2 < len2 && bitarray_is_set(changed2, i2))
+        ++i2;
+      if (i1 == len1 || i2 == len2)
+        break;
+      tt_assert(lines_eq(smartlist_get(sl1, i1), smartlist_get(sl2, i2)));
+      ++i1;
+      ++i2;
+      ++kept1;
+    }
+    for (; i2 < len2; ++i2)
+      tt_assert(bitarray_is_set(changed2, i2));
+    for (; i1 < len1; ++i1)
+      tt_assert(bitarray_is_set(changed1, i1));
+    for (i = 0; i < len2; ++i)
+      kept2 += !bitarray_is_set(changed2, i);
+    tt_int_op(kept1, OP_EQ, kept2);
+
+    /* ... and we must keep as many of them as the old engine did, since
+     * both find a longest common subsequence. */
+    old_changed1 = bitarray_init_zero(len1);
+    old_changed2 = bitarray_init_zero(len2);
+    sls1 = smartlist_slice(sl1, 0, -1);
+    sls2 = smartlist_slice(sl2, 0, -1);
+    calc_changes(sls1, sls2, old_changed1, old_changed2);
+    for (i = 0; i < len1; ++i)
+      old_kept1 += !bitarray_is_set(old_changed1, i);
+    tt_int_op(kept1, OP_EQ, old_kept1);
+
+    /* None of these lines are router lines, so gen_ed_diff diffs the lists
+     * as a whole, and its diff must turn the first list into the second. */
+    diff = gen_ed_diff(sl1, sl2, area);
+    tt_assert(diff);
+    sl3 = apply_ed_diff(sl1, diff, 0);
+    tt_assert(sl3);
+    tt_int_op(smartlist_len(sl3), OP_EQ, len2);
+    for (i = 0; i < len2; ++i)
+      tt_assert(lines_eq(smartlist_get(sl3, i), smartlist_get(sl2, i)));
+
+    smartlist_free(diff);
+    smartlist_free(sl3);
+    diff = sl3 = NULL;
+    tor_free(sls1);
+    tor_free(sls2);
+    bitarray_free(changed1);
+    bitarray_free(changed2);
+    bitarray_free(old_changed1);
+    bitarray_free(old_changed2);
+  }
+
+ done:
+  myers_state_clear(&myers);
+  bitarray_free(changed1);
+  bitarray_free(changed2);
+  bitarray_free(old_changed1);
+  bitarray_free(old_changed2);
+  smartlist_free(diff);
+  smartlist_free(sl3);
+  smartlist_free(sl1);
+  smartlist_free(sl2);
+  tor_free(sls1);
+  tor_free(sls2);
+  memarea_drop_all(area);
+}
+
 static void
 test_consdiff_get_id_hash(void *arg)
 {
@@ -1005,6 +1143,32 @@ test_consdiff_gen_diff(void *arg)
   memarea_drop_all(area);
 }
 
+/** Helper: apply <b>diff</b> to <b>cons1_str</b>, which is split into
+ * <b>cons1</b>, with both consdiff_apply_diff() and
+ * consdiff_apply_diff_to_str(), check that they give the same result, and
+ * return it.  Leave only the log messages from consdiff_apply_diff(). */
+static char *
+consdiff_apply_diff_both_(const char *cons1_str, const smartlist_t *cons1,
+                          const smartlist_t *diff,
+                          const consensus_digest_t *digests1)
+{
+  char *streamed, *result;
+
+  streamed = consdiff_apply_diff_to_str(cons1_str, strlen(cons1_str),
+                                        smartlist_len(cons1), diff,
+                                        digests1);
+  mock_clean_saved_logs();
+  result = consdiff_apply_diff(cons1, diff, digests1);
+  if (result)
+    tt_str_op(result, OP_EQ, streamed);
+  else
+    tt_ptr_op(streamed, OP_EQ, NULL);
+
+ done:
+  tor_free(streamed);
+  return result;
+}
+
 static void
 test_consdiff_apply_diff(void *arg)
 {
@@ -1028,7 +1192,7 @@ test_consdiff_apply_diff(void *arg)
   consensus_split_lines_(cons1, cons1_str, area);
 
   /* diff doesn't have enough lines. */
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff_both_(cons1_str, cons1, diff, &digests1);
   tt_ptr_op(NULL, OP_EQ, cons2);
   expect_single_log_msg_containing("too short")
 
@@ -1036,7 +1200,7 @@ test_consdiff_apply_diff(void *arg)
   smartlist_add_linecpy(diff, area, "foo-bar");
   smartlist_add_linecpy(diff, area, "header-line");
   mock_clean_saved_logs();
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff_both_(cons1_str, cons1, diff, &digests1);
   tt_ptr_op(NULL, OP_EQ, cons2);
   expect_single_log_msg_containing("format is not known")
 
@@ -1046,7 +1210,7 @@ test_consdiff_apply_diff(void *arg)
   smartlist_add_linecpy(diff, area, "word a b");
   smartlist_add_linecpy(diff, area, "x");
   mock_clean_saved_logs();
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff_both_(cons1_str, cons1, diff, &digests1);
   tt_ptr_op(NULL, OP_EQ, cons2);
   expect_single_log_msg_containing("does not include the necessary digests")
 
@@ -1055,7 +1219,7 @@ test_consdiff_apply_diff(void *arg)
   smartlist_add_linecpy(diff, area, "network-status-diff-version 1");
   smartlist_add_linecpy(diff, area, "hash a b c");
   mock_clean_saved_logs();
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff_both_(cons1_str, cons1, diff, &digests1);
   tt_ptr_op(NULL, OP_EQ, cons2);
   expect_single_log_msg_containing("does not include the necessary digests")
 
@@ -1064,7 +1228,7 @@ test_consdiff_apply_diff(void *arg)
   smartlist_add_linecpy(diff, area, "network-status-diff-version 1");
   smartlist_add_linecpy(diff, area, "hash aaa bbb");
   mock_clean_saved_logs();
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff_both_(cons1_str, cons1, diff, &digests1);
   tt_ptr_op(NULL, OP_EQ, cons2);
   expect_single_log_msg_containing("includes base16-encoded digests of "
                                    "incorrect size")
@@ -1076,7 +1240,7 @@ test_consdiff_apply_diff(void *arg)
       " ????????????????????????????????????????????????????????????????"
       " ----------------------------------------------------------------");
   mock_clean_saved_logs();
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff_both_(cons1_str, cons1, diff, &digests1);
   tt_ptr_op(NULL, OP_EQ, cons2);
   expect_single_log_msg_containing("includes malformed digests")
 
@@ -1092,7 +1256,7 @@ test_consdiff_apply_diff(void *arg)
       " 635D34593020C08E5ECD865F9986E29D50028EFA62843766A8197AD228A7F6AA");
   smartlist_add_linecpy(diff, area, "foobar");
   mock_clean_saved_logs();
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff_both_(cons1_str, cons1, diff, &digests1);
   tt_ptr_op(NULL, OP_EQ, cons2);
   expect_single_log_msg_containing("because an ed command was missing a line "
                                    "number")
@@ -1106,7 +1270,7 @@ test_consdiff_apply_diff(void *arg)
       /* sha256 of cons2. */
       " 635D34593020C08E5ECD865F9986E29D50028EFA62843766A8197AD228A7F6AA");
   mock_clean_saved_logs();
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff_both_(cons1_str, cons1, diff, &digests1);
   tt_ptr_op(NULL, OP_EQ, cons2);
   expect_log_msg_containing("base consensus doesn't match the digest "
                             "as found");
@@ -1120,7 +1284,7 @@ test_consdiff_apply_diff(void *arg)
       /* bogus sha3. */
       " 3333333333333333333333333333333333333333333333333333333333333333");
   mock_clean_saved_logs();
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff_both_(cons1_str, cons1, diff, &digests1);
   tt_ptr_op(NULL, OP_EQ, cons2);
   expect_log_msg_containing("resulting consensus doesn't match the "
                             "digest as found");
@@ -1154,7 +1318,7 @@ test_consdiff_apply_diff(void *arg)
   smartlist_add_linecpy(diff, area, "3c");
   smartlist_add_linecpy(diff, area, "sample");
   smartlist_add_linecpy(diff, area, ".");
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff_both_(cons1_str, cons1, diff, &digests1);
   tt_ptr_op(NULL, OP_NE, cons2);
   tt_str_op(
       "network-status-version foo\n"
@@ -1175,7 +1339,7 @@ test_consdiff_apply_diff(void *arg)
   smartlist_add_linecpy(diff, area, "3c");
   smartlist_add_linecpy(diff, area, "sample");
   smartlist_add_linecpy(diff, area, ".");
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff_both_(cons1_str, cons1, diff, &digests1);
   tt_ptr_op(NULL, OP_NE, cons2);
   tt_str_op(
       "network-status-version foo\n"
@@ -1195,6 +1359,285 @@ test_consdiff_apply_diff(void *arg)
   memarea_drop_all(area);
 }
 
+/** Helper: return a newly allocated string holding the lines in
+ * <b>lines</b>, each followed by a NL. */
+static char *
+join_lines_(const smartlist_t *lines)
+{
+  smartlist_t *chunks = smartlist_new();
+  char *result;
+  SMARTLIST_FOREACH(lines, const cdline_t *, line,
+    smartlist_add_asprintf(chunks, "%.*s\n", (int)line->len, line->s));
+  result = smartlist_join_strings(chunks, "", 0, NULL);
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  return result;
+}
+
+/** Helper: apply the ed diff <b>diff_str</b> to <b>cons1_str</b> with both
+ * apply_ed_diff() and apply_ed_diff_to_str(), and check that they agree,
+ * down to the digest of the result.  Return true iff the diff applied. */
+static int
+apply_ed_diff_both_(const char *cons1_str, const char *diff_str)
+{
+  memarea_t *area = memarea_new();
+  smartlist_t *cons1 = smartlist_new(), *diff = smartlist_new();
+  smartlist_t *cons2 = NULL;
+  crypto_digest_t *digest = crypto_digest256_new(DIGEST_SHA3_256);
+  char *joined = NULL, *streamed = NULL;
+  char d1[DIGEST256_LEN], d2[DIGEST256_LEN];
+  int applied = 0;
+
+  consensus_split_lines_(cons1, cons1_str, area);
+  consensus_split_lines_(diff, diff_str, area);
+  cons2 = apply_ed_diff(cons1, diff, 0);
+  streamed = apply_ed_diff_to_str(cons1_str, strlen(cons1_str),
+                                  smartlist_len(cons1), diff, 0, digest);
+  if (!cons2) {
+    tt_ptr_op(streamed, OP_EQ, NULL);
+    goto done;
+  }
+  tt_assert(streamed);
+  joined = join_lines_(cons2);
+  tt_str_op(joined, OP_EQ, streamed);
+  crypto_digest_get_digest(digest, d1, sizeof(d1));
+  crypto_digest256(d2, joined, strlen(joined), DIGEST_SHA3_256);
+  tt_mem_op(d1, OP_EQ, d2, DIGEST256_LEN);
+  applied = 1;
+
+ done:
+  crypto_digest_free(digest);
+  smartlist_free(cons1);
+  smartlist_free(diff);
+  smartlist_free(cons2);
+  tor_free(joined);
+  tor_free(streamed);
+  memarea_drop_all(area);
+  return applied;
+}
+
+static void
+test_consdiff_apply_ed_diff_to_str(void *arg)
+{
+  static const char cons1_str[] = "A\nB\nC\nD\nE\n";
+  /* Diffs that use the corners of the ed format. */
+  static const char *good_diffs[] = {
+    "", "0a\nX\n.\n", "0c\nX\n.\n", "0,2d\n", "1,$d\n", "3,$d\n",
+    "5a\nX\nY\n.\n", "5d\n4a\nX\n.\n", "4a\nX\n.\n4a\nY\n.\n",
+    "4a\nX\n.\n4d\n", "5c\n.X\n.\n2,4c\nX\n.\n", "2d\n1d\n0a\nZ\n.\n",
+  };
+  /* Diffs that must not apply, for the two engines to reject alike. */
+  static const char *bad_diffs[] = {
+    "6d\n", "2d\n3d\n", "0d\n0a\nX\n.\n", "2,2d\n", "2,$c\nX\n.\n",
+    "1a\n.\n", "1a\nX\n", "1x\n", "1dd\n", "d\n",
+  };
+  memarea_t *area = memarea_new();
+  smartlist_t *sl1 = smartlist_new(), *sl2 = smartlist_new();
+  smartlist_t *diff = NULL;
+  char *str1 = NULL, *diff_str = NULL;
+  unsigned i;
+  (void)arg;
+
+  setup_capture_of_logs(LOG_WARN);
+  for (i = 0; i < ARRAY_LENGTH(good_diffs); ++i)
+    tt_assert(apply_ed_diff_both_(cons1_str, good_diffs[i]));
+  for (i = 0; i < ARRAY_LENGTH(bad_diffs); ++i)
+    tt_assert(!apply_ed_diff_both_(cons1_str, bad_diffs[i]));
+
+  /* And the diffs that gen_ed_diff makes between random lists. */
+  for (i = 0; i < 200; ++i) {
+    smartlist_clear(sl1);
+    smartlist_clear(sl2);
+    add_random_lines(sl1, 30, area);
+    add_random_lines(sl2, 30, area);
+    diff = gen_ed_diff(sl1, sl2, area);
+    tt_assert(diff);
+    str1 = join_lines_(sl1);
+    diff_str = join_lines_(diff);
+    tt_assert(apply_ed_diff_both_(str1, diff_str));
+    smartlist_free(diff);
+    tor_free(str1);
+    tor_free(diff_str);
+  }
+
+ done:
+  teardown_capture_of_logs();
+  smartlist_free(sl1);
+  smartlist_free(sl2);
+  smartlist_free(diff);
+  tor_free(str1);
+  tor_free(diff_str);
+  memarea_drop_all(area);
+}
+
+#if defined(__linux__) && defined(HAVE_SYS_RESOURCE_H)
+/** Return the most memory this process has ever had resident, in KB. */
+static long
+max_rss_kb(void)
+{
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru) < 0)
+    return -1;
+  return ru.ru_maxrss;
+}
+
+/** What a child process from apply_diff_in_child() reports. */
+typedef struct apply_diff_report_t {
+  /** How far applying the diff raised the child's peak memory, in KB. */
+  long kb;
+  /** The SHA256 digest of the result. */
+  char digest[DIGEST256_LEN];
+} apply_diff_report_t;
+
+/** In a child process of its own, apply the diff in <b>diff_str</b> to the
+ * <b>n_lines</b>-line consensus <b>cons1_str</b>, whose digests are
+ * <b>digests1</b>, with consdiff_apply_diff() if <b>split_lines</b> is
+ * true, and with consdiff_apply_diff_to_str() otherwise.  On success, fill
+ * in <b>report_out</b> and return 0.  Return -1 on failure.
+ *
+ * ru_maxrss never goes down, so a process can only measure the peak of the
+ * first thing it does that needs more memory than it ever had.  Each child
+ * starts out with the same memory, so its peak only counts its own
+ * applier. */
+static int
+apply_diff_in_child(const char *cons1_str, int n_lines, const char *diff_str,
+                    const consensus_digest_t *digests1, int split_lines,
+                    apply_diff_report_t *report_out)
+{
+  int fds[2], status;
+  pid_t pid;
+  ssize_t n;
+
+  if (pipe(fds) < 0)
+    return -1;
+  pid = fork();
+  if (pid < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+  if (pid == 0) {
+    apply_diff_report_t report;
+    memarea_t *area = memarea_new();
+    smartlist_t *diff = smartlist_new();
+    smartlist_t *cons1 = smartlist_new();
+    long before = max_rss_kb();
+    char *result;
+
+    consensus_split_lines_(diff, diff_str, area);
+    if (split_lines) {
+      consensus_split_lines_(cons1, cons1_str, area);
+      result = consdiff_apply_diff(cons1, diff, digests1);
+    } else {
+      result = consdiff_apply_diff_to_str(cons1_str, strlen(cons1_str),
+                                          n_lines, diff, digests1);
+    }
+    if (!result)
+      _exit(1);
+    memset(&report, 0, sizeof(report));
+    report.kb = max_rss_kb() - before;
+    crypto_digest256(report.digest, result, strlen(result), DIGEST_SHA256);
+    if (write(fds[1], &report, sizeof(report)) != (ssize_t)sizeof(report))
+      _exit(1);
+    _exit(0);
+  }
+
+  close(fds[1]);
+  n = read(fds[0], report_out, sizeof(*report_out));
+  close(fds[0]);
+  if (waitpid(pid, &status, 0) != pid ||
+      !WIFEXITED(status) || WEXITSTATUS(status) != 0 ||
+      n != (ssize_t)sizeof(*report_out))
+    return -1;
+  return 0;
+}
+#endif /* defined(__linux__) && defined(HAVE_SYS_RESOURCE_H) */
+
+static void
+test_consdiff_apply_diff_peak_memory(void *arg)
+{
+#if defined(__linux__) && defined(HAVE_SYS_RESOURCE_H)
+  /* About as many lines as a real consensus. */
+  const int n_lines = 40000;
+  const char line_fmt[] = "line %06d abcdefghijklmnopqrstuvwxyz0123456789";
+  const size_t line_len = 48;
+  char buf[64];
+  char *cons1_str = NULL, *diff_str = NULL, *cp;
+  char *hash_line = NULL;
+  size_t diff_alloc;
+  consensus_digest_t digests1;
+  crypto_digest_t *digest = crypto_digest256_new(DIGEST_SHA3_256);
+  char digest2[DIGEST256_LEN];
+  char hex1[HEX_DIGEST256_LEN+1], hex2[HEX_DIGEST256_LEN+1];
+  apply_diff_report_t streaming, legacy;
+  int i;
+  (void)arg;
+
+  /* Make a consensus-sized document, and a diff that changes every fifth
+   * line of it.  We build both with a single allocation each, so that
+   * neither leaves freed memory around for the code we measure to reuse. */
+  cons1_str = cp = tor_malloc(n_lines * (line_len + 1) + 1);
+  for (i = 1; i <= n_lines; ++i) {
+    tor_snprintf(cp, line_len + 1, line_fmt, i);
+    tt_int_op(strlen(cp), OP_EQ, line_len);
+    cp += line_len;
+    *cp++ = '\n';
+  }
+  *cp = '\0';
+  for (i = 1; i <= n_lines; ++i) {
+    if (i % 5 == 0)
+      tor_snprintf(buf, sizeof(buf), "changed %06d", i);
+    else
+      tor_snprintf(buf, sizeof(buf), line_fmt, i);
+    crypto_digest_add_bytes(digest, buf, strlen(buf));
+    crypto_digest_add_bytes(digest, "\n", 1);
+  }
+  crypto_digest_get_digest(digest, digest2, sizeof(digest2));
+  tt_int_op(0, OP_EQ, consensus_compute_digest_(cons1_str, &digests1));
+  base16_encode(hex1, sizeof(hex1), (const char *)digests1.sha3_256,
+                DIGEST256_LEN);
+  base16_encode(hex2, sizeof(hex2), digest2, DIGEST256_LEN);
+  tor_asprintf(&hash_line, "network-status-diff-version 1\nhash %s %s\n",
+               hex1, hex2);
+  diff_alloc = strlen(hash_line) + (n_lines / 5) * 32 + 1;
+  diff_str = cp = tor_malloc(diff_alloc);
+  strlcpy(cp, hash_line, diff_alloc);
+  cp += strlen(cp);
+  for (i = n_lines - n_lines % 5; i > 0; i -= 5) {
+    tor_snprintf(cp, diff_alloc - (cp - diff_str),
+                 "%dc\nchanged %06d\n.\n", i, i);
+    cp += strlen(cp);
+  }
+
+  /* Now measure how far each way of applying the diff pushes up the peak
+   * memory of a process that starts out like this one. */
+  tt_int_op(max_rss_kb(), OP_GT, 0);
+  tt_int_op(0, OP_EQ, apply_diff_in_child(cons1_str, n_lines, diff_str,
+                                          &digests1, 0, &streaming));
+  tt_int_op(0, OP_EQ, apply_diff_in_child(cons1_str, n_lines, diff_str,
+                                          &digests1, 1, &legacy));
+
+  tt_mem_op(streaming.digest, OP_EQ, legacy.digest, DIGEST256_LEN);
+  TT_BLATHER(("Applying a diff to a %d byte consensus raised peak memory "
+              "by %ld KB streaming it, and by %ld KB splitting it into "
+              "lines.", (int)strlen(cons1_str), streaming.kb, legacy.kb));
+  /* The old way splits the consensus into lines and then joins the result:
+   * it must not come out ahead. */
+  tt_int_op(streaming.kb, OP_LE, legacy.kb);
+
+ done:
+  crypto_digest_free(digest);
+  tor_free(cons1_str);
+  tor_free(diff_str);
+  tor_free(hash_line);
+#else /* !(defined(__linux__) && defined(HAVE_SYS_RESOURCE_H)) */
+  (void)arg;
+  tt_skip();
+ done:
+  ;
+#endif /* defined(__linux__) && defined(HAVE_SYS_RESOURCE_H) */
+}
+
 #define CONSDIFF_LEGACY(name)                                          \
   { #name, test_consdiff_ ## name , 0, NULL, NULL }
 
@@ -1205,13 +1648,17 @@ struct testcase_t consdiff_tests[] = {
   CONSDIFF_LEGACY(trim_slices),
   CONSDIFF_LEGACY(set_changed),
   CONSDIFF_LEGACY(calc_changes),
+  CONSDIFF_LEGACY(myers_changes),
   CONSDIFF_LEGACY(get_id_hash),
   CONSDIFF_LEGACY(is_valid_router_entry),
   CONSDIFF_LEGACY(next_router),
   CONSDIFF_LEGACY(base64cmp),
   CONSDIFF_LEGACY(gen_ed_diff),
   CONSDIFF_LEGACY(apply_ed_diff),
+  CONSDIFF_LEGACY(apply_ed_diff_to_str),
   CONSDIFF_LEGACY(gen_diff),
   CONSDIFF_LEGACY(apply_diff),
+  { "apply_diff_peak_memory", test_consdiff_apply_diff_peak_memory,
+    TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
@@ -360,6 +360,127 @@ test_consdiffmgr_add(void *arg)
   tor_free(body_owned);
 }
 
+static int
+mock_is_compression_bomb(size_t size_in, size_t size_out)
+{
+  (void)size_in;
+  (void)size_out;
+  return 1;
+}
+
+static void
+test_consdiffmgr_compress_multiple(void *arg)
+{
+  (void)arg;
+  const compress_method_t methods[] = {
+    NO_METHOD, GZIP_METHOD, ZLIB_METHOD, LZMA_METHOD, ZSTD_METHOD,
+  };
+  const int n_methods = ARRAY_LENGTH(methods);
+  compressed_result_t results[ARRAY_LENGTH(methods)];
+  config_line_t *labels = NULL;
+  smartlist_t *lines = smartlist_new();
+  char *input = NULL, *output = NULL;
+  size_t input_len, output_len;
+  int i, n_groups, r;
+
+  memset(results, 0, sizeof(results));
+  config_line_append(&labels, "flavor", "ns");
+
+  /* Something like a consensus, big enough to take several chunks. */
+  for (i = 0; i < 20000; ++i) {
+    smartlist_add_asprintf(lines, "r relay%d %d %s\n", i,
+                           crypto_rand_int(1000),
+                           i % 3 ? "Fast Running Valid" : "Running");
+  }
+  input = smartlist_join_strings(lines, "", 0, &input_len);
+  tt_int_op(input_len, OP_GT, 3*128*1024);
+
+  for (n_groups = 0; n_groups <= n_methods + 1; ++n_groups) {
+    int all_supported = 1;
+    r = compress_multiple_in_groups(results, n_methods, methods,
+                                    (const uint8_t *)input, input_len,
+                                    labels, n_groups);
+    for (i = 0; i < n_methods; ++i) {
+      if (!tor_compress_supports_method(methods[i]))
+        all_supported = 0;
+    }
+    tt_int_op(r, OP_EQ, all_supported ? 0 : -1);
+    for (i = 0; i < n_methods; ++i) {
+      if (!tor_compress_supports_method(methods[i])) {
+        tt_ptr_op(results[i].body, OP_EQ, NULL);
+        continue;
+      }
+      tt_assert(results[i].body);
+      tt_int_op(results[i].usec, OP_GE, 0);
+      tt_str_op(results[i].labels->key, OP_EQ, "compression");
+      tt_str_op(results[i].labels->value, OP_EQ,
+                compression_method_get_name(methods[i]));
+      tt_str_op(results[i].labels->next->key, OP_EQ, "sha3-digest");
+      tt_str_op(results[i].labels->next->next->key, OP_EQ, "flavor");
+
+      r = tor_uncompress(&output, &output_len,
+                         (const char *)results[i].body, results[i].bodylen,
+                         methods[i], 1, LOG_WARN);
+      tt_int_op(r, OP_EQ, 0);
+      tt_mem_op(output, OP_EQ, input, input_len);
+      tt_int_op(output_len, OP_EQ, input_len);
+      tor_free(output);
+
+      tor_free(results[i].body);
+      config_free_lines(results[i].labels);
+      results[i].labels = NULL;
+    }
+    memset(results, 0, sizeof(results));
+  }
+
+  /* Empty input works too. */
+  r = compress_multiple_in_groups(results, n_methods, methods,
+                                  (const uint8_t *)"", 0, labels, 2);
+  for (i = 0; i < n_methods; ++i) {
+    if (!tor_compress_supports_method(methods[i]))
+      continue;
+    tt_assert(results[i].body);
+    r = tor_uncompress(&output, &output_len,
+                       (const char *)results[i].body, results[i].bodylen,
+                       methods[i], 1, LOG_WARN);
+    tt_int_op(r, OP_EQ, 0);
+    tt_int_op(output_len, OP_EQ, 0);
+    tor_free(output);
+  }
+  for (i = 0; i < n_methods; ++i) {
+    tor_free(results[i].body);
+    config_free_lines(results[i].labels);
+    results[i].labels = NULL;
+  }
+  memset(results, 0, sizeof(results));
+
+  /* A result that looks like a compression bomb fails, as it would with
+   * tor_compress(). */
+  MOCK(tor_compress_is_compression_bomb, mock_is_compression_bomb);
+  setup_capture_of_logs(LOG_WARN);
+  r = compress_multiple_in_groups(results, n_methods, methods,
+                                  (const uint8_t *)input, input_len,
+                                  labels, 2);
+  tt_int_op(r, OP_EQ, -1);
+  expect_log_msg_containing("other Tors would think this was a "
+                            "compression bomb");
+  for (i = 0; i < n_methods; ++i)
+    tt_ptr_op(results[i].body, OP_EQ, NULL);
+
+ done:
+  UNMOCK(tor_compress_is_compression_bomb);
+  teardown_capture_of_logs();
+  for (i = 0; i < n_methods; ++i) {
+    tor_free(results[i].body);
+    config_free_lines(results[i].labels);
+  }
+  config_free_lines(labels);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  tor_free(input);
+  tor_free(output);
+}
+
 static void
 test_consdiffmgr_make_diffs(void *arg)
 {
@@ -443,7 +564,20 @@ test_consdiffmgr_make_diffs(void *arg)
   consdiffmgr_rescan();
   tt_ptr_op(NULL, OP_EQ, fake_cpuworker_queue);
 
+  /* The heartbeat should tell us about all of that. */
+  setup_capture_of_logs(LOG_NOTICE);
+  consdiffmgr_log_heartbeat();
+  expect_log_msg_containing("gzipped documents");
+  expect_log_msg_containing("Our latest ns consensus was ready to serve ");
+  expect_log_msg_containing("no diffs to it are ready yet.");
+  expect_log_msg_containing("Our latest microdesc consensus was ready to "
+                            "serve ");
+  expect_log_msg_containing("the last of 1 diffs to it was ready after ");
+  expect_log_msg_containing("Earlier microdesc consensuses were ready "
+                            "after ");
+
  done:
+  teardown_capture_of_logs();
   tor_free(md_ns_body);
   tor_free(md_ns_body_2);
   tor_free(diff_text);
@@ -905,6 +1039,7 @@ struct testcase_t consdiffmgr_tests[] = {
 #endif
   TEST(sha3_helper),
   TEST(add),
+  TEST(compress_multiple),
   TEST(make_diffs),
   TEST(diff_rules),
   TEST(diff_failure),
@@ -28,6 +28,7 @@
 #include "app/config/config.h"
 #include "app/config/confparse.h"
 #include "core/mainloop/connection.h"
+#include "core/mainloop/cpuworker.h"
 #include "core/or/relay.h"
 #include "core/or/versions.h"
 #include "feature/client/bridges.h"
@@ -6385,6 +6386,133 @@ test_dir_format_versions_list(void *arg)
   teardown_capture_of_logs();
 }
 
+/** How many routerstatus entries have we been asked to dump? */
+static int mock_dump_desc_rs_calls = 0;
+
+static void
+mock_dump_desc(const char *desc, const char *type)
+{
+  (void)desc;
+  if (!strcmp(type, "routerstatus entry"))
+    ++mock_dump_desc_rs_calls;
+}
+
+/** Return a made-up microdesc consensus with <b>n_relays</b> entries, and
+ * an unparseable address in the entry at index <b>bad_idx</b>. */
+static char *
+make_big_consensus(int n_relays, int bad_idx)
+{
+  smartlist_t *chunks = smartlist_new();
+  char *result;
+  int i;
+
+  smartlist_add_strdup(chunks,
+    "network-status-version 3 microdesc\n"
+    "vote-status consensus\n"
+    "consensus-method 28\n"
+    "valid-after 2019-02-13 12:00:00\n"
+    "fresh-until 2019-02-13 13:00:00\n"
+    "valid-until 2019-02-13 15:00:00\n"
+    "voting-delay 300 300\n"
+    "known-flags Fast Guard Running Stable V2Dir Valid\n"
+    "dir-source test0 D586D18309DED4CD6D57C18FDB97EFA96D330566 "
+    "test0.example.com 127.0.0.1 80 443\n"
+    "contact Nobody <nobody@example.com>\n"
+    "vote-digest 5AEA0C5BC2EA7D86B2EE2EFA7A1C1C31AD5DB1AC\n");
+
+  for (i = 0; i < n_relays; ++i) {
+    char id[DIGEST_LEN], md_digest[DIGEST256_LEN];
+    char id_b64[BASE64_DIGEST_LEN+1], md_b64[BASE64_DIGEST256_LEN+1];
+    char addr[32];
+    crypto_rand(id, sizeof(id));
+    set_uint32(id, htonl(i));
+    crypto_rand(md_digest, sizeof(md_digest));
+    digest_to_base64(id_b64, id);
+    digest256_to_base64(md_b64, md_digest);
+    if (i == bad_idx)
+      strlcpy(addr, "bogus", sizeof(addr));
+    else
+      tor_snprintf(addr, sizeof(addr), "10.%d.%d.%d",
+                   (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff);
+    smartlist_add_asprintf(chunks,
+      "r relay%d %s 2019-02-13 11:00:00 %s 9001 0\n"
+      "m %s\n"
+      "s Fast%s Running Stable V2Dir Valid\n"
+      "v Tor 0.3.5.7\n"
+      "pr Cons=1-2 Desc=1-2 DirCache=1-2 HSDir=1-2 HSIntro=3-4 HSRend=1-2 "
+      "Link=1-5 LinkAuth=1,3 Microdesc=1-2 Relay=1-2\n"
+      "w Bandwidth=%d\n",
+      i, id_b64, addr, md_b64, (i % 3 == 0) ? " Guard" : "", i + 1);
+  }
+
+  smartlist_add_strdup(chunks,
+    "directory-footer\n"
+    "directory-signature sha256 D586D18309DED4CD6D57C18FDB97EFA96D330566 "
+    "A3F2F9B48D0E4E7A1A4A8F0E5A1B7C3D2E6F0A11\n"
+    "-----BEGIN SIGNATURE-----\n"
+    "AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA\n"
+    "AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA\n"
+    "AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA\n"
+    "AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA\n"
+    "-----END SIGNATURE-----\n");
+
+  result = smartlist_join_strings(chunks, "", 0, NULL);
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  return result;
+}
+
+static void
+test_dir_parallel_consensus_parse(void *arg)
+{
+  const int n_relays = 3000, bad_idx = 2222;
+  char *text = make_big_consensus(n_relays, bad_idx);
+  networkstatus_t *serial = NULL, *parallel = NULL;
+  int i;
+  (void)arg;
+
+  MOCK(dump_desc, mock_dump_desc);
+
+  /* Without cpuworkers, we parse everything here. */
+  serial = networkstatus_parse_vote_from_string(text, strlen(text), NULL,
+                                                NS_TYPE_CONSENSUS);
+  tt_assert(serial);
+  tt_int_op(smartlist_len(serial->routerstatus_list), OP_EQ, n_relays - 1);
+  tt_int_op(mock_dump_desc_rs_calls, OP_EQ, 1);
+
+  /* With them, we should get exactly the same entries in the same order,
+   * and still dump the bad one from the main thread. */
+  tt_int_op(init_keys_client(), OP_EQ, 0);
+  cpu_init();
+  tt_int_op(cpuworker_get_n_threads(), OP_GE, 2);
+  mock_dump_desc_rs_calls = 0;
+  parallel = networkstatus_parse_vote_from_string(text, strlen(text), NULL,
+                                                  NS_TYPE_CONSENSUS);
+  tt_assert(parallel);
+  tt_int_op(mock_dump_desc_rs_calls, OP_EQ, 1);
+  tt_int_op(smartlist_len(parallel->routerstatus_list), OP_EQ,
+            n_relays - 1);
+  for (i = 0; i < n_relays - 1; ++i) {
+    const routerstatus_t *a = smartlist_get(serial->routerstatus_list, i);
+    const routerstatus_t *b = smartlist_get(parallel->routerstatus_list, i);
+    tt_mem_op(a->identity_digest, OP_EQ, b->identity_digest, DIGEST_LEN);
+    tt_mem_op(a->descriptor_digest, OP_EQ, b->descriptor_digest,
+              DIGEST256_LEN);
+    tt_str_op(a->nickname, OP_EQ, b->nickname);
+    tt_int_op(a->addr, OP_EQ, b->addr);
+    tt_int_op(a->bandwidth_kb, OP_EQ, b->bandwidth_kb);
+    tt_int_op(a->is_possible_guard, OP_EQ, b->is_possible_guard);
+    tt_int_op(a->pv.supports_v3_hsdir, OP_EQ, b->pv.supports_v3_hsdir);
+    tt_int_op(b->bandwidth_kb, OP_EQ, i < bad_idx ? i + 1 : i + 2);
+  }
+
+ done:
+  UNMOCK(dump_desc);
+  networkstatus_vote_free(serial);
+  networkstatus_vote_free(parallel);
+  tor_free(text);
+}
+
 #define DIR_LEGACY(name)                             \
   { #name, test_dir_ ## name , TT_FORK, NULL, NULL }
 
@@ -6456,5 +6584,6 @@ struct testcase_t dir_tests[] = {
   DIR(platform_str, 0),
   DIR(networkstatus_consensus_has_ipv6, TT_FORK),
   DIR(format_versions_list, TT_FORK),
+  DIR(parallel_consensus_parse, TT_FORK),
   END_OF_TESTCASES
 };
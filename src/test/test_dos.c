@@ -6,6 +6,7 @@
 #define CIRCUITLIST_PRIVATE
 
 #include "core/or/or.h"
+#include "app/config/config.h"
 #include "core/or/dos.h"
 #include "core/or/circuitlist.h"
 #include "lib/crypt_ops/crypto_rand.h"
@@ -17,6 +18,7 @@
 #include "feature/nodelist/routerlist.h"
 
 #include "feature/nodelist/networkstatus_st.h"
+#include "app/config/or_options_st.h"
 #include "core/or/or_connection_st.h"
 #include "feature/nodelist/routerstatus_st.h"
 
@@ -65,6 +67,7 @@ test_dos_conn_creation(void *arg)
 
   /* Initialize test data */
   or_connection_t or_conn;
+  memset(&or_conn, 0, sizeof(or_conn));
   time_t now = 1281533250; /* 2010-08-11 13:27:30 UTC */
   tt_int_op(AF_INET,OP_EQ, tor_addr_parse(&or_conn.real_addr,
                                           "18.0.0.1"));
@@ -138,6 +141,7 @@ test_dos_circuit_creation(void *arg)
 
   /* Initialize test data */
   or_connection_t or_conn;
+  memset(&or_conn, 0, sizeof(or_conn));
   time_t now = 1281533250; /* 2010-08-11 13:27:30 UTC */
   tt_int_op(AF_INET,OP_EQ, tor_addr_parse(&or_conn.real_addr,
                                           "18.0.0.1"));
@@ -202,6 +206,7 @@ test_dos_bucket_refill(void *arg)
   channel_init(chan);
   chan->is_client = 1;
   or_connection_t or_conn;
+  memset(&or_conn, 0, sizeof(or_conn));
   tt_int_op(AF_INET,OP_EQ, tor_addr_parse(&or_conn.real_addr,
                                           "18.0.0.1"));
   tor_addr_t *addr = &or_conn.real_addr;
@@ -418,6 +423,214 @@ test_dos_bucket_refill(void *arg)
   dos_free_all();
 }
 
+/** Test that in sketch mode, the connection tracker blocks clients who open
+ *  too many connections without adding them to the geoip cache. */
+static void
+test_dos_sketch_conn_creation(void *arg)
+{
+  (void) arg;
+  unsigned int i;
+
+  MOCK(get_param_cc_enabled, mock_enable_dos_protection);
+  MOCK(get_param_conn_enabled, mock_enable_dos_protection);
+  MOCK(get_param_sketch_enabled, mock_enable_dos_protection);
+
+  or_connection_t or_conn;
+  memset(&or_conn, 0, sizeof(or_conn));
+  time_t now = 1281533250; /* 2010-08-11 13:27:30 UTC */
+  update_approx_time(now);
+  tt_int_op(AF_INET,OP_EQ, tor_addr_parse(&or_conn.real_addr,
+                                          "18.0.0.1"));
+  tor_addr_t *addr = &or_conn.real_addr;
+
+  /* The test setup turns on entry statistics, which cache every client. */
+  get_options_mutable()->EntryStatistics = 0;
+  dos_init();
+  tt_u64_op(dos_sketch_get_allocation(), OP_GT, 0);
+  tt_int_op(dos_wants_client_entries(), OP_EQ, 0);
+  uint32_t max_concurrent_conns = get_param_conn_max_concurrent_count(NULL);
+
+  geoip_note_client_seen(GEOIP_CLIENT_CONNECT, addr, NULL, now);
+  for (i = 0; i < max_concurrent_conns; i++) {
+    dos_new_client_conn(&or_conn);
+  }
+  tt_uint_op(or_conn.tracked_in_dos_sketch, OP_EQ, 1);
+  tt_uint_op(or_conn.tracked_for_dos_mitigation, OP_EQ, 0);
+  /* Nothing went into the geoip cache. */
+  tt_ptr_op(geoip_lookup_client(addr, NULL, GEOIP_CLIENT_CONNECT), OP_EQ,
+            NULL);
+  tt_uint_op(dos_sketch_conn_estimate(addr), OP_EQ, max_concurrent_conns);
+  tt_int_op(DOS_CONN_DEFENSE_NONE, OP_EQ,
+            dos_conn_addr_get_defense_type(addr));
+
+  /* One more connection and we are over the limit. */
+  dos_new_client_conn(&or_conn);
+  tt_int_op(DOS_CONN_DEFENSE_CLOSE, OP_EQ,
+            dos_conn_addr_get_defense_type(addr));
+
+  /* Closing one brings us back under it. */
+  dos_close_client_conn(&or_conn);
+  tt_int_op(DOS_CONN_DEFENSE_NONE, OP_EQ,
+            dos_conn_addr_get_defense_type(addr));
+
+ done:
+  dos_free_all();
+}
+
+/** Test that in sketch mode, an address only gets a geoip cache entry once
+ *  it is a heavy hitter, and still gets detected. */
+static void
+test_dos_sketch_circuit_creation(void *arg)
+{
+  (void) arg;
+  unsigned int i;
+  clientmap_entry_t *entry;
+
+  MOCK(get_param_cc_enabled, mock_enable_dos_protection);
+  MOCK(get_param_conn_enabled, mock_enable_dos_protection);
+  MOCK(get_param_sketch_enabled, mock_enable_dos_protection);
+  MOCK(channel_get_addr_if_possible,
+       mock_channel_get_addr_if_possible);
+
+  channel_t *chan = tor_malloc_zero(sizeof(channel_t));
+  channel_init(chan);
+  chan->is_client = 1;
+
+  or_connection_t or_conn;
+  memset(&or_conn, 0, sizeof(or_conn));
+  time_t now = 1281533250; /* 2010-08-11 13:27:30 UTC */
+  update_approx_time(now);
+  tt_int_op(AF_INET,OP_EQ, tor_addr_parse(&or_conn.real_addr,
+                                          "18.0.0.1"));
+  tor_addr_t *addr = &or_conn.real_addr;
+
+  dos_init();
+  uint32_t max_circuit_count = get_param_cc_circuit_burst(NULL);
+  uint32_t min_conc_conns_for_cc =
+    get_param_cc_min_concurrent_connection(NULL);
+  uint32_t promote_at = max_circuit_count / 2;
+
+  for (i = 0; i < min_conc_conns_for_cc ; i++) {
+    dos_new_client_conn(&or_conn);
+  }
+
+  /* Below the heavy hitter threshold, nothing is cached. */
+  for (i = 0; i < promote_at - 1; i++) {
+    dos_cc_new_create_cell(chan);
+  }
+  tt_uint_op(dos_sketch_circ_estimate(addr), OP_EQ, promote_at - 1);
+  tt_ptr_op(geoip_lookup_client(addr, NULL, GEOIP_CLIENT_CONNECT), OP_EQ,
+            NULL);
+  tt_u64_op(dos_sketch_get_n_promoted(), OP_EQ, 0);
+
+  /* Reaching it promotes the address. */
+  dos_cc_new_create_cell(chan);
+  entry = geoip_lookup_client(addr, NULL, GEOIP_CLIENT_CONNECT);
+  tt_assert(entry);
+  tt_u64_op(dos_sketch_get_n_promoted(), OP_EQ, 1);
+  /* The circuits that the sketch counted come out of the first bucket. */
+  tt_uint_op(entry->dos_stats.cc_stats.circuit_bucket, OP_EQ,
+             max_circuit_count - promote_at);
+  tt_int_op(DOS_CC_DEFENSE_NONE, OP_EQ, dos_cc_get_defense_type(chan));
+
+  /* From here on, the exact bucket of the entry decides, so the whole burst
+   * is all the address gets. */
+  for (i = 0; i < max_circuit_count - promote_at - 1; i++) {
+    dos_cc_new_create_cell(chan);
+  }
+  tt_int_op(DOS_CC_DEFENSE_NONE, OP_EQ, dos_cc_get_defense_type(chan));
+  dos_cc_new_create_cell(chan);
+  tt_int_op(DOS_CC_DEFENSE_REFUSE_CELL, OP_EQ, dos_cc_get_defense_type(chan));
+  tt_u64_op(dos_sketch_get_n_promoted(), OP_EQ, 1);
+
+ done:
+  tor_free(chan);
+  dos_free_all();
+}
+
+/** Test the estimates of the sketch under collisions, and its decay. */
+static void
+test_dos_sketch_estimates(void *arg)
+{
+  (void) arg;
+  unsigned int i;
+  tor_addr_t addr;
+  or_connection_t *conns = NULL;
+  const unsigned n_clients = 4000, heavy_conns = 150;
+  size_t cache_before;
+
+  MOCK(get_param_cc_enabled, mock_enable_dos_protection);
+  MOCK(get_param_conn_enabled, mock_enable_dos_protection);
+  MOCK(get_param_sketch_enabled, mock_enable_dos_protection);
+
+  time_t now = 1281533250; /* 2010-08-11 13:27:30 UTC */
+  update_approx_time(now);
+
+  /* A small sketch, so there are plenty of collisions. */
+  get_options_mutable()->DoSSketchWidth = 1000;
+  get_options_mutable()->EntryStatistics = 0;
+  dos_init();
+  tt_uint_op(get_param_sketch_width(NULL), OP_EQ, 512);
+  tt_u64_op(dos_sketch_get_allocation(), OP_EQ,
+            sizeof(dos_sketch_t) + 2 * DOS_SKETCH_DEPTH * 512 * 4);
+
+  /* Many clients with one connection each, and one with many. None of this
+   * touches the geoip cache. */
+  cache_before = geoip_client_cache_total_allocation();
+  conns = tor_calloc(n_clients + 1, sizeof(or_connection_t));
+  for (i = 0; i < n_clients; i++) {
+    tor_addr_from_ipv4h(&conns[i].real_addr, 0x12000000 + i);
+    geoip_note_client_seen(GEOIP_CLIENT_CONNECT, &conns[i].real_addr, NULL,
+                           now);
+    dos_new_client_conn(&conns[i]);
+  }
+  tor_addr_from_ipv4h(&conns[n_clients].real_addr, 0x13000001);
+  for (i = 0; i < heavy_conns; i++) {
+    dos_new_client_conn(&conns[n_clients]);
+  }
+  tt_u64_op(geoip_client_cache_total_allocation(), OP_EQ, cache_before);
+
+  /* Estimates are never too low, and the heavy client is over the limit. */
+  for (i = 0; i < n_clients; i++) {
+    tt_uint_op(dos_sketch_conn_estimate(&conns[i].real_addr), OP_GE, 1);
+  }
+  tt_uint_op(dos_sketch_conn_estimate(&conns[n_clients].real_addr), OP_GE,
+             heavy_conns);
+  tt_int_op(DOS_CONN_DEFENSE_CLOSE, OP_EQ,
+            dos_conn_addr_get_defense_type(&conns[n_clients].real_addr));
+
+  /* Closing every connection empties the sketch. */
+  for (i = 0; i < n_clients; i++) {
+    dos_close_client_conn(&conns[i]);
+  }
+  for (i = 0; i < heavy_conns; i++) {
+    dos_close_client_conn(&conns[n_clients]);
+  }
+  tt_uint_op(dos_sketch_conn_estimate(&conns[n_clients].real_addr), OP_EQ, 0);
+  tt_uint_op(dos_sketch_conn_estimate(&conns[0].real_addr), OP_EQ, 0);
+
+  /* Circuit counts halve every half-life. */
+  tor_addr_from_ipv4h(&addr, 0x14000001);
+  tt_uint_op(dos_sketch_circ_estimate(&addr), OP_EQ, 0);
+  for (i = 0; i < 40; i++) {
+    /* Stay under the heavy hitter threshold. */
+    (void) dos_sketch_note_circuit(&addr);
+  }
+  tt_uint_op(dos_sketch_circ_estimate(&addr), OP_EQ, 40);
+  dos_sketch_decay(now + DOS_SKETCH_HALF_LIFE - 1);
+  tt_uint_op(dos_sketch_circ_estimate(&addr), OP_EQ, 40);
+  dos_sketch_decay(now + DOS_SKETCH_HALF_LIFE);
+  tt_uint_op(dos_sketch_circ_estimate(&addr), OP_EQ, 20);
+  dos_sketch_decay(now + 3 * DOS_SKETCH_HALF_LIFE);
+  tt_uint_op(dos_sketch_circ_estimate(&addr), OP_EQ, 5);
+  dos_sketch_decay(now + 100 * DOS_SKETCH_HALF_LIFE);
+  tt_uint_op(dos_sketch_circ_estimate(&addr), OP_EQ, 0);
+
+ done:
+  tor_free(conns);
+  dos_free_all();
+}
+
 /* Test if we avoid counting a known relay. */
 static void
 test_known_relay(void *arg)
@@ -443,6 +656,7 @@ test_known_relay(void *arg)
 
   /* Setup an OR conn so we can pass it to the DoS subsystem. */
   or_connection_t or_conn;
+  memset(&or_conn, 0, sizeof(or_conn));
   tor_addr_parse(&or_conn.real_addr, "42.42.42.42");
 
   rs = tor_malloc_zero(sizeof(*rs));
@@ -498,5 +712,10 @@ struct testcase_t dos_tests[] = {
   { "bucket_refill", test_dos_bucket_refill, TT_FORK, NULL, NULL },
   { "known_relay" , test_known_relay, TT_FORK,
     NULL, NULL },
+  { "sketch_conn_creation", test_dos_sketch_conn_creation, TT_FORK,
+    NULL, NULL },
+  { "sketch_circuit_creation", test_dos_sketch_circuit_creation, TT_FORK,
+    NULL, NULL },
+  { "sketch_estimates", test_dos_sketch_estimates, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
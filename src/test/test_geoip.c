@@ -12,8 +12,13 @@
 #include "app/config/config.h"
 #include "lib/geoip/geoip.h"
 #include "feature/stats/geoip_stats.h"
+#include "lib/crypt_ops/crypto_rand.h"
 #include "test/test.h"
 
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+
   /* Record odd numbered fake-IPs using ipv6, even numbered fake-IPs
    * using ipv4.  Since our fake geoip database is the same between
    * ipv4 and ipv6, we should get the same result no matter which
@@ -564,6 +569,189 @@ test_geoip_load_2nd_file(void *arg)
   tor_free(fname_empty);
 }
 
+/** Compile the loaded GeoIP table for <b>family</b>, write it to a file
+ * called <b>name</b>, and return the path of that file. */
+static char *
+write_compiled_geoip(sa_family_t family, const char *name)
+{
+  char *buf = NULL, *fname = tor_strdup(get_fname(name));
+  size_t len = 0;
+
+  tt_int_op(0, OP_EQ, geoip_compile_db(family, &buf, &len));
+  tt_int_op(0, OP_EQ, write_bytes_to_file(fname, buf, len, 1));
+  tor_free(buf);
+  return fname;
+
+ done:
+  tor_free(buf);
+  tor_free(fname);
+  return NULL;
+}
+
+/** Return a newly allocated string listing the country of each IPv4 address
+ * from <b>low</b> to <b>high</b>. */
+static char *
+geoip_list_ipv4_countries(uint32_t low, uint32_t high)
+{
+  smartlist_t *sl = smartlist_new();
+  uint64_t a;
+  char *result;
+  for (a = low; a <= high; ++a) {
+    smartlist_add_strdup(sl,
+              geoip_get_country_name(geoip_get_country_by_ipv4((uint32_t)a)));
+  }
+  result = smartlist_join_strings(sl, ",", 0, NULL);
+  SMARTLIST_FOREACH(sl, char *, cp, tor_free(cp));
+  smartlist_free(sl);
+  return result;
+}
+
+/** Check that compiled GeoIP files give the same answers as the text files
+ * they come from. */
+static void
+test_geoip_load_compiled(void *arg)
+{
+  (void)arg;
+  char *fname_db = NULL, *text_result = NULL, *db_result = NULL;
+  char *content = NULL, *digest = NULL, *buf = NULL;
+  const char *fname = get_fname("geoip_small");
+  struct in6_addr iaddr6;
+  uint32_t addrs[1000];
+  int countries[1000];
+  struct stat st;
+  int i, n;
+
+  /* For every table size up to 20, with gaps between the ranges, check the
+   * addresses in and around all of them. */
+  for (n = 1; n <= 20; ++n) {
+    smartlist_t *lines = smartlist_new();
+    for (i = 1; i <= n; ++i) {
+      smartlist_add_asprintf(lines, "%d,%d,%c%c\n", 10*i, 10*i + 4,
+                             'A' + i % 26, 'A' + n % 26);
+    }
+    content = smartlist_join_strings(lines, "", 0, NULL);
+    SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+    smartlist_free(lines);
+
+    tt_int_op(0, OP_EQ, write_str_to_file(fname, content, 0));
+    tt_int_op(0, OP_EQ, geoip_load_file(AF_INET, fname, LOG_WARN));
+    text_result = geoip_list_ipv4_countries(0, 10*n + 20);
+    tt_int_op(-1, OP_NE, geoip_get_country_by_ipv4(0));
+    fname_db = write_compiled_geoip(AF_INET, "geoip_small.db");
+    tt_assert(fname_db);
+
+    tt_int_op(0, OP_EQ, geoip_load_file(AF_INET, fname_db, LOG_WARN));
+    db_result = geoip_list_ipv4_countries(0, 10*n + 20);
+    tt_str_op(text_result, OP_EQ, db_result);
+    tt_int_op(0, OP_EQ, geoip_get_country_by_ipv4(UINT32_MAX));
+
+    tor_free(content);
+    tor_free(text_result);
+    tor_free(db_result);
+    tor_free(fname_db);
+  }
+
+  /* A range that goes up to the highest address. */
+  tt_int_op(0, OP_EQ, write_str_to_file(fname,
+                                        "5,7,AB\n4294967290,4294967295,CD\n",
+                                        0));
+  tt_int_op(0, OP_EQ, geoip_load_file(AF_INET, fname, LOG_WARN));
+  fname_db = write_compiled_geoip(AF_INET, "geoip_small.db");
+  tt_assert(fname_db);
+  tt_int_op(0, OP_EQ, geoip_load_file(AF_INET, fname_db, LOG_WARN));
+  tt_str_op("cd", OP_EQ,
+            geoip_get_country_name(geoip_get_country_by_ipv4(UINT32_MAX)));
+  tt_str_op("??", OP_EQ,
+            geoip_get_country_name(geoip_get_country_by_ipv4(8)));
+  tor_free(fname_db);
+
+  /* A realistic table: same answers, and the same digest. */
+  fname = get_fname("geoip");
+  tt_int_op(0, OP_EQ, write_str_to_file(fname, GEOIP_CONTENT, 1));
+  tt_int_op(0, OP_EQ, geoip_load_file(AF_INET, fname, LOG_WARN));
+  digest = tor_strdup(geoip_db_digest(AF_INET));
+  text_result = geoip_list_ipv4_countries(134445000, 134455000);
+  for (i = 0; i < 1000; ++i) {
+    addrs[i] = 134445000 + crypto_rand_int(135433000 - 134445000);
+    countries[i] = geoip_get_country_by_ipv4(addrs[i]);
+  }
+  fname_db = write_compiled_geoip(AF_INET, "geoip.db");
+  tt_assert(fname_db);
+  tt_int_op(0, OP_EQ, geoip_load_file(AF_INET, fname_db, LOG_WARN));
+  tt_assert(geoip_is_loaded(AF_INET));
+  tt_str_op(digest, OP_EQ, geoip_db_digest(AF_INET));
+  db_result = geoip_list_ipv4_countries(134445000, 134455000);
+  tt_str_op(text_result, OP_EQ, db_result);
+  for (i = 0; i < 1000; ++i) {
+    tt_int_op(countries[i], OP_EQ, geoip_get_country_by_ipv4(addrs[i]));
+  }
+
+  /* A compiled file for the wrong family, or a damaged one, is refused, and
+   * leaves the current table in place. */
+  tt_int_op(-1, OP_EQ, geoip_load_file(AF_INET6, fname_db, LOG_INFO));
+  buf = read_file_to_str(fname_db, RFTS_BIN, &st);
+  tt_assert(buf);
+  tt_int_op(0, OP_EQ, write_bytes_to_file(fname_db, buf,
+                                          (size_t)st.st_size - 1, 1));
+  tt_int_op(-1, OP_EQ, geoip_load_file(AF_INET, fname_db, LOG_INFO));
+  tt_str_op(digest, OP_EQ, geoip_db_digest(AF_INET));
+  tt_str_op("us", OP_EQ,
+            geoip_get_country_name(geoip_get_country_by_ipv4(134447104)));
+
+  /* A bad country code is refused before any of the codes ahead of it are
+   * added to the country list.  The codes start right after the 48-byte
+   * header. */
+  n = geoip_get_n_countries();
+  memcpy(buf + 48, "QX\x01\x01", 4);
+  tt_int_op(0, OP_EQ, write_bytes_to_file(fname_db, buf,
+                                          (size_t)st.st_size, 1));
+  tt_int_op(-1, OP_EQ, geoip_load_file(AF_INET, fname_db, LOG_INFO));
+  tt_int_op(n, OP_EQ, geoip_get_n_countries());
+  tt_int_op(-1, OP_EQ, geoip_get_country("qx"));
+  tt_str_op(digest, OP_EQ, geoip_db_digest(AF_INET));
+
+  /* IPv6. */
+  fname = get_fname("geoip6");
+  tt_int_op(0, OP_EQ, write_str_to_file(fname,
+     "2001:4830:6010::,2001:4830:601f:ffff:ffff:ffff:ffff:ffff,GB\n"
+     "2001:4830:6020::,2001:4830:ffff:ffff:ffff:ffff:ffff:ffff,US\n"
+     "2001:4878:204::,2001:4878:204:ffff:ffff:ffff:ffff:ffff,DE\n", 1));
+  tt_int_op(0, OP_EQ, geoip_load_file(AF_INET6, fname, LOG_WARN));
+  tor_free(fname_db);
+  fname_db = write_compiled_geoip(AF_INET6, "geoip6.db");
+  tt_assert(fname_db);
+  tt_int_op(0, OP_EQ, geoip_load_file(AF_INET6, fname_db, LOG_WARN));
+  tt_assert(geoip_is_loaded(AF_INET6));
+#define CHECK_IPV6(addr, cc) do {                                       \
+    tor_inet_pton(AF_INET6, (addr), &iaddr6);                           \
+    tt_str_op((cc), OP_EQ,                                              \
+              geoip_get_country_name(geoip_get_country_by_ipv6(&iaddr6))); \
+  } while (0)
+  CHECK_IPV6("::", "??");
+  CHECK_IPV6("2001:4830:600f:ffff:ffff:ffff:ffff:ffff", "??");
+  CHECK_IPV6("2001:4830:6010::", "gb");
+  CHECK_IPV6("2001:4830:601f:ffff:ffff:ffff:ffff:ffff", "gb");
+  CHECK_IPV6("2001:4830:6020::", "us");
+  CHECK_IPV6("2001:4830:ffff::1", "us");
+  CHECK_IPV6("2001:4831::", "??");
+  CHECK_IPV6("2001:4878:204::8", "de");
+  CHECK_IPV6("ffff::", "??");
+#undef CHECK_IPV6
+
+  /* Freeing everything unmaps the files. */
+  geoip_free_all();
+  tt_assert(!geoip_is_loaded(AF_INET));
+  tt_assert(!geoip_is_loaded(AF_INET6));
+
+ done:
+  tor_free(content);
+  tor_free(text_result);
+  tor_free(db_result);
+  tor_free(fname_db);
+  tor_free(digest);
+  tor_free(buf);
+}
+
 #define ENT(name)                                                       \
   { #name, test_ ## name , 0, NULL, NULL }
 #define FORK(name)                                                      \
@@ -575,6 +763,7 @@ struct testcase_t geoip_tests[] = {
   { "load_file", test_geoip_load_file, TT_FORK, NULL, NULL },
   { "load_file6", test_geoip6_load_file, TT_FORK, NULL, NULL },
   { "load_2nd_file", test_geoip_load_2nd_file, TT_FORK, NULL, NULL },
+  { "load_compiled", test_geoip_load_compiled, TT_FORK, NULL, NULL },
 
   END_OF_TESTCASES
 };
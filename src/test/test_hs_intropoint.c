@@ -678,6 +678,8 @@ test_introduce1_suitable_circuit(void *arg)
     /* Bogus pointer, the check is against NULL on n_chan. */
     circ->base_.n_chan = (channel_t *) circ;
     ret = circuit_is_suitable_for_introduce1(circ);
+    /* Don't let circuit_free_() look for us in the bogus channel's map. */
+    circ->base_.n_chan = NULL;
     circuit_free_(TO_CIRCUIT(circ));
     tt_int_op(ret, OP_EQ, 0);
   }
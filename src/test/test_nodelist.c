@@ -11,6 +11,7 @@
 #include "core/or/or.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "feature/nodelist/networkstatus.h"
+#include "feature/nodelist/node_select.h"
 #include "feature/nodelist/nodefamily.h"
 #include "feature/nodelist/nodelist.h"
 #include "feature/nodelist/torcert.h"
@@ -640,6 +641,112 @@ test_nodelist_nodefamily_canonicalize(void *arg)
   tor_free(c);
 }
 
+/* Make sure that router_choose_random_node() weights nodes by bandwidth,
+ * respects its exclusions, and notices when the nodelist changes. */
+static void
+test_nodelist_weighted_choice(void *arg)
+{
+#define N_NODES 6
+#define N_TRIALS 20000
+  static const uint32_t bw_kb[N_NODES] = { 0, 1, 2, 3, 4, 10 };
+  routerstatus_t *rs[N_NODES];
+  const node_t *nodes[N_NODES];
+  int counts[N_NODES];
+  smartlist_t *excluded = smartlist_new();
+  networkstatus_t *ns;
+  uint64_t generation;
+  int i, j;
+  (void)arg;
+
+  ns = tor_malloc_zero(sizeof(networkstatus_t));
+  ns->flavor = FLAV_NS;
+  ns->routerstatus_list = smartlist_new();
+  dummy_ns = ns;
+  MOCK(networkstatus_get_latest_consensus,
+       mock_networkstatus_get_latest_consensus);
+
+  for (i = 0; i < N_NODES; ++i) {
+    rs[i] = tor_malloc_zero(sizeof(*rs[i]));
+    crypto_rand(rs[i]->identity_digest, sizeof(rs[i]->identity_digest));
+    rs[i]->is_flagged_running = rs[i]->is_valid = 1;
+    rs[i]->is_fast = rs[i]->is_stable = 1;
+    rs[i]->has_bandwidth = 1;
+    rs[i]->bandwidth_kb = bw_kb[i];
+    rs[i]->pv.supports_extend2_cells = 1;
+    smartlist_add(ns->routerstatus_list, rs[i]);
+  }
+
+  generation = nodelist_get_generation();
+  nodelist_set_consensus(ns);
+  tt_u64_op(generation, OP_NE, nodelist_get_generation());
+  for (i = 0; i < N_NODES; ++i) {
+    nodes[i] = node_get_by_id(rs[i]->identity_digest);
+    tt_assert(nodes[i]);
+  }
+
+  /* Every node comes out in proportion to its bandwidth, and the node with
+   * no bandwidth never comes out. */
+  memset(counts, 0, sizeof(counts));
+  for (j = 0; j < N_TRIALS; ++j) {
+    const node_t *node = router_choose_random_node(NULL, NULL, 0);
+    for (i = 0; i < N_NODES; ++i) {
+      if (node == nodes[i])
+        ++counts[i];
+    }
+  }
+  tt_int_op(counts[0], OP_EQ, 0);
+  for (i = 1; i < N_NODES; ++i) {
+    int expected = N_TRIALS * bw_kb[i] / 20;
+    tt_int_op(counts[i], OP_GT, expected - N_TRIALS / 20);
+    tt_int_op(counts[i], OP_LT, expected + N_TRIALS / 20);
+  }
+
+  /* Excluded nodes never come out. */
+  smartlist_add(excluded, (void*)nodes[5]);
+  smartlist_add(excluded, (void*)nodes[4]);
+  for (j = 0; j < 1000; ++j) {
+    const node_t *node = router_choose_random_node(excluded, NULL, 0);
+    tt_ptr_op(node, OP_NE, nodes[5]);
+    tt_ptr_op(node, OP_NE, nodes[4]);
+    tt_ptr_op(node, OP_NE, nodes[0]);
+  }
+
+  /* If only the node with no bandwidth is left, we still choose it. */
+  for (i = 1; i < 4; ++i)
+    smartlist_add(excluded, (void*)nodes[i]);
+  tt_ptr_op(router_choose_random_node(excluded, NULL, 0), OP_EQ, nodes[0]);
+  smartlist_clear(excluded);
+
+  /* A new consensus that takes away the biggest node's bandwidth takes
+   * effect right away. */
+  rs[5]->bandwidth_kb = 0;
+  nodelist_set_consensus(ns);
+  for (j = 0; j < 1000; ++j) {
+    const node_t *node = router_choose_random_node(NULL, NULL, 0);
+    tt_ptr_op(node, OP_NE, nodes[5]);
+    tt_ptr_op(node, OP_NE, nodes[0]);
+  }
+
+  /* So does a node that stops running. */
+  node_get_mutable_by_id(rs[4]->identity_digest)->is_running = 0;
+  for (j = 0; j < 1000; ++j) {
+    const node_t *node = router_choose_random_node(NULL, NULL, 0);
+    tt_ptr_op(node, OP_NE, nodes[4]);
+  }
+
+ done:
+  smartlist_free(excluded);
+  nodelist_free_all();
+  node_select_free_all();
+  for (i = 0; i < N_NODES; ++i)
+    tor_free(rs[i]);
+  smartlist_clear(ns->routerstatus_list);
+  networkstatus_vote_free(ns);
+  UNMOCK(networkstatus_get_latest_consensus);
+#undef N_NODES
+#undef N_TRIALS
+}
+
 #define NODE(name, flags) \
   { #name, test_nodelist_##name, (flags), NULL, NULL }
 
@@ -654,5 +761,6 @@ struct testcase_t nodelist_tests[] = {
   NODE(nickname_matches, 0),
   NODE(node_nodefamily, TT_FORK),
   NODE(nodefamily_canonicalize, 0),
+  NODE(weighted_choice, TT_FORK),
   END_OF_TESTCASES
 };
@@ -90,7 +90,8 @@ server1(int argc, char **argv)
   keys = tor_malloc(keybytes);
   hexkeys = tor_malloc(keybytes*2+1);
   if (onion_skin_ntor_server_handshake(
-                                msg_in, keymap, NULL, node_id, msg_out, keys,
+                                msg_in, keymap, NULL, NULL, node_id, msg_out,
+                                keys,
                                 (size_t)keybytes)<0) {
     fprintf(stderr, "handshake failed");
     result = 2;
@@ -273,6 +273,46 @@ test_parsecommon_get_next_token_concat_args(void *arg)
   memarea_drop_all(area);
 }
 
+static void
+test_parsecommon_get_next_token_long_args(void *arg)
+{
+  memarea_t *area = memarea_new();
+  /* Arguments longer than 16 bytes, separated by tabs and '#', and
+   * keywords that share a first character. */
+  const char *str =
+    "fingerprint-x ABCDEFGHIJKLMNOPQRSTUVWXYZ\tabcdefghijklmnopqrst uv\n"
+    "family $0123456789012345678901234567890123456789#comment\n";
+  const char *end = str + strlen(str);
+  const char **s = &str;
+  token_rule_t table[] = {
+    T01("fingerprint", K_FINGERPRINT, GE(1), NO_OBJ),
+    T01("fingerprint-x", K_FAMILY, GE(1), NO_OBJ),
+    T01("family", K_PROTO, ARGS, NO_OBJ),
+    END_OF_TABLE
+  };
+  directory_token_t *token;
+  (void)arg;
+
+  token = get_next_token(area, s, end, table);
+  tt_int_op(token->tp, OP_EQ, K_FAMILY);
+  tt_int_op(token->n_args, OP_EQ, 3);
+  tt_str_op(token->args[0], OP_EQ, "ABCDEFGHIJKLMNOPQRSTUVWXYZ");
+  tt_str_op(token->args[1], OP_EQ, "abcdefghijklmnopqrst");
+  tt_str_op(token->args[2], OP_EQ, "uv");
+
+  token = get_next_token(area, s, end, table);
+  tt_int_op(token->tp, OP_EQ, K_PROTO);
+  /* A '#' ends an argument, but the rest of the line is not a comment. */
+  tt_int_op(token->n_args, OP_EQ, 2);
+  tt_str_op(token->args[0], OP_EQ,
+            "$0123456789012345678901234567890123456789");
+  tt_str_op(token->args[1], OP_EQ, "comment");
+  tt_ptr_op(*s, OP_EQ, end);
+
+ done:
+  memarea_drop_all(area);
+}
+
 static void
 test_parsecommon_get_next_token_parse_keys(void *arg)
 {
@@ -582,6 +622,7 @@ struct testcase_t parsecommon_tests[] = {
   PARSECOMMON_TEST(tokenize_string_no_annotations),
   PARSECOMMON_TEST(get_next_token_success),
   PARSECOMMON_TEST(get_next_token_concat_args),
+  PARSECOMMON_TEST(get_next_token_long_args),
   PARSECOMMON_TEST(get_next_token_parse_keys),
   PARSECOMMON_TEST(get_next_token_object),
   PARSECOMMON_TEST(get_next_token_err_too_many_args),
@@ -9,6 +9,7 @@
 #include "core/or/policies.h"
 #include "feature/dirparse/policy_parse.h"
 #include "feature/relay/router.h"
+#include "lib/crypt_ops/crypto_rand.h"
 #include "lib/encoding/confline.h"
 #include "test/test.h"
 
@@ -2487,6 +2488,179 @@ test_policies_fascist_firewall_choose_address(void *arg)
 #undef CHECK_CHOSEN_ADDR_NODE
 #undef CHECK_CHOSEN_ADDR_RN
 
+/** Helper: return a random canonical policy entry whose address is near
+ * one of a few prefixes, so that random lookups often match it. */
+static addr_policy_t *
+compiled_test_random_entry(void)
+{
+  static const uint16_t ports[] = { 1, 21, 22, 80, 443, 1024, 6667, 65535 };
+  addr_policy_t e;
+  uint16_t a = ports[crypto_rand_int(ARRAY_LENGTH(ports))];
+  uint16_t b = ports[crypto_rand_int(ARRAY_LENGTH(ports))];
+
+  memset(&e, 0, sizeof(e));
+  e.policy_type = crypto_rand_int(2) ? ADDR_POLICY_ACCEPT : ADDR_POLICY_REJECT;
+  e.prt_min = MIN(a, b);
+  e.prt_max = MAX(a, b);
+  if (crypto_rand_int(2)) {
+    uint32_t addr = 0x0a000000u | (crypto_rand_int(4) << 16) |
+      crypto_rand_int(1 << 16);
+    tor_addr_from_ipv4h(&e.addr, addr);
+    e.maskbits = crypto_rand_int(33);
+  } else {
+    uint8_t addr[16] = { 0x20, 0x01, 0x0d, 0xb8 };
+    addr[4] = crypto_rand_int(4);
+    crypto_rand((char *)addr + 5, sizeof(addr) - 5);
+    tor_addr_from_ipv6_bytes(&e.addr, (const char *)addr);
+    e.maskbits = crypto_rand_int(129);
+  }
+  return addr_policy_get_canonical_entry(&e);
+}
+
+/** Helper: set <b>addr</b> to a random address that is likely to match
+ * some entries from compiled_test_random_entry(). */
+static void
+compiled_test_random_addr(tor_addr_t *addr)
+{
+  if (crypto_rand_int(2)) {
+    tor_addr_from_ipv4h(addr, 0x0a000000u | (crypto_rand_int(4) << 16) |
+                        crypto_rand_int(1 << 16));
+  } else {
+    uint8_t bytes[16] = { 0x20, 0x01, 0x0d, 0xb8 };
+    bytes[4] = crypto_rand_int(4);
+    crypto_rand((char *)bytes + 5, sizeof(bytes) - 5);
+    tor_addr_from_ipv6_bytes(addr, (const char *)bytes);
+  }
+}
+
+static void
+test_policies_compiled(void *arg)
+{
+  static const uint16_t ports[] = { 0, 1, 2, 21, 22, 23, 79, 80, 81, 442,
+                                    443, 444, 1023, 1024, 6667, 65534, 65535 };
+  smartlist_t *policy = NULL, *policy2 = NULL;
+  compiled_policy_t *cp = NULL, *cp2 = NULL;
+  tor_addr_t addr;
+  int i, j, k;
+  (void)arg;
+
+  /* A NULL policy accepts everything, compiled or not. */
+  tt_ptr_op(compiled_policy_get(NULL), OP_EQ, NULL);
+  tor_addr_from_ipv4h(&addr, 0x01020304u);
+  tt_int_op(compare_tor_addr_to_compiled_policy(&addr, 80, NULL), OP_EQ,
+            ADDR_POLICY_ACCEPTED);
+
+  /* Compiled policies must agree with the linear walk everywhere. */
+  for (i = 0; i < 200; ++i) {
+    int n = crypto_rand_int(i < 100 ? 20 : 200);
+    policy = smartlist_new();
+    for (j = 0; j < n; ++j)
+      smartlist_add(policy, compiled_test_random_entry());
+    cp = compiled_policy_get(policy);
+    tt_assert(cp);
+
+    for (j = 0; j < 200; ++j) {
+      uint16_t port = ports[crypto_rand_int(ARRAY_LENGTH(ports))];
+      if (j % 4 == 0)
+        port = crypto_rand_int(65536);
+      compiled_test_random_addr(&addr);
+      tt_int_op(compare_tor_addr_to_compiled_policy(&addr, port, cp), OP_EQ,
+                compare_tor_addr_to_addr_policy(&addr, port, policy));
+      /* Make sure we also try the addresses of the entries themselves. */
+      if (n) {
+        const addr_policy_t *e = smartlist_get(policy, crypto_rand_int(n));
+        tt_int_op(compare_tor_addr_to_compiled_policy(&e->addr, port, cp),
+                  OP_EQ,
+                  compare_tor_addr_to_addr_policy(&e->addr, port, policy));
+      }
+    }
+    /* Unknown addresses take the slow path. */
+    tor_addr_make_unspec(&addr);
+    for (k = 1; k < (int)ARRAY_LENGTH(ports); ++k) {
+      tt_int_op(compare_tor_addr_to_compiled_policy(&addr, ports[k], cp),
+                OP_EQ,
+                compare_tor_addr_to_addr_policy(&addr, ports[k], policy));
+    }
+
+    compiled_policy_free(cp);
+    addr_policy_list_free(policy);
+  }
+
+  /* Equal policies share a compiled policy, even if their entries aren't
+   * canonical. */
+  policy = smartlist_new();
+  policy2 = smartlist_new();
+  for (j = 0; j < 10; ++j) {
+    addr_policy_t *e = compiled_test_random_entry();
+    smartlist_add(policy, e);
+    smartlist_add(policy2, tor_memdup(e, sizeof(*e)));
+    ((addr_policy_t *)smartlist_get(policy2, j))->is_canonical = 0;
+    ((addr_policy_t *)smartlist_get(policy2, j))->refcnt = 1;
+  }
+  cp = compiled_policy_get(policy);
+  cp2 = compiled_policy_get(policy2);
+  tt_ptr_op(cp, OP_EQ, cp2);
+  compiled_policy_free(cp2);
+  addr_policy_list_free(policy2);
+  smartlist_add(policy, compiled_test_random_entry());
+  cp2 = compiled_policy_get(policy);
+  tt_ptr_op(cp, OP_NE, cp2);
+  compiled_policy_free(cp);
+  compiled_policy_free(cp2);
+
+  /* Policies that are too big to compile cheaply stay uncompiled. */
+  while (smartlist_len(policy) < 256)
+    smartlist_add(policy, compiled_test_random_entry());
+  cp = compiled_policy_get(policy);
+  tt_assert(cp);
+  compiled_policy_free(cp);
+  smartlist_add(policy, compiled_test_random_entry());
+  tt_ptr_op(compiled_policy_get(policy), OP_EQ, NULL);
+
+ done:
+  compiled_policy_free(cp);
+  compiled_policy_free(cp2);
+  addr_policy_list_free(policy);
+  addr_policy_list_free(policy2);
+}
+
+static void
+test_policies_short_policy_search(void *arg)
+{
+  static const char *summaries[] = {
+    "accept 22,80-90,443,6660-6669",
+    "reject 1-24,26-118,120-65535",
+    "accept 443,80,22",
+    "accept 80-90,85-100",
+    "reject 65535",
+  };
+  short_policy_t *policy = NULL;
+  unsigned i;
+  int port;
+  (void)arg;
+
+  for (i = 0; i < ARRAY_LENGTH(summaries); ++i) {
+    policy = parse_short_policy(summaries[i]);
+    tt_assert(policy);
+    tt_int_op(policy->entries_are_sorted, OP_EQ, i < 2 || i == 4);
+    for (port = 1; port < 65536; ++port) {
+      int j, match = 0;
+      for (j = 0; j < (int)policy->n_entries; ++j) {
+        if (policy->entries[j].min_port <= port &&
+            port <= policy->entries[j].max_port)
+          match = 1;
+      }
+      tt_int_op(compare_tor_addr_to_short_policy(NULL, port, policy), OP_EQ,
+                (match == policy->is_accept) ?
+                ADDR_POLICY_PROBABLY_ACCEPTED : ADDR_POLICY_REJECTED);
+    }
+    short_policy_free(policy);
+  }
+
+ done:
+  short_policy_free(policy);
+}
+
 struct testcase_t policy_tests[] = {
   { "router_dump_exit_policy_to_string", test_dump_exit_policy_to_string, 0,
     NULL, NULL },
@@ -2501,5 +2675,7 @@ struct testcase_t policy_tests[] = {
     test_policies_fascist_firewall_allows_address, 0, NULL, NULL },
   { "fascist_firewall_choose_address",
     test_policies_fascist_firewall_choose_address, 0, NULL, NULL },
+  { "compiled", test_policies_compiled, 0, NULL, NULL },
+  { "short_policy_search", test_policies_short_policy_search, 0, NULL, NULL },
   END_OF_TESTCASES
 };
@@ -9,7 +9,11 @@
 #include "core/or/circuitlist.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "core/or/relay.h"
+#define RELAY_SHARD_PRIVATE
+#include "core/or/relay_shard.h"
 #include "core/crypto/relay_crypto.h"
+#include "lib/evloop/workqueue.h"
+#include "lib/time/compat_time.h"
 
 #include "core/or/cell_st.h"
 #include "core/or/or_circuit_st.h"
@@ -179,12 +183,256 @@ test_relaycrypt_inbound(void *arg)
   ;
 }
 
+#define N_BATCH_CELLS 35
+
+/* As test_relaycrypt_outbound, but decrypt the cells in batches. */
+static void
+test_relaycrypt_outbound_batch(void *arg)
+{
+  testing_circuitset_t *cs = arg;
+  tt_assert(cs);
+
+  relay_header_t rh;
+  cell_t orig[N_BATCH_CELLS];
+  cell_t encrypted[N_BATCH_CELLS];
+  cell_t *cells[N_BATCH_CELLS];
+  crypt_path_t *layer_hints[N_BATCH_CELLS];
+  char recognized[N_BATCH_CELLS];
+  int i, j, k;
+
+  for (i = 0; i < 4; ++i) {
+    for (k = 0; k < N_BATCH_CELLS; ++k) {
+      crypto_rand((char *)&orig[k], sizeof(orig[k]));
+      relay_header_unpack(&rh, orig[k].payload);
+      rh.recognized = 0;
+      memset(rh.integrity, 0, sizeof(rh.integrity));
+      relay_header_pack(orig[k].payload, &rh);
+      memcpy(&encrypted[k], &orig[k], sizeof(orig[k]));
+      cells[k] = &encrypted[k];
+    }
+
+    /* Encrypt the cells to the last hop */
+    for (k = 0; k < N_BATCH_CELLS; ++k)
+      relay_encrypt_cell_outbound(cells[k], cs->origin_circ,
+                                  cs->origin_circ->cpath->prev);
+
+    for (j = 0; j < 3; ++j) {
+      int r = relay_decrypt_cells(TO_CIRCUIT(cs->or_circ[j]),
+                                  cells, N_BATCH_CELLS,
+                                  CELL_DIRECTION_OUT,
+                                  layer_hints, recognized);
+      tt_int_op(r, OP_EQ, 0);
+      for (k = 0; k < N_BATCH_CELLS; ++k) {
+        tt_ptr_op(layer_hints[k], OP_EQ, NULL);
+        tt_int_op(recognized[k] != 0, OP_EQ, j == 2);
+      }
+    }
+
+    for (k = 0; k < N_BATCH_CELLS; ++k)
+      tt_mem_op(orig[k].payload, OP_EQ, encrypted[k].payload,
+                CELL_PAYLOAD_SIZE);
+  }
+
+  /* The batches must have left the crypto state where single cells would
+   * have, so the unbatched path still works afterwards. */
+  test_relaycrypt_outbound(arg);
+
+ done:
+  ;
+}
+
+/* As test_relaycrypt_inbound, but relay the cells in batches. */
+static void
+test_relaycrypt_inbound_batch(void *arg)
+{
+  testing_circuitset_t *cs = arg;
+  tt_assert(cs);
+
+  relay_header_t rh;
+  cell_t orig[N_BATCH_CELLS];
+  cell_t encrypted[N_BATCH_CELLS];
+  cell_t *cells[N_BATCH_CELLS];
+  crypt_path_t *layer_hints[N_BATCH_CELLS];
+  char recognized[N_BATCH_CELLS];
+  int i, j, k, r;
+
+  for (i = 0; i < 4; ++i) {
+    for (k = 0; k < N_BATCH_CELLS; ++k) {
+      crypto_rand((char *)&orig[k], sizeof(orig[k]));
+      relay_header_unpack(&rh, orig[k].payload);
+      rh.recognized = 0;
+      memset(rh.integrity, 0, sizeof(rh.integrity));
+      relay_header_pack(orig[k].payload, &rh);
+      memcpy(&encrypted[k], &orig[k], sizeof(orig[k]));
+      cells[k] = &encrypted[k];
+    }
+
+    /* Encrypt the cells from the last hop */
+    for (k = 0; k < N_BATCH_CELLS; ++k)
+      relay_encrypt_cell_inbound(cells[k], cs->or_circ[2]);
+
+    for (j = 1; j >= 0; --j) {
+      r = relay_decrypt_cells(TO_CIRCUIT(cs->or_circ[j]),
+                              cells, N_BATCH_CELLS,
+                              CELL_DIRECTION_IN,
+                              layer_hints, recognized);
+      tt_int_op(r, OP_EQ, 0);
+      for (k = 0; k < N_BATCH_CELLS; ++k) {
+        tt_ptr_op(layer_hints[k], OP_EQ, NULL);
+        tt_int_op(recognized[k], OP_EQ, 0);
+      }
+    }
+
+    r = relay_decrypt_cells(TO_CIRCUIT(cs->origin_circ),
+                            cells, N_BATCH_CELLS,
+                            CELL_DIRECTION_IN,
+                            layer_hints, recognized);
+    tt_int_op(r, OP_EQ, 0);
+    for (k = 0; k < N_BATCH_CELLS; ++k) {
+      tt_int_op(recognized[k], OP_EQ, 1);
+      tt_ptr_op(layer_hints[k], OP_EQ, cs->origin_circ->cpath->prev);
+      tt_mem_op(orig[k].payload, OP_EQ, encrypted[k].payload,
+                CELL_PAYLOAD_SIZE);
+    }
+  }
+
+  test_relaycrypt_inbound(arg);
+
+ done:
+  ;
+}
+
+/* Cells that the relay shard threads have handed back to the main
+ * thread. */
+static cell_t shard_cells[N_BATCH_CELLS];
+static char shard_recognized[N_BATCH_CELLS];
+static int shard_n_cells = 0;
+
+static int
+mock_circuit_handle_decrypted_relay_cells(circuit_t *circ, cell_t **cells,
+                                          int n_cells,
+                                          cell_direction_t cell_direction,
+                                          crypt_path_t **layer_hints,
+                                          const char *recognized)
+{
+  int i;
+  (void)circ;
+  (void)layer_hints;
+  tor_assert(cell_direction == CELL_DIRECTION_OUT);
+  tor_assert(shard_n_cells + n_cells <= N_BATCH_CELLS);
+  for (i = 0; i < n_cells; ++i) {
+    memcpy(&shard_cells[shard_n_cells], cells[i], sizeof(cell_t));
+    shard_recognized[shard_n_cells++] = recognized[i];
+  }
+  return 0;
+}
+
+/* Process relay shard replies until the shards hold no more cells. */
+static void
+relay_shard_wait_for_replies(void)
+{
+  int i;
+  for (i = 0; i < 10000 && relay_shard_get_total_allocation(); ++i) {
+    replyqueue_process(relay_shard_get_replyqueue());
+    tor_sleep_msec(1);
+  }
+}
+
+/* As test_relaycrypt_outbound_batch, but let the relay shard threads
+ * decrypt the cells at each hop. */
+static void
+test_relaycrypt_outbound_shards(void *arg)
+{
+  testing_circuitset_t *cs = arg;
+  tt_assert(cs);
+
+  relay_header_t rh;
+  cell_t orig[N_BATCH_CELLS];
+  cell_t encrypted[N_BATCH_CELLS];
+  cell_t *cells[N_BATCH_CELLS];
+  int i, j, k;
+
+  MOCK(circuit_handle_decrypted_relay_cells,
+       mock_circuit_handle_decrypted_relay_cells);
+  relay_shard_init_with_n_threads(2);
+  tt_assert(relay_shard_wants_cells(TO_CIRCUIT(cs->or_circ[0]),
+                                    CELL_DIRECTION_OUT));
+  tt_assert(! relay_shard_wants_cells(TO_CIRCUIT(cs->or_circ[0]),
+                                      CELL_DIRECTION_IN));
+  tt_assert(! relay_shard_wants_cells(TO_CIRCUIT(cs->origin_circ),
+                                      CELL_DIRECTION_OUT));
+
+  for (i = 0; i < 4; ++i) {
+    for (k = 0; k < N_BATCH_CELLS; ++k) {
+      crypto_rand((char *)&orig[k], sizeof(orig[k]));
+      relay_header_unpack(&rh, orig[k].payload);
+      rh.recognized = 0;
+      memset(rh.integrity, 0, sizeof(rh.integrity));
+      relay_header_pack(orig[k].payload, &rh);
+      memcpy(&encrypted[k], &orig[k], sizeof(orig[k]));
+      cells[k] = &encrypted[k];
+    }
+
+    for (k = 0; k < N_BATCH_CELLS; ++k)
+      relay_encrypt_cell_outbound(cells[k], cs->origin_circ,
+                                  cs->origin_circ->cpath->prev);
+
+    for (j = 0; j < 3; ++j) {
+      /* Hand the cells over in uneven runs, the way they might come off an
+       * OR connection. */
+      shard_n_cells = 0;
+      for (k = 0; k < N_BATCH_CELLS; k += 7) {
+        int n = MIN(7, N_BATCH_CELLS - k);
+        tt_int_op(0, OP_EQ,
+                  circuit_receive_relay_cells(&cells[k], n,
+                                              TO_CIRCUIT(cs->or_circ[j]),
+                                              CELL_DIRECTION_OUT));
+      }
+      relay_shard_wait_for_replies();
+      tt_int_op(shard_n_cells, OP_EQ, N_BATCH_CELLS);
+      tt_int_op(cs->or_circ[j]->shard_n_cells, OP_EQ, 0);
+      tt_ptr_op(cs->or_circ[j]->shard_job, OP_EQ, NULL);
+      for (k = 0; k < N_BATCH_CELLS; ++k) {
+        tt_int_op(shard_recognized[k] != 0, OP_EQ, j == 2);
+        memcpy(&encrypted[k], &shard_cells[k], sizeof(cell_t));
+      }
+    }
+
+    for (k = 0; k < N_BATCH_CELLS; ++k)
+      tt_mem_op(orig[k].payload, OP_EQ, encrypted[k].payload,
+                CELL_PAYLOAD_SIZE);
+  }
+
+  /* The shards must have left the crypto state where the main thread
+   * would have. */
+  test_relaycrypt_outbound(arg);
+
+  /* If a circuit goes away while its cells are on a shard thread, the job
+   * takes over its forward crypto state. */
+  shard_n_cells = 0;
+  tt_int_op(0, OP_EQ, relay_shard_queue_cells(cs->or_circ[0], cells,
+                                              N_BATCH_CELLS));
+  tt_int_op(cs->or_circ[0]->shard_n_cells, OP_EQ, N_BATCH_CELLS);
+  relay_shard_circuit_free(cs->or_circ[0]);
+  tt_int_op(cs->or_circ[0]->shard_n_cells, OP_EQ, 0);
+  tt_ptr_op(cs->or_circ[0]->shard_pending, OP_EQ, NULL);
+  relay_shard_wait_for_replies();
+  tt_int_op(relay_shard_get_total_allocation(), OP_EQ, 0);
+  tt_int_op(shard_n_cells, OP_EQ, 0);
+
+ done:
+  UNMOCK(circuit_handle_decrypted_relay_cells);
+}
+
 #define TEST(name) \
   { # name, test_relaycrypt_ ## name, 0, &relaycrypt_setup, NULL }
 
 struct testcase_t relaycrypt_tests[] = {
   TEST(outbound),
   TEST(inbound),
+  TEST(outbound_batch),
+  TEST(inbound_batch),
+  TEST(outbound_shards),
   END_OF_TESTCASES
 };
 
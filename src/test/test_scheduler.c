@@ -832,6 +832,117 @@ test_scheduler_loop_kist(void *arg)
   return;
 }
 
+static int update_socket_info_impl_mock_ctr = 0;
+static uint32_t mock_socket_unacked = 0;
+
+static void
+update_socket_info_impl_mock_kernel(socket_table_ent_t *ent)
+{
+  ++update_socket_info_impl_mock_ctr;
+  ent->cwnd = 10;
+  ent->unacked = mock_socket_unacked;
+  ent->mss = 1460;
+  ent->notsent = 0;
+  ent->rto = 200000;
+  ent->limit = INT_MAX;
+}
+
+/* Run the KIST scheduler once on <b>chan</b>, after giving it some cells to
+ * flush, at <b>now_msec</b> msec after the start of the test. */
+static void
+run_kist_once(channel_t *chan, uint64_t now_msec)
+{
+  monotime_set_mock_time_nsec(UINT64_C(1000000000) + now_msec * 1000000);
+  scheduler_channel_has_waiting_cells(chan);
+  channel_flush_some_cells_mock_set(chan, 5);
+  the_scheduler->run();
+}
+
+static void
+test_scheduler_kist_sock_info_cache(void *arg)
+{
+  (void) arg;
+
+#ifndef HAVE_KIST_SUPPORT
+  return;
+#endif
+
+  channel_t *ch1 = new_fake_channel();
+
+  MOCK(get_options, mock_get_options);
+  MOCK(channel_flush_some_cells, channel_flush_some_cells_mock);
+  MOCK(channel_more_to_flush, channel_more_to_flush_mock);
+  MOCK(channel_write_to_kernel, channel_write_to_kernel_mock);
+  MOCK(channel_should_write_to_kernel, channel_should_write_to_kernel_mock);
+  MOCK(update_socket_info_impl, update_socket_info_impl_mock_kernel);
+  monotime_enable_test_mocking();
+  monotime_set_mock_time_nsec(UINT64_C(1000000000));
+  clear_options();
+  mocked_options.KISTSchedRunInterval = 10;
+  set_scheduler_options(SCHEDULER_KIST);
+  scheduler_init();
+  scheduler_kist_set_full_mode();
+
+  tt_assert(ch1);
+  ch1->magic = TLS_CHAN_MAGIC;
+  ch1->state = CHANNEL_STATE_OPENING;
+  channel_register(ch1);
+  channel_change_state_open(ch1);
+  scheduler_channel_wants_writes(ch1);
+
+  /* With data in flight and no caching allowed, we ask every run. */
+  mock_socket_unacked = 5;
+  run_kist_once(ch1, 0);
+  tt_int_op(update_socket_info_impl_mock_ctr, OP_EQ, 1);
+  run_kist_once(ch1, 10);
+  tt_int_op(update_socket_info_impl_mock_ctr, OP_EQ, 2);
+
+  /* If we may cache for 100 msec, we don't ask again until then. */
+  mocked_options.KISTSockInfoMaxAge = 100;
+  the_scheduler->on_new_options();
+  run_kist_once(ch1, 20);
+  tt_int_op(update_socket_info_impl_mock_ctr, OP_EQ, 2);
+  run_kist_once(ch1, 109);
+  tt_int_op(update_socket_info_impl_mock_ctr, OP_EQ, 2);
+  run_kist_once(ch1, 110);
+  tt_int_op(update_socket_info_impl_mock_ctr, OP_EQ, 3);
+
+  /* An idle socket's information can't change until we write to it, or
+   * until it has been idle for longer than its RTO. */
+  mocked_options.KISTSockInfoMaxAge = 0;
+  the_scheduler->on_new_options();
+  mock_socket_unacked = 0;
+  run_kist_once(ch1, 120);
+  tt_int_op(update_socket_info_impl_mock_ctr, OP_EQ, 4);
+  run_kist_once(ch1, 319);
+  tt_int_op(update_socket_info_impl_mock_ctr, OP_EQ, 4);
+  run_kist_once(ch1, 320);
+  tt_int_op(update_socket_info_impl_mock_ctr, OP_EQ, 5);
+  ch1->n_bytes_xmitted += 514;
+  run_kist_once(ch1, 330);
+  tt_int_op(update_socket_info_impl_mock_ctr, OP_EQ, 6);
+
+  /* KISTLite never uses kernel information, so it never caches. */
+  scheduler_kist_set_lite_mode();
+  run_kist_once(ch1, 340);
+  tt_int_op(update_socket_info_impl_mock_ctr, OP_EQ, 7);
+
+ done:
+  channel_flush_some_cells_mock_free_all();
+  ch1->state = CHANNEL_STATE_CLOSED;
+  ch1->registered = 0;
+  channel_free(ch1);
+  UNMOCK(update_socket_info_impl);
+  UNMOCK(channel_should_write_to_kernel);
+  UNMOCK(channel_write_to_kernel);
+  UNMOCK(channel_more_to_flush);
+  UNMOCK(channel_flush_some_cells);
+  UNMOCK(get_options);
+  monotime_disable_test_mocking();
+  scheduler_free_all();
+  cleanup_scheduler_options();
+}
+
 static void
 test_scheduler_channel_states(void *arg)
 {
@@ -1272,6 +1383,8 @@ struct testcase_t scheduler_tests[] = {
   { "initfree", test_scheduler_initfree, TT_FORK, NULL, NULL },
   { "loop_vanilla", test_scheduler_loop_vanilla, TT_FORK, NULL, NULL },
   { "loop_kist", test_scheduler_loop_kist, TT_FORK, NULL, NULL },
+  { "kist_sock_info_cache", test_scheduler_kist_sock_info_cache, TT_FORK,
+    NULL, NULL },
   { "ns_changed", test_scheduler_ns_changed, TT_FORK, NULL, NULL},
   { "should_use_kist", test_scheduler_can_use_kist, TT_FORK, NULL, NULL },
   { "kist_pending_list", test_scheduler_kist_pending_list, TT_FORK,
@@ -13,6 +13,7 @@
 #include "lib/evloop/compat_libevent.h"
 #include "lib/intmath/weakrng.h"
 #include "lib/crypt_ops/crypto_init.h"
+#include "lib/time/compat_time.h"
 
 #include <stdio.h>
 
@@ -25,6 +26,7 @@ static int opt_n_inflight = 1000;
 static int opt_n_lowwater = 250;
 static int opt_n_cancel = 0;
 static int opt_ratio_rsa = 5;
+static int opt_sleep_msec = 0;
 
 #ifdef TRACK_RESPONSES
 tor_mutex_t bitmap_mutex;
@@ -35,19 +37,30 @@ bitarray_t *handled;
 typedef struct state_s {
   int magic;
   int n_handled;
+  int thread_id;
   crypto_pk_t *rsa;
   curve25519_secret_key_t ecdh;
   int is_shutdown;
 } state_t;
 
-typedef struct rsa_work_s {
+/* Every kind of work starts with these fields, so that handle_reply() can
+ * look at them without knowing which kind it has. */
+typedef struct work_header_s {
   int serial;
+  /* The thread_id of the state of the worker that handled this work. */
+  int thread_id;
+  /* The worker's n_handled when it handled this work. */
+  int seq;
+} work_header_t;
+
+typedef struct rsa_work_s {
+  work_header_t h;
   uint8_t msg[128];
   uint8_t msglen;
 } rsa_work_t;
 
 typedef struct ecdh_work_s {
-  int serial;
+  work_header_t h;
   union {
     curve25519_public_key_t pk;
     uint8_t msg[32];
@@ -55,16 +68,16 @@ typedef struct ecdh_work_s {
 } ecdh_work_t;
 
 static void
-mark_handled(int serial)
+mark_handled(state_t *st, work_header_t *h)
 {
+  h->thread_id = st->thread_id;
+  h->seq = st->n_handled;
 #ifdef TRACK_RESPONSES
   tor_mutex_acquire(&bitmap_mutex);
-  tor_assert(serial < handled_len);
-  tor_assert(! bitarray_is_set(handled, serial));
-  bitarray_set(handled, serial);
+  tor_assert(h->serial < handled_len);
+  tor_assert(! bitarray_is_set(handled, h->serial));
+  bitarray_set(handled, h->serial);
   tor_mutex_release(&bitmap_mutex);
-#else /* !(defined(TRACK_RESPONSES)) */
-  (void)serial;
 #endif /* defined(TRACK_RESPONSES) */
 }
 
@@ -91,7 +104,7 @@ workqueue_do_rsa(void *state, void *work)
   memcpy(rw->msg, sig, len);
   ++st->n_handled;
 
-  mark_handled(rw->serial);
+  mark_handled(st, &rw->h);
 
   return WQ_RPL_REPLY;
 }
@@ -118,7 +131,7 @@ workqueue_do_ecdh(void *state, void *work)
   curve25519_handshake(output, &st->ecdh, &ew->u.pk);
   memcpy(ew->u.msg, output, CURVE25519_OUTPUT_LEN);
   ++st->n_handled;
-  mark_handled(ew->serial);
+  mark_handled(st, &ew->h);
   return WQ_RPL_REPLY;
 }
 
@@ -130,6 +143,8 @@ workqueue_shutdown_error(void *state, void *work)
   return WQ_RPL_REPLY;
 }
 
+static int n_states = 0;
+
 static void *
 new_state(void *arg)
 {
@@ -137,6 +152,8 @@ new_state(void *arg)
   (void)arg;
 
   st = tor_malloc(sizeof(*st));
+  st->n_handled = 0;
+  st->thread_id = n_states++;
   /* Every thread gets its own keys. not a problem for benchmarking */
   st->rsa = crypto_pk_new();
   if (crypto_pk_generate_key_with_bits(st->rsa, 1024) < 0) {
@@ -164,6 +181,9 @@ static int ecdh_sent = 0;
 static int n_received_previously = 0;
 static int n_received = 0;
 static int no_shutdown = 0;
+/* For each worker, the seq of the last of its replies that we handled. */
+static int *last_seq_by_thread = NULL;
+static int n_out_of_order = 0;
 
 #ifdef TRACK_RESPONSES
 bitarray_t *received;
@@ -172,12 +192,19 @@ bitarray_t *received;
 static void
 handle_reply(void *arg)
 {
+  work_header_t *h = arg;
 #ifdef TRACK_RESPONSES
-  rsa_work_t *rw = arg; /* Naughty cast, but only looking at serial. */
-  tor_assert(! bitarray_is_set(received, rw->serial));
-  bitarray_set(received,rw->serial);
+  tor_assert(! bitarray_is_set(received, h->serial));
+  bitarray_set(received, h->serial);
 #endif
 
+  /* Each worker's replies must reach us in the order it sent them. */
+  if (h->thread_id >= 0 && h->thread_id < opt_n_threads) {
+    if (h->seq <= last_seq_by_thread[h->thread_id])
+      ++n_out_of_order;
+    last_seq_by_thread[h->thread_id] = h->seq;
+  }
+
   tor_free(arg);
   ++n_received;
 }
@@ -199,7 +226,7 @@ add_work(threadpool_t *tp)
 
   if (add_rsa) {
     rsa_work_t *w = tor_malloc_zero(sizeof(*w));
-    w->serial = n_sent++;
+    w->h.serial = n_sent++;
     crypto_rand((char*)w->msg, 20);
     w->msglen = 20;
     ++rsa_sent;
@@ -208,7 +235,7 @@ add_work(threadpool_t *tp)
                                           workqueue_do_rsa, handle_reply, w);
   } else {
     ecdh_work_t *w = tor_malloc_zero(sizeof(*w));
-    w->serial = n_sent++;
+    w->h.serial = n_sent++;
     /* Not strictly right, but this is just for benchmarks. */
     crypto_rand((char*)w->u.pk.public_key, 32);
     ++ecdh_sent;
@@ -267,6 +294,9 @@ static int shutting_down = 0;
 static void
 replysock_readable_cb(threadpool_t *tp)
 {
+  if (opt_sleep_msec)
+    tor_sleep_msec(opt_sleep_msec);
+
   if (n_received_previously == n_received)
     return;
 
@@ -329,6 +359,8 @@ help(void)
      "  -L <lowwater> Add items whenever fewer than this many are pending\n"
      "  -C <cancel>   Try to cancel N items of every batch that we add\n"
      "  -R <ratio>    Make one out of this many items be a slow (RSA) one\n"
+     "  -S <msec>     Sleep this long after handling each batch of replies,\n"
+     "                so that replies pile up\n"
      "  --no-{eventfd2,eventfd,pipe2,pipe,socketpair}\n"
      "                Disable one of the alert_socket backends.");
 }
@@ -357,6 +389,8 @@ main(int argc, char **argv)
       opt_ratio_rsa = atoi(argv[++i]);
     } else if (!strcmp(argv[i], "-C") && i+1<argc) {
       opt_n_cancel = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-S") && i+1<argc) {
+      opt_sleep_msec = atoi(argv[++i]);
     } else if (!strcmp(argv[i], "--no-eventfd2")) {
       as_flags |= ASOCKS_NOEVENTFD2;
     } else if (!strcmp(argv[i], "--no-eventfd")) {
@@ -379,7 +413,7 @@ main(int argc, char **argv)
   if (opt_n_threads < 1 ||
       opt_n_items < 1 || opt_n_inflight < 1 || opt_n_lowwater < 0 ||
       opt_n_cancel > opt_n_inflight || opt_n_inflight > MAX_INFLIGHT ||
-      opt_ratio_rsa < 0) {
+      opt_ratio_rsa < 0 || opt_sleep_msec < 0) {
     help();
     return 1;
   }
@@ -404,6 +438,9 @@ main(int argc, char **argv)
     return 77; // 77 means "skipped".
 
   tor_assert(rq);
+  last_seq_by_thread = tor_calloc(opt_n_threads, sizeof(int));
+  for (i = 0; i < opt_n_threads; ++i)
+    last_seq_by_thread[i] = -1;
   tp = threadpool_new(opt_n_threads,
                       rq, new_state, free_state, NULL);
   tor_assert(tp);
@@ -440,6 +477,27 @@ main(int argc, char **argv)
 
   tor_libevent_run_event_loop(tor_libevent_get_base(), 0);
 
+  {
+    uint64_t n_wakeups, n_replies;
+    unsigned max_per_wakeup;
+    replyqueue_get_stats(rq, &n_wakeups, &n_replies, &max_per_wakeup);
+    if (opt_verbose)
+      printf("%"PRIu64" replies in %"PRIu64" wakeups; at most %u at once\n",
+             n_replies, n_wakeups, max_per_wakeup);
+    if (n_replies != (uint64_t)n_received) {
+      printf("%"PRIu64" replies counted vs %d received\n",
+             n_replies, n_received);
+      puts("FAIL");
+      return 1;
+    }
+  }
+
+  if (n_out_of_order) {
+    printf("%d replies arrived out of order\n", n_out_of_order);
+    puts("FAIL");
+    return 1;
+  }
+
   if (n_sent != opt_n_items || n_received+n_successful_cancel != n_sent) {
     printf("%d vs %d\n", n_sent, opt_n_items);
     printf("%d+%d vs %d\n", n_received, n_successful_cancel, n_sent);
@@ -0,0 +1,4 @@
+#!/bin/sh
+
+${builddir:-.}/src/test/test_workqueue \
+	   -T 2 -N 5000 -I 5000 -R 100000 -S 10
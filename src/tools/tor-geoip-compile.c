@@ -0,0 +1,72 @@
+/* Copyright (c) 2019, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file tor-geoip-compile.c
+ * \brief Compile a GeoIP text file into the binary format that tor can mmap.
+ *
+ * Usage: tor-geoip-compile -4|-6 INPUT OUTPUT
+ *
+ * Point GeoIPFile or GeoIPv6File at the output to use it. The compiled file
+ * reports the same digest as the text file it came from.
+ **/
+
+#include "orconfig.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "lib/crypt_ops/crypto_init.h"
+#include "lib/fs/files.h"
+#include "lib/geoip/geoip.h"
+#include "lib/log/log.h"
+#include "lib/malloc/malloc.h"
+#include "lib/net/inaddr_st.h"
+
+/** Entry point to tor-geoip-compile */
+int
+main(int argc, char **argv)
+{
+  sa_family_t family;
+  char *buf = NULL;
+  size_t len = 0;
+  int r = 1;
+  log_severity_list_t s;
+
+  if (argc != 4 ||
+      (strcmp(argv[1], "-4") && strcmp(argv[1], "-6"))) {
+    fprintf(stderr, "Usage:\n");
+    fprintf(stderr, "%s -4|-6 <geoip text file> <output file>\n", argv[0]);
+    return 1;
+  }
+  family = !strcmp(argv[1], "-4") ? AF_INET : AF_INET6;
+
+  init_logging(1);
+  set_log_severity_config(LOG_WARN, LOG_ERR, &s);
+  add_stream_log(&s, "<stderr>", fileno(stderr));
+
+  if (crypto_global_init(0, NULL, NULL)) {
+    fprintf(stderr, "Couldn't initialize crypto library.\n");
+    return 1;
+  }
+
+  if (geoip_load_file(family, argv[2], LOG_ERR) < 0)
+    goto done;
+  if (!geoip_is_loaded(family) || geoip_compile_db(family, &buf, &len) < 0) {
+    fprintf(stderr, "Couldn't compile %s.\n", argv[2]);
+    goto done;
+  }
+  if (write_bytes_to_file(argv[3], buf, len, 1) < 0) {
+    fprintf(stderr, "Couldn't write %s.\n", argv[3]);
+    goto done;
+  }
+  printf("Wrote %s (%lu bytes), digest %s.\n", argv[3], (unsigned long) len,
+         geoip_db_digest(family));
+
+  r = 0;
+ done:
+  tor_free(buf);
+  geoip_free_all();
+  crypto_global_cleanup();
+  return r;
+}